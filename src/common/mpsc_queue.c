@@ -0,0 +1,61 @@
+#include "mpsc_queue.h"
+
+#include <stddef.h>
+
+void mpsc_queue_init(struct mpsc_queue * queue)
+{
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(struct mpsc_queue * queue, struct mpsc_node * node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+    // the node is visible to the consumer once it is linked to its predecessor
+    struct mpsc_node * const prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+struct mpsc_node * mpsc_queue_pop(struct mpsc_queue * queue)
+{
+    struct mpsc_node * tail = queue->tail;
+    struct mpsc_node * next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    // the stub keeps the queue non-empty; skip it
+    if (&queue->stub == tail)
+    {
+        if (NULL == next)
+        {
+            return NULL;
+        }
+
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (NULL != next)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    // tail is the last node, unless a producer is about to link another one
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    // re-insert the stub, so that the last node can be returned
+    mpsc_queue_push(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (NULL != next)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// node of an intrusive queue; embedded into the queued element
+struct mpsc_node
+{
+    struct mpsc_node * _Atomic next;
+};
+
+// lock-free, unbounded queue with many producers and a single consumer;
+// producers never wait for each other or for the consumer
+struct mpsc_queue
+{
+    struct mpsc_node * _Atomic head;
+    struct mpsc_node * tail;
+    struct mpsc_node stub;
+};
+
+extern void mpsc_queue_init(struct mpsc_queue * queue);
+
+// may be called from any thread
+extern void mpsc_queue_push(struct mpsc_queue * queue, struct mpsc_node * node);
+
+// must only be called from the consumer thread;
+// returns NULL, if the queue is empty or a push is not yet complete
+extern struct mpsc_node * mpsc_queue_pop(struct mpsc_queue * queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+#include "mqtt_backoff.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+void mqtt_backoff_init(struct mqtt_backoff * backoff, unsigned int min, unsigned int max)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    backoff->min = min;
+    backoff->max = max;
+    backoff->current = min;
+    backoff->seed = (unsigned int) now.tv_nsec ^ ((unsigned int) getpid() << 16);
+}
+
+void mqtt_backoff_reset(struct mqtt_backoff * backoff)
+{
+    backoff->current = backoff->min;
+}
+
+unsigned int mqtt_backoff_next(struct mqtt_backoff * backoff)
+{
+    unsigned int const half = backoff->current / 2;
+    unsigned int const jitter = (unsigned int) rand_r(&backoff->seed) % (half + 1);
+    unsigned int const delay = (backoff->current - half) + jitter;
+
+    backoff->current = (backoff->current > (backoff->max / 2)) ? backoff->max : backoff->current * 2;
+    return delay;
+}
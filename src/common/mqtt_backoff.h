@@ -0,0 +1,33 @@
+#ifndef MQTT_BACKOFF_H
+#define MQTT_BACKOFF_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// exponential backoff with jitter, used to delay reconnects
+struct mqtt_backoff
+{
+    unsigned int min;
+    unsigned int max;
+    unsigned int current;
+    unsigned int seed;
+};
+
+// initializes the backoff with delays in milliseconds
+extern void mqtt_backoff_init(struct mqtt_backoff * backoff, unsigned int min, unsigned int max);
+
+// restarts with the minimum delay, e.g. after a successful connect
+extern void mqtt_backoff_reset(struct mqtt_backoff * backoff);
+
+// returns the next delay in milliseconds and doubles the current delay;
+// the delay is chosen randomly between half and all of the current delay,
+// so that clients disconnected at the same time do not reconnect at once
+extern unsigned int mqtt_backoff_next(struct mqtt_backoff * backoff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
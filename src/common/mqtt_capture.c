@@ -0,0 +1,467 @@
+#include "mqtt_capture.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_CAPTURE_INITIAL_TOPICS (64)
+
+// type, timestamp, offset, messages and topics
+#define MQTT_CAPTURE_INDEX_SIZE (1 + 8 + 8 + 4 + 4)
+
+// a varint of a 64 bit value takes up to 10 bytes
+#define MQTT_CAPTURE_VARINT_SIZE (10)
+
+uint64_t mqtt_capture_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+static size_t mqtt_capture_put_varint(unsigned char * buffer, uint64_t value)
+{
+    size_t length = 0;
+    while (0x80 <= value)
+    {
+        buffer[length++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (unsigned char) value;
+
+    return length;
+}
+
+static void mqtt_capture_put_fixed(unsigned char * buffer, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        buffer[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static void mqtt_capture_write(struct mqtt_capture_writer * writer, void const * data, size_t length)
+{
+    if (length != fwrite(data, 1, length, writer->file))
+    {
+        writer->failed = true;
+    }
+    writer->offset += length;
+}
+
+// FNV-1a
+static uint32_t mqtt_capture_hash(char const * topic)
+{
+    uint32_t hash = 2166136261U;
+    for (unsigned char const * c = (unsigned char const *) topic; '\0' != *c; c++)
+    {
+        hash ^= *c;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+// open addressing keeps the lookup of known topics free of allocations
+static struct mqtt_capture_topic * mqtt_capture_find(struct mqtt_capture_topic * topics,
+    size_t capacity, char const * topic)
+{
+    size_t index = mqtt_capture_hash(topic) & (capacity - 1);
+    while ((NULL != topics[index].topic) && (0 != strcmp(topics[index].topic, topic)))
+    {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return &topics[index];
+}
+
+static bool mqtt_capture_grow(struct mqtt_capture_writer * writer)
+{
+    size_t const capacity = writer->topic_capacity * 2;
+    struct mqtt_capture_topic * topics = calloc(capacity, sizeof(struct mqtt_capture_topic));
+    if (NULL == topics)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < writer->topic_capacity; i++)
+    {
+        if (NULL != writer->topics[i].topic)
+        {
+            *mqtt_capture_find(topics, capacity, writer->topics[i].topic) = writer->topics[i];
+        }
+    }
+
+    free(writer->topics);
+    writer->topics = topics;
+    writer->topic_capacity = capacity;
+    return true;
+}
+
+// returns the id of a topic and adds it to the dictionary on first use;
+// returns false, if the topic could not be added
+static bool mqtt_capture_topic_id(struct mqtt_capture_writer * writer, char const * topic, uint32_t * id)
+{
+    struct mqtt_capture_topic * entry = mqtt_capture_find(writer->topics, writer->topic_capacity, topic);
+    if (NULL != entry->topic)
+    {
+        *id = entry->id;
+        return true;
+    }
+
+    // the table is kept at most half full
+    if ((writer->topic_count + 1) * 2 > writer->topic_capacity)
+    {
+        if (!mqtt_capture_grow(writer))
+        {
+            return false;
+        }
+        entry = mqtt_capture_find(writer->topics, writer->topic_capacity, topic);
+    }
+
+    entry->topic = strdup(topic);
+    if (NULL == entry->topic)
+    {
+        return false;
+    }
+    entry->id = writer->topic_count++;
+    *id = entry->id;
+
+    size_t const length = strlen(topic);
+    unsigned char header[1 + (2 * MQTT_CAPTURE_VARINT_SIZE)];
+    size_t header_length = 0;
+    header[header_length++] = MQTT_CAPTURE_TOPIC;
+    header_length += mqtt_capture_put_varint(&header[header_length], entry->id);
+    header_length += mqtt_capture_put_varint(&header[header_length], length);
+    mqtt_capture_write(writer, header, header_length);
+    mqtt_capture_write(writer, topic, length + 1);
+
+    return true;
+}
+
+static void mqtt_capture_write_index(struct mqtt_capture_writer * writer)
+{
+    unsigned char index[MQTT_CAPTURE_INDEX_SIZE];
+    index[0] = MQTT_CAPTURE_INDEX;
+    mqtt_capture_put_fixed(&index[1], writer->timestamp, 8);
+    mqtt_capture_put_fixed(&index[9], writer->previous_index, 8);
+    mqtt_capture_put_fixed(&index[17], writer->messages, 4);
+    mqtt_capture_put_fixed(&index[21], writer->topic_count, 4);
+
+    writer->previous_index = writer->offset;
+    writer->messages = 0;
+    mqtt_capture_write(writer, index, sizeof(index));
+
+    // an index marks a consistent state of the file, e.g. after a crash
+    if (0 != fflush(writer->file))
+    {
+        writer->failed = true;
+    }
+}
+
+static bool mqtt_capture_writer_init(struct mqtt_capture_writer * writer, char const * path, char const * mode)
+{
+    writer->file = fopen(path, mode);
+    writer->topic_capacity = MQTT_CAPTURE_INITIAL_TOPICS;
+    writer->topics = calloc(writer->topic_capacity, sizeof(struct mqtt_capture_topic));
+    if ((NULL == writer->file) || (NULL == writer->topics))
+    {
+        if (NULL != writer->file)
+        {
+            fclose(writer->file);
+        }
+        free(writer->topics);
+        return false;
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    writer->topic_count = 0;
+    writer->offset = 0;
+    writer->previous_index = 0;
+    writer->messages = 0;
+    writer->failed = false;
+    mqtt_capture_write(writer, MQTT_CAPTURE_MAGIC, MQTT_CAPTURE_MAGIC_SIZE);
+
+    // the first index provides the base of the first message's timestamp
+    writer->timestamp = mqtt_capture_now();
+    mqtt_capture_write_index(writer);
+
+    return true;
+}
+
+bool mqtt_capture_writer_open(struct mqtt_capture_writer * writer, char const * path)
+{
+    return mqtt_capture_writer_init(writer, path, "wb");
+}
+
+bool mqtt_capture_writer_create(struct mqtt_capture_writer * writer, char const * path)
+{
+    // exclusive mode of C11
+    return mqtt_capture_writer_init(writer, path, "wbx");
+}
+
+bool mqtt_capture_writer_close(struct mqtt_capture_writer * writer)
+{
+    mqtt_capture_write_index(writer);
+    bool const result = (0 == fclose(writer->file)) && (!writer->failed);
+
+    for (size_t i = 0; i < writer->topic_capacity; i++)
+    {
+        free(writer->topics[i].topic);
+    }
+    free(writer->topics);
+    pthread_mutex_destroy(&writer->lock);
+
+    return result;
+}
+
+void mqtt_capture_writer_add(struct mqtt_capture_writer * writer,
+    struct mqtt_capture_message const * message)
+{
+    pthread_mutex_lock(&writer->lock);
+
+    uint32_t topic_id = 0;
+    if (!mqtt_capture_topic_id(writer, message->topic, &topic_id))
+    {
+        writer->failed = true;
+        pthread_mutex_unlock(&writer->lock);
+        return;
+    }
+
+    // the realtime clock may step back, which is recorded as no delay
+    uint64_t const delta = (writer->timestamp < message->timestamp) ? (message->timestamp - writer->timestamp) : 0;
+    writer->timestamp += delta;
+
+    bool const has_properties = (0 < message->propertieslen);
+    unsigned char header[2 + (3 * MQTT_CAPTURE_VARINT_SIZE)];
+    size_t length = 0;
+    header[length++] = MQTT_CAPTURE_MESSAGE;
+    length += mqtt_capture_put_varint(&header[length], delta);
+    length += mqtt_capture_put_varint(&header[length], topic_id);
+    header[length++] = (unsigned char) ((message->qos & 0x03) |
+        (message->retain ? MQTT_CAPTURE_FLAG_RETAIN : 0x00) |
+        (has_properties ? MQTT_CAPTURE_FLAG_PROPERTIES : 0x00));
+    length += mqtt_capture_put_varint(&header[length], message->payloadlen);
+    mqtt_capture_write(writer, header, length);
+    mqtt_capture_write(writer, message->payload, message->payloadlen);
+
+    if (has_properties)
+    {
+        length = mqtt_capture_put_varint(header, message->propertieslen);
+        mqtt_capture_write(writer, header, length);
+        mqtt_capture_write(writer, message->properties, message->propertieslen);
+    }
+
+    writer->messages++;
+    if (MQTT_CAPTURE_INDEX_INTERVAL <= writer->messages)
+    {
+        mqtt_capture_write_index(writer);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+}
+
+bool mqtt_capture_writer_sync(struct mqtt_capture_writer * writer)
+{
+    pthread_mutex_lock(&writer->lock);
+
+    // the index marks the synced state as consistent
+    mqtt_capture_write_index(writer);
+    if (0 != fsync(fileno(writer->file)))
+    {
+        writer->failed = true;
+    }
+    bool const result = !writer->failed;
+
+    pthread_mutex_unlock(&writer->lock);
+    return result;
+}
+
+bool mqtt_capture_reader_open(struct mqtt_capture_reader * reader, char const * path)
+{
+    int const fd = open(path, O_RDONLY);
+    if (0 > fd)
+    {
+        return false;
+    }
+
+    struct stat info;
+    bool result = (0 == fstat(fd, &info)) && (MQTT_CAPTURE_MAGIC_SIZE <= info.st_size);
+    if (result)
+    {
+        reader->size = (size_t) info.st_size;
+        void * const data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        result = (MAP_FAILED != data);
+        reader->data = result ? data : NULL;
+    }
+    close(fd);
+
+    if ((result) && (0 != memcmp(reader->data, MQTT_CAPTURE_MAGIC, MQTT_CAPTURE_MAGIC_SIZE)))
+    {
+        munmap((void *) reader->data, reader->size);
+        result = false;
+    }
+
+    if (result)
+    {
+        // the capture is read once from start to end
+        madvise((void *) reader->data, reader->size, MADV_SEQUENTIAL);
+        reader->position = MQTT_CAPTURE_MAGIC_SIZE;
+        reader->topics = NULL;
+        reader->topic_capacity = 0;
+        reader->timestamp = 0;
+        reader->failed = false;
+    }
+
+    return result;
+}
+
+void mqtt_capture_reader_close(struct mqtt_capture_reader * reader)
+{
+    munmap((void *) reader->data, reader->size);
+    free(reader->topics);
+}
+
+static bool mqtt_capture_get_varint(struct mqtt_capture_reader * reader, uint64_t * value)
+{
+    *value = 0;
+    for (unsigned int shift = 0; (shift < 64) && (reader->position < reader->size); shift += 7)
+    {
+        unsigned char const byte = reader->data[reader->position++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (0 == (byte & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint64_t mqtt_capture_get_fixed(unsigned char const * buffer, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        value |= (uint64_t) buffer[i] << (8 * i);
+    }
+
+    return value;
+}
+
+static bool mqtt_capture_read_topic(struct mqtt_capture_reader * reader)
+{
+    uint64_t id = 0;
+    uint64_t length = 0;
+    if ((!mqtt_capture_get_varint(reader, &id)) || (!mqtt_capture_get_varint(reader, &length)) ||
+        ((reader->size - reader->position) <= length) || ('\0' != reader->data[reader->position + length]) ||
+        (UINT32_MAX <= id))
+    {
+        return false;
+    }
+
+    if (reader->topic_capacity <= id)
+    {
+        size_t capacity = (0 < reader->topic_capacity) ? reader->topic_capacity : MQTT_CAPTURE_INITIAL_TOPICS;
+        while (capacity <= id)
+        {
+            capacity *= 2;
+        }
+
+        char const * * topics = realloc(reader->topics, capacity * sizeof(char const *));
+        if (NULL == topics)
+        {
+            return false;
+        }
+        memset(&topics[reader->topic_capacity], 0, (capacity - reader->topic_capacity) * sizeof(char const *));
+        reader->topics = topics;
+        reader->topic_capacity = capacity;
+    }
+
+    // topics are stored terminated, so they are used in place
+    reader->topics[id] = (char const *) &reader->data[reader->position];
+    reader->position += length + 1;
+    return true;
+}
+
+bool mqtt_capture_reader_next(struct mqtt_capture_reader * reader,
+    struct mqtt_capture_message * message)
+{
+    while ((!reader->failed) && (reader->position < reader->size))
+    {
+        unsigned char const type = reader->data[reader->position++];
+        switch (type)
+        {
+            case MQTT_CAPTURE_TOPIC:
+                reader->failed = !mqtt_capture_read_topic(reader);
+                break;
+            case MQTT_CAPTURE_INDEX:
+                if ((reader->size - reader->position) < (MQTT_CAPTURE_INDEX_SIZE - 1))
+                {
+                    reader->failed = true;
+                    break;
+                }
+                reader->timestamp = mqtt_capture_get_fixed(&reader->data[reader->position], 8);
+                reader->position += MQTT_CAPTURE_INDEX_SIZE - 1;
+                break;
+            case MQTT_CAPTURE_MESSAGE:
+                {
+                    uint64_t delta = 0;
+                    uint64_t topic_id = 0;
+                    uint64_t length = 0;
+                    uint64_t properties_length = 0;
+                    size_t properties = 0;
+                    unsigned char flags = 0;
+                    bool valid = mqtt_capture_get_varint(reader, &delta) &&
+                        mqtt_capture_get_varint(reader, &topic_id) &&
+                        (reader->position < reader->size);
+                    if (valid)
+                    {
+                        flags = reader->data[reader->position++];
+                        valid = mqtt_capture_get_varint(reader, &length) &&
+                            (length <= (reader->size - reader->position)) &&
+                            (topic_id < reader->topic_capacity) && (NULL != reader->topics[topic_id]);
+                    }
+                    if ((valid) && (0 != (flags & MQTT_CAPTURE_FLAG_PROPERTIES)))
+                    {
+                        // properties follow the payload
+                        size_t const payload = reader->position;
+                        reader->position += (size_t) length;
+                        valid = mqtt_capture_get_varint(reader, &properties_length) &&
+                            (0 < properties_length) &&
+                            (properties_length <= (reader->size - reader->position));
+                        properties = reader->position;
+                        reader->position = payload;
+                    }
+                    if (!valid)
+                    {
+                        reader->failed = true;
+                        break;
+                    }
+
+                    reader->timestamp += delta;
+                    message->timestamp = reader->timestamp;
+                    message->topic = reader->topics[topic_id];
+                    message->payload = &reader->data[reader->position];
+                    message->payloadlen = (size_t) length;
+                    message->qos = flags & 0x03;
+                    message->retain = (0 != (flags & MQTT_CAPTURE_FLAG_RETAIN));
+                    message->properties = (0 < properties_length) ? &reader->data[properties] : NULL;
+                    message->propertieslen = (size_t) properties_length;
+                    reader->position = (0 < properties_length) ? (properties + (size_t) properties_length) :
+                        (reader->position + (size_t) length);
+                }
+                return true;
+            default:
+                reader->failed = true;
+                break;
+        }
+    }
+
+    return false;
+}
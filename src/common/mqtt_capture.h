@@ -0,0 +1,126 @@
+#ifndef MQTT_CAPTURE_H
+#define MQTT_CAPTURE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// append-only capture of MQTT messages
+//
+// The file starts with the 8 byte magic "MQTTCAP1", followed by blocks,
+// each starting with a type byte. Numbers are unsigned LEB128 varints,
+// fixed size fields are little endian.
+//
+// topic:   type 1, varint id, varint length, topic, '\0'
+//          (written before the first message of a topic)
+// message: type 2, varint nanoseconds since the previous message,
+//          varint topic id, flags (qos | retain << 2 | properties << 3),
+//          varint length, payload, and with the properties flag
+//          varint length, properties
+// index:   type 3, u64 timestamp in nanoseconds since the epoch, u64 offset
+//          of the previous index (0 for none), u32 messages since the
+//          previous index, u32 number of topics
+//          (written every MQTT_CAPTURE_INDEX_INTERVAL messages and on close;
+//          a message following an index is relative to its timestamp)
+#define MQTT_CAPTURE_MAGIC "MQTTCAP1"
+#define MQTT_CAPTURE_MAGIC_SIZE (8)
+
+#define MQTT_CAPTURE_TOPIC   (1)
+#define MQTT_CAPTURE_MESSAGE (2)
+#define MQTT_CAPTURE_INDEX   (3)
+
+#define MQTT_CAPTURE_INDEX_INTERVAL (1024)
+
+#define MQTT_CAPTURE_FLAG_RETAIN     (0x04)
+#define MQTT_CAPTURE_FLAG_PROPERTIES (0x08)
+
+struct mqtt_capture_message
+{
+    uint64_t timestamp;
+    char const * topic;
+    void const * payload;
+    size_t payloadlen;
+    int qos;
+    bool retain;
+
+    // properties are opaque to the capture, e.g. encoded MQTT 5 properties;
+    // NULL with a length of 0 for none
+    void const * properties;
+    size_t propertieslen;
+};
+
+struct mqtt_capture_topic
+{
+    char * topic;
+    uint32_t id;
+};
+
+// writes a capture; messages may be added from any thread
+struct mqtt_capture_writer
+{
+    FILE * file;
+    pthread_mutex_t lock;
+    struct mqtt_capture_topic * topics;
+    size_t topic_capacity;
+    uint32_t topic_count;
+    uint64_t timestamp;
+    uint64_t offset;
+    uint64_t previous_index;
+    uint32_t messages;
+    bool failed;
+};
+
+// creates or truncates the file; returns false on error
+extern bool mqtt_capture_writer_open(struct mqtt_capture_writer * writer, char const * path);
+
+// creates the file like mqtt_capture_writer_open, but fails if it exists
+extern bool mqtt_capture_writer_create(struct mqtt_capture_writer * writer, char const * path);
+
+// writes a final index and closes the file;
+// returns false, if any write failed
+extern bool mqtt_capture_writer_close(struct mqtt_capture_writer * writer);
+
+// returns a timestamp of the realtime clock in nanoseconds
+extern uint64_t mqtt_capture_now(void);
+
+extern void mqtt_capture_writer_add(struct mqtt_capture_writer * writer,
+    struct mqtt_capture_message const * message);
+
+// writes an index and waits until the file is stored on disk;
+// returns false, if any write failed
+extern bool mqtt_capture_writer_sync(struct mqtt_capture_writer * writer);
+
+// reads a capture mapped into memory; topics and payloads of the
+// messages point into the mapping and stay valid until the reader is closed
+struct mqtt_capture_reader
+{
+    unsigned char const * data;
+    size_t size;
+    size_t position;
+    char const * * topics;
+    size_t topic_capacity;
+    uint64_t timestamp;
+    bool failed;
+};
+
+extern bool mqtt_capture_reader_open(struct mqtt_capture_reader * reader, char const * path);
+
+extern void mqtt_capture_reader_close(struct mqtt_capture_reader * reader);
+
+// reads the next message; returns false at the end of the capture or,
+// setting failed, if the capture is corrupt
+extern bool mqtt_capture_reader_next(struct mqtt_capture_reader * reader,
+    struct mqtt_capture_message * message);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
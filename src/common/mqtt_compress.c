@@ -0,0 +1,353 @@
+#include "mqtt_compress.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// uncompressed length in front of lz4 blocks
+#define MQTT_COMPRESS_LZ4_HEADER_SIZE (4)
+
+bool mqtt_compression_parse(char const * name, enum mqtt_compression * compression)
+{
+    if (0 == strcmp("zstd", name))
+    {
+        *compression = MQTT_COMPRESSION_ZSTD;
+    }
+    else if (0 == strcmp("lz4", name))
+    {
+        *compression = MQTT_COMPRESSION_LZ4;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+char const * mqtt_compression_name(enum mqtt_compression compression)
+{
+    switch (compression)
+    {
+        case MQTT_COMPRESSION_ZSTD:
+            return "zstd";
+        case MQTT_COMPRESSION_LZ4:
+            return "lz4";
+        default:
+            return "none";
+    }
+}
+
+bool mqtt_compression_supported(enum mqtt_compression compression)
+{
+    switch (compression)
+    {
+        case MQTT_COMPRESSION_NONE:
+            return true;
+#ifdef HAVE_ZSTD
+        case MQTT_COMPRESSION_ZSTD:
+            return true;
+#endif
+#ifdef HAVE_LZ4
+        case MQTT_COMPRESSION_LZ4:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+void mqtt_dictionary_init(struct mqtt_dictionary * dictionary)
+{
+    dictionary->data = NULL;
+    dictionary->size = 0;
+    dictionary->zstd_cdict = NULL;
+    dictionary->zstd_ddict = NULL;
+}
+
+void mqtt_dictionary_cleanup(struct mqtt_dictionary * dictionary)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCDict(dictionary->zstd_cdict);
+    ZSTD_freeDDict(dictionary->zstd_ddict);
+#endif
+    free(dictionary->data);
+    mqtt_dictionary_init(dictionary);
+}
+
+bool mqtt_dictionary_load(struct mqtt_dictionary * dictionary, char const * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (NULL == file)
+    {
+        return false;
+    }
+
+    bool result = false;
+    long size = -1;
+    if ((0 == fseek(file, 0, SEEK_END)) && (0 < (size = ftell(file))) && (0 == fseek(file, 0, SEEK_SET)))
+    {
+        dictionary->data = malloc((size_t) size);
+        dictionary->size = (size_t) size;
+        result = (NULL != dictionary->data) && (dictionary->size == fread(dictionary->data, 1, dictionary->size, file));
+    }
+    fclose(file);
+
+#ifdef HAVE_ZSTD
+    // digested once, so that each message only references the dictionary
+    if (result)
+    {
+        dictionary->zstd_cdict = ZSTD_createCDict(dictionary->data, dictionary->size, ZSTD_CLEVEL_DEFAULT);
+        dictionary->zstd_ddict = ZSTD_createDDict(dictionary->data, dictionary->size);
+        result = (NULL != dictionary->zstd_cdict) && (NULL != dictionary->zstd_ddict);
+    }
+#endif
+
+    if (!result)
+    {
+        mqtt_dictionary_cleanup(dictionary);
+    }
+
+    return result;
+}
+
+void mqtt_codec_init(struct mqtt_codec * codec, struct mqtt_dictionary const * dictionary)
+{
+    codec->dictionary = ((NULL != dictionary) && (NULL != dictionary->data)) ? dictionary : NULL;
+    codec->zstd_cctx = NULL;
+    codec->zstd_dctx = NULL;
+    codec->lz4_stream = NULL;
+    codec->buffer = NULL;
+    codec->capacity = 0;
+}
+
+void mqtt_codec_cleanup(struct mqtt_codec * codec)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(codec->zstd_cctx);
+    ZSTD_freeDCtx(codec->zstd_dctx);
+#endif
+#ifdef HAVE_LZ4
+    LZ4_freeStream(codec->lz4_stream);
+#endif
+    free(codec->buffer);
+    mqtt_codec_init(codec, NULL);
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+
+static bool mqtt_codec_reserve(struct mqtt_codec * codec, size_t capacity)
+{
+    if (capacity <= codec->capacity)
+    {
+        return true;
+    }
+
+    unsigned char * buffer = realloc(codec->buffer, capacity);
+    if (NULL == buffer)
+    {
+        return false;
+    }
+
+    codec->buffer = buffer;
+    codec->capacity = capacity;
+    return true;
+}
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+static bool mqtt_codec_compress_zstd(struct mqtt_codec * codec,
+    void const * data, size_t length, size_t * result_length)
+{
+    if (NULL == codec->zstd_cctx)
+    {
+        codec->zstd_cctx = ZSTD_createCCtx();
+    }
+    if ((NULL == codec->zstd_cctx) || (!mqtt_codec_reserve(codec, ZSTD_compressBound(length))))
+    {
+        return false;
+    }
+
+    size_t const rc = (NULL != codec->dictionary) ?
+        ZSTD_compress_usingCDict(codec->zstd_cctx, codec->buffer, codec->capacity,
+            data, length, codec->dictionary->zstd_cdict) :
+        ZSTD_compressCCtx(codec->zstd_cctx, codec->buffer, codec->capacity,
+            data, length, ZSTD_CLEVEL_DEFAULT);
+    *result_length = rc;
+
+    return (!ZSTD_isError(rc));
+}
+
+static bool mqtt_codec_decompress_zstd(struct mqtt_codec * codec,
+    void const * data, size_t length, size_t * result_length)
+{
+    // frames written by mqtt_codec_compress always contain their size
+    unsigned long long const size = ZSTD_getFrameContentSize(data, length);
+    if ((ZSTD_CONTENTSIZE_UNKNOWN == size) || (ZSTD_CONTENTSIZE_ERROR == size) ||
+        (MQTT_COMPRESS_MAX_LENGTH < size))
+    {
+        return false;
+    }
+
+    if (NULL == codec->zstd_dctx)
+    {
+        codec->zstd_dctx = ZSTD_createDCtx();
+    }
+    // one extra byte for the terminating 0
+    if ((NULL == codec->zstd_dctx) || (!mqtt_codec_reserve(codec, (size_t) size + 1)))
+    {
+        return false;
+    }
+
+    size_t const rc = (NULL != codec->dictionary) ?
+        ZSTD_decompress_usingDDict(codec->zstd_dctx, codec->buffer, (size_t) size,
+            data, length, codec->dictionary->zstd_ddict) :
+        ZSTD_decompressDCtx(codec->zstd_dctx, codec->buffer, (size_t) size, data, length);
+    *result_length = rc;
+    codec->buffer[size] = '\0';
+
+    return (!ZSTD_isError(rc)) && (rc == size);
+}
+
+#endif
+
+#ifdef HAVE_LZ4
+
+static bool mqtt_codec_compress_lz4(struct mqtt_codec * codec,
+    void const * data, size_t length, size_t * result_length)
+{
+    if (LZ4_MAX_INPUT_SIZE < length)
+    {
+        return false;
+    }
+
+    if (NULL == codec->lz4_stream)
+    {
+        codec->lz4_stream = LZ4_createStream();
+    }
+    int const bound = LZ4_compressBound((int) length);
+    if ((NULL == codec->lz4_stream) ||
+        (!mqtt_codec_reserve(codec, MQTT_COMPRESS_LZ4_HEADER_SIZE + (size_t) bound)))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < MQTT_COMPRESS_LZ4_HEADER_SIZE; i++)
+    {
+        codec->buffer[i] = (unsigned char) (length >> (8 * i));
+    }
+
+    char * const block = (char *) &codec->buffer[MQTT_COMPRESS_LZ4_HEADER_SIZE];
+    int rc = 0;
+    if (NULL != codec->dictionary)
+    {
+        // lz4 only references the last 64 KiB of the dictionary
+        LZ4_loadDict(codec->lz4_stream, codec->dictionary->data, (int) codec->dictionary->size);
+        rc = LZ4_compress_fast_continue(codec->lz4_stream, data, block, (int) length, bound, 1);
+    }
+    else
+    {
+        rc = LZ4_compress_fast_extState(codec->lz4_stream, data, block, (int) length, bound, 1);
+    }
+    *result_length = MQTT_COMPRESS_LZ4_HEADER_SIZE + (size_t) rc;
+
+    return (0 < rc);
+}
+
+static bool mqtt_codec_decompress_lz4(struct mqtt_codec * codec,
+    void const * data, size_t length, size_t * result_length)
+{
+    if (MQTT_COMPRESS_LZ4_HEADER_SIZE > length)
+    {
+        return false;
+    }
+
+    unsigned char const * header = data;
+    size_t size = 0;
+    for (size_t i = 0; i < MQTT_COMPRESS_LZ4_HEADER_SIZE; i++)
+    {
+        size |= (size_t) header[i] << (8 * i);
+    }
+    if ((MQTT_COMPRESS_MAX_LENGTH < size) || (!mqtt_codec_reserve(codec, size + 1)))
+    {
+        return false;
+    }
+
+    char const * const block = (char const *) &header[MQTT_COMPRESS_LZ4_HEADER_SIZE];
+    int const block_length = (int) (length - MQTT_COMPRESS_LZ4_HEADER_SIZE);
+    int const rc = (NULL != codec->dictionary) ?
+        LZ4_decompress_safe_usingDict(block, (char *) codec->buffer, block_length, (int) size,
+            codec->dictionary->data, (int) codec->dictionary->size) :
+        LZ4_decompress_safe(block, (char *) codec->buffer, block_length, (int) size);
+    *result_length = (0 <= rc) ? (size_t) rc : 0;
+    codec->buffer[size] = '\0';
+
+    return (0 <= rc) && ((size_t) rc == size);
+}
+
+#endif
+
+bool mqtt_codec_compress(struct mqtt_codec * codec, enum mqtt_compression compression,
+    void const * data, size_t length, void const * * result, size_t * result_length)
+{
+    bool ok = false;
+    *result_length = 0;
+    switch (compression)
+    {
+#ifdef HAVE_ZSTD
+        case MQTT_COMPRESSION_ZSTD:
+            ok = mqtt_codec_compress_zstd(codec, data, length, result_length);
+            break;
+#endif
+#ifdef HAVE_LZ4
+        case MQTT_COMPRESSION_LZ4:
+            ok = mqtt_codec_compress_lz4(codec, data, length, result_length);
+            break;
+#endif
+        default:
+            (void) data; // unused
+            (void) length; // unused
+            break;
+    }
+    *result = ok ? codec->buffer : NULL;
+
+    return ok;
+}
+
+bool mqtt_codec_decompress(struct mqtt_codec * codec, enum mqtt_compression compression,
+    void const * data, size_t length, void const * * result, size_t * result_length)
+{
+    bool ok = false;
+    *result_length = 0;
+    switch (compression)
+    {
+#ifdef HAVE_ZSTD
+        case MQTT_COMPRESSION_ZSTD:
+            ok = mqtt_codec_decompress_zstd(codec, data, length, result_length);
+            break;
+#endif
+#ifdef HAVE_LZ4
+        case MQTT_COMPRESSION_LZ4:
+            ok = mqtt_codec_decompress_lz4(codec, data, length, result_length);
+            break;
+#endif
+        default:
+            (void) data; // unused
+            (void) length; // unused
+            break;
+    }
+    *result = ok ? codec->buffer : NULL;
+
+    return ok;
+}
@@ -0,0 +1,84 @@
+#ifndef MQTT_COMPRESS_H
+#define MQTT_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// name of the MQTT 5 user property, which marks compressed payloads
+#define MQTT_COMPRESS_PROPERTY "content-encoding"
+
+// largest payload, which is decompressed (maximum payload size of MQTT)
+#define MQTT_COMPRESS_MAX_LENGTH (268435455)
+
+enum mqtt_compression
+{
+    MQTT_COMPRESSION_NONE,
+    MQTT_COMPRESSION_ZSTD,
+    MQTT_COMPRESSION_LZ4
+};
+
+// parses the name of a compression ("zstd" or "lz4");
+// returns false, if the name is unknown
+extern bool mqtt_compression_parse(char const * name, enum mqtt_compression * compression);
+
+extern char const * mqtt_compression_name(enum mqtt_compression compression);
+
+// returns false, if the library of the compression was not available at build time
+extern bool mqtt_compression_supported(enum mqtt_compression compression);
+
+// dictionary trained on typical payloads (e.g. by zstd --train);
+// it is read-only once loaded and shared by all codecs
+struct mqtt_dictionary
+{
+    void * data;
+    size_t size;
+    void * zstd_cdict;
+    void * zstd_ddict;
+};
+
+extern void mqtt_dictionary_init(struct mqtt_dictionary * dictionary);
+
+extern void mqtt_dictionary_cleanup(struct mqtt_dictionary * dictionary);
+
+// reads the dictionary from a file; returns false on error
+extern bool mqtt_dictionary_load(struct mqtt_dictionary * dictionary, char const * path);
+
+// compression contexts and result buffer of a single thread; contexts are
+// created on first use and reused, so that no memory is allocated per message
+// once the buffer has grown to the size of the largest payload
+struct mqtt_codec
+{
+    struct mqtt_dictionary const * dictionary;
+    void * zstd_cctx;
+    void * zstd_dctx;
+    void * lz4_stream;
+    unsigned char * buffer;
+    size_t capacity;
+};
+
+// dictionary may be NULL; it must outlive the codec
+extern void mqtt_codec_init(struct mqtt_codec * codec, struct mqtt_dictionary const * dictionary);
+
+extern void mqtt_codec_cleanup(struct mqtt_codec * codec);
+
+// compresses data; the result is owned by the codec and valid until the next call;
+// lz4 payloads are prefixed by their uncompressed length (4 bytes little endian)
+extern bool mqtt_codec_compress(struct mqtt_codec * codec, enum mqtt_compression compression,
+    void const * data, size_t length, void const * * result, size_t * result_length);
+
+// decompresses data; the result is owned by the codec and valid until the next call;
+// like payloads of libmosquitto, it is followed by a terminating 0 byte;
+// returns false, if the data is malformed or was compressed with another dictionary
+extern bool mqtt_codec_decompress(struct mqtt_codec * codec, enum mqtt_compression compression,
+    void const * data, size_t length, void const * * result, size_t * result_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
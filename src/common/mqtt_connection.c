@@ -0,0 +1,808 @@
+#include "mqtt_connection.h"
+#include "mqtt_backoff.h"
+#include "topic_alias.h"
+#include "mqtt_tls.h"
+
+#include <mqtt_protocol.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOOP_INTERVAL (1000)
+
+// message ids are 16 bit (MQTT 3.1.1, 2.3.1)
+#define MQTT_CONNECTION_MIDS (UINT16_MAX + 1)
+
+// state of a message id
+enum mqtt_connection_mid
+{
+    MID_FREE,
+    MID_QOS0,
+    MID_QOS,
+    MID_COMPLETED
+};
+
+struct mqtt_connection
+{
+    struct mosquitto * mosq;
+    struct mqtt_options const * options;
+    struct mqtt_connection_callbacks callbacks;
+    void * user_data;
+    struct mqtt_backoff backoff;
+    pthread_t thread;
+    bool started;
+    bool reconnect_pending;
+    uint64_t reconnect_at;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char * mids;
+    unsigned int pending;
+    unsigned int pending_qos0;
+    unsigned int lost;
+    unsigned int disconnects;
+    unsigned int generation;
+    pthread_mutex_t alias_lock;
+    struct topic_alias aliases;
+    unsigned int receive_maximum;
+    int notify_fd;
+    bool connected;
+    bool stopped;
+    bool failed;
+};
+
+static struct timespec deadline_after(unsigned int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    return deadline;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000) + ((uint64_t) now.tv_nsec / 1000000);
+}
+
+static void sleep_ms(unsigned int delay)
+{
+    struct timespec const duration = {
+        .tv_sec = delay / 1000,
+        .tv_nsec = (long) (delay % 1000) * 1000000L
+    };
+    nanosleep(&duration, NULL);
+}
+
+// signals the waiter of mqtt_connection_ready once; called with lock held
+static void mqtt_connection_notify(struct mqtt_connection * connection)
+{
+    if (0 <= connection->notify_fd)
+    {
+        // a failed write leaves the counter of the eventfd as is, i.e. signaled
+        uint64_t const value = 1;
+        ssize_t const written = write(connection->notify_fd, &value, sizeof(value));
+        (void) written; // unused
+        connection->notify_fd = -1;
+    }
+}
+
+static void mqtt_connection_on_connect(struct mosquitto * mosq, void * user_data, int rc, int flags,
+    mosquitto_property const * properties)
+{
+    struct mqtt_connection * connection = user_data;
+
+    if (0 == rc)
+    {
+        mqtt_options_tune_socket(connection->options, mosq);
+
+        // asynchronous reconnects only fail once the broker is contacted,
+        // so the backoff is reset, when the broker accepted the connect
+        mqtt_backoff_reset(&connection->backoff);
+    }
+
+    // the broker announces the limits of this connection in CONNACK;
+    // without, topic aliases are not allowed (MQTT 5, 3.2.2.3.8)
+    uint16_t alias_maximum = 0;
+    uint16_t receive_maximum = UINT16_MAX;
+    mosquitto_property_read_int16(properties, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &alias_maximum, false);
+    mosquitto_property_read_int16(properties, MQTT_PROP_RECEIVE_MAXIMUM, &receive_maximum, false);
+
+    // aliases are only valid within a network connection
+    if (0 == rc)
+    {
+        pthread_mutex_lock(&connection->alias_lock);
+        if (!topic_alias_reset(&connection->aliases, alias_maximum))
+        {
+            topic_alias_reset(&connection->aliases, 0);
+        }
+        pthread_mutex_unlock(&connection->alias_lock);
+    }
+
+    pthread_mutex_lock(&connection->lock);
+    if (0 == rc)
+    {
+        connection->connected = true;
+        connection->receive_maximum = receive_maximum;
+        mqtt_connection_notify(connection);
+    }
+    else
+    {
+        fprintf(stderr, "error: connection refused: %s\n", mosquitto_connack_string(rc));
+        connection->failed = true;
+    }
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->lock);
+
+    if (NULL != connection->callbacks.on_connect)
+    {
+        connection->callbacks.on_connect(connection, connection->user_data, rc, flags);
+    }
+}
+
+static void mqtt_connection_on_disconnect(struct mosquitto * mosq, void * user_data, int rc)
+{
+    (void) mosq; // unused
+    struct mqtt_connection * connection = user_data;
+
+    pthread_mutex_lock(&connection->lock);
+    connection->connected = false;
+    connection->generation++;
+    if ((0 != rc) && (!connection->stopped))
+    {
+        fprintf(stderr, "warning: connection lost\n");
+        connection->disconnects++;
+
+        // libmosquitto retransmits QoS 1 and 2 messages after reconnect,
+        // but drops queued QoS 0 messages without notice
+        for (size_t mid = 0; (0 < connection->pending_qos0) && (mid < MQTT_CONNECTION_MIDS); mid++)
+        {
+            if (MID_QOS0 == connection->mids[mid])
+            {
+                connection->mids[mid] = MID_FREE;
+                connection->pending_qos0--;
+                connection->pending--;
+                connection->lost++;
+            }
+        }
+    }
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->lock);
+}
+
+static void mqtt_connection_on_publish(struct mosquitto * mosq, void * user_data, int mid)
+{
+    (void) mosq; // unused
+    struct mqtt_connection * connection = user_data;
+
+    pthread_mutex_lock(&connection->lock);
+    unsigned char * state = &connection->mids[(uint16_t) mid];
+    switch (*state)
+    {
+        case MID_QOS0:
+            connection->pending_qos0--;
+            // fall-through
+        case MID_QOS:
+            connection->pending--;
+            *state = MID_FREE;
+            break;
+        case MID_FREE:
+            // the loop thread completed the message, before it was tracked
+            *state = MID_COMPLETED;
+            break;
+        default:
+            break;
+    }
+    mqtt_connection_notify(connection);
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->lock);
+}
+
+static void mqtt_connection_on_message(struct mosquitto * mosq,
+    void * user_data, struct mosquitto_message const * message, mosquitto_property const * properties)
+{
+    (void) mosq; // unused
+    struct mqtt_connection * connection = user_data;
+
+    if (NULL != connection->callbacks.on_message)
+    {
+        connection->callbacks.on_message(connection, connection->user_data, message, properties);
+    }
+}
+
+static void mqtt_connection_on_subscribe(struct mosquitto * mosq, void * user_data,
+    int mid, int qos_count, int const * granted_qos, mosquitto_property const * properties)
+{
+    (void) mosq; // unused
+    (void) properties; // unused
+    struct mqtt_connection * connection = user_data;
+
+    if (NULL != connection->callbacks.on_subscribe)
+    {
+        connection->callbacks.on_subscribe(connection, connection->user_data, mid, qos_count, granted_qos);
+    }
+}
+
+struct mqtt_connection * mqtt_connection_create(
+    struct mqtt_options const * options,
+    char const * id,
+    struct mqtt_connection_callbacks const * callbacks,
+    void * user_data)
+{
+    struct mqtt_connection * connection = malloc(sizeof(struct mqtt_connection));
+    if (NULL == connection)
+    {
+        fprintf(stderr, "error: failed to allocate connection\n");
+        return NULL;
+    }
+
+    connection->options = options;
+    connection->callbacks.on_connect = (NULL != callbacks) ? callbacks->on_connect : NULL;
+    connection->callbacks.on_message = (NULL != callbacks) ? callbacks->on_message : NULL;
+    connection->callbacks.on_subscribe = (NULL != callbacks) ? callbacks->on_subscribe : NULL;
+    connection->user_data = user_data;
+    connection->started = false;
+    connection->reconnect_pending = false;
+    connection->reconnect_at = 0;
+    connection->mids = calloc(MQTT_CONNECTION_MIDS, sizeof(unsigned char));
+    connection->pending = 0;
+    connection->pending_qos0 = 0;
+    connection->lost = 0;
+    connection->disconnects = 0;
+    connection->generation = 0;
+    topic_alias_init(&connection->aliases);
+    connection->receive_maximum = UINT16_MAX;
+    connection->notify_fd = -1;
+    connection->connected = false;
+    connection->stopped = false;
+    connection->failed = false;
+    mqtt_backoff_init(&connection->backoff, options->reconnect_min, options->reconnect_max);
+
+    if (NULL == connection->mids)
+    {
+        fprintf(stderr, "error: failed to allocate connection\n");
+        free(connection);
+        return NULL;
+    }
+
+    connection->mosq = mosquitto_new((NULL != id) ? id : options->id, options->clean_session, connection);
+    if (NULL == connection->mosq)
+    {
+        fprintf(stderr, "error: failed to create mosquitto instance\n");
+        free(connection->mids);
+        free(connection);
+        return NULL;
+    }
+
+    int const rc = mosquitto_username_pw_set(connection->mosq, options->user, options->password);
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to set user and password\n");
+        mosquitto_destroy(connection->mosq);
+        free(connection->mids);
+        free(connection);
+        return NULL;
+    }
+
+    mosquitto_int_option(connection->mosq, MOSQ_OPT_PROTOCOL_VERSION, options->protocol_version);
+    mqtt_options_apply(options, connection->mosq);
+
+    if ((NULL != options->tls_context) && (!mqtt_tls_apply(options->tls_context, connection->mosq)))
+    {
+        fprintf(stderr, "error: failed to set up TLS\n");
+        mosquitto_destroy(connection->mosq);
+        free(connection->mids);
+        free(connection);
+        return NULL;
+    }
+
+    if (0 < options->max_inflight)
+    {
+        mosquitto_max_inflight_messages_set(connection->mosq, options->max_inflight);
+    }
+
+    // the v5 callbacks are also called for MQTT 3.1.1 without properties
+    mosquitto_connect_v5_callback_set(connection->mosq, &mqtt_connection_on_connect);
+    mosquitto_disconnect_callback_set(connection->mosq, &mqtt_connection_on_disconnect);
+    mosquitto_publish_callback_set(connection->mosq, &mqtt_connection_on_publish);
+    mosquitto_message_v5_callback_set(connection->mosq, &mqtt_connection_on_message);
+    mosquitto_subscribe_v5_callback_set(connection->mosq, &mqtt_connection_on_subscribe);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&connection->lock, NULL);
+    pthread_mutex_init(&connection->alias_lock, NULL);
+    pthread_cond_init(&connection->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return connection;
+}
+
+void mqtt_connection_destroy(struct mqtt_connection * connection)
+{
+    mqtt_connection_stop(connection);
+
+    mosquitto_destroy(connection->mosq);
+    topic_alias_cleanup(&connection->aliases);
+    free(connection->mids);
+    pthread_cond_destroy(&connection->cond);
+    pthread_mutex_destroy(&connection->lock);
+    pthread_mutex_destroy(&connection->alias_lock);
+    free(connection);
+}
+
+struct mosquitto * mqtt_connection_mosq(struct mqtt_connection * connection)
+{
+    return connection->mosq;
+}
+
+void * mqtt_connection_user_data(struct mqtt_connection * connection)
+{
+    return connection->user_data;
+}
+
+static int mqtt_connection_connect_once(struct mqtt_connection * connection)
+{
+    struct mqtt_options const * options = connection->options;
+
+    // libmosquitto keeps the bind address for reconnects
+    if (MQTT_PROTOCOL_V5 != options->protocol_version)
+    {
+        return mosquitto_connect_bind(connection->mosq, options->host, options->port, options->keepalive,
+            options->bind_address);
+    }
+
+    // with MQTT 5, a session ends on disconnect without an expiry interval
+    // (3.1.2.11.2); it is kept like a persistent session of MQTT 3.1.1
+    mosquitto_property * properties = NULL;
+    if ((!options->clean_session) && (MOSQ_ERR_SUCCESS != mosquitto_property_add_int32(&properties,
+        MQTT_PROP_SESSION_EXPIRY_INTERVAL, UINT32_MAX)))
+    {
+        fprintf(stderr, "error: failed to create connect properties\n");
+        return MOSQ_ERR_NOMEM;
+    }
+
+    // the properties are kept by libmosquitto for reconnects
+    int const rc = mosquitto_connect_bind_v5(connection->mosq, options->host, options->port, options->keepalive,
+        options->bind_address, properties);
+    mosquitto_property_free_all(&properties);
+
+    return rc;
+}
+
+int mqtt_connection_connect(struct mqtt_connection * connection, unsigned int retries)
+{
+    int rc = mqtt_connection_connect_once(connection);
+    for (unsigned int retry = 0; (MOSQ_ERR_SUCCESS != rc) && (retry < retries); retry++)
+    {
+        unsigned int const delay = mqtt_backoff_next(&connection->backoff);
+        fprintf(stderr, "warning: failed to connect to MQTT broker; retry in %u ms\n", delay);
+        sleep_ms(delay);
+
+        rc = mqtt_connection_connect_once(connection);
+    }
+
+    if (MOSQ_ERR_SUCCESS == rc)
+    {
+        mqtt_backoff_reset(&connection->backoff);
+    }
+
+    return rc;
+}
+
+static bool mqtt_connection_stopped(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    bool const stopped = connection->stopped;
+    pthread_mutex_unlock(&connection->lock);
+
+    return stopped;
+}
+
+// waits for the given delay or until the connection is stopped
+static void mqtt_connection_delay(struct mqtt_connection * connection, unsigned int delay)
+{
+    struct timespec const deadline = deadline_after(delay);
+
+    pthread_mutex_lock(&connection->lock);
+    bool timed_out = false;
+    while ((!connection->stopped) && (!timed_out))
+    {
+        timed_out = (ETIMEDOUT == pthread_cond_timedwait(&connection->cond, &connection->lock, &deadline));
+    }
+    pthread_mutex_unlock(&connection->lock);
+}
+
+static void * mqtt_connection_run(void * arg)
+{
+    struct mqtt_connection * connection = arg;
+
+    bool done = false;
+    while (!done)
+    {
+        int rc = mosquitto_loop(connection->mosq, LOOP_INTERVAL, connection->options->max_packets);
+        if (MOSQ_ERR_SUCCESS != rc)
+        {
+            // once stopped, the loop runs until the disconnect is complete
+            done = mqtt_connection_stopped(connection);
+            if (!done)
+            {
+                unsigned int const delay = mqtt_backoff_next(&connection->backoff);
+                fprintf(stderr, "warning: not connected (%s); reconnect in %u ms\n",
+                    mosquitto_strerror(rc), delay);
+                mqtt_connection_delay(connection, delay);
+
+                rc = mqtt_connection_stopped(connection) ? MOSQ_ERR_SUCCESS : mosquitto_reconnect(connection->mosq);
+                if (MOSQ_ERR_SUCCESS == rc)
+                {
+                    mqtt_backoff_reset(&connection->backoff);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+bool mqtt_connection_start(struct mqtt_connection * connection)
+{
+    // the network loop runs in a thread of our own, so that reconnects
+    // use our backoff; libmosquitto needs to know about it
+    mosquitto_threaded_set(connection->mosq, true);
+
+    connection->started = (0 == pthread_create(&connection->thread, NULL, &mqtt_connection_run, connection));
+    if (!connection->started)
+    {
+        fprintf(stderr, "error: failed to start message loop\n");
+    }
+
+    return connection->started;
+}
+
+void mqtt_connection_stop(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    connection->stopped = true;
+    pthread_cond_broadcast(&connection->cond);
+    pthread_mutex_unlock(&connection->lock);
+
+    mosquitto_disconnect(connection->mosq);
+
+    if (connection->started)
+    {
+        pthread_join(connection->thread, NULL);
+        connection->started = false;
+    }
+}
+
+void mqtt_connection_poll(struct mqtt_connection * connection, int timeout_ms)
+{
+    if (connection->reconnect_pending)
+    {
+        connection->reconnect_pending = false;
+        if (MOSQ_ERR_SUCCESS == mosquitto_reconnect(connection->mosq))
+        {
+            mqtt_backoff_reset(&connection->backoff);
+        }
+        return;
+    }
+
+    int const rc = mosquitto_loop(connection->mosq, timeout_ms, connection->options->max_packets);
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        unsigned int const delay = mqtt_backoff_next(&connection->backoff);
+        fprintf(stderr, "warning: not connected (%s); reconnect in %u ms\n",
+            mosquitto_strerror(rc), delay);
+
+        // signals interrupt the delay, so that shutdown is not delayed
+        sleep_ms(delay);
+        connection->reconnect_pending = true;
+    }
+}
+
+int mqtt_connection_socket(struct mqtt_connection * connection)
+{
+    return mosquitto_socket(connection->mosq);
+}
+
+bool mqtt_connection_want_write(struct mqtt_connection * connection)
+{
+    return mosquitto_want_write(connection->mosq);
+}
+
+// schedules a reconnect after the next backoff delay; returns the delay
+static unsigned int mqtt_connection_schedule_reconnect(struct mqtt_connection * connection,
+    char const * reason)
+{
+    unsigned int const delay = mqtt_backoff_next(&connection->backoff);
+    fprintf(stderr, "warning: not connected (%s); reconnect in %u ms\n", reason, delay);
+    connection->reconnect_at = now_ms() + delay;
+
+    return delay;
+}
+
+unsigned int mqtt_connection_process(struct mqtt_connection * connection, bool readable, bool writable)
+{
+    struct mosquitto * mosq = connection->mosq;
+
+    // the TCP handshake of the reconnect completes in the event loop,
+    // which reports it as writable
+    if (mosquitto_socket(mosq) < 0)
+    {
+        uint64_t const now = now_ms();
+        if (mqtt_connection_stopped(connection))
+        {
+            return LOOP_INTERVAL;
+        }
+        else if (now < connection->reconnect_at)
+        {
+            return (unsigned int) (connection->reconnect_at - now);
+        }
+
+        int const rc = mosquitto_reconnect_async(mosq);
+        return (MOSQ_ERR_SUCCESS == rc) ? LOOP_INTERVAL :
+            mqtt_connection_schedule_reconnect(connection, mosquitto_strerror(rc));
+    }
+
+    int rc = MOSQ_ERR_SUCCESS;
+    if (readable)
+    {
+        rc = mosquitto_loop_read(mosq, connection->options->max_packets);
+    }
+    if ((MOSQ_ERR_SUCCESS == rc) && (writable))
+    {
+        rc = mosquitto_loop_write(mosq, connection->options->max_packets);
+    }
+
+    // sends pings and detects a broker, which stopped responding
+    if (MOSQ_ERR_SUCCESS == rc)
+    {
+        rc = mosquitto_loop_misc(mosq);
+    }
+
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        return mqtt_connection_stopped(connection) ? LOOP_INTERVAL :
+            mqtt_connection_schedule_reconnect(connection, mosquitto_strerror(rc));
+    }
+
+    // TLS may have buffered data, which the socket does not signal
+    return mqtt_tls_pending(mosq) ? 0 : LOOP_INTERVAL;
+}
+
+// waits until the client is connected;
+// returns false, if the connection was refused or the timeout elapsed
+static bool mqtt_connection_wait_connected(struct mqtt_connection * connection, unsigned int timeout_ms)
+{
+    struct timespec const deadline = deadline_after(timeout_ms);
+
+    bool timed_out = false;
+    pthread_mutex_lock(&connection->lock);
+    while ((!connection->failed) && (!connection->stopped) && (!timed_out) && (!connection->connected))
+    {
+        if (0 == timeout_ms)
+        {
+            pthread_cond_wait(&connection->cond, &connection->lock);
+        }
+        else
+        {
+            timed_out = (ETIMEDOUT == pthread_cond_timedwait(&connection->cond, &connection->lock, &deadline));
+        }
+    }
+    bool const result = (!connection->failed) && (connection->connected);
+    pthread_mutex_unlock(&connection->lock);
+
+    return result;
+}
+
+bool mqtt_connection_connected(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    bool const connected = connection->connected;
+    pthread_mutex_unlock(&connection->lock);
+
+    return connected;
+}
+
+static unsigned int mqtt_connection_generation(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    unsigned int const generation = connection->generation;
+    pthread_mutex_unlock(&connection->lock);
+
+    return generation;
+}
+
+// counts a sent message as pending by its id; the loop thread may have
+// completed it already, before mosquitto_publish returned, or dropped it
+// with a disconnect in between, if it is a QoS 0 message
+static void mqtt_connection_track(struct mqtt_connection * connection, int mid, int qos,
+    unsigned int generation)
+{
+    pthread_mutex_lock(&connection->lock);
+    unsigned char * state = &connection->mids[(uint16_t) mid];
+    if (MID_COMPLETED == *state)
+    {
+        *state = MID_FREE;
+    }
+    else if ((0 == qos) && (generation != connection->generation))
+    {
+        connection->lost++;
+    }
+    else
+    {
+        *state = (0 == qos) ? MID_QOS0 : MID_QOS;
+        connection->pending++;
+        connection->pending_qos0 += (0 == qos) ? 1 : 0;
+    }
+    pthread_mutex_unlock(&connection->lock);
+}
+
+// publishes QoS 0 messages of a MQTT 5 connection with a topic alias, once
+// the alias is known to the broker; QoS 1 and 2 messages are sent with their
+// topic, since libmosquitto retransmits them as is after a reconnect, when
+// the alias is no longer valid
+static int mqtt_connection_send(struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length, int qos, bool retain,
+    mosquitto_property const * properties, int * mid)
+{
+    if (MQTT_PROTOCOL_V5 != connection->options->protocol_version)
+    {
+        return mosquitto_publish(connection->mosq, mid, topic, (int) length, payload, qos, retain);
+    }
+
+    if (0 != qos)
+    {
+        return mosquitto_publish_v5(connection->mosq, mid, topic, (int) length, payload, qos, retain, properties);
+    }
+
+    // the alias lock keeps a reconnect from resetting the aliases in between;
+    // it is not the connection's lock, since libmosquitto writes QoS 0 messages
+    // inline without a loop thread and calls on_publish, which takes that lock
+    pthread_mutex_lock(&connection->alias_lock);
+    bool is_new = false;
+    uint16_t const alias = topic_alias_get(&connection->aliases, topic, &is_new);
+
+    // the alias is appended to a copy of the caller's properties
+    mosquitto_property * alias_properties = NULL;
+    bool const aliased = (0 < alias) &&
+        (MOSQ_ERR_SUCCESS == mosquitto_property_copy_all(&alias_properties, properties)) &&
+        (MOSQ_ERR_SUCCESS == mosquitto_property_add_int16(&alias_properties, MQTT_PROP_TOPIC_ALIAS, alias));
+    int const rc = mosquitto_publish_v5(connection->mosq, mid, (aliased && (!is_new)) ? "" : topic,
+        (int) length, payload, qos, retain, aliased ? alias_properties : properties);
+    mosquitto_property_free_all(&alias_properties);
+
+    // the broker did not learn the new alias; sending the topic with
+    // the next message of any topic assigns the aliases again
+    if ((is_new) && ((!aliased) || (MOSQ_ERR_SUCCESS != rc)))
+    {
+        topic_alias_reset(&connection->aliases, connection->aliases.maximum);
+    }
+    pthread_mutex_unlock(&connection->alias_lock);
+
+    return rc;
+}
+
+bool mqtt_connection_publish(struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length, int qos, bool retain,
+    unsigned int timeout_ms)
+{
+    return mqtt_connection_publish_v5(connection, topic, payload, length, qos, retain, NULL, timeout_ms);
+}
+
+bool mqtt_connection_publish_v5(struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length, int qos, bool retain,
+    mosquitto_property const * properties, unsigned int timeout_ms)
+{
+    int mid = 0;
+    unsigned int generation = mqtt_connection_generation(connection);
+    int rc = mqtt_connection_send(connection, topic, payload, length, qos, retain, properties, &mid);
+    while ((MOSQ_ERR_NO_CONN == rc) && (mqtt_connection_wait_connected(connection, timeout_ms)))
+    {
+        generation = mqtt_connection_generation(connection);
+        rc = mqtt_connection_send(connection, topic, payload, length, qos, retain, properties, &mid);
+    }
+
+    // only sent messages are counted, so that a failed send leaves no trace
+    if (MOSQ_ERR_SUCCESS == rc)
+    {
+        mqtt_connection_track(connection, mid, qos, generation);
+    }
+    else
+    {
+        fprintf(stderr, "error: failed to publish message\n");
+    }
+
+    return (MOSQ_ERR_SUCCESS == rc);
+}
+
+bool mqtt_connection_wait(struct mqtt_connection * connection,
+    unsigned int limit, unsigned int timeout_ms)
+{
+    struct timespec const deadline = deadline_after(timeout_ms);
+
+    bool timed_out = false;
+    pthread_mutex_lock(&connection->lock);
+    while ((!connection->failed) && (!connection->stopped) && (!timed_out) && (connection->pending > limit))
+    {
+        if (0 == timeout_ms)
+        {
+            pthread_cond_wait(&connection->cond, &connection->lock);
+        }
+        else
+        {
+            timed_out = (ETIMEDOUT == pthread_cond_timedwait(&connection->cond, &connection->lock, &deadline));
+        }
+    }
+    bool const result = (!connection->failed) && (connection->pending <= limit);
+    if (timed_out && (!result))
+    {
+        fprintf(stderr, "error: timed out waiting for %u message(s) to be delivered\n", connection->pending);
+    }
+    pthread_mutex_unlock(&connection->lock);
+
+    return result;
+}
+
+bool mqtt_connection_ready(struct mqtt_connection * connection, unsigned int limit, int fd)
+{
+    pthread_mutex_lock(&connection->lock);
+    bool const ready = (connection->connected) && (connection->pending <= limit);
+    if (!ready)
+    {
+        connection->notify_fd = fd;
+    }
+    pthread_mutex_unlock(&connection->lock);
+
+    return ready;
+}
+
+unsigned int mqtt_connection_pending(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    unsigned int const pending = connection->pending;
+    pthread_mutex_unlock(&connection->lock);
+
+    return pending;
+}
+
+unsigned int mqtt_connection_lost(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    unsigned int const lost = connection->lost;
+    pthread_mutex_unlock(&connection->lock);
+
+    return lost;
+}
+
+unsigned int mqtt_connection_disconnects(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    unsigned int const disconnects = connection->disconnects;
+    pthread_mutex_unlock(&connection->lock);
+
+    return disconnects;
+}
+
+unsigned int mqtt_connection_receive_maximum(struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&connection->lock);
+    unsigned int const receive_maximum = connection->receive_maximum;
+    pthread_mutex_unlock(&connection->lock);
+
+    return receive_maximum;
+}
@@ -0,0 +1,130 @@
+#ifndef MQTT_CONNECTION_H
+#define MQTT_CONNECTION_H
+
+#include "mqtt_options.h"
+
+#include <mosquitto.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct mqtt_connection;
+
+struct mqtt_connection_callbacks
+{
+    // called when the broker accepted or refused a connect;
+    // flags contain the session present flag of CONNACK
+    void (*on_connect)(struct mqtt_connection * connection, void * user_data, int rc, int flags);
+
+    // called for each received message; properties are NULL for MQTT 3.1.1
+    void (*on_message)(struct mqtt_connection * connection, void * user_data,
+        struct mosquitto_message const * message, mosquitto_property const * properties);
+
+    // called when the broker acknowledged a subscribe; granted_qos contains
+    // the granted QoS or failure reason code of each topic, as in SUBACK
+    void (*on_subscribe)(struct mqtt_connection * connection, void * user_data,
+        int mid, int qos_count, int const * granted_qos);
+};
+
+// creates a connection to the broker specified by options;
+// options must outlive the connection; id overrides options->id;
+// callbacks may be NULL
+extern struct mqtt_connection * mqtt_connection_create(
+    struct mqtt_options const * options,
+    char const * id,
+    struct mqtt_connection_callbacks const * callbacks,
+    void * user_data);
+
+// stops the connection, if it is started, and releases it
+extern void mqtt_connection_destroy(struct mqtt_connection * connection);
+
+extern struct mosquitto * mqtt_connection_mosq(struct mqtt_connection * connection);
+
+extern void * mqtt_connection_user_data(struct mqtt_connection * connection);
+
+// connects to the broker; if the connect fails, it is retried up to
+// retries times with backoff; returns a libmosquitto error code
+extern int mqtt_connection_connect(struct mqtt_connection * connection, unsigned int retries);
+
+// starts the network loop in a thread of its own;
+// lost connections are reconnected with backoff
+extern bool mqtt_connection_start(struct mqtt_connection * connection);
+
+// disconnects and waits for the network loop thread to finish;
+// publishers waiting for the connection give up
+extern void mqtt_connection_stop(struct mqtt_connection * connection);
+
+// runs a single iteration of the network loop in the calling thread,
+// as alternative to mqtt_connection_start;
+// when the connection is lost, it waits for the next backoff delay and
+// reconnects during the following call
+extern void mqtt_connection_poll(struct mqtt_connection * connection, int timeout_ms);
+
+// external event loops, e.g. mqtt_event_loop, drive a connection with the
+// following functions instead of mqtt_connection_start or mqtt_connection_poll;
+// the connection must only be used from the event loop's thread then
+
+// returns the socket of the connection or -1 while it is disconnected;
+// the socket changes on reconnect
+extern int mqtt_connection_socket(struct mqtt_connection * connection);
+
+// returns true, if the connection has data to send
+extern bool mqtt_connection_want_write(struct mqtt_connection * connection);
+
+// reads and writes the socket as it is ready, sends keepalive pings and
+// reconnects with backoff without blocking; returns the time in milliseconds
+// after which it must be called again, even if the socket is not ready
+extern unsigned int mqtt_connection_process(struct mqtt_connection * connection,
+    bool readable, bool writable);
+
+// publishes a message and tracks it until it is delivered;
+// while disconnected, it waits up to timeout_ms for a reconnect (0 waits forever);
+// with MQTT 5, QoS 0 messages are sent with topic aliases, if the broker allows
+extern bool mqtt_connection_publish(struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length, int qos, bool retain,
+    unsigned int timeout_ms);
+
+// publishes a message like mqtt_connection_publish with additional MQTT 5
+// properties; properties must be NULL for MQTT 3.1.1
+extern bool mqtt_connection_publish_v5(struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length, int qos, bool retain,
+    mosquitto_property const * properties, unsigned int timeout_ms);
+
+// waits until at most limit published messages are not yet delivered;
+// a timeout of 0 waits forever;
+// returns false, if the connection was refused or stopped or the timeout elapsed
+extern bool mqtt_connection_wait(struct mqtt_connection * connection,
+    unsigned int limit, unsigned int timeout_ms);
+
+// returns true, while the connection is accepted by the broker
+extern bool mqtt_connection_connected(struct mqtt_connection * connection);
+
+// returns true, if a message can be published without waiting, i.e. if the
+// connection is accepted and at most limit published messages are not yet
+// delivered; otherwise, the eventfd fd is signaled once, when this may have
+// changed, so that an event loop does not need to wait
+extern bool mqtt_connection_ready(struct mqtt_connection * connection, unsigned int limit, int fd);
+
+// returns the number of published messages not yet delivered
+extern unsigned int mqtt_connection_pending(struct mqtt_connection * connection);
+
+// returns the number of QoS 0 messages dropped due to connection loss
+extern unsigned int mqtt_connection_lost(struct mqtt_connection * connection);
+
+// returns the number of QoS 1 and 2 messages the broker accepts at once,
+// as announced by the broker on connect
+extern unsigned int mqtt_connection_receive_maximum(struct mqtt_connection * connection);
+
+// returns how often the connection was lost unexpectedly
+extern unsigned int mqtt_connection_disconnects(struct mqtt_connection * connection);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
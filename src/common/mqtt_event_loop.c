@@ -0,0 +1,356 @@
+#include "mqtt_event_loop.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MQTT_EVENT_LOOP_MAX_EVENTS (64)
+
+struct mqtt_event_source
+{
+    int fd;
+    uint32_t events;
+    mqtt_event_loop_handler_fn * handler;
+    void * user_data;
+    struct mqtt_connection * connection;
+    uint64_t deadline;
+    bool pending;
+    bool removed;
+};
+
+struct mqtt_event_loop
+{
+    int epoll_fd;
+    struct mqtt_event_source ** sources;
+    size_t size;
+    size_t capacity;
+    bool dispatching;
+    bool stopped;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000) + ((uint64_t) now.tv_nsec / 1000000);
+}
+
+struct mqtt_event_loop * mqtt_event_loop_create(void)
+{
+    struct mqtt_event_loop * loop = malloc(sizeof(struct mqtt_event_loop));
+    if (NULL == loop)
+    {
+        fprintf(stderr, "error: failed to allocate event loop\n");
+        return NULL;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (0 > loop->epoll_fd)
+    {
+        fprintf(stderr, "error: failed to create epoll instance\n");
+        free(loop);
+        return NULL;
+    }
+
+    loop->sources = NULL;
+    loop->size = 0;
+    loop->capacity = 0;
+    loop->dispatching = false;
+    loop->stopped = false;
+
+    return loop;
+}
+
+void mqtt_event_loop_destroy(struct mqtt_event_loop * loop)
+{
+    if (NULL == loop)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < loop->size; i++)
+    {
+        free(loop->sources[i]);
+    }
+    free(loop->sources);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+static struct mqtt_event_source * mqtt_event_loop_append(struct mqtt_event_loop * loop)
+{
+    if (loop->size == loop->capacity)
+    {
+        size_t const capacity = (0 < loop->capacity) ? 2 * loop->capacity : 16;
+        struct mqtt_event_source ** sources = realloc(loop->sources, capacity * sizeof(struct mqtt_event_source *));
+        if (NULL == sources)
+        {
+            return NULL;
+        }
+        loop->sources = sources;
+        loop->capacity = capacity;
+    }
+
+    struct mqtt_event_source * source = malloc(sizeof(struct mqtt_event_source));
+    if (NULL != source)
+    {
+        source->fd = -1;
+        source->events = 0;
+        source->handler = NULL;
+        source->user_data = NULL;
+        source->connection = NULL;
+        source->deadline = 0;
+        source->pending = false;
+        source->removed = false;
+        loop->sources[loop->size] = source;
+        loop->size++;
+    }
+
+    return source;
+}
+
+static void mqtt_event_loop_compact(struct mqtt_event_loop * loop)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < loop->size; i++)
+    {
+        if (loop->sources[i]->removed)
+        {
+            free(loop->sources[i]);
+        }
+        else
+        {
+            loop->sources[count] = loop->sources[i];
+            count++;
+        }
+    }
+    loop->size = count;
+}
+
+// sources are released after dispatch, since pending epoll events may still refer to them
+static void mqtt_event_loop_release(struct mqtt_event_loop * loop, struct mqtt_event_source * source)
+{
+    if ((0 <= source->fd) && (0 != source->events))
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+    }
+    source->events = 0;
+    source->removed = true;
+
+    if (!loop->dispatching)
+    {
+        mqtt_event_loop_compact(loop);
+    }
+}
+
+bool mqtt_event_loop_add(struct mqtt_event_loop * loop, int fd, uint32_t events,
+    mqtt_event_loop_handler_fn * handler, void * user_data)
+{
+    struct mqtt_event_source * source = mqtt_event_loop_append(loop);
+    if (NULL == source)
+    {
+        fprintf(stderr, "error: failed to allocate event source\n");
+        return false;
+    }
+
+    source->fd = fd;
+    source->events = events;
+    source->handler = handler;
+    source->user_data = user_data;
+    source->deadline = UINT64_MAX;
+
+    struct epoll_event event = { .events = events, .data.ptr = source };
+    if (0 != epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event))
+    {
+        fprintf(stderr, "error: failed to watch file descriptor %d\n", fd);
+        source->events = 0;
+        mqtt_event_loop_release(loop, source);
+        return false;
+    }
+
+    return true;
+}
+
+void mqtt_event_loop_remove(struct mqtt_event_loop * loop, int fd)
+{
+    for (size_t i = 0; i < loop->size; i++)
+    {
+        struct mqtt_event_source * source = loop->sources[i];
+        if ((!source->removed) && (NULL == source->connection) && (fd == source->fd))
+        {
+            mqtt_event_loop_release(loop, source);
+            return;
+        }
+    }
+}
+
+// libmosquitto replaces the socket on reconnect and only wants to be
+// woken for writing while it has data to send
+static void mqtt_event_loop_sync(struct mqtt_event_loop * loop, struct mqtt_event_source * source)
+{
+    int const fd = mqtt_connection_socket(source->connection);
+    uint32_t const events = EPOLLIN | (mqtt_connection_want_write(source->connection) ? EPOLLOUT : 0);
+    struct epoll_event event = { .events = events, .data.ptr = source };
+
+    if (fd != source->fd)
+    {
+        // a closed socket is already removed from the epoll instance
+        if ((0 <= source->fd) && (0 <= fd) && (0 != source->events))
+        {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+        }
+
+        source->fd = fd;
+        source->events = 0;
+        if ((0 <= fd) && (0 == epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)))
+        {
+            source->events = events;
+        }
+    }
+    else if ((0 <= fd) && (events != source->events))
+    {
+        int rc = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        if ((0 != rc) && (ENOENT == errno))
+        {
+            rc = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        }
+        source->events = (0 == rc) ? events : 0;
+    }
+}
+
+static void mqtt_event_loop_process(struct mqtt_event_loop * loop, struct mqtt_event_source * source,
+    bool readable, bool writable)
+{
+    unsigned int const delay = mqtt_connection_process(source->connection, readable, writable);
+    source->deadline = now_ms() + delay;
+    source->pending = (0 == delay);
+
+    mqtt_event_loop_sync(loop, source);
+}
+
+bool mqtt_event_loop_add_connection(struct mqtt_event_loop * loop,
+    struct mqtt_connection * connection)
+{
+    struct mqtt_event_source * source = mqtt_event_loop_append(loop);
+    if (NULL == source)
+    {
+        fprintf(stderr, "error: failed to allocate event source\n");
+        return false;
+    }
+
+    source->connection = connection;
+    mqtt_event_loop_process(loop, source, false, true);
+
+    return true;
+}
+
+void mqtt_event_loop_remove_connection(struct mqtt_event_loop * loop,
+    struct mqtt_connection * connection)
+{
+    for (size_t i = 0; i < loop->size; i++)
+    {
+        struct mqtt_event_source * source = loop->sources[i];
+        if ((!source->removed) && (connection == source->connection))
+        {
+            mqtt_event_loop_release(loop, source);
+            return;
+        }
+    }
+}
+
+// the deadlines are scanned linearly, which is cheap compared to
+// processing a connection for hundreds of connections
+static int mqtt_event_loop_timeout(struct mqtt_event_loop const * loop, int timeout_ms)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (size_t i = 0; i < loop->size; i++)
+    {
+        if ((!loop->sources[i]->removed) && (loop->sources[i]->deadline < deadline))
+        {
+            deadline = loop->sources[i]->deadline;
+        }
+    }
+
+    if (UINT64_MAX == deadline)
+    {
+        return timeout_ms;
+    }
+
+    uint64_t const now = now_ms();
+    uint64_t const remaining = (now < deadline) ? deadline - now : 0;
+    int const timeout = (INT_MAX < remaining) ? INT_MAX : (int) remaining;
+
+    return ((0 <= timeout_ms) && (timeout_ms < timeout)) ? timeout_ms : timeout;
+}
+
+bool mqtt_event_loop_dispatch(struct mqtt_event_loop * loop, int timeout_ms)
+{
+    if (loop->stopped)
+    {
+        return false;
+    }
+
+    struct epoll_event events[MQTT_EVENT_LOOP_MAX_EVENTS];
+    int const count = epoll_wait(loop->epoll_fd, events, MQTT_EVENT_LOOP_MAX_EVENTS,
+        mqtt_event_loop_timeout(loop, timeout_ms));
+    if ((0 > count) && (EINTR != errno))
+    {
+        fprintf(stderr, "error: failed to wait for events\n");
+        loop->stopped = true;
+        return false;
+    }
+
+    loop->dispatching = true;
+    for (int i = 0; i < count; i++)
+    {
+        struct mqtt_event_source * source = events[i].data.ptr;
+        if (source->removed)
+        {
+            continue;
+        }
+
+        if (NULL != source->connection)
+        {
+            bool const readable = (0 != (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)));
+            bool const writable = (0 != (events[i].events & EPOLLOUT));
+            mqtt_event_loop_process(loop, source, readable, writable);
+        }
+        else
+        {
+            source->handler(source->user_data, source->fd, events[i].events);
+        }
+    }
+
+    // keepalive pings, reconnects and data buffered by TLS
+    uint64_t const now = now_ms();
+    for (size_t i = 0; i < loop->size; i++)
+    {
+        struct mqtt_event_source * source = loop->sources[i];
+        if ((!source->removed) && (NULL != source->connection) && (source->deadline <= now))
+        {
+            mqtt_event_loop_process(loop, source, source->pending, false);
+        }
+    }
+    loop->dispatching = false;
+
+    mqtt_event_loop_compact(loop);
+
+    return !loop->stopped;
+}
+
+void mqtt_event_loop_run(struct mqtt_event_loop * loop)
+{
+    while (mqtt_event_loop_dispatch(loop, -1))
+    {
+        // dispatch until stopped
+    }
+}
+
+void mqtt_event_loop_stop(struct mqtt_event_loop * loop)
+{
+    loop->stopped = true;
+}
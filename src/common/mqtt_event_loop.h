@@ -0,0 +1,59 @@
+#ifndef MQTT_EVENT_LOOP_H
+#define MQTT_EVENT_LOOP_H
+
+#include "mqtt_connection.h"
+
+#include <sys/epoll.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// epoll based event loop, which drives many connections and file descriptors
+// of our own from a single thread; it sleeps until a socket is ready or
+// a connection needs to send a keepalive ping or to reconnect
+struct mqtt_event_loop;
+
+// called when fd is ready; events contains the epoll events (e.g. EPOLLIN)
+typedef void mqtt_event_loop_handler_fn(void * user_data, int fd, uint32_t events);
+
+extern struct mqtt_event_loop * mqtt_event_loop_create(void);
+
+// releases the loop; connections and file descriptors are not closed
+extern void mqtt_event_loop_destroy(struct mqtt_event_loop * loop);
+
+// watches fd for events (level triggered); returns false on error
+extern bool mqtt_event_loop_add(struct mqtt_event_loop * loop, int fd, uint32_t events,
+    mqtt_event_loop_handler_fn * handler, void * user_data);
+
+extern void mqtt_event_loop_remove(struct mqtt_event_loop * loop, int fd);
+
+// drives a connected connection instead of mqtt_connection_start;
+// the connection must only be used from the thread of the loop
+extern bool mqtt_event_loop_add_connection(struct mqtt_event_loop * loop,
+    struct mqtt_connection * connection);
+
+extern void mqtt_event_loop_remove_connection(struct mqtt_event_loop * loop,
+    struct mqtt_connection * connection);
+
+// waits up to timeout_ms (-1 waits until a connection needs attention) and
+// dispatches ready events once; handlers may add and remove sources;
+// returns false, once the loop is stopped
+extern bool mqtt_event_loop_dispatch(struct mqtt_event_loop * loop, int timeout_ms);
+
+// dispatches events until the loop is stopped
+extern void mqtt_event_loop_run(struct mqtt_event_loop * loop);
+
+// makes the loop return; must be called from the thread of the loop,
+// e.g. by the handler of a signalfd
+extern void mqtt_event_loop_stop(struct mqtt_event_loop * loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
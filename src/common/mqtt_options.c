@@ -0,0 +1,261 @@
+#include "mqtt_options.h"
+#include "mqtt_tls.h"
+
+#include <mosquitto.h>
+
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void mqtt_options_init(struct mqtt_options * options)
+{
+    options->id = NULL;
+    options->user = NULL;
+    options->password = NULL;
+    options->host = strdup("localhost");
+    options->port = 0;
+    options->qos = MQTT_DEFAULT_QOS;
+    options->protocol_version = MQTT_PROTOCOL_V311;
+    options->clean_session = true;
+    options->max_packets = 1;
+    options->max_inflight = 0;
+    options->reconnect_min = MQTT_RECONNECT_DELAY_MIN;
+    options->reconnect_max = MQTT_RECONNECT_DELAY_MAX;
+    options->stats_interval = 0;
+    options->stats_file = NULL;
+    options->tls = false;
+    options->cafile = NULL;
+    options->certfile = NULL;
+    options->keyfile = NULL;
+    options->tls_version = NULL;
+    options->tls_session = NULL;
+    options->tls_context = NULL;
+    options->keepalive = MQTT_DEFAULT_KEEPALIVE;
+    options->nodelay = false;
+    options->send_buffer = 0;
+    options->receive_buffer = 0;
+    options->bind_address = NULL;
+}
+
+void mqtt_options_cleanup(struct mqtt_options * options)
+{
+    free(options->id);
+    free(options->user);
+    free(options->password);
+    free(options->host);
+    free(options->stats_file);
+    mqtt_tls_destroy(options->tls_context);
+    free(options->cafile);
+    free(options->certfile);
+    free(options->keyfile);
+    free(options->tls_version);
+    free(options->tls_session);
+    free(options->bind_address);
+}
+
+bool mqtt_options_parse(struct mqtt_options * options, int c, char const * value)
+{
+    switch (c)
+    {
+        case 'i':
+            free(options->id);
+            options->id = strdup(value);
+            break;
+        case 'h':
+            free(options->host);
+            options->host = strdup(value);
+            break;
+        case 'p':
+            options->port = atoi(value);
+            break;
+        case 'u':
+            free(options->user);
+            options->user = strdup(value);
+            break;
+        case 'P':
+            free(options->password);
+            options->password = strdup(value);
+            break;
+        case 'q':
+            options->qos = atoi(value);
+            break;
+        case 'V':
+            if ((0 == strcmp(value, "5")) || (0 == strcmp(value, "mqttv5")))
+            {
+                options->protocol_version = MQTT_PROTOCOL_V5;
+            }
+            else if ((0 == strcmp(value, "311")) || (0 == strcmp(value, "mqttv311")))
+            {
+                options->protocol_version = MQTT_PROTOCOL_V311;
+            }
+            else
+            {
+                options->protocol_version = 0;
+            }
+            break;
+        case 'b':
+            options->reconnect_min = (unsigned int) atoi(value);
+            break;
+        case 'B':
+            options->reconnect_max = (unsigned int) atoi(value);
+            break;
+        case MQTT_OPTION_STATS_INTERVAL:
+            options->stats_interval = (unsigned int) atoi(value);
+            break;
+        case MQTT_OPTION_STATS_FILE:
+            free(options->stats_file);
+            options->stats_file = strdup(value);
+            break;
+        case MQTT_OPTION_TLS:
+            options->tls = true;
+            break;
+        case MQTT_OPTION_CAFILE:
+            options->tls = true;
+            free(options->cafile);
+            options->cafile = strdup(value);
+            break;
+        case MQTT_OPTION_CERT:
+            options->tls = true;
+            free(options->certfile);
+            options->certfile = strdup(value);
+            break;
+        case MQTT_OPTION_KEY:
+            options->tls = true;
+            free(options->keyfile);
+            options->keyfile = strdup(value);
+            break;
+        case MQTT_OPTION_TLS_VERSION:
+            options->tls = true;
+            free(options->tls_version);
+            options->tls_version = strdup(value);
+            break;
+        case MQTT_OPTION_TLS_SESSION:
+            options->tls = true;
+            free(options->tls_session);
+            options->tls_session = strdup(value);
+            break;
+        case MQTT_OPTION_KEEPALIVE:
+            options->keepalive = atoi(value);
+            break;
+        case MQTT_OPTION_NODELAY:
+            options->nodelay = true;
+            break;
+        case MQTT_OPTION_SEND_BUFFER:
+            options->send_buffer = atoi(value);
+            break;
+        case MQTT_OPTION_RECEIVE_BUFFER:
+            options->receive_buffer = atoi(value);
+            break;
+        case MQTT_OPTION_BIND_ADDRESS:
+            free(options->bind_address);
+            options->bind_address = strdup(value);
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+bool mqtt_options_validate(struct mqtt_options * options)
+{
+    if ((options->qos < 0) || (2 < options->qos))
+    {
+        fprintf(stderr, "error: invalid qos\n");
+        return false;
+    }
+
+    if ((options->protocol_version != MQTT_PROTOCOL_V311) && (options->protocol_version != MQTT_PROTOCOL_V5))
+    {
+        fprintf(stderr, "error: invalid protocol version\n");
+        return false;
+    }
+
+    if ((options->reconnect_min == 0) || (options->reconnect_max < options->reconnect_min))
+    {
+        fprintf(stderr, "error: invalid reconnect delay\n");
+        return false;
+    }
+
+    if ((!options->clean_session) && (options->id == NULL))
+    {
+        fprintf(stderr, "error: persistent session requires a client id\n");
+        return false;
+    }
+
+    // libmosquitto rejects keepalives below 5 seconds; 0 disables it
+    if ((options->keepalive < 0) || ((0 < options->keepalive) && (options->keepalive < 5)) ||
+        (UINT16_MAX < options->keepalive))
+    {
+        fprintf(stderr, "error: invalid keepalive\n");
+        return false;
+    }
+
+    if ((options->send_buffer < 0) || (options->receive_buffer < 0))
+    {
+        fprintf(stderr, "error: invalid socket buffer size\n");
+        return false;
+    }
+
+    if ((NULL != options->tls_version) &&
+        (0 != strcmp(options->tls_version, "tlsv1.2")) && (0 != strcmp(options->tls_version, "tlsv1.3")))
+    {
+        fprintf(stderr, "error: invalid TLS version\n");
+        return false;
+    }
+
+    if ((NULL != options->keyfile) && (NULL == options->certfile))
+    {
+        fprintf(stderr, "error: key requires a client certificate\n");
+        return false;
+    }
+
+    if (0 == options->port)
+    {
+        options->port = (options->tls) ? MQTT_DEFAULT_TLS_PORT : MQTT_DEFAULT_PORT;
+    }
+
+    // the TLS context is shared by all connections and reconnects
+    if ((options->tls) && (NULL == options->tls_context))
+    {
+        options->tls_context = mqtt_tls_create(options);
+    }
+
+    return (!options->tls) || (NULL != options->tls_context);
+}
+
+void mqtt_options_apply(struct mqtt_options const * options, struct mosquitto * mosq)
+{
+    // small messages are sent right away instead of being coalesced
+    if (options->nodelay)
+    {
+        mosquitto_int_option(mosq, MOSQ_OPT_TCP_NODELAY, 1);
+    }
+}
+
+void mqtt_options_tune_socket(struct mqtt_options const * options, struct mosquitto * mosq)
+{
+    int const fd = mosquitto_socket(mosq);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    // 0 keeps the size chosen by the kernel; the window scale is already
+    // agreed in the handshake, so a large receive buffer cannot raise the
+    // TCP window beyond what the scale allows
+    if ((0 < options->send_buffer) &&
+        (0 != setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options->send_buffer, sizeof(options->send_buffer))))
+    {
+        fprintf(stderr, "warning: failed to set send buffer size\n");
+    }
+
+    if ((0 < options->receive_buffer) &&
+        (0 != setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options->receive_buffer, sizeof(options->receive_buffer))))
+    {
+        fprintf(stderr, "warning: failed to set receive buffer size\n");
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef MQTT_OPTIONS_H
+#define MQTT_OPTIONS_H
+
+#include <mosquitto.h>
+
+#include <getopt.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define MQTT_DEFAULT_PORT (1883)
+#define MQTT_DEFAULT_TLS_PORT (8883)
+#define MQTT_DEFAULT_KEEPALIVE (60)
+#define MQTT_DEFAULT_QOS     (0)
+
+#define MQTT_RECONNECT_DELAY_MIN (1000)
+#define MQTT_RECONNECT_DELAY_MAX (30 * 1000)
+
+// codes of long options without a short option
+#define MQTT_OPTION_STATS_INTERVAL (256)
+#define MQTT_OPTION_STATS_FILE     (257)
+#define MQTT_OPTION_TLS            (258)
+#define MQTT_OPTION_CAFILE         (259)
+#define MQTT_OPTION_CERT           (260)
+#define MQTT_OPTION_KEY            (261)
+#define MQTT_OPTION_TLS_VERSION    (262)
+#define MQTT_OPTION_TLS_SESSION    (263)
+#define MQTT_OPTION_KEEPALIVE      (264)
+#define MQTT_OPTION_NODELAY        (265)
+#define MQTT_OPTION_SEND_BUFFER    (266)
+#define MQTT_OPTION_RECEIVE_BUFFER (267)
+#define MQTT_OPTION_BIND_ADDRESS   (268)
+
+// short and long options parsed by mqtt_options_parse
+#define MQTT_OPTIONS_SHORT "i:h:p:u:P:q:V:b:B:"
+#define MQTT_OPTIONS_LONG \
+    {"client-id", required_argument, 0, 'i'}, \
+    {"host", required_argument, 0, 'h'}, \
+    {"port", required_argument, 0, 'p'}, \
+    {"user", required_argument, 0, 'u'}, \
+    {"password", required_argument, 0, 'P'}, \
+    {"qos", required_argument, 0, 'q'}, \
+    {"protocol-version", required_argument, 0, 'V'}, \
+    {"reconnect-min", required_argument, 0, 'b'}, \
+    {"reconnect-max", required_argument, 0, 'B'}, \
+    {"stats-interval", required_argument, 0, MQTT_OPTION_STATS_INTERVAL}, \
+    {"stats-file", required_argument, 0, MQTT_OPTION_STATS_FILE}, \
+    {"tls", no_argument, 0, MQTT_OPTION_TLS}, \
+    {"cafile", required_argument, 0, MQTT_OPTION_CAFILE}, \
+    {"cert", required_argument, 0, MQTT_OPTION_CERT}, \
+    {"key", required_argument, 0, MQTT_OPTION_KEY}, \
+    {"tls-version", required_argument, 0, MQTT_OPTION_TLS_VERSION}, \
+    {"tls-session", required_argument, 0, MQTT_OPTION_TLS_SESSION}, \
+    {"keepalive", required_argument, 0, MQTT_OPTION_KEEPALIVE}, \
+    {"nodelay", no_argument, 0, MQTT_OPTION_NODELAY}, \
+    {"send-buffer", required_argument, 0, MQTT_OPTION_SEND_BUFFER}, \
+    {"receive-buffer", required_argument, 0, MQTT_OPTION_RECEIVE_BUFFER}, \
+    {"bind-address", required_argument, 0, MQTT_OPTION_BIND_ADDRESS}
+
+struct mqtt_tls;
+
+// options of a broker connection shared by all tools
+struct mqtt_options
+{
+    char * id;
+    char * user;
+    char * password;
+    char * host;
+    int port;
+    int qos;
+    int protocol_version;
+    bool clean_session;
+    int max_packets;
+    unsigned int max_inflight;
+    unsigned int reconnect_min;
+    unsigned int reconnect_max;
+    unsigned int stats_interval;
+    char * stats_file;
+    bool tls;
+    char * cafile;
+    char * certfile;
+    char * keyfile;
+    char * tls_version;
+    char * tls_session;
+    struct mqtt_tls * tls_context;
+    int keepalive;
+    bool nodelay;
+    int send_buffer;
+    int receive_buffer;
+    char * bind_address;
+};
+
+extern void mqtt_options_init(struct mqtt_options * options);
+
+extern void mqtt_options_cleanup(struct mqtt_options * options);
+
+// parses an option of MQTT_OPTIONS_SHORT or MQTT_OPTIONS_LONG;
+// returns false, if the option is not a shared option
+extern bool mqtt_options_parse(struct mqtt_options * options, int c, char const * value);
+
+// prints an error and returns false, if the options are invalid;
+// with TLS, it also loads the certificates and keys and resolves the
+// default port
+extern bool mqtt_options_validate(struct mqtt_options * options);
+
+// applies the socket options, which libmosquitto sets on connect;
+// must be called before connecting
+extern void mqtt_options_apply(struct mqtt_options const * options, struct mosquitto * mosq);
+
+// sizes the socket buffers of a connected mosquitto instance;
+// the socket is new after each reconnect, so it is called on every connect;
+// libmosquitto has no hook before connect, so the receive buffer is set
+// after the TCP handshake, whose window scale limits the usable window
+extern void mqtt_options_tune_socket(struct mqtt_options const * options, struct mosquitto * mosq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#include "mqtt_pacer.h"
+
+#include <errno.h>
+#include <time.h>
+
+uint64_t mqtt_pacer_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+void mqtt_pacer_init(struct mqtt_pacer * pacer, unsigned int rate, unsigned int burst)
+{
+    pacer->interval = 1000000000ULL / ((0 < rate) ? rate : 1);
+    pacer->tolerance = pacer->interval * (((0 < burst) ? burst : 1) - 1);
+    pacer->next = 0;
+}
+
+void mqtt_pacer_wait(struct mqtt_pacer * pacer)
+{
+    uint64_t const now = mqtt_pacer_now();
+
+    // an idle pacer does not accumulate more than burst tokens
+    if ((pacer->next + pacer->tolerance) < now)
+    {
+        pacer->next = now - pacer->tolerance;
+    }
+
+    // the deadline is absolute, so that the time spent publishing
+    // between two calls does not add up to the interval
+    if (now < pacer->next)
+    {
+        mqtt_pacer_sleep_until(pacer->next);
+    }
+
+    pacer->next += pacer->interval;
+}
+
+void mqtt_pacer_sleep_until(uint64_t deadline)
+{
+    struct timespec const time = {
+        .tv_sec = (time_t) (deadline / 1000000000ULL),
+        .tv_nsec = (long) (deadline % 1000000000ULL)
+    };
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL)) { }
+}
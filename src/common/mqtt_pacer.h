@@ -0,0 +1,37 @@
+#ifndef MQTT_PACER_H
+#define MQTT_PACER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// token bucket limiting the rate of messages; it is implemented as virtual
+// scheduling in integer nanoseconds, so the rate does not drift over time
+struct mqtt_pacer
+{
+    uint64_t interval;
+    uint64_t tolerance;
+    uint64_t next;
+};
+
+// initializes the pacer with a rate in messages per second and the number
+// of messages, which may be sent at once after being idle (at least 1)
+extern void mqtt_pacer_init(struct mqtt_pacer * pacer, unsigned int rate, unsigned int burst);
+
+// takes a token; sleeps until the next token is available, if necessary
+extern void mqtt_pacer_wait(struct mqtt_pacer * pacer);
+
+// returns a timestamp of the monotonic clock in nanoseconds
+extern uint64_t mqtt_pacer_now(void);
+
+// sleeps until a timestamp of mqtt_pacer_now
+extern void mqtt_pacer_sleep_until(uint64_t deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,177 @@
+#include "mqtt_pool.h"
+
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct mqtt_pool
+{
+    struct mqtt_connection ** connections;
+    bool * borrowed;
+    size_t size;
+    size_t available;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// returns NULL, if there is no prefix, to let libmosquitto generate ids
+static char * mqtt_pool_id(char const * prefix, size_t index)
+{
+    if (NULL == prefix)
+    {
+        return NULL;
+    }
+
+    size_t const length = strlen(prefix) + 24;
+    char * id = malloc(length);
+    if (NULL != id)
+    {
+        snprintf(id, length, "%s-%zu", prefix, index);
+    }
+
+    return id;
+}
+
+struct mqtt_pool * mqtt_pool_create(struct mqtt_options const * options, size_t size,
+    unsigned int retries, bool offline)
+{
+    struct mqtt_pool * pool = malloc(sizeof(struct mqtt_pool));
+    if (NULL == pool)
+    {
+        fprintf(stderr, "error: failed to allocate connection pool\n");
+        return NULL;
+    }
+
+    pool->connections = calloc(size, sizeof(struct mqtt_connection *));
+    pool->borrowed = calloc(size, sizeof(bool));
+    pool->size = 0;
+    pool->available = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    bool ok = (NULL != pool->connections) && (NULL != pool->borrowed);
+    for (size_t i = 0; (ok) && (i < size); i++)
+    {
+        // a single connection keeps the client id as is
+        char * id = (1 < size) ? mqtt_pool_id(options->id, i) : NULL;
+        struct mqtt_connection * connection = mqtt_connection_create(options, id, NULL, NULL);
+        free(id);
+
+        ok = (NULL != connection);
+        if (ok)
+        {
+            pool->connections[pool->size] = connection;
+            pool->size++;
+
+            // other errors, e.g. invalid arguments, are fatal in any case
+            int const rc = mqtt_connection_connect(connection, retries);
+            ok = (MOSQ_ERR_SUCCESS == rc);
+            if ((!ok) && (offline) && ((MOSQ_ERR_ERRNO == rc) || (MOSQ_ERR_EAI == rc)))
+            {
+                fprintf(stderr, "warning: failed to connect to MQTT broker; connecting in background\n");
+                ok = true;
+            }
+            else if (!ok)
+            {
+                fprintf(stderr, "error: failed to connect to MQTT broker: %s\n", mosquitto_strerror(rc));
+            }
+        }
+
+        ok = ok && mqtt_connection_start(connection);
+    }
+
+    if (!ok)
+    {
+        mqtt_pool_destroy(pool);
+        return NULL;
+    }
+
+    pool->available = pool->size;
+    return pool;
+}
+
+void mqtt_pool_destroy(struct mqtt_pool * pool)
+{
+    for (size_t i = 0; i < pool->size; i++)
+    {
+        mqtt_connection_destroy(pool->connections[i]);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->borrowed);
+    free(pool->connections);
+    free(pool);
+}
+
+size_t mqtt_pool_size(struct mqtt_pool const * pool)
+{
+    return pool->size;
+}
+
+struct mqtt_connection * mqtt_pool_get(struct mqtt_pool * pool, size_t index)
+{
+    return (index < pool->size) ? pool->connections[index] : NULL;
+}
+
+struct mqtt_connection * mqtt_pool_acquire(struct mqtt_pool * pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (0 == pool->available)
+    {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+
+    struct mqtt_connection * connection = NULL;
+    for (size_t i = 0; (NULL == connection) && (i < pool->size); i++)
+    {
+        if (!pool->borrowed[i])
+        {
+            pool->borrowed[i] = true;
+            pool->available--;
+            connection = pool->connections[i];
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return connection;
+}
+
+void mqtt_pool_release(struct mqtt_pool * pool, struct mqtt_connection * connection)
+{
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < pool->size; i++)
+    {
+        if ((connection == pool->connections[i]) && (pool->borrowed[i]))
+        {
+            pool->borrowed[i] = false;
+            pool->available++;
+            pthread_cond_signal(&pool->cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool mqtt_pool_wait(struct mqtt_pool * pool, unsigned int timeout_ms)
+{
+    bool result = true;
+    for (size_t i = 0; i < pool->size; i++)
+    {
+        result = mqtt_connection_wait(pool->connections[i], 0, timeout_ms) && result;
+    }
+
+    return result;
+}
+
+unsigned int mqtt_pool_lost(struct mqtt_pool * pool)
+{
+    unsigned int lost = 0;
+    for (size_t i = 0; i < pool->size; i++)
+    {
+        lost += mqtt_connection_lost(pool->connections[i]);
+    }
+
+    return lost;
+}
@@ -0,0 +1,49 @@
+#ifndef MQTT_POOL_H
+#define MQTT_POOL_H
+
+#include "mqtt_connection.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct mqtt_pool;
+
+// creates size connections, connects and starts them;
+// if there is more than one connection, they are named "<id>-<n>";
+// with offline, connections to an unreachable broker are started anyway and
+// connect in their network loop, e.g. to queue messages meanwhile;
+// options must outlive the pool
+extern struct mqtt_pool * mqtt_pool_create(struct mqtt_options const * options, size_t size,
+    unsigned int retries, bool offline);
+
+// stops and releases all connections; borrowed connections must be released before
+extern void mqtt_pool_destroy(struct mqtt_pool * pool);
+
+extern size_t mqtt_pool_size(struct mqtt_pool const * pool);
+
+// returns the connection at index, without borrowing it
+extern struct mqtt_connection * mqtt_pool_get(struct mqtt_pool * pool, size_t index);
+
+// borrows a connection exclusively; blocks while all connections are borrowed
+extern struct mqtt_connection * mqtt_pool_acquire(struct mqtt_pool * pool);
+
+// returns a borrowed connection to the pool
+extern void mqtt_pool_release(struct mqtt_pool * pool, struct mqtt_connection * connection);
+
+// waits until all messages published on all connections are delivered;
+// the timeout applies to each connection; a timeout of 0 waits forever
+extern bool mqtt_pool_wait(struct mqtt_pool * pool, unsigned int timeout_ms);
+
+// returns the number of QoS 0 messages dropped on all connections
+extern unsigned int mqtt_pool_lost(struct mqtt_pool * pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
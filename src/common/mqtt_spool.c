@@ -0,0 +1,565 @@
+#include "mqtt_spool.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// sequence number with 20 digits and extension
+#define MQTT_SPOOL_NAME_SIZE (20 + 4)
+
+// locked by the process using the spool
+#define MQTT_SPOOL_LOCK_NAME "lock"
+
+// upper bound of the blocks written for a message besides its payload,
+// i.e. the message header and the topic, if it is new to the segment
+#define MQTT_SPOOL_MESSAGE_OVERHEAD (64)
+
+struct mqtt_spool
+{
+    char * directory;
+    char * path;
+    int lock_fd;
+    pthread_mutex_t lock;
+
+    // unread segments first to next - 1 are on disk
+    uint64_t first;
+    uint64_t next;
+
+    // messages are committed up to the committed_index-th one of segment
+    // committed; the segments committed to first - 1 are read, but kept
+    // until they are committed
+    uint64_t committed;
+    unsigned long committed_index;
+
+    // sealed segments, including the ones being read or not committed,
+    // take size bytes
+    unsigned long long size;
+    unsigned long long max_size;
+    unsigned long long segment_size;
+    enum mqtt_spool_policy policy;
+    unsigned long dropped;
+
+    // the newest segment is written, until it is sealed
+    bool writing;
+    struct mqtt_capture_writer writer;
+    unsigned long written;
+    unsigned int sync_interval;
+    unsigned int unsynced;
+
+    // segment first - 1 is read, once it is sealed; an evicted segment is
+    // removed, but closed by the next read, since the last message refers to
+    // its mapping
+    bool reading;
+    uint64_t reading_sequence;
+    struct mqtt_capture_reader reader;
+    unsigned long read;
+    bool evicted;
+};
+
+static char const * mqtt_spool_path(struct mqtt_spool * spool, uint64_t sequence)
+{
+    snprintf(spool->path, strlen(spool->directory) + MQTT_SPOOL_NAME_SIZE + 2, "%s/%020llu.cap",
+        spool->directory, (unsigned long long) sequence);
+
+    return spool->path;
+}
+
+static unsigned long long mqtt_spool_file_size(struct mqtt_spool * spool, uint64_t sequence)
+{
+    struct stat info;
+    return (0 == stat(mqtt_spool_path(spool, sequence), &info)) ? (unsigned long long) info.st_size : 0;
+}
+
+// removes a segment from disk and, if counted, from the size of the spool
+static void mqtt_spool_remove(struct mqtt_spool * spool, uint64_t sequence, bool counted)
+{
+    if (counted)
+    {
+        unsigned long long const size = mqtt_spool_file_size(spool, sequence);
+        spool->size = (size < spool->size) ? spool->size - size : 0;
+    }
+    unlink(mqtt_spool_path(spool, sequence));
+}
+
+// returns false, if the name is not a segment
+static bool mqtt_spool_parse_name(char const * name, uint64_t * sequence)
+{
+    if ((MQTT_SPOOL_NAME_SIZE != strlen(name)) || (0 != strcmp(&name[20], ".cap")))
+    {
+        return false;
+    }
+
+    *sequence = 0;
+    for (size_t i = 0; i < 20; i++)
+    {
+        if ((name[i] < '0') || ('9' < name[i]))
+        {
+            return false;
+        }
+        *sequence = (*sequence * 10) + (uint64_t) (name[i] - '0');
+    }
+
+    return true;
+}
+
+static bool mqtt_spool_scan(struct mqtt_spool * spool)
+{
+    DIR * dir = opendir(spool->directory);
+    if (NULL == dir)
+    {
+        return false;
+    }
+
+    bool found = false;
+    struct dirent * entry;
+    while (NULL != (entry = readdir(dir)))
+    {
+        uint64_t sequence = 0;
+        if (mqtt_spool_parse_name(entry->d_name, &sequence))
+        {
+            spool->first = ((!found) || (sequence < spool->first)) ? sequence : spool->first;
+            spool->next = ((!found) || (spool->next <= sequence)) ? sequence + 1 : spool->next;
+            spool->size += mqtt_spool_file_size(spool, sequence);
+            found = true;
+        }
+    }
+    closedir(dir);
+
+    return true;
+}
+
+// two processes using the same spool would read and remove the same segments;
+// the lock is released by the kernel, if the process crashes
+static bool mqtt_spool_lock(struct mqtt_spool * spool)
+{
+    size_t const length = strlen(spool->directory) + sizeof(MQTT_SPOOL_LOCK_NAME) + 1;
+    char * path = malloc(length);
+    if (NULL == path)
+    {
+        return false;
+    }
+    snprintf(path, length, "%s/%s", spool->directory, MQTT_SPOOL_LOCK_NAME);
+
+    spool->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    free(path);
+    if (0 > spool->lock_fd)
+    {
+        return false;
+    }
+
+    if (0 != flock(spool->lock_fd, LOCK_EX | LOCK_NB))
+    {
+        if (EWOULDBLOCK == errno)
+        {
+            fprintf(stderr, "error: spool directory %s is used by another process\n", spool->directory);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+struct mqtt_spool * mqtt_spool_open(char const * directory,
+    unsigned long long max_size, enum mqtt_spool_policy policy, unsigned int sync_interval)
+{
+    if ((0 != mkdir(directory, 0700)) && (EEXIST != errno))
+    {
+        fprintf(stderr, "error: failed to create spool directory %s\n", directory);
+        return NULL;
+    }
+
+    struct mqtt_spool * spool = malloc(sizeof(struct mqtt_spool));
+    if (NULL == spool)
+    {
+        fprintf(stderr, "error: failed to allocate spool\n");
+        return NULL;
+    }
+
+    spool->directory = strdup(directory);
+    spool->path = malloc(strlen(directory) + MQTT_SPOOL_NAME_SIZE + 2);
+    spool->lock_fd = -1;
+    spool->first = 1;
+    spool->next = 1;
+    spool->size = 0;
+    spool->max_size = max_size;
+    spool->segment_size = MQTT_SPOOL_SEGMENT_SIZE;
+    if ((0 < max_size) && (max_size / MQTT_SPOOL_SEGMENTS_PER_LIMIT < spool->segment_size))
+    {
+        spool->segment_size = max_size / MQTT_SPOOL_SEGMENTS_PER_LIMIT;
+    }
+    spool->policy = policy;
+    spool->dropped = 0;
+    spool->writing = false;
+    spool->written = 0;
+    spool->sync_interval = sync_interval;
+    spool->unsynced = 0;
+    spool->reading = false;
+    spool->reading_sequence = 0;
+    spool->read = 0;
+    spool->evicted = false;
+    if ((NULL == spool->directory) || (NULL == spool->path) || (!mqtt_spool_lock(spool)) ||
+        (!mqtt_spool_scan(spool)))
+    {
+        fprintf(stderr, "error: failed to read spool directory %s\n", directory);
+        if (0 <= spool->lock_fd)
+        {
+            close(spool->lock_fd);
+        }
+        free(spool->path);
+        free(spool->directory);
+        free(spool);
+        return NULL;
+    }
+    spool->committed = spool->first;
+    spool->committed_index = 0;
+    pthread_mutex_init(&spool->lock, NULL);
+
+    return spool;
+}
+
+// the name of a new segment is only durable, once the directory is synced
+static void mqtt_spool_sync_directory(struct mqtt_spool * spool)
+{
+    int const fd = open(spool->directory, O_RDONLY | O_DIRECTORY);
+    if (0 <= fd)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// the segment is closed and removed, if it contains no message
+static void mqtt_spool_seal(struct mqtt_spool * spool)
+{
+    if ((0 < spool->written) && (!mqtt_capture_writer_sync(&spool->writer)))
+    {
+        fprintf(stderr, "warning: failed to sync spool segment\n");
+    }
+    if (!mqtt_capture_writer_close(&spool->writer))
+    {
+        fprintf(stderr, "warning: failed to write spool segment\n");
+    }
+    spool->writing = false;
+
+    if (0 == spool->written)
+    {
+        spool->next--;
+        unlink(mqtt_spool_path(spool, spool->next));
+    }
+    else
+    {
+        spool->size += mqtt_spool_file_size(spool, spool->next - 1);
+    }
+}
+
+void mqtt_spool_close(struct mqtt_spool * spool)
+{
+    if (NULL == spool)
+    {
+        return;
+    }
+
+    // segments, which are not committed, are read again by the next process
+    if (spool->reading)
+    {
+        mqtt_capture_reader_close(&spool->reader);
+    }
+    if (spool->writing)
+    {
+        mqtt_spool_seal(spool);
+    }
+
+    pthread_mutex_destroy(&spool->lock);
+    close(spool->lock_fd);
+    free(spool->path);
+    free(spool->directory);
+    free(spool);
+}
+
+static unsigned long mqtt_spool_count(struct mqtt_spool * spool, uint64_t sequence)
+{
+    unsigned long count = 0;
+    struct mqtt_capture_reader reader;
+    if (mqtt_capture_reader_open(&reader, mqtt_spool_path(spool, sequence)))
+    {
+        struct mqtt_capture_message message;
+        while (mqtt_capture_reader_next(&reader, &message))
+        {
+            count++;
+        }
+        mqtt_capture_reader_close(&reader);
+    }
+
+    return count;
+}
+
+// removes the unread segment first, including messages committed in it
+static void mqtt_spool_skip(struct mqtt_spool * spool)
+{
+    mqtt_spool_remove(spool, spool->first, true);
+    if (spool->committed == spool->first)
+    {
+        spool->committed++;
+        spool->committed_index = 0;
+    }
+    spool->first++;
+}
+
+// drops the oldest segment; returns false, if there is none left
+static bool mqtt_spool_evict(struct mqtt_spool * spool)
+{
+    // segments, which were read, but not committed, are dropped first
+    uint64_t const read_end = (spool->reading) ? spool->reading_sequence : spool->first;
+    if (spool->committed < read_end)
+    {
+        unsigned long const count = mqtt_spool_count(spool, spool->committed);
+        spool->dropped += (spool->committed_index < count) ? count - spool->committed_index : 0;
+        mqtt_spool_remove(spool, spool->committed, true);
+        spool->committed++;
+        spool->committed_index = 0;
+        return true;
+    }
+
+    // the segment being read is the oldest one at this point; it is removed
+    // at once, since the mapping of the reader stays valid
+    if ((spool->reading) && (!spool->evicted))
+    {
+        unsigned long const count = mqtt_spool_count(spool, spool->reading_sequence);
+        spool->dropped += (spool->committed_index < count) ? count - spool->committed_index : 0;
+        mqtt_spool_remove(spool, spool->reading_sequence, true);
+        spool->evicted = true;
+        return true;
+    }
+
+    if ((spool->writing) && (spool->first + 1 == spool->next))
+    {
+        // the newest segment is dropped last
+        mqtt_spool_seal(spool);
+    }
+
+    if (spool->first < spool->next)
+    {
+        unsigned long const count = mqtt_spool_count(spool, spool->first);
+        unsigned long const skipped = (spool->committed == spool->first) ? spool->committed_index : 0;
+        spool->dropped += (skipped < count) ? count - skipped : 0;
+        mqtt_spool_skip(spool);
+        return true;
+    }
+
+    return false;
+}
+
+bool mqtt_spool_add(struct mqtt_spool * spool, struct mqtt_capture_message const * message)
+{
+    pthread_mutex_lock(&spool->lock);
+
+    if ((spool->writing) && (spool->segment_size <= spool->writer.offset))
+    {
+        mqtt_spool_seal(spool);
+    }
+
+    bool full = false;
+    if (0 < spool->max_size)
+    {
+        unsigned long long const needed = message->payloadlen + message->propertieslen +
+            strlen(message->topic) + MQTT_SPOOL_MESSAGE_OVERHEAD;
+        full = (spool->max_size < spool->size + (spool->writing ? spool->writer.offset : 0) + needed);
+        while ((full) && (MQTT_SPOOL_DROP_OLDEST == spool->policy) && (mqtt_spool_evict(spool)))
+        {
+            full = (spool->max_size < spool->size + (spool->writing ? spool->writer.offset : 0) + needed);
+        }
+    }
+
+    if (full)
+    {
+        spool->dropped++;
+        pthread_mutex_unlock(&spool->lock);
+        return true;
+    }
+
+    if (!spool->writing)
+    {
+        spool->writing = mqtt_capture_writer_create(&spool->writer, mqtt_spool_path(spool, spool->next));
+        if (spool->writing)
+        {
+            spool->next++;
+            spool->written = 0;
+            spool->unsynced = 0;
+            mqtt_spool_sync_directory(spool);
+        }
+    }
+
+    bool result = spool->writing;
+    if (result)
+    {
+        mqtt_capture_writer_add(&spool->writer, message);
+        spool->written++;
+        spool->unsynced++;
+
+        // messages are synced in batches, since each sync waits for the disk
+        if ((0 < spool->sync_interval) && (spool->sync_interval <= spool->unsynced))
+        {
+            mqtt_capture_writer_sync(&spool->writer);
+            spool->unsynced = 0;
+        }
+        result = !spool->writer.failed;
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+    return result;
+}
+
+// the messages of an evicted segment are no longer committed
+static void mqtt_spool_close_reader(struct mqtt_spool * spool)
+{
+    mqtt_capture_reader_close(&spool->reader);
+    spool->reading = false;
+    if (spool->evicted)
+    {
+        spool->committed = spool->reading_sequence + 1;
+        spool->committed_index = 0;
+    }
+}
+
+bool mqtt_spool_next(struct mqtt_spool * spool, struct mqtt_capture_message * message)
+{
+    pthread_mutex_lock(&spool->lock);
+
+    bool result = false;
+    bool done = false;
+    while ((!result) && (!done))
+    {
+        if (spool->reading)
+        {
+            result = (!spool->evicted) && (mqtt_capture_reader_next(&spool->reader, message));
+            if (result)
+            {
+                spool->read++;
+            }
+            else
+            {
+                // a segment truncated by a crash is read up to the damage
+                if ((!spool->evicted) && (spool->reader.failed))
+                {
+                    fprintf(stderr, "warning: spool segment %s is truncated or corrupt\n",
+                        mqtt_spool_path(spool, spool->reading_sequence));
+                }
+                // the segment is kept, until its messages are committed
+                mqtt_spool_close_reader(spool);
+            }
+        }
+        else if (spool->first == spool->next)
+        {
+            done = true;
+        }
+        else if ((spool->writing) && (spool->first + 1 == spool->next))
+        {
+            // the newest segment is read, once all older ones are
+            done = (0 == spool->written);
+            if (!done)
+            {
+                mqtt_spool_seal(spool);
+            }
+        }
+        else
+        {
+            spool->reading = mqtt_capture_reader_open(&spool->reader, mqtt_spool_path(spool, spool->first));
+            if (spool->reading)
+            {
+                spool->reading_sequence = spool->first;
+                spool->read = 0;
+                spool->evicted = false;
+                spool->first++;
+
+                // committed messages are skipped after a rewind
+                unsigned long const skipped = (spool->committed == spool->reading_sequence) ?
+                    spool->committed_index : 0;
+                struct mqtt_capture_message skip;
+                while ((spool->read < skipped) && (mqtt_capture_reader_next(&spool->reader, &skip)))
+                {
+                    spool->read++;
+                }
+            }
+            else
+            {
+                // e.g. a segment, which was empty when the process crashed
+                mqtt_spool_skip(spool);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+    return result;
+}
+
+void mqtt_spool_commit(struct mqtt_spool * spool)
+{
+    pthread_mutex_lock(&spool->lock);
+
+    uint64_t const read_end = (spool->reading) ? spool->reading_sequence : spool->first;
+    while (spool->committed < read_end)
+    {
+        mqtt_spool_remove(spool, spool->committed, true);
+        spool->committed++;
+    }
+    spool->committed_index = (spool->reading) ? spool->read : 0;
+
+    pthread_mutex_unlock(&spool->lock);
+}
+
+void mqtt_spool_rewind(struct mqtt_spool * spool)
+{
+    pthread_mutex_lock(&spool->lock);
+
+    if (spool->reading)
+    {
+        mqtt_spool_close_reader(spool);
+    }
+    spool->first = spool->committed;
+
+    pthread_mutex_unlock(&spool->lock);
+}
+
+bool mqtt_spool_empty(struct mqtt_spool * spool)
+{
+    pthread_mutex_lock(&spool->lock);
+    bool const empty = ((!spool->reading) || (spool->evicted)) && ((spool->first == spool->next) ||
+        ((spool->writing) && (spool->first + 1 == spool->next) && (0 == spool->written)));
+    pthread_mutex_unlock(&spool->lock);
+
+    return empty;
+}
+
+unsigned long mqtt_spool_dropped(struct mqtt_spool * spool)
+{
+    pthread_mutex_lock(&spool->lock);
+    unsigned long const dropped = spool->dropped;
+    pthread_mutex_unlock(&spool->lock);
+
+    return dropped;
+}
+
+bool mqtt_spool_policy_parse(char const * name, enum mqtt_spool_policy * policy)
+{
+    if (0 == strcmp(name, "drop-oldest"))
+    {
+        *policy = MQTT_SPOOL_DROP_OLDEST;
+        return true;
+    }
+    else if (0 == strcmp(name, "drop-newest"))
+    {
+        *policy = MQTT_SPOOL_DROP_NEWEST;
+        return true;
+    }
+
+    return false;
+}
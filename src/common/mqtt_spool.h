@@ -0,0 +1,78 @@
+#ifndef MQTT_SPOOL_H
+#define MQTT_SPOOL_H
+
+#include "mqtt_capture.h"
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// segments are sealed, once they grow beyond this size;
+// with a limit, segments are smaller, so that less is evicted at once
+#define MQTT_SPOOL_SEGMENT_SIZE (16 * 1024 * 1024)
+#define MQTT_SPOOL_SEGMENTS_PER_LIMIT (8)
+
+// behavior of mqtt_spool_add when the spool is full
+enum mqtt_spool_policy
+{
+    MQTT_SPOOL_DROP_OLDEST,
+    MQTT_SPOOL_DROP_NEWEST
+};
+
+// store-and-forward queue of messages on disk
+//
+// The spool is a directory of segments in capture format (see mqtt_capture.h),
+// named by their sequence number (e.g. 00000000000000000001.cap). Messages are
+// appended to the newest segment and read from the oldest one. Read messages
+// stay in the spool, until they are committed once delivered, and are read
+// again after a rewind; a segment is removed, once all of its messages are
+// committed. Segments left by a previous process are read first, so messages
+// are delivered at least once across restarts. The directory is locked, so
+// that a single process uses it at a time. Messages may be added and read
+// from different threads.
+struct mqtt_spool;
+
+// opens the spool, creating the directory if needed; the size of all segments
+// is limited to max_size bytes (0 is unlimited); the segment is synced to disk
+// every sync_interval messages (0 syncs only when a segment is sealed);
+// returns NULL on error, e.g. if the spool is used by another process
+extern struct mqtt_spool * mqtt_spool_open(char const * directory,
+    unsigned long long max_size, enum mqtt_spool_policy policy, unsigned int sync_interval);
+
+// seals the segment being written; messages, which are not committed,
+// are kept on disk
+extern void mqtt_spool_close(struct mqtt_spool * spool);
+
+// appends a message, dropping messages according to the policy if the spool
+// is full; returns false, if it could not be written
+extern bool mqtt_spool_add(struct mqtt_spool * spool, struct mqtt_capture_message const * message);
+
+// reads the oldest message, which is not read yet; topic and payload stay
+// valid until the next call; returns false, if all messages are read
+extern bool mqtt_spool_next(struct mqtt_spool * spool, struct mqtt_capture_message * message);
+
+// removes the messages read so far, e.g. once the broker confirmed them
+extern void mqtt_spool_commit(struct mqtt_spool * spool);
+
+// reads the messages, which are not committed, again from the oldest one,
+// e.g. after the connection was lost
+extern void mqtt_spool_rewind(struct mqtt_spool * spool);
+
+// returns true, if all messages are read
+extern bool mqtt_spool_empty(struct mqtt_spool * spool);
+
+// returns the number of messages dropped, since the spool was full;
+// messages, which were read but not committed, are counted as well
+extern unsigned long mqtt_spool_dropped(struct mqtt_spool * spool);
+
+// parses "drop-oldest" or "drop-newest"; returns false for unknown names
+extern bool mqtt_spool_policy_parse(char const * name, enum mqtt_spool_policy * policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
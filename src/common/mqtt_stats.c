@@ -0,0 +1,252 @@
+#include "mqtt_stats.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+void mqtt_stats_init(struct mqtt_stats * stats)
+{
+    atomic_init(&stats->messages, 0);
+    atomic_init(&stats->bytes, 0);
+    atomic_init(&stats->errors, 0);
+    atomic_init(&stats->dropped, 0);
+    atomic_init(&stats->reconnects, 0);
+    atomic_init(&stats->queue_depth, 0);
+
+    for (int i = 0; i < MQTT_STATS_BUCKETS; i++)
+    {
+        atomic_init(&stats->latency.buckets[i], 0);
+    }
+    atomic_init(&stats->latency.count, 0);
+    atomic_init(&stats->latency.sum, 0);
+    atomic_init(&stats->latency.max, 0);
+}
+
+uint64_t mqtt_stats_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+static int mqtt_stats_bucket(uint64_t value)
+{
+    int const bucket = 63 - __builtin_clzll(value | 1);
+    return (bucket < MQTT_STATS_BUCKETS) ? bucket : (MQTT_STATS_BUCKETS - 1);
+}
+
+void mqtt_stats_record(struct mqtt_stats * stats, size_t bytes, uint64_t start)
+{
+    uint64_t const latency = mqtt_stats_now() - start;
+    struct mqtt_stats_histogram * histogram = &stats->latency;
+
+    atomic_fetch_add_explicit(&stats->messages, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[mqtt_stats_bucket(latency)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, latency, memory_order_relaxed);
+
+    unsigned long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while ((max < latency) && (!atomic_compare_exchange_weak_explicit(&histogram->max, &max, latency,
+        memory_order_relaxed, memory_order_relaxed))) { }
+}
+
+// upper bound of the bucket containing the given quantile in nanoseconds
+static uint64_t mqtt_stats_quantile(struct mqtt_stats_histogram * histogram, double quantile)
+{
+    unsigned long const count = atomic_load(&histogram->count);
+    unsigned long const rank = (unsigned long) ((double) count * quantile);
+    unsigned long seen = 0;
+    for (int i = 0; i < MQTT_STATS_BUCKETS; i++)
+    {
+        seen += atomic_load(&histogram->buckets[i]);
+        if ((0 < seen) && (seen > rank))
+        {
+            return (uint64_t) 2 << i;
+        }
+    }
+
+    return 0;
+}
+
+void mqtt_stats_print(struct mqtt_stats * stats, char const * name, FILE * file)
+{
+    struct mqtt_stats_histogram * histogram = &stats->latency;
+    unsigned long const count = atomic_load(&histogram->count);
+    unsigned long const mean = (0 < count) ? (atomic_load(&histogram->sum) / count) : 0;
+
+    fprintf(file, "stats: %s messages=%lu bytes=%lu errors=%lu dropped=%lu reconnects=%lu queue=%lu "
+        "latency_us mean=%.1f p50<%.1f p99<%.1f max=%.1f\n",
+        name,
+        atomic_load(&stats->messages),
+        atomic_load(&stats->bytes),
+        atomic_load(&stats->errors),
+        atomic_load(&stats->dropped),
+        atomic_load(&stats->reconnects),
+        atomic_load(&stats->queue_depth),
+        (double) mean / 1000.0,
+        (double) mqtt_stats_quantile(histogram, 0.5) / 1000.0,
+        (double) mqtt_stats_quantile(histogram, 0.99) / 1000.0,
+        (double) atomic_load(&histogram->max) / 1000.0);
+    fflush(file);
+}
+
+void mqtt_stats_write_prometheus(struct mqtt_stats * stats, char const * name, FILE * file)
+{
+    fprintf(file, "# TYPE %s_messages_total counter\n%s_messages_total %lu\n",
+        name, name, atomic_load(&stats->messages));
+    fprintf(file, "# TYPE %s_bytes_total counter\n%s_bytes_total %lu\n",
+        name, name, atomic_load(&stats->bytes));
+    fprintf(file, "# TYPE %s_errors_total counter\n%s_errors_total %lu\n",
+        name, name, atomic_load(&stats->errors));
+    fprintf(file, "# TYPE %s_dropped_total counter\n%s_dropped_total %lu\n",
+        name, name, atomic_load(&stats->dropped));
+    fprintf(file, "# TYPE %s_reconnects_total counter\n%s_reconnects_total %lu\n",
+        name, name, atomic_load(&stats->reconnects));
+    fprintf(file, "# TYPE %s_queue_depth gauge\n%s_queue_depth %lu\n",
+        name, name, atomic_load(&stats->queue_depth));
+
+    struct mqtt_stats_histogram * histogram = &stats->latency;
+    fprintf(file, "# TYPE %s_latency_seconds histogram\n", name);
+    unsigned long cumulative = 0;
+    for (int i = 0; i < (MQTT_STATS_BUCKETS - 1); i++)
+    {
+        cumulative += atomic_load(&histogram->buckets[i]);
+        fprintf(file, "%s_latency_seconds_bucket{le=\"%.9f\"} %lu\n",
+            name, (double) ((uint64_t) 2 << i) / 1e9, cumulative);
+    }
+    fprintf(file, "%s_latency_seconds_bucket{le=\"+Inf\"} %lu\n", name, atomic_load(&histogram->count));
+    fprintf(file, "%s_latency_seconds_sum %.9f\n", name, (double) atomic_load(&histogram->sum) / 1e9);
+    fprintf(file, "%s_latency_seconds_count %lu\n", name, atomic_load(&histogram->count));
+}
+
+// the file is replaced at once, so that scrapers never read a partial file
+static void mqtt_stats_reporter_write(struct mqtt_stats_reporter * reporter)
+{
+    size_t const length = strlen(reporter->path) + 5;
+    char * temp_path = malloc(length);
+    if (NULL == temp_path)
+    {
+        return;
+    }
+    snprintf(temp_path, length, "%s.tmp", reporter->path);
+
+    FILE * file = fopen(temp_path, "w");
+    if (NULL != file)
+    {
+        mqtt_stats_write_prometheus(reporter->stats, reporter->name, file);
+        bool const written = (0 == fclose(file));
+        if ((!written) || (0 != rename(temp_path, reporter->path)))
+        {
+            fprintf(stderr, "warning: failed to write stats file\n");
+        }
+    }
+    else
+    {
+        fprintf(stderr, "warning: failed to write stats file\n");
+    }
+
+    free(temp_path);
+}
+
+static void mqtt_stats_reporter_collect(struct mqtt_stats_reporter * reporter)
+{
+    if (NULL != reporter->collect)
+    {
+        reporter->collect(reporter->user_data, reporter->stats);
+    }
+}
+
+static void * mqtt_stats_reporter_run(void * arg)
+{
+    struct mqtt_stats_reporter * reporter = arg;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    struct timespec const interval = {
+        .tv_sec = reporter->interval / 1000,
+        .tv_nsec = (long) (reporter->interval % 1000) * 1000000L
+    };
+
+    while (!atomic_load(&reporter->stopped))
+    {
+        int const signal_number = (0 < reporter->interval) ?
+            sigtimedwait(&signals, NULL, &interval) : sigwaitinfo(&signals, NULL);
+        if (atomic_load(&reporter->stopped))
+        {
+            break;
+        }
+
+        bool const requested = (SIGUSR1 == signal_number);
+        bool const elapsed = (0 > signal_number) && (EAGAIN == errno);
+        if (requested || elapsed)
+        {
+            mqtt_stats_reporter_collect(reporter);
+            mqtt_stats_print(reporter->stats, reporter->name, stderr);
+            if (NULL != reporter->path)
+            {
+                mqtt_stats_reporter_write(reporter);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void mqtt_stats_reporter_init(struct mqtt_stats_reporter * reporter,
+    struct mqtt_stats * stats, char const * name, unsigned int interval, char const * path)
+{
+    reporter->stats = stats;
+    reporter->name = name;
+    reporter->interval = interval;
+    reporter->path = path;
+    reporter->collect = NULL;
+    reporter->user_data = NULL;
+    atomic_init(&reporter->stopped, false);
+    reporter->started = false;
+
+    // SIGUSR1 is only accepted by the reporter thread
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+bool mqtt_stats_reporter_start(struct mqtt_stats_reporter * reporter,
+    mqtt_stats_collect_fn * collect, void * user_data)
+{
+    reporter->collect = collect;
+    reporter->user_data = user_data;
+
+    reporter->started = (0 == pthread_create(&reporter->thread, NULL, &mqtt_stats_reporter_run, reporter));
+    if (!reporter->started)
+    {
+        fprintf(stderr, "error: failed to start stats reporter\n");
+    }
+
+    return reporter->started;
+}
+
+void mqtt_stats_reporter_stop(struct mqtt_stats_reporter * reporter)
+{
+    if (!reporter->started)
+    {
+        return;
+    }
+
+    atomic_store(&reporter->stopped, true);
+    pthread_kill(reporter->thread, SIGUSR1);
+    pthread_join(reporter->thread, NULL);
+    reporter->started = false;
+
+    if (NULL != reporter->path)
+    {
+        mqtt_stats_reporter_collect(reporter);
+        mqtt_stats_reporter_write(reporter);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef MQTT_STATS_H
+#define MQTT_STATS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// bucket i counts latencies below 2^(i+1) ns, the last one all larger values
+#define MQTT_STATS_BUCKETS (32)
+
+struct mqtt_stats_histogram
+{
+    atomic_ulong buckets[MQTT_STATS_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum;
+    atomic_ulong max;
+};
+
+// counters are updated lock-free from any thread; gauges and counters
+// maintained elsewhere are filled in by the collect callback of the reporter
+struct mqtt_stats
+{
+    atomic_ulong messages;
+    atomic_ulong bytes;
+    atomic_ulong errors;
+    atomic_ulong dropped;
+    atomic_ulong reconnects;
+    atomic_ulong queue_depth;
+    struct mqtt_stats_histogram latency;
+};
+
+extern void mqtt_stats_init(struct mqtt_stats * stats);
+
+// returns a timestamp in nanoseconds to measure latencies
+extern uint64_t mqtt_stats_now(void);
+
+// counts a message and records the time elapsed since start
+extern void mqtt_stats_record(struct mqtt_stats * stats, size_t bytes, uint64_t start);
+
+// prints a single line summary, e.g. on SIGUSR1
+extern void mqtt_stats_print(struct mqtt_stats * stats, char const * name, FILE * file);
+
+// writes the stats in Prometheus text exposition format
+extern void mqtt_stats_write_prometheus(struct mqtt_stats * stats, char const * name, FILE * file);
+
+typedef void mqtt_stats_collect_fn(void * user_data, struct mqtt_stats * stats);
+
+// reports stats on SIGUSR1 and every interval milliseconds (if not 0)
+// to stderr and, if a path is given, to a Prometheus text file
+struct mqtt_stats_reporter
+{
+    struct mqtt_stats * stats;
+    char const * name;
+    unsigned int interval;
+    char const * path;
+    mqtt_stats_collect_fn * collect;
+    void * user_data;
+    atomic_bool stopped;
+    bool started;
+    pthread_t thread;
+};
+
+// blocks SIGUSR1 in the calling thread, so it must be called before
+// other threads are created, which inherit the signal mask
+extern void mqtt_stats_reporter_init(struct mqtt_stats_reporter * reporter,
+    struct mqtt_stats * stats, char const * name, unsigned int interval, char const * path);
+
+// starts the reporter thread; collect is called before each report
+extern bool mqtt_stats_reporter_start(struct mqtt_stats_reporter * reporter,
+    mqtt_stats_collect_fn * collect, void * user_data);
+
+// writes the final stats to the file, if any, and stops the reporter
+extern void mqtt_stats_reporter_stop(struct mqtt_stats_reporter * reporter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
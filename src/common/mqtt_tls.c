@@ -0,0 +1,231 @@
+#include "mqtt_tls.h"
+#include "mqtt_options.h"
+
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct mqtt_tls
+{
+    struct mqtt_options const * options;
+    SSL_CTX * ctx;
+    pthread_mutex_t lock;
+    SSL_SESSION * session;
+};
+
+// sessions of other brokers or expired sessions would only cost a round trip
+static bool mqtt_tls_session_usable(struct mqtt_tls const * tls, SSL_SESSION const * session)
+{
+    char const * const hostname = SSL_SESSION_get0_hostname(session);
+    long const expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+
+    return (1 == SSL_SESSION_is_resumable(session)) && (time(NULL) < expires) &&
+        ((NULL == hostname) || (0 == strcmp(hostname, tls->options->host)));
+}
+
+static void mqtt_tls_load_session(struct mqtt_tls * tls)
+{
+    FILE * file = fopen(tls->options->tls_session, "r");
+    if (NULL == file)
+    {
+        return;
+    }
+
+    SSL_SESSION * session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+    fclose(file);
+
+    if ((NULL != session) && (mqtt_tls_session_usable(tls, session)))
+    {
+        tls->session = session;
+    }
+    else
+    {
+        SSL_SESSION_free(session);
+    }
+}
+
+// the file is replaced atomically and readable by the owner only,
+// since the session contains its master secret
+static void mqtt_tls_save_session(struct mqtt_tls * tls)
+{
+    char const * const path = tls->options->tls_session;
+    size_t const length = strlen(path) + 5;
+    char * temp_path = malloc(length);
+    if (NULL == temp_path)
+    {
+        return;
+    }
+    snprintf(temp_path, length, "%s.tmp", path);
+
+    bool ok = false;
+    int const fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE * file = (0 <= fd) ? fdopen(fd, "w") : NULL;
+    if (NULL != file)
+    {
+        ok = (1 == PEM_write_SSL_SESSION(file, tls->session));
+        ok = (0 == fclose(file)) && ok;
+        ok = ok && (0 == rename(temp_path, path));
+    }
+    else if (0 <= fd)
+    {
+        close(fd);
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "warning: failed to save TLS session to %s\n", path);
+        unlink(temp_path);
+    }
+    free(temp_path);
+}
+
+// called by OpenSSL for each session (or TLS 1.3 ticket) received from the broker
+static int mqtt_tls_on_new_session(SSL * ssl, SSL_SESSION * session)
+{
+    struct mqtt_tls * tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    pthread_mutex_lock(&tls->lock);
+    SSL_SESSION_free(tls->session);
+    tls->session = session;
+    if (NULL != tls->options->tls_session)
+    {
+        mqtt_tls_save_session(tls);
+    }
+    pthread_mutex_unlock(&tls->lock);
+
+    // the reference of session is kept
+    return 1;
+}
+
+// libmosquitto creates the SSL object and starts the handshake right away,
+// so the start of the handshake is the only point to offer the session
+// before the ClientHello is written
+static void mqtt_tls_on_info(SSL const * ssl, int where, int ret)
+{
+    (void) ret; // unused
+
+    if ((0 == (where & SSL_CB_HANDSHAKE_START)) || (NULL != SSL_get_session(ssl)))
+    {
+        return;
+    }
+
+    struct mqtt_tls * tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    pthread_mutex_lock(&tls->lock);
+    if (NULL != tls->session)
+    {
+        SSL_set_session((SSL *) ssl, tls->session);
+    }
+    pthread_mutex_unlock(&tls->lock);
+}
+
+static bool mqtt_tls_init_ctx(struct mqtt_tls * tls)
+{
+    struct mqtt_options const * options = tls->options;
+
+    int const version = ((NULL != options->tls_version) && (0 == strcmp(options->tls_version, "tlsv1.3"))) ?
+        TLS1_3_VERSION : TLS1_2_VERSION;
+    SSL_CTX_set_min_proto_version(tls->ctx, version);
+
+    int const ca_loaded = (NULL != options->cafile) ?
+        SSL_CTX_load_verify_locations(tls->ctx, options->cafile, NULL) :
+        SSL_CTX_set_default_verify_paths(tls->ctx);
+    if (1 != ca_loaded)
+    {
+        fprintf(stderr, "error: failed to load CA certificates\n");
+        return false;
+    }
+
+    if ((NULL != options->certfile) &&
+        ((1 != SSL_CTX_use_certificate_chain_file(tls->ctx, options->certfile)) ||
+        (1 != SSL_CTX_use_PrivateKey_file(tls->ctx,
+            (NULL != options->keyfile) ? options->keyfile : options->certfile, SSL_FILETYPE_PEM)) ||
+        (1 != SSL_CTX_check_private_key(tls->ctx))))
+    {
+        fprintf(stderr, "error: failed to load client certificate or key\n");
+        return false;
+    }
+
+    // the certificate must match the broker's hostname or IP address
+    SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+    X509_VERIFY_PARAM * param = SSL_CTX_get0_param(tls->ctx);
+    X509_VERIFY_PARAM_set_hostflags(param, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+    if ((1 != X509_VERIFY_PARAM_set1_ip_asc(param, options->host)) &&
+        (1 != X509_VERIFY_PARAM_set1_host(param, options->host, 0)))
+    {
+        fprintf(stderr, "error: failed to set TLS hostname\n");
+        return false;
+    }
+
+    // sessions are kept by mqtt_tls instead of the internal cache,
+    // which OpenSSL does not consult for clients
+    SSL_CTX_set_app_data(tls->ctx, tls);
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls->ctx, &mqtt_tls_on_new_session);
+    SSL_CTX_set_info_callback(tls->ctx, &mqtt_tls_on_info);
+
+    return true;
+}
+
+struct mqtt_tls * mqtt_tls_create(struct mqtt_options const * options)
+{
+    struct mqtt_tls * tls = malloc(sizeof(struct mqtt_tls));
+    if (NULL == tls)
+    {
+        fprintf(stderr, "error: failed to allocate TLS context\n");
+        return NULL;
+    }
+
+    tls->options = options;
+    tls->session = NULL;
+    tls->ctx = SSL_CTX_new(TLS_client_method());
+    if ((NULL == tls->ctx) || (!mqtt_tls_init_ctx(tls)))
+    {
+        SSL_CTX_free(tls->ctx);
+        free(tls);
+        return NULL;
+    }
+    pthread_mutex_init(&tls->lock, NULL);
+
+    if (NULL != options->tls_session)
+    {
+        mqtt_tls_load_session(tls);
+    }
+
+    return tls;
+}
+
+void mqtt_tls_destroy(struct mqtt_tls * tls)
+{
+    if (NULL == tls)
+    {
+        return;
+    }
+
+    SSL_SESSION_free(tls->session);
+    SSL_CTX_free(tls->ctx);
+    pthread_mutex_destroy(&tls->lock);
+    free(tls);
+}
+
+bool mqtt_tls_apply(struct mqtt_tls * tls, struct mosquitto * mosq)
+{
+    // the context is completely configured, so libmosquitto must not
+    // apply its defaults, which would load the CA file on each connect
+    return (MOSQ_ERR_SUCCESS == mosquitto_int_option(mosq, MOSQ_OPT_SSL_CTX_WITH_DEFAULTS, 0)) &&
+        (MOSQ_ERR_SUCCESS == mosquitto_void_option(mosq, MOSQ_OPT_SSL_CTX, tls->ctx));
+}
+
+bool mqtt_tls_pending(struct mosquitto * mosq)
+{
+    SSL * ssl = mosquitto_ssl_get(mosq);
+    return (NULL != ssl) && (1 == SSL_has_pending(ssl));
+}
@@ -0,0 +1,38 @@
+#ifndef MQTT_TLS_H
+#define MQTT_TLS_H
+
+#include <mosquitto.h>
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct mqtt_options;
+
+// TLS context shared by all connections of a process; certificates and keys
+// are loaded once and TLS sessions are resumed on reconnect, optionally
+// across processes by storing the latest session in a file
+struct mqtt_tls;
+
+// creates the TLS context of the TLS options; options must outlive the context;
+// prints an error and returns NULL, if a certificate or key cannot be loaded
+extern struct mqtt_tls * mqtt_tls_create(struct mqtt_options const * options);
+
+extern void mqtt_tls_destroy(struct mqtt_tls * tls);
+
+// makes a mosquitto instance connect via TLS using the shared context;
+// must be called before connecting
+extern bool mqtt_tls_apply(struct mqtt_tls * tls, struct mosquitto * mosq);
+
+// returns true, if TLS received data of a mosquitto instance, which is
+// not read yet; the socket is not readable for this data
+extern bool mqtt_tls_pending(struct mosquitto * mosq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,435 @@
+#include "mqtt_trace.h"
+#include "mqtt_capture.h"
+
+#include <mqtt_protocol.h>
+
+#include <sys/random.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_TRACE_INITIAL_STREAMS (64)
+
+// "<source> <sequence> <timestamp>" with 10 + 20 + 20 digits
+#define MQTT_TRACE_VALUE_SIZE (64)
+
+bool mqtt_trace_init(struct mqtt_trace * trace)
+{
+    trace->stream_capacity = MQTT_TRACE_INITIAL_STREAMS;
+    trace->stream_count = 0;
+    trace->streams = calloc(trace->stream_capacity, sizeof(struct mqtt_trace_stream));
+    if (NULL == trace->streams)
+    {
+        return false;
+    }
+
+    // publishers are told apart by their source, e.g. after a restart
+    if (sizeof(trace->source) != getrandom(&trace->source, sizeof(trace->source), 0))
+    {
+        trace->source = (uint32_t) (mqtt_capture_now() ^ (uint64_t) getpid());
+    }
+
+    for (size_t i = 0; i < MQTT_TRACE_BUCKETS; i++)
+    {
+        atomic_init(&trace->latency.buckets[i], 0);
+    }
+    atomic_init(&trace->latency.count, 0);
+    atomic_init(&trace->latency.max, 0);
+    atomic_init(&trace->untraced, 0);
+    atomic_init(&trace->skewed, 0);
+    pthread_mutex_init(&trace->lock, NULL);
+
+    return true;
+}
+
+void mqtt_trace_cleanup(struct mqtt_trace * trace)
+{
+    for (size_t i = 0; i < trace->stream_capacity; i++)
+    {
+        free(trace->streams[i].topic);
+    }
+    free(trace->streams);
+    pthread_mutex_destroy(&trace->lock);
+}
+
+// FNV-1a of source and topic
+static uint32_t mqtt_trace_hash(uint32_t source, char const * topic)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < sizeof(source); i++)
+    {
+        hash ^= (source >> (i * 8)) & 0xff;
+        hash *= 16777619U;
+    }
+    for (unsigned char const * c = (unsigned char const *) topic; '\0' != *c; c++)
+    {
+        hash ^= *c;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static struct mqtt_trace_stream * mqtt_trace_find(struct mqtt_trace_stream * streams, size_t capacity,
+    uint32_t source, char const * topic)
+{
+    size_t index = mqtt_trace_hash(source, topic) & (capacity - 1);
+    while ((NULL != streams[index].topic) &&
+        ((source != streams[index].source) || (0 != strcmp(topic, streams[index].topic))))
+    {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return &streams[index];
+}
+
+// the table is kept at most half full, so that probe sequences stay short
+static bool mqtt_trace_grow(struct mqtt_trace * trace)
+{
+    size_t const capacity = trace->stream_capacity * 2;
+    struct mqtt_trace_stream * streams = calloc(capacity, sizeof(struct mqtt_trace_stream));
+    if (NULL == streams)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < trace->stream_capacity; i++)
+    {
+        struct mqtt_trace_stream const * stream = &trace->streams[i];
+        if (NULL != stream->topic)
+        {
+            *mqtt_trace_find(streams, capacity, stream->source, stream->topic) = *stream;
+        }
+    }
+
+    free(trace->streams);
+    trace->streams = streams;
+    trace->stream_capacity = capacity;
+    return true;
+}
+
+// returns the stream of source and topic, which is created if needed;
+// must be called with lock held
+static struct mqtt_trace_stream * mqtt_trace_stream(struct mqtt_trace * trace, uint32_t source,
+    char const * topic, bool * created)
+{
+    struct mqtt_trace_stream * stream = mqtt_trace_find(trace->streams, trace->stream_capacity, source, topic);
+    *created = (NULL == stream->topic);
+    if (!*created)
+    {
+        return stream;
+    }
+
+    if ((trace->stream_capacity <= (trace->stream_count + 1) * 2) && (mqtt_trace_grow(trace)))
+    {
+        stream = mqtt_trace_find(trace->streams, trace->stream_capacity, source, topic);
+    }
+
+    stream->topic = strdup(topic);
+    if (NULL == stream->topic)
+    {
+        return NULL;
+    }
+    stream->source = source;
+    stream->next = 0;
+    stream->received = 0;
+    stream->messages = 0;
+    stream->gaps = 0;
+    stream->reordered = 0;
+    stream->duplicates = 0;
+    stream->max = 0;
+    trace->stream_count++;
+
+    return stream;
+}
+
+void mqtt_trace_stamp(struct mqtt_trace * trace, char const * topic, struct mqtt_trace_stamp * stamp)
+{
+    pthread_mutex_lock(&trace->lock);
+
+    bool created = false;
+    struct mqtt_trace_stream * stream = mqtt_trace_stream(trace, trace->source, topic, &created);
+    stamp->source = trace->source;
+    stamp->sequence = (NULL != stream) ? stream->next++ : 0;
+
+    pthread_mutex_unlock(&trace->lock);
+
+    // taken last, so that the latency does not include the lookup
+    stamp->timestamp = mqtt_capture_now();
+}
+
+bool mqtt_trace_add_property(mosquitto_property * * properties, struct mqtt_trace_stamp const * stamp)
+{
+    char value[MQTT_TRACE_VALUE_SIZE];
+    snprintf(value, sizeof(value), "%u %llu %llu", (unsigned int) stamp->source,
+        (unsigned long long) stamp->sequence, (unsigned long long) stamp->timestamp);
+
+    return (MOSQ_ERR_SUCCESS == mosquitto_property_add_string_pair(properties,
+        MQTT_PROP_USER_PROPERTY, MQTT_TRACE_PROPERTY, value));
+}
+
+static void mqtt_trace_put_fixed(unsigned char * buffer, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        buffer[i] = (unsigned char) (value >> (i * 8));
+    }
+}
+
+static uint64_t mqtt_trace_get_fixed(unsigned char const * buffer, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        value |= (uint64_t) buffer[i] << (i * 8);
+    }
+
+    return value;
+}
+
+void mqtt_trace_write_header(unsigned char * buffer, struct mqtt_trace_stamp const * stamp)
+{
+    memcpy(buffer, MQTT_TRACE_MAGIC, 4);
+    mqtt_trace_put_fixed(&buffer[4], stamp->source, 4);
+    mqtt_trace_put_fixed(&buffer[8], stamp->sequence, 8);
+    mqtt_trace_put_fixed(&buffer[16], stamp->timestamp, 8);
+}
+
+static bool mqtt_trace_parse_property(mosquitto_property const * properties, struct mqtt_trace_stamp * stamp)
+{
+    bool found = false;
+    bool result = false;
+    char * name = NULL;
+    char * value = NULL;
+    for (mosquitto_property const * property = mosquitto_property_read_string_pair(properties,
+            MQTT_PROP_USER_PROPERTY, &name, &value, false);
+        (!found) && (NULL != property);
+        property = mosquitto_property_read_string_pair(property, MQTT_PROP_USER_PROPERTY, &name, &value, true))
+    {
+        found = (0 == strcmp(name, MQTT_TRACE_PROPERTY));
+        if (found)
+        {
+            unsigned int source = 0;
+            unsigned long long sequence = 0;
+            unsigned long long timestamp = 0;
+            result = (3 == sscanf(value, "%u %llu %llu", &source, &sequence, &timestamp));
+            stamp->source = (uint32_t) source;
+            stamp->sequence = (uint64_t) sequence;
+            stamp->timestamp = (uint64_t) timestamp;
+        }
+
+        free(name);
+        free(value);
+        name = NULL;
+        value = NULL;
+    }
+
+    return result;
+}
+
+bool mqtt_trace_parse(mosquitto_property const * properties, void const * payload, size_t length,
+    struct mqtt_trace_stamp * stamp, size_t * header_size)
+{
+    // the publisher may use MQTT 3.1.1, even if the subscriber does not
+    *header_size = 0;
+    if ((NULL != properties) && (mqtt_trace_parse_property(properties, stamp)))
+    {
+        return true;
+    }
+
+    unsigned char const * header = payload;
+    if ((length < MQTT_TRACE_HEADER_SIZE) || (0 != memcmp(header, MQTT_TRACE_MAGIC, 4)))
+    {
+        return false;
+    }
+
+    stamp->source = (uint32_t) mqtt_trace_get_fixed(&header[4], 4);
+    stamp->sequence = mqtt_trace_get_fixed(&header[8], 8);
+    stamp->timestamp = mqtt_trace_get_fixed(&header[16], 8);
+    *header_size = MQTT_TRACE_HEADER_SIZE;
+
+    return true;
+}
+
+static size_t mqtt_trace_bucket(uint64_t value)
+{
+    if (value < MQTT_TRACE_SUB_BUCKETS)
+    {
+        return (size_t) value;
+    }
+
+    unsigned int const high = 63 - (unsigned int) __builtin_clzll(value);
+    size_t const sub = (size_t) (value >> (high - MQTT_TRACE_SUB_BITS)) & (MQTT_TRACE_SUB_BUCKETS - 1);
+    return ((size_t) (high - MQTT_TRACE_SUB_BITS + 1) * MQTT_TRACE_SUB_BUCKETS) + sub;
+}
+
+// returns the smallest value of the next bucket, i.e. the bucket's upper bound
+static uint64_t mqtt_trace_bucket_limit(size_t bucket)
+{
+    if (bucket < MQTT_TRACE_SUB_BUCKETS)
+    {
+        return (uint64_t) bucket + 1;
+    }
+
+    unsigned int const shift = (unsigned int) (bucket / MQTT_TRACE_SUB_BUCKETS) - 1;
+    uint64_t const sub = (uint64_t) (bucket % MQTT_TRACE_SUB_BUCKETS);
+    return (MQTT_TRACE_SUB_BUCKETS + sub + 1) << shift;
+}
+
+static void mqtt_trace_histogram_record(struct mqtt_trace_histogram * histogram, uint64_t value)
+{
+    atomic_fetch_add_explicit(&histogram->buckets[mqtt_trace_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+
+    unsigned long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while ((max < value) && (!atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+        memory_order_relaxed, memory_order_relaxed)))
+    {
+        // retry with the updated maximum
+    }
+}
+
+void mqtt_trace_record(struct mqtt_trace * trace, char const * topic,
+    struct mqtt_trace_stamp const * stamp, uint64_t received)
+{
+    // a receive time before the send time is due to clocks out of sync
+    uint64_t latency = 0;
+    if (stamp->timestamp <= received)
+    {
+        latency = received - stamp->timestamp;
+    }
+    else
+    {
+        atomic_fetch_add(&trace->skewed, 1);
+    }
+    mqtt_trace_histogram_record(&trace->latency, latency);
+
+    pthread_mutex_lock(&trace->lock);
+
+    bool created = false;
+    struct mqtt_trace_stream * stream = mqtt_trace_stream(trace, stamp->source, topic, &created);
+    if (NULL != stream)
+    {
+        // a subscriber may start in the middle of a stream
+        uint64_t const sequence = stamp->sequence;
+        if ((created) || (stream->next <= sequence))
+        {
+            uint64_t const shift = (created) ? MQTT_TRACE_WINDOW : (sequence - stream->next + 1);
+            if (!created)
+            {
+                stream->gaps += sequence - stream->next;
+            }
+            stream->received = (shift < MQTT_TRACE_WINDOW) ? ((stream->received << shift) | 1) : 1;
+            stream->next = sequence + 1;
+        }
+        else
+        {
+            // messages older than the window cannot be told from duplicates
+            uint64_t const age = stream->next - 1 - sequence;
+            uint64_t const bit = (age < MQTT_TRACE_WINDOW) ? ((uint64_t) 1 << age) : 0;
+            if ((0 != bit) && (0 != (stream->received & bit)))
+            {
+                stream->duplicates++;
+            }
+            else
+            {
+                stream->received |= bit;
+                stream->reordered++;
+                if ((0 != bit) && (0 < stream->gaps))
+                {
+                    stream->gaps--;
+                }
+            }
+        }
+
+        stream->messages++;
+        stream->max = (stream->max < latency) ? latency : stream->max;
+    }
+
+    pthread_mutex_unlock(&trace->lock);
+}
+
+static uint64_t mqtt_trace_quantile(struct mqtt_trace_histogram * histogram, double quantile)
+{
+    unsigned long const count = atomic_load(&histogram->count);
+    unsigned long const rank = (unsigned long) ((double) count * quantile);
+
+    unsigned long seen = 0;
+    for (size_t i = 0; i < MQTT_TRACE_BUCKETS; i++)
+    {
+        seen += atomic_load(&histogram->buckets[i]);
+        if ((0 < seen) && (rank < seen))
+        {
+            return mqtt_trace_bucket_limit(i);
+        }
+    }
+
+    return atomic_load(&histogram->max);
+}
+
+void mqtt_trace_print(struct mqtt_trace * trace, FILE * file, bool detailed)
+{
+    struct mqtt_trace_histogram * histogram = &trace->latency;
+
+    unsigned long gaps = 0;
+    unsigned long reordered = 0;
+    unsigned long duplicates = 0;
+    pthread_mutex_lock(&trace->lock);
+    for (size_t i = 0; i < trace->stream_capacity; i++)
+    {
+        gaps += trace->streams[i].gaps;
+        reordered += trace->streams[i].reordered;
+        duplicates += trace->streams[i].duplicates;
+    }
+    size_t const streams = trace->stream_count;
+    pthread_mutex_unlock(&trace->lock);
+
+    fprintf(file, "trace: messages=%lu streams=%zu gaps=%lu reordered=%lu duplicates=%lu untraced=%lu "
+        "skewed=%lu latency_us p50<%.1f p90<%.1f p99<%.1f p99.9<%.1f p99.99<%.1f max=%.1f\n",
+        atomic_load(&histogram->count), streams, gaps, reordered, duplicates,
+        atomic_load(&trace->untraced), atomic_load(&trace->skewed),
+        (double) mqtt_trace_quantile(histogram, 0.5) / 1000.0,
+        (double) mqtt_trace_quantile(histogram, 0.9) / 1000.0,
+        (double) mqtt_trace_quantile(histogram, 0.99) / 1000.0,
+        (double) mqtt_trace_quantile(histogram, 0.999) / 1000.0,
+        (double) mqtt_trace_quantile(histogram, 0.9999) / 1000.0,
+        (double) atomic_load(&histogram->max) / 1000.0);
+
+    if (!detailed)
+    {
+        return;
+    }
+
+    // streams without anomalies are only counted, since there may be many
+    pthread_mutex_lock(&trace->lock);
+    for (size_t i = 0; i < trace->stream_capacity; i++)
+    {
+        struct mqtt_trace_stream const * stream = &trace->streams[i];
+        if ((NULL != stream->topic) && ((0 < stream->gaps) || (0 < stream->reordered) || (0 < stream->duplicates)))
+        {
+            fprintf(file, "trace: topic=%s source=%08x messages=%lu gaps=%lu reordered=%lu duplicates=%lu "
+                "max_us=%.1f\n", stream->topic, (unsigned int) stream->source, stream->messages,
+                stream->gaps, stream->reordered, stream->duplicates, (double) stream->max / 1000.0);
+        }
+    }
+    pthread_mutex_unlock(&trace->lock);
+
+    // cumulative distribution of the non-empty buckets
+    unsigned long const count = atomic_load(&histogram->count);
+    unsigned long seen = 0;
+    if (0 < count)
+    {
+        fprintf(file, "trace: %14s %12s %12s\n", "latency_us<", "percentile", "count");
+    }
+    for (size_t i = 0; (0 < count) && (i < MQTT_TRACE_BUCKETS); i++)
+    {
+        unsigned long const bucket = atomic_load(&histogram->buckets[i]);
+        if (0 < bucket)
+        {
+            seen += bucket;
+            fprintf(file, "trace: %14.3f %12.6f %12lu\n", (double) mqtt_trace_bucket_limit(i) / 1000.0,
+                (double) seen * 100.0 / (double) count, seen);
+        }
+    }
+}
@@ -0,0 +1,119 @@
+#ifndef MQTT_TRACE_H
+#define MQTT_TRACE_H
+
+#include <mosquitto.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// end-to-end latency tracing of messages
+//
+// A traced message carries the id of its publisher, a sequence number,
+// which counts the messages of a topic, and its send time in nanoseconds
+// of the realtime clock. With MQTT 5, the stamp is the user property
+// MQTT_TRACE_PROPERTY with the value "<source> <sequence> <timestamp>";
+// with MQTT 3.1.1, it is a header preceding the payload: the magic
+// "MQTR", u32 source, u64 sequence and u64 timestamp (little endian).
+// Latencies between hosts require synchronized clocks.
+#define MQTT_TRACE_PROPERTY "mqtt-trace"
+#define MQTT_TRACE_MAGIC "MQTR"
+#define MQTT_TRACE_HEADER_SIZE (4 + 4 + 8 + 8)
+
+// log-linear histogram in the manner of HdrHistogram: values are grouped by
+// their highest bit and each group is split into 2^MQTT_TRACE_SUB_BITS linear
+// buckets, so that each bucket is accurate within 1/16 (6.25%) of its value
+#define MQTT_TRACE_SUB_BITS (4)
+#define MQTT_TRACE_SUB_BUCKETS (1 << MQTT_TRACE_SUB_BITS)
+#define MQTT_TRACE_BUCKETS ((64 - MQTT_TRACE_SUB_BITS + 1) * MQTT_TRACE_SUB_BUCKETS)
+
+struct mqtt_trace_histogram
+{
+    atomic_ulong buckets[MQTT_TRACE_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong max;
+};
+
+struct mqtt_trace_stamp
+{
+    uint32_t source;
+    uint64_t sequence;
+    uint64_t timestamp;
+};
+
+// number of sequences before the next expected one, which are remembered
+// to tell late messages from duplicates
+#define MQTT_TRACE_WINDOW 64
+
+// messages of a topic sent by a single publisher; bit i of received is set,
+// if the sequence next - 1 - i was received
+struct mqtt_trace_stream
+{
+    char * topic;
+    uint32_t source;
+    uint64_t next;
+    uint64_t received;
+    unsigned long messages;
+    unsigned long gaps;
+    unsigned long reordered;
+    unsigned long duplicates;
+    uint64_t max;
+};
+
+// stamps messages on the publisher's side and records them on the
+// subscriber's side; both may be used from any thread
+struct mqtt_trace
+{
+    pthread_mutex_t lock;
+    uint32_t source;
+    struct mqtt_trace_stream * streams;
+    size_t stream_count;
+    size_t stream_capacity;
+    struct mqtt_trace_histogram latency;
+    atomic_ulong untraced;
+    atomic_ulong skewed;
+};
+
+// the source id of stamped messages is chosen at random
+extern bool mqtt_trace_init(struct mqtt_trace * trace);
+
+extern void mqtt_trace_cleanup(struct mqtt_trace * trace);
+
+// returns the next stamp of a message published to topic
+extern void mqtt_trace_stamp(struct mqtt_trace * trace, char const * topic, struct mqtt_trace_stamp * stamp);
+
+// appends the stamp as user property; returns false on error
+extern bool mqtt_trace_add_property(mosquitto_property * * properties, struct mqtt_trace_stamp const * stamp);
+
+// writes the stamp to a buffer of MQTT_TRACE_HEADER_SIZE bytes
+extern void mqtt_trace_write_header(unsigned char * buffer, struct mqtt_trace_stamp const * stamp);
+
+// reads the stamp of a received message from its properties or, without
+// the property, from the payload; header_size is set to the size of the header to
+// strip from the payload; returns false, if the message is not traced
+extern bool mqtt_trace_parse(mosquitto_property const * properties, void const * payload, size_t length,
+    struct mqtt_trace_stamp * stamp, size_t * header_size);
+
+// records the latency of a stamped message received at the given time
+// (see mqtt_capture_now) and checks its sequence against its stream; a
+// missing message that arrives late is no longer counted as gap
+extern void mqtt_trace_record(struct mqtt_trace * trace, char const * topic,
+    struct mqtt_trace_stamp const * stamp, uint64_t received);
+
+// prints a single line summary; the detailed report adds the streams with
+// gaps, reordered or duplicate messages and the latency distribution
+extern void mqtt_trace_print(struct mqtt_trace * trace, FILE * file, bool detailed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
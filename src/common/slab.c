@@ -0,0 +1,239 @@
+#include "slab.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define SLAB_SEGMENT_SIZE (256 * 1024)
+#define SLAB_MIN_BLOCKS (8)
+#define SLAB_EMPTY (UINT32_MAX)
+#define SLAB_NO_CLASS (UINT32_MAX)
+
+// precedes each block, so that it can be returned to its class
+struct slab_header
+{
+    _Alignas(16) uint32_t class_index;
+    uint32_t block_index;
+};
+
+static uint64_t slab_pack(uint32_t tag, uint32_t index)
+{
+    return ((uint64_t) tag << 32) | index;
+}
+
+static uint32_t slab_index(uint64_t head)
+{
+    return (uint32_t) (head & UINT32_MAX);
+}
+
+static uint32_t slab_tag(uint64_t head)
+{
+    return (uint32_t) (head >> 32);
+}
+
+static struct slab_header * slab_block(struct slab_class * cls, uint32_t index)
+{
+    uint32_t const segment = index / cls->blocks_per_segment;
+    uint32_t const offset = index % cls->blocks_per_segment;
+    return (struct slab_header *) &cls->segments[segment][(size_t) offset * cls->block_size];
+}
+
+static _Atomic uint32_t * slab_next(struct slab_class * cls, uint32_t index)
+{
+    return &cls->next[index / cls->blocks_per_segment][index % cls->blocks_per_segment];
+}
+
+// links blocks first to last of a class, which are not in use, into the free list
+static void slab_push(struct slab_class * cls, uint32_t first, uint32_t last)
+{
+    uint64_t head = atomic_load_explicit(&cls->head, memory_order_relaxed);
+    uint64_t update;
+    do
+    {
+        atomic_store_explicit(slab_next(cls, last), slab_index(head), memory_order_relaxed);
+        update = slab_pack(slab_tag(head) + 1, first);
+    } while (!atomic_compare_exchange_weak_explicit(&cls->head, &head, update,
+        memory_order_release, memory_order_relaxed));
+}
+
+static uint32_t slab_pop(struct slab_class * cls)
+{
+    uint64_t head = atomic_load_explicit(&cls->head, memory_order_acquire);
+    uint64_t update;
+    do
+    {
+        uint32_t const index = slab_index(head);
+        if (SLAB_EMPTY == index)
+        {
+            return SLAB_EMPTY;
+        }
+
+        // next may be stale, if the block was taken meanwhile;
+        // the tag makes the exchange fail in that case
+        uint32_t const next = atomic_load_explicit(slab_next(cls, index), memory_order_relaxed);
+        update = slab_pack(slab_tag(head) + 1, next);
+    } while (!atomic_compare_exchange_weak_explicit(&cls->head, &head, update,
+        memory_order_acquire, memory_order_acquire));
+
+    return slab_index(head);
+}
+
+// adds a segment; returns false, if the limit is reached
+static bool slab_grow(struct slab * slab, struct slab_class * cls, uint32_t class_index)
+{
+    size_t const segment_size = (size_t) cls->blocks_per_segment * cls->block_size;
+
+    pthread_mutex_lock(&cls->grow_lock);
+
+    // another thread may have added a segment meanwhile
+    bool result = (SLAB_EMPTY != slab_index(atomic_load(&cls->head)));
+    uint32_t const segment = atomic_load(&cls->segment_count);
+    if ((!result) && (segment < SLAB_MAX_SEGMENTS) &&
+        ((0 == slab->limit) || ((atomic_load(&slab->reserved) + segment_size) <= slab->limit)))
+    {
+        char * data = aligned_alloc(16, segment_size);
+        _Atomic uint32_t * next = calloc(cls->blocks_per_segment, sizeof(_Atomic uint32_t));
+        result = (NULL != data) && (NULL != next);
+        if (result)
+        {
+            cls->segments[segment] = data;
+            cls->next[segment] = next;
+            atomic_store(&cls->segment_count, segment + 1);
+            atomic_fetch_add(&slab->reserved, segment_size);
+
+            uint32_t const first = segment * cls->blocks_per_segment;
+            uint32_t const last = first + cls->blocks_per_segment - 1;
+            for (uint32_t index = first; index <= last; index++)
+            {
+                struct slab_header * header = slab_block(cls, index);
+                header->class_index = class_index;
+                header->block_index = index;
+                atomic_init(slab_next(cls, index), index + 1);
+            }
+            slab_push(cls, first, last);
+        }
+        else
+        {
+            free(next);
+            free(data);
+        }
+    }
+
+    pthread_mutex_unlock(&cls->grow_lock);
+    return result;
+}
+
+void slab_init(struct slab * slab, size_t limit)
+{
+    size_t const sizes[SLAB_CLASSES] = SLAB_CLASS_SIZES;
+
+    slab->limit = limit;
+    atomic_init(&slab->reserved, 0);
+    atomic_init(&slab->fallbacks, 0);
+
+    for (uint32_t i = 0; i < SLAB_CLASSES; i++)
+    {
+        struct slab_class * cls = &slab->classes[i];
+        cls->size = sizes[i];
+        cls->block_size = sizeof(struct slab_header) + sizes[i];
+        cls->blocks_per_segment = (uint32_t) (SLAB_SEGMENT_SIZE / cls->block_size);
+        if (cls->blocks_per_segment < SLAB_MIN_BLOCKS)
+        {
+            cls->blocks_per_segment = SLAB_MIN_BLOCKS;
+        }
+
+        atomic_init(&cls->head, slab_pack(0, SLAB_EMPTY));
+        atomic_init(&cls->segment_count, 0);
+        atomic_init(&cls->used, 0);
+        atomic_init(&cls->peak, 0);
+        pthread_mutex_init(&cls->grow_lock, NULL);
+    }
+}
+
+void slab_cleanup(struct slab * slab)
+{
+    for (uint32_t i = 0; i < SLAB_CLASSES; i++)
+    {
+        struct slab_class * cls = &slab->classes[i];
+        uint32_t const count = atomic_load(&cls->segment_count);
+        for (uint32_t segment = 0; segment < count; segment++)
+        {
+            free(cls->segments[segment]);
+            free(cls->next[segment]);
+        }
+        pthread_mutex_destroy(&cls->grow_lock);
+    }
+}
+
+void * slab_alloc(struct slab * slab, size_t size)
+{
+    uint32_t class_index = 0;
+    while ((class_index < SLAB_CLASSES) && (slab->classes[class_index].size < size))
+    {
+        class_index++;
+    }
+
+    if (class_index < SLAB_CLASSES)
+    {
+        struct slab_class * cls = &slab->classes[class_index];
+        uint32_t index = slab_pop(cls);
+        while ((SLAB_EMPTY == index) && (slab_grow(slab, cls, class_index)))
+        {
+            index = slab_pop(cls);
+        }
+
+        if (SLAB_EMPTY != index)
+        {
+            size_t const used = atomic_fetch_add_explicit(&cls->used, 1, memory_order_relaxed) + 1;
+            size_t peak = atomic_load_explicit(&cls->peak, memory_order_relaxed);
+            while ((peak < used) && (!atomic_compare_exchange_weak_explicit(&cls->peak, &peak, used,
+                memory_order_relaxed, memory_order_relaxed))) { }
+
+            return &slab_block(cls, index)[1];
+        }
+    }
+
+    // too large or the limit is reached
+    atomic_fetch_add_explicit(&slab->fallbacks, 1, memory_order_relaxed);
+    struct slab_header * header = malloc(sizeof(struct slab_header) + size);
+    if (NULL == header)
+    {
+        return NULL;
+    }
+
+    header->class_index = SLAB_NO_CLASS;
+    header->block_index = 0;
+    return &header[1];
+}
+
+void slab_free(struct slab * slab, void * block)
+{
+    if (NULL == block)
+    {
+        return;
+    }
+
+    struct slab_header * header = &((struct slab_header *) block)[-1];
+    if (SLAB_NO_CLASS == header->class_index)
+    {
+        free(header);
+        return;
+    }
+
+    struct slab_class * cls = &slab->classes[header->class_index];
+    atomic_fetch_sub_explicit(&cls->used, 1, memory_order_relaxed);
+    slab_push(cls, header->block_index, header->block_index);
+}
+
+void slab_report(struct slab * slab, FILE * file)
+{
+    for (uint32_t i = 0; i < SLAB_CLASSES; i++)
+    {
+        struct slab_class * cls = &slab->classes[i];
+        size_t const capacity = (size_t) atomic_load(&cls->segment_count) * cls->blocks_per_segment;
+        fprintf(file, "pool: %6zu bytes: %zu of %zu blocks used (peak %zu)\n",
+            cls->size, atomic_load(&cls->used), capacity, atomic_load(&cls->peak));
+    }
+
+    fprintf(file, "pool: %zu bytes reserved, %lu allocation(s) outside the pool\n",
+        atomic_load(&slab->reserved), atomic_load(&slab->fallbacks));
+}
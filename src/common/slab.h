@@ -0,0 +1,71 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// size classes in bytes, tuned for typical MQTT payloads
+// (sensor values, JSON documents, small files)
+#define SLAB_CLASSES (6)
+#define SLAB_CLASS_SIZES { 128, 512, 2048, 8192, 32768, 131072 }
+
+#define SLAB_MAX_SEGMENTS (1024)
+
+struct slab_class
+{
+    size_t size;
+    size_t block_size;
+    uint32_t blocks_per_segment;
+
+    // free list of block indices; the upper 32 bits are a tag,
+    // which is incremented on each change to prevent ABA
+    _Atomic uint64_t head;
+
+    // segments are added when the free list is empty, but never released
+    // before cleanup, so that the steady state does not allocate
+    char * segments[SLAB_MAX_SEGMENTS];
+    _Atomic uint32_t * next[SLAB_MAX_SEGMENTS];
+    _Atomic uint32_t segment_count;
+    pthread_mutex_t grow_lock;
+
+    atomic_size_t used;
+    atomic_size_t peak;
+};
+
+// lock-free allocator with size classes; blocks may be allocated and
+// released from any thread
+struct slab
+{
+    struct slab_class classes[SLAB_CLASSES];
+    size_t limit;
+    atomic_size_t reserved;
+    atomic_ulong fallbacks;
+};
+
+// limit is the maximum number of bytes reserved for segments (0 is unlimited);
+// allocations beyond the limit or the largest class use malloc
+extern void slab_init(struct slab * slab, size_t limit);
+
+// releases all segments; all blocks must be released before
+extern void slab_cleanup(struct slab * slab);
+
+extern void * slab_alloc(struct slab * slab, size_t size);
+
+extern void slab_free(struct slab * slab, void * block);
+
+// prints the usage of each size class
+extern void slab_report(struct slab * slab, FILE * file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,227 @@
+#include "spsc_ring.h"
+
+#include <errno.h>
+#include <time.h>
+#include <stdlib.h>
+
+bool spsc_ring_init(struct spsc_ring * ring, size_t capacity, enum spsc_ring_policy policy)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size *= 2;
+    }
+
+    ring->slots = calloc(size, sizeof(void * _Atomic));
+    if (NULL == ring->slots)
+    {
+        return false;
+    }
+
+    ring->mask = size - 1;
+    ring->policy = policy;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, false);
+    atomic_init(&ring->pushed, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->blocked, 0);
+    sem_init(&ring->available, 0, 0);
+    sem_init(&ring->space, 0, (unsigned int) size);
+
+    return true;
+}
+
+void spsc_ring_cleanup(struct spsc_ring * ring)
+{
+    sem_destroy(&ring->space);
+    sem_destroy(&ring->available);
+    free(ring->slots);
+}
+
+static void semaphore_wait(sem_t * semaphore)
+{
+    while ((0 != sem_wait(semaphore)) && (EINTR == errno)) { }
+}
+
+// returns false, if the deadline passed; waits forever without deadline
+static bool semaphore_wait_until(sem_t * semaphore, struct timespec const * deadline)
+{
+    if (NULL == deadline)
+    {
+        semaphore_wait(semaphore);
+        return true;
+    }
+
+    int rc;
+    while ((0 != (rc = sem_timedwait(semaphore, deadline))) && (EINTR == errno)) { }
+    return (0 == rc);
+}
+
+// sem_timedwait only accepts a deadline of the realtime clock
+static struct timespec semaphore_deadline(int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (1000000000L <= deadline.tv_nsec)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    return deadline;
+}
+
+// takes the item at head, if head did not change in between;
+// returns NULL, if the ring is empty or the other side took the item before
+static void * spsc_ring_take(struct spsc_ring * ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t const tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail)
+    {
+        return NULL;
+    }
+
+    // the slot may be overwritten once head passed it, so the item is
+    // only used, if head is unchanged when it is claimed
+    void * const item = atomic_load_explicit(&ring->slots[head & ring->mask], memory_order_relaxed);
+    bool const claimed = atomic_compare_exchange_strong_explicit(&ring->head, &head, head + 1,
+        memory_order_acq_rel, memory_order_relaxed);
+
+    return claimed ? item : NULL;
+}
+
+static void spsc_ring_store(struct spsc_ring * ring, size_t tail, void * item)
+{
+    atomic_store_explicit(&ring->slots[tail & ring->mask], item, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+    sem_post(&ring->available);
+}
+
+void * spsc_ring_push(struct spsc_ring * ring, void * item)
+{
+    void * dropped = NULL;
+    size_t const size = ring->mask + 1;
+    size_t const tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    switch (ring->policy)
+    {
+        case SPSC_RING_DROP_NEWEST:
+            if ((tail - atomic_load_explicit(&ring->head, memory_order_acquire)) >= size)
+            {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+                return item;
+            }
+            break;
+        case SPSC_RING_DROP_OLDEST:
+            while ((NULL == dropped) &&
+                ((tail - atomic_load_explicit(&ring->head, memory_order_acquire)) >= size))
+            {
+                // races with the consumer for the oldest item; either side
+                // wins, both make room for the new item
+                dropped = spsc_ring_take(ring);
+            }
+            if (NULL != dropped)
+            {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            }
+            break;
+        case SPSC_RING_BLOCK:
+            // fall-through
+        default:
+            if (0 != sem_trywait(&ring->space))
+            {
+                atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+                semaphore_wait(&ring->space);
+            }
+            break;
+    }
+
+    spsc_ring_store(ring, tail, item);
+
+    return dropped;
+}
+
+bool spsc_ring_push_timeout(struct spsc_ring * ring, void * item, int timeout_ms)
+{
+    if (0 != sem_trywait(&ring->space))
+    {
+        atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+        struct timespec const deadline = semaphore_deadline(timeout_ms);
+        if (!semaphore_wait_until(&ring->space, &deadline))
+        {
+            return false;
+        }
+    }
+
+    spsc_ring_store(ring, atomic_load_explicit(&ring->tail, memory_order_relaxed), item);
+
+    return true;
+}
+
+void * spsc_ring_pop(struct spsc_ring * ring)
+{
+    return spsc_ring_pop_timeout(ring, -1, NULL);
+}
+
+void * spsc_ring_pop_timeout(struct spsc_ring * ring, int timeout_ms, bool * timed_out)
+{
+    struct timespec deadline;
+    if (0 <= timeout_ms)
+    {
+        deadline = semaphore_deadline(timeout_ms);
+    }
+
+    if (NULL != timed_out)
+    {
+        *timed_out = false;
+    }
+
+    void * item = NULL;
+    while (NULL == item)
+    {
+        // there is a post for each pushed item, but dropped items are
+        // not accounted, so the ring may be empty after a wakeup
+        bool const woken = semaphore_wait_until(&ring->available, (0 <= timeout_ms) ? &deadline : NULL);
+
+        // closed is read first, so that all items pushed before are visible
+        bool const closed = atomic_load(&ring->closed);
+        item = spsc_ring_take(ring);
+        while ((NULL == item) && (atomic_load_explicit(&ring->head, memory_order_acquire) !=
+            atomic_load_explicit(&ring->tail, memory_order_acquire)))
+        {
+            item = spsc_ring_take(ring);
+        }
+
+        if ((NULL == item) && (closed))
+        {
+            return NULL;
+        }
+
+        if ((NULL == item) && (!woken))
+        {
+            if (NULL != timed_out)
+            {
+                *timed_out = true;
+            }
+            return NULL;
+        }
+    }
+
+    if (SPSC_RING_BLOCK == ring->policy)
+    {
+        sem_post(&ring->space);
+    }
+
+    return item;
+}
+
+void spsc_ring_close(struct spsc_ring * ring)
+{
+    atomic_store(&ring->closed, true);
+    sem_post(&ring->available);
+}
@@ -0,0 +1,72 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// behavior of spsc_ring_push when the ring is full
+enum spsc_ring_policy
+{
+    SPSC_RING_BLOCK,
+    SPSC_RING_DROP_OLDEST,
+    SPSC_RING_DROP_NEWEST
+};
+
+// bounded, lock-free ring of pointers with a single producer and a single
+// consumer; only waiting for items or free space uses semaphores
+struct spsc_ring
+{
+    void * _Atomic * slots;
+    size_t mask;
+    enum spsc_ring_policy policy;
+
+    // head is advanced by the consumer and, to drop the oldest item,
+    // by the producer; tail is only advanced by the producer
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    atomic_bool closed;
+    sem_t available;
+    sem_t space;
+
+    atomic_ulong pushed;
+    atomic_ulong dropped;
+    atomic_ulong blocked;
+};
+
+// the capacity is rounded up to a power of two
+extern bool spsc_ring_init(struct spsc_ring * ring, size_t capacity, enum spsc_ring_policy policy);
+
+extern void spsc_ring_cleanup(struct spsc_ring * ring);
+
+// adds an item; if the ring is full, it waits or drops an item depending on
+// the policy; returns the dropped item, which is owned by the caller, or NULL
+extern void * spsc_ring_push(struct spsc_ring * ring, void * item);
+
+// adds an item like spsc_ring_push with SPSC_RING_BLOCK, but waits at most
+// timeout_ms milliseconds for free space; returns false, if the ring is
+// still full and the item was not added; only valid for SPSC_RING_BLOCK
+extern bool spsc_ring_push_timeout(struct spsc_ring * ring, void * item, int timeout_ms);
+
+// removes the oldest item; waits while the ring is empty;
+// returns NULL, when the ring is closed and empty
+extern void * spsc_ring_pop(struct spsc_ring * ring);
+
+// like spsc_ring_pop, but waits at most timeout_ms milliseconds, if not
+// negative; returns NULL and sets timed_out, if the ring is still empty
+extern void * spsc_ring_pop_timeout(struct spsc_ring * ring, int timeout_ms, bool * timed_out);
+
+// wakes the consumer, which returns the remaining items before NULL
+extern void spsc_ring_close(struct spsc_ring * ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+#include "topic_alias.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void topic_alias_init(struct topic_alias * aliases)
+{
+    aliases->entries = NULL;
+    aliases->capacity = 0;
+    aliases->maximum = 0;
+    aliases->count = 0;
+}
+
+static void topic_alias_clear(struct topic_alias * aliases)
+{
+    for (size_t i = 0; i < aliases->capacity; i++)
+    {
+        free(aliases->entries[i].topic);
+        aliases->entries[i].topic = NULL;
+    }
+    aliases->count = 0;
+}
+
+void topic_alias_cleanup(struct topic_alias * aliases)
+{
+    topic_alias_clear(aliases);
+    free(aliases->entries);
+    topic_alias_init(aliases);
+}
+
+bool topic_alias_reset(struct topic_alias * aliases, uint16_t maximum)
+{
+    topic_alias_clear(aliases);
+    aliases->maximum = 0;
+
+    // the table is kept at most half full
+    size_t capacity = 1;
+    while (capacity < ((size_t) maximum * 2))
+    {
+        capacity *= 2;
+    }
+
+    if ((0 < maximum) && (aliases->capacity < capacity))
+    {
+        struct topic_alias_entry * entries = calloc(capacity, sizeof(struct topic_alias_entry));
+        if (NULL == entries)
+        {
+            return false;
+        }
+        free(aliases->entries);
+        aliases->entries = entries;
+        aliases->capacity = capacity;
+    }
+
+    aliases->maximum = maximum;
+    return true;
+}
+
+// FNV-1a
+static uint32_t topic_alias_hash(char const * topic)
+{
+    uint32_t hash = 2166136261U;
+    for (unsigned char const * c = (unsigned char const *) topic; '\0' != *c; c++)
+    {
+        hash ^= *c;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+uint16_t topic_alias_get(struct topic_alias * aliases, char const * topic, bool * is_new)
+{
+    *is_new = false;
+    if (0 == aliases->maximum)
+    {
+        return 0;
+    }
+
+    size_t const mask = aliases->capacity - 1;
+    size_t index = topic_alias_hash(topic) & mask;
+    while (NULL != aliases->entries[index].topic)
+    {
+        if (0 == strcmp(aliases->entries[index].topic, topic))
+        {
+            return aliases->entries[index].alias;
+        }
+        index = (index + 1) & mask;
+    }
+
+    // once all aliases are taken, further topics are sent in full
+    if (aliases->count == aliases->maximum)
+    {
+        return 0;
+    }
+
+    aliases->entries[index].topic = strdup(topic);
+    if (NULL == aliases->entries[index].topic)
+    {
+        return 0;
+    }
+    aliases->count++;
+    aliases->entries[index].alias = aliases->count;
+    *is_new = true;
+
+    return aliases->entries[index].alias;
+}
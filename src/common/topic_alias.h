@@ -0,0 +1,45 @@
+#ifndef TOPIC_ALIAS_H
+#define TOPIC_ALIAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct topic_alias_entry
+{
+    char * topic;
+    uint16_t alias;
+};
+
+// topic aliases of a MQTT 5 connection; aliases are assigned to topics
+// in order of first use, until the maximum of the broker is reached
+struct topic_alias
+{
+    struct topic_alias_entry * entries;
+    size_t capacity;
+    uint16_t maximum;
+    uint16_t count;
+};
+
+extern void topic_alias_init(struct topic_alias * aliases);
+
+extern void topic_alias_cleanup(struct topic_alias * aliases);
+
+// forgets all aliases, e.g. on reconnect, and sets the maximum
+// announced by the broker; 0 disables aliases
+extern bool topic_alias_reset(struct topic_alias * aliases, uint16_t maximum);
+
+// returns the alias of a topic or 0, if there is none; assigns a new
+// alias, if possible, and sets is_new, so that the topic is sent with it
+extern uint16_t topic_alias_get(struct topic_alias * aliases, char const * topic, bool * is_new);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
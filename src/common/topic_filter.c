@@ -0,0 +1,238 @@
+#include "topic_filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void topic_filter_node_init(struct topic_filter_node * node)
+{
+    node->level = NULL;
+    node->length = 0;
+    node->terminal = false;
+    node->children = NULL;
+    node->child_count = 0;
+    node->child_capacity = 0;
+    node->single = NULL;
+    node->multi = false;
+}
+
+static void topic_filter_node_cleanup(struct topic_filter_node * node)
+{
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        topic_filter_node_cleanup(&node->children[i]);
+    }
+    free(node->children);
+
+    if (NULL != node->single)
+    {
+        topic_filter_node_cleanup(node->single);
+        free(node->single);
+    }
+    free(node->level);
+}
+
+void topic_filter_init(struct topic_filter * filter)
+{
+    topic_filter_node_init(&filter->root);
+    filter->count = 0;
+}
+
+void topic_filter_cleanup(struct topic_filter * filter)
+{
+    topic_filter_node_cleanup(&filter->root);
+    topic_filter_node_init(&filter->root);
+    filter->count = 0;
+}
+
+static struct topic_filter_node * topic_filter_node_find(struct topic_filter_node const * node,
+    char const * level, size_t length)
+{
+    for (size_t i = 0; i < node->child_count; i++)
+    {
+        struct topic_filter_node * child = &node->children[i];
+        if ((child->length == length) && (0 == memcmp(child->level, level, length)))
+        {
+            return child;
+        }
+    }
+
+    return NULL;
+}
+
+static struct topic_filter_node * topic_filter_node_add(struct topic_filter_node * node,
+    char const * level, size_t length)
+{
+    if ((1 == length) && ('+' == level[0]))
+    {
+        if (NULL == node->single)
+        {
+            node->single = malloc(sizeof(struct topic_filter_node));
+            if (NULL != node->single)
+            {
+                topic_filter_node_init(node->single);
+            }
+        }
+        return node->single;
+    }
+
+    struct topic_filter_node * child = topic_filter_node_find(node, level, length);
+    if (NULL != child)
+    {
+        return child;
+    }
+
+    if (node->child_count == node->child_capacity)
+    {
+        size_t const capacity = (0 < node->child_capacity) ? (node->child_capacity * 2) : 4;
+        struct topic_filter_node * children = realloc(node->children, capacity * sizeof(struct topic_filter_node));
+        if (NULL == children)
+        {
+            return NULL;
+        }
+        node->children = children;
+        node->child_capacity = capacity;
+    }
+
+    char * const copy = malloc(length + 1);
+    if (NULL == copy)
+    {
+        return NULL;
+    }
+    memcpy(copy, level, length);
+    copy[length] = '\0';
+
+    child = &node->children[node->child_count++];
+    topic_filter_node_init(child);
+    child->level = copy;
+    child->length = length;
+    return child;
+}
+
+// wildcards must occupy a whole level and '#' must be the last level
+static bool topic_filter_is_valid(char const * pattern)
+{
+    if ('\0' == pattern[0])
+    {
+        return false;
+    }
+
+    for (char const * c = pattern; '\0' != *c; c++)
+    {
+        if (('+' == *c) || ('#' == *c))
+        {
+            bool const starts_level = (c == pattern) || ('/' == c[-1]);
+            bool const ends_level = ('\0' == c[1]) || ('/' == c[1]);
+            if ((!starts_level) || (!ends_level) || (('#' == *c) && ('\0' != c[1])))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool topic_filter_add(struct topic_filter * filter, char const * pattern)
+{
+    if (!topic_filter_is_valid(pattern))
+    {
+        return false;
+    }
+
+    struct topic_filter_node * node = &filter->root;
+    char const * level = pattern;
+    while (NULL != node)
+    {
+        char const * const separator = strchr(level, '/');
+        size_t const length = (NULL != separator) ? (size_t) (separator - level) : strlen(level);
+
+        if ((1 == length) && ('#' == level[0]))
+        {
+            node->multi = true;
+            break;
+        }
+
+        node = topic_filter_node_add(node, level, length);
+        if (NULL == separator)
+        {
+            if (NULL != node)
+            {
+                node->terminal = true;
+            }
+            break;
+        }
+        level = separator + 1;
+    }
+
+    if (NULL == node)
+    {
+        return false;
+    }
+
+    filter->count++;
+    return true;
+}
+
+static bool topic_filter_node_match(struct topic_filter_node const * node, char const * level)
+{
+    // "a/#" also matches "a"
+    if (node->multi)
+    {
+        return true;
+    }
+
+    char const * const separator = strchr(level, '/');
+    size_t const length = (NULL != separator) ? (size_t) (separator - level) : strlen(level);
+
+    struct topic_filter_node const * const children[2] = {
+        topic_filter_node_find(node, level, length),
+        node->single
+    };
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        struct topic_filter_node const * child = children[i];
+        if (NULL == child)
+        {
+            continue;
+        }
+
+        if (NULL == separator)
+        {
+            // "a/b/#" matches "a/b", which ends at the child
+            if ((child->terminal) || (child->multi))
+            {
+                return true;
+            }
+        }
+        else if (topic_filter_node_match(child, separator + 1))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool topic_filter_match(struct topic_filter const * filter, char const * topic)
+{
+    struct topic_filter_node const * root = &filter->root;
+
+    // wildcards in the first level do not match topics starting with '$',
+    // e.g. "#" does not match "$SYS/broker/uptime"
+    if ('$' == topic[0])
+    {
+        char const * const separator = strchr(topic, '/');
+        size_t const length = (NULL != separator) ? (size_t) (separator - topic) : strlen(topic);
+        struct topic_filter_node const * child = topic_filter_node_find(root, topic, length);
+        if (NULL == child)
+        {
+            return false;
+        }
+
+        return (NULL == separator) ? ((child->terminal) || (child->multi)) :
+            topic_filter_node_match(child, separator + 1);
+    }
+
+    return topic_filter_node_match(root, topic);
+}
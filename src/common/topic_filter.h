@@ -0,0 +1,49 @@
+#ifndef TOPIC_FILTER_H
+#define TOPIC_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// node of the trie; each node represents a topic level of a filter
+struct topic_filter_node
+{
+    char * level;
+    size_t length;
+    bool terminal;
+    struct topic_filter_node * children;
+    size_t child_count;
+    size_t child_capacity;
+    struct topic_filter_node * single;  // '+'
+    bool multi;                         // '#'
+};
+
+// set of topic filters with MQTT wildcard semantics, compiled into a trie,
+// so that matching a topic walks its levels once regardless of the number
+// of filters and does not allocate
+struct topic_filter
+{
+    struct topic_filter_node root;
+    size_t count;
+};
+
+extern void topic_filter_init(struct topic_filter * filter);
+
+extern void topic_filter_cleanup(struct topic_filter * filter);
+
+// adds a filter, e.g. "sensors/+/temperature" or "sensors/#";
+// returns false, if the filter is invalid or out of memory
+extern bool topic_filter_add(struct topic_filter * filter, char const * pattern);
+
+// returns true, if the topic matches any of the filters
+extern bool topic_filter_match(struct topic_filter const * filter, char const * topic);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,805 @@
+#include "mqtt_options.h"
+#include "mqtt_tls.h"
+
+#include <mosquitto.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_QOS_LEVELS    (3)
+#define MAX_SIZES         (16)
+
+#define DEFAULT_PUBLISHERS  (1)
+#define DEFAULT_SUBSCRIBERS (1)
+#define DEFAULT_COUNT       (10000)
+#define DEFAULT_SIZE        (64)
+#define DEFAULT_WINDOW      (1024)
+#define DEFAULT_TIMEOUT     (5 * 1000)
+
+#define SUBSCRIBE_TIMEOUT   (5 * 1000)
+#define POLL_INTERVAL_MS    (10)
+
+enum command {
+    COMMAND_BENCH,
+    COMMAND_SHOW_HELP
+};
+
+struct context
+{
+    struct mqtt_options mqtt;
+    char * topic;
+    int publishers;
+    int subscribers;
+    unsigned int count;
+    unsigned int window;
+    unsigned int timeout;
+    int qos[MAX_QOS_LEVELS];
+    int qos_count;
+    size_t sizes[MAX_SIZES];
+    int size_count;
+    enum command cmd;
+    int exit_code;
+};
+
+// header of each benchmark message; the remainder of the payload is padding
+struct bench_header
+{
+    uint64_t timestamp;
+    uint32_t sequence;
+    uint32_t publisher;
+};
+
+struct publisher
+{
+    struct context * ctx;
+    struct mosquitto * mosq;
+    pthread_t thread;
+    char topic[256];
+    int index;
+    int qos;
+    size_t size;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int pending;
+    bool failed;
+    unsigned int sent;
+};
+
+struct subscriber
+{
+    struct mosquitto * mosq;
+    int publishers;
+    unsigned int count;
+    atomic_bool subscribed;
+    atomic_uint received;
+    atomic_uint_fast64_t last_received;
+    uint64_t * latencies;
+    unsigned int latency_count;
+    unsigned char * seen;
+    uint32_t * next_sequence;
+    unsigned int reordered;
+    unsigned int duplicates;
+    unsigned int invalid;
+};
+
+static void print_usage(void)
+{
+    printf(
+        "mqtt_bench, (c) 2024 Falk Werner <github.com/falk-werner>\n"
+        "Measure MQTT throughput and end-to-end latency\n"
+        "\n"
+        "Usage:\n"
+        "    mqtt_bench [-h host] [-p port] [-u user] [-P password]\n"
+        "               [-i client-id] [-t topic] [-c publishers] [-s subscribers]\n"
+        "               [-n count] [-q qos[,qos...]] [-S size[,size...]]\n"
+        "               [-w window] [-T timeout]\n"
+        "               [--tls] [--cafile file] [--cert file [--key file]]\n"
+        "               [--tls-version version] [--keepalive seconds] [--nodelay]\n"
+        "               [--send-buffer bytes] [--receive-buffer bytes]\n"
+        "               [--bind-address address]\n"
+        "\n"
+        "Options:\n"
+        "    -h, --host       : hostname of MQTT broker (default: localhost)\n"
+        "    -p, --port       : port of MQTT broker (default: 1883, 8883 with TLS)\n"
+        "    -u, --user       : name of the MQTT user (default: <unset>)\n"
+        "    -P, --password   : password of the MQTT user (default: <unset>)\n"
+        "    -i, --client-id  : prefix of MQTT client ids (default: <unset>)\n"
+        "    -t, --topic      : prefix of benchmark topics (default: bench)\n"
+        "    -c, --publishers : number of publisher connections (default: 1)\n"
+        "    -s, --subscribers: number of subscriber connections (default: 1)\n"
+        "    -n, --count      : messages sent by each publisher (default: 10000)\n"
+        "    -q, --qos        : comma separated QoS levels to test (default: 0)\n"
+        "    -S, --size       : comma separated payload sizes in bytes (default: 64)\n"
+        "    -w, --window     : maximum number of undelivered messages\n"
+        "                       per publisher (default: 1024)\n"
+        "    -T, --timeout    : time in milliseconds to wait for outstanding\n"
+        "                       messages after publishing (default: 5000)\n"
+        "    --tls            : connect via TLS, verifying the broker with the\n"
+        "                       system's CA certificates\n"
+        "    --cafile         : file of CA certificates; implies --tls\n"
+        "    --cert           : file of the client certificate chain; implies --tls\n"
+        "    --key            : file of the client key (default: --cert)\n"
+        "    --tls-version    : minimum TLS version tlsv1.2 or tlsv1.3\n"
+        "                       (default: tlsv1.2)\n"
+        "    --keepalive      : keepalive interval in seconds; 0 disables it\n"
+        "                       (default: 60)\n"
+        "    --nodelay        : disable Nagle's algorithm (TCP_NODELAY)\n"
+        "    --send-buffer    : size of the socket send buffer in bytes\n"
+        "                       (default: chosen by the kernel)\n"
+        "    --receive-buffer : size of the socket receive buffer in bytes; it is\n"
+        "                       set after connect, so the TCP window scale agreed in the\n"
+        "                       handshake limits large sizes (default: chosen by the kernel)\n"
+        "    --bind-address   : local address to connect from (default: <unset>)\n"
+        "\n"
+        "Example:\n"
+        "    mqtt_bench -c 4 -s 2 -q 0,1 -S 64,1024\n"
+    );
+}
+
+// parses a comma separated list of non-negative numbers;
+// returns the number of values or -1 on error
+static int parse_list(char const * text, long * values, int max_count)
+{
+    int count = 0;
+    char const * current = text;
+    while ('\0' != *current)
+    {
+        char * end = NULL;
+        long const value = strtol(current, &end, 10);
+        if ((end == current) || (value < 0) || (count >= max_count) ||
+            ((*end != ',') && (*end != '\0')))
+        {
+            return -1;
+        }
+
+        values[count++] = value;
+        current = (*end == ',') ? end + 1 : end;
+    }
+
+    return count;
+}
+
+static void context_init(struct context * ctx, int argc, char* argv[])
+{
+    mqtt_options_init(&ctx->mqtt);
+    ctx->topic = strdup("bench");
+    ctx->publishers = DEFAULT_PUBLISHERS;
+    ctx->subscribers = DEFAULT_SUBSCRIBERS;
+    ctx->count = DEFAULT_COUNT;
+    ctx->window = DEFAULT_WINDOW;
+    ctx->timeout = DEFAULT_TIMEOUT;
+    ctx->qos[0] = 0;
+    ctx->qos_count = 1;
+    ctx->sizes[0] = DEFAULT_SIZE;
+    ctx->size_count = 1;
+    ctx->cmd = COMMAND_BENCH;
+    ctx->exit_code = EXIT_SUCCESS;
+
+    optind = 0;
+    opterr = 0;
+
+    struct option const long_opts[] = {
+        {"client-id", required_argument, 0, 'i'},
+        {"host", required_argument, 0, 'h'},
+        {"port", required_argument, 0, 'p'},
+        {"user", required_argument, 0, 'u'},
+        {"password", required_argument, 0, 'P'},
+        {"topic", required_argument, 0, 't'},
+        {"publishers", required_argument, 0, 'c'},
+        {"subscribers", required_argument, 0, 's'},
+        {"count", required_argument, 0, 'n'},
+        {"qos", required_argument, 0, 'q'},
+        {"size", required_argument, 0, 'S'},
+        {"window", required_argument, 0, 'w'},
+        {"timeout", required_argument, 0, 'T'},
+        {"tls", no_argument, 0, MQTT_OPTION_TLS},
+        {"cafile", required_argument, 0, MQTT_OPTION_CAFILE},
+        {"cert", required_argument, 0, MQTT_OPTION_CERT},
+        {"key", required_argument, 0, MQTT_OPTION_KEY},
+        {"tls-version", required_argument, 0, MQTT_OPTION_TLS_VERSION},
+        {"keepalive", required_argument, 0, MQTT_OPTION_KEEPALIVE},
+        {"nodelay", no_argument, 0, MQTT_OPTION_NODELAY},
+        {"send-buffer", required_argument, 0, MQTT_OPTION_SEND_BUFFER},
+        {"receive-buffer", required_argument, 0, MQTT_OPTION_RECEIVE_BUFFER},
+        {"bind-address", required_argument, 0, MQTT_OPTION_BIND_ADDRESS},
+        {"help", no_argument, 0, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+
+    bool done = false;
+    while (!done)
+    {
+        long values[MAX_SIZES];
+        int value_count = 0;
+        int option_index = 0;
+        int const c = getopt_long(argc, argv, "i:h:p:u:P:t:c:s:n:q:S:w:T:H", long_opts, &option_index);
+
+        // qos is a list of levels here, which is parsed below
+        if (('q' != c) && (mqtt_options_parse(&ctx->mqtt, c, optarg)))
+        {
+            continue;
+        }
+
+        switch (c)
+        {
+            case -1:
+                done = true;
+                break;
+            case 't':
+                free(ctx->topic);
+                ctx->topic = strdup(optarg);
+                break;
+            case 'c':
+                ctx->publishers = atoi(optarg);
+                break;
+            case 's':
+                ctx->subscribers = atoi(optarg);
+                break;
+            case 'n':
+                ctx->count = (unsigned int) atoi(optarg);
+                break;
+            case 'q':
+                value_count = parse_list(optarg, values, MAX_QOS_LEVELS);
+                ctx->qos_count = (value_count > 0) ? value_count : 0;
+                for (int i = 0; i < ctx->qos_count; i++)
+                {
+                    ctx->qos[i] = (int) values[i];
+                    if (2 < ctx->qos[i])
+                    {
+                        ctx->qos_count = 0;
+                    }
+                }
+                break;
+            case 'S':
+                value_count = parse_list(optarg, values, MAX_SIZES);
+                ctx->size_count = (value_count > 0) ? value_count : 0;
+                for (int i = 0; i < ctx->size_count; i++)
+                {
+                    ctx->sizes[i] = (size_t) values[i];
+                }
+                break;
+            case 'w':
+                ctx->window = (unsigned int) atoi(optarg);
+                break;
+            case 'T':
+                ctx->timeout = (unsigned int) atoi(optarg);
+                break;
+            case 'H':
+                ctx->cmd = COMMAND_SHOW_HELP;
+                done = true;
+                break;
+            default:
+                fprintf(stderr, "error: unknown option\n");
+                ctx->exit_code = EXIT_FAILURE;
+                ctx->cmd = COMMAND_SHOW_HELP;
+                done = true;
+        }
+    }
+
+    if ((ctx->cmd == COMMAND_BENCH) && ((ctx->qos_count == 0) || (ctx->size_count == 0)))
+    {
+        fprintf(stderr, "error: invalid qos or size list\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_BENCH) && ((ctx->publishers <= 0) || (ctx->subscribers <= 0) ||
+        (ctx->count == 0) || (ctx->window == 0)))
+    {
+        fprintf(stderr, "error: invalid number of connections, messages or window\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_BENCH) && (!mqtt_options_validate(&ctx->mqtt)))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+}
+
+static int context_cleanup(struct context * ctx)
+{
+    mqtt_options_cleanup(&ctx->mqtt);
+    free(ctx->topic);
+
+    return ctx->exit_code;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+static void sleep_ms(unsigned int milliseconds)
+{
+    struct timespec const duration = {
+        .tv_sec = milliseconds / 1000,
+        .tv_nsec = (long) (milliseconds % 1000) * 1000000L
+    };
+    nanosleep(&duration, NULL);
+}
+
+static struct mosquitto * bench_connect(struct context * ctx, char const * role, int index, void * user_data)
+{
+    char id[256];
+    char const * client_id = NULL;
+    if (NULL != ctx->mqtt.id)
+    {
+        snprintf(id, sizeof(id), "%s-%s-%d", ctx->mqtt.id, role, index);
+        client_id = id;
+    }
+
+    struct mosquitto * mosq = mosquitto_new(client_id, true, user_data);
+    if (NULL == mosq)
+    {
+        fprintf(stderr, "error: failed to create mosquitto instance\n");
+        return NULL;
+    }
+
+    int rc = mosquitto_username_pw_set(mosq, ctx->mqtt.user, ctx->mqtt.password);
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to set user and password\n");
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+
+    mosquitto_max_inflight_messages_set(mosq, ctx->window);
+
+    if ((NULL != ctx->mqtt.tls_context) && (!mqtt_tls_apply(ctx->mqtt.tls_context, mosq)))
+    {
+        fprintf(stderr, "error: failed to set up TLS\n");
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+
+    mqtt_options_apply(&ctx->mqtt, mosq);
+    rc = mosquitto_connect_bind(mosq, ctx->mqtt.host, ctx->mqtt.port, ctx->mqtt.keepalive, ctx->mqtt.bind_address);
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to connect to MQTT broker\n");
+        mosquitto_destroy(mosq);
+        return NULL;
+    }
+    mqtt_options_tune_socket(&ctx->mqtt, mosq);
+
+    return mosq;
+}
+
+static void bench_disconnect(struct mosquitto * mosq)
+{
+    if (NULL != mosq)
+    {
+        mosquitto_disconnect(mosq);
+        mosquitto_loop_stop(mosq, false);
+        mosquitto_destroy(mosq);
+    }
+}
+
+static void publisher_on_disconnect(struct mosquitto * mosq, void * user_data, int rc)
+{
+    (void) mosq; // unused
+    struct publisher * publisher = user_data;
+
+    if (0 != rc)
+    {
+        pthread_mutex_lock(&publisher->lock);
+        publisher->failed = true;
+        pthread_cond_broadcast(&publisher->cond);
+        pthread_mutex_unlock(&publisher->lock);
+    }
+}
+
+static void publisher_on_publish(struct mosquitto * mosq, void * user_data, int mid)
+{
+    (void) mosq; // unused
+    (void) mid; // unused
+    struct publisher * publisher = user_data;
+
+    pthread_mutex_lock(&publisher->lock);
+    publisher->pending--;
+    pthread_cond_broadcast(&publisher->cond);
+    pthread_mutex_unlock(&publisher->lock);
+}
+
+// waits until at most limit messages are pending;
+// returns false if the connection failed
+static bool publisher_wait(struct publisher * publisher, unsigned int limit)
+{
+    pthread_mutex_lock(&publisher->lock);
+    while ((!publisher->failed) && (publisher->pending > limit))
+    {
+        pthread_cond_wait(&publisher->cond, &publisher->lock);
+    }
+    bool const result = !publisher->failed;
+    pthread_mutex_unlock(&publisher->lock);
+
+    return result;
+}
+
+static void * publisher_run(void * arg)
+{
+    struct publisher * publisher = arg;
+    struct context * ctx = publisher->ctx;
+
+    unsigned char * payload = calloc(1, publisher->size);
+    if (NULL == payload)
+    {
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < ctx->count; i++)
+    {
+        if (!publisher_wait(publisher, ctx->window - 1))
+        {
+            break;
+        }
+
+        struct bench_header const header = {
+            .timestamp = now_ns(),
+            .sequence = i,
+            .publisher = (uint32_t) publisher->index
+        };
+        memcpy(payload, &header, sizeof(header));
+
+        pthread_mutex_lock(&publisher->lock);
+        publisher->pending++;
+        pthread_mutex_unlock(&publisher->lock);
+
+        int const rc = mosquitto_publish(publisher->mosq, NULL, publisher->topic,
+            (int) publisher->size, payload, publisher->qos, false);
+        if (MOSQ_ERR_SUCCESS != rc)
+        {
+            pthread_mutex_lock(&publisher->lock);
+            publisher->pending--;
+            pthread_mutex_unlock(&publisher->lock);
+            break;
+        }
+
+        publisher->sent++;
+    }
+
+    free(payload);
+    return NULL;
+}
+
+static void subscriber_on_subscribe(struct mosquitto * mosq, void * user_data,
+    int mid, int qos_count, int const * granted_qos)
+{
+    (void) mosq; // unused
+    (void) mid; // unused
+    (void) qos_count; // unused
+    (void) granted_qos; // unused
+    struct subscriber * subscriber = user_data;
+
+    atomic_store(&subscriber->subscribed, true);
+}
+
+static void subscriber_on_message(struct mosquitto * mosq,
+    void * user_data, struct mosquitto_message const * message)
+{
+    (void) mosq; // unused
+    struct subscriber * subscriber = user_data;
+    uint64_t const received = now_ns();
+
+    struct bench_header header;
+    if ((message->payloadlen < (int) sizeof(header)))
+    {
+        subscriber->invalid++;
+        return;
+    }
+    memcpy(&header, message->payload, sizeof(header));
+    if ((header.publisher >= (uint32_t) subscriber->publishers) || (header.sequence >= subscriber->count))
+    {
+        subscriber->invalid++;
+        return;
+    }
+
+    size_t const bit = ((size_t) header.publisher * subscriber->count) + header.sequence;
+    unsigned char const mask = (unsigned char) (1U << (bit % 8));
+    if (0 != (subscriber->seen[bit / 8] & mask))
+    {
+        subscriber->duplicates++;
+        return;
+    }
+    subscriber->seen[bit / 8] |= mask;
+
+    if (header.sequence < subscriber->next_sequence[header.publisher])
+    {
+        subscriber->reordered++;
+    }
+    else
+    {
+        subscriber->next_sequence[header.publisher] = header.sequence + 1;
+    }
+
+    subscriber->latencies[subscriber->latency_count++] = received - header.timestamp;
+    atomic_store(&subscriber->last_received, received);
+    atomic_fetch_add(&subscriber->received, 1);
+}
+
+static int compare_u64(void const * lhs, void const * rhs)
+{
+    uint64_t const a = *((uint64_t const *) lhs);
+    uint64_t const b = *((uint64_t const *) rhs);
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+static double percentile_us(uint64_t const * sorted, size_t count, double percentile)
+{
+    if (0 == count)
+    {
+        return 0.0;
+    }
+
+    size_t index = (size_t) ((percentile / 100.0) * (double) count);
+    if (index >= count)
+    {
+        index = count - 1;
+    }
+
+    return (double) sorted[index] / 1000.0;
+}
+
+static unsigned int bench_received(struct subscriber * subscribers, int count)
+{
+    unsigned int received = 0;
+    for (int i = 0; i < count; i++)
+    {
+        received += atomic_load(&subscribers[i].received);
+    }
+
+    return received;
+}
+
+static bool bench_subscribers_init(struct context * ctx, struct subscriber * subscribers,
+    char const * filter, int qos)
+{
+    size_t const expected = (size_t) ctx->publishers * ctx->count;
+    for (int i = 0; i < ctx->subscribers; i++)
+    {
+        struct subscriber * subscriber = &subscribers[i];
+        subscriber->publishers = ctx->publishers;
+        subscriber->count = ctx->count;
+        atomic_init(&subscriber->subscribed, false);
+        atomic_init(&subscriber->received, 0);
+        atomic_init(&subscriber->last_received, 0);
+        subscriber->latencies = malloc(sizeof(uint64_t) * expected);
+        subscriber->seen = calloc(1, (expected + 7) / 8);
+        subscriber->next_sequence = calloc((size_t) ctx->publishers, sizeof(uint32_t));
+        if ((NULL == subscriber->latencies) || (NULL == subscriber->seen) || (NULL == subscriber->next_sequence))
+        {
+            fprintf(stderr, "error: failed to allocate memory\n");
+            return false;
+        }
+
+        subscriber->mosq = bench_connect(ctx, "sub", i, subscriber);
+        if (NULL == subscriber->mosq)
+        {
+            return false;
+        }
+
+        mosquitto_subscribe_callback_set(subscriber->mosq, &subscriber_on_subscribe);
+        mosquitto_message_callback_set(subscriber->mosq, &subscriber_on_message);
+        if ((MOSQ_ERR_SUCCESS != mosquitto_loop_start(subscriber->mosq)) ||
+            (MOSQ_ERR_SUCCESS != mosquitto_subscribe(subscriber->mosq, NULL, filter, qos)))
+        {
+            fprintf(stderr, "error: failed to subscribe\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void bench_run(struct context * ctx, int run, int qos, size_t size)
+{
+    char filter[256];
+    snprintf(filter, sizeof(filter), "%s/%d/%d/#", ctx->topic, (int) getpid(), run);
+
+    struct subscriber * subscribers = calloc((size_t) ctx->subscribers, sizeof(struct subscriber));
+    struct publisher * publishers = calloc((size_t) ctx->publishers, sizeof(struct publisher));
+    if ((NULL == subscribers) || (NULL == publishers))
+    {
+        fprintf(stderr, "error: failed to allocate memory\n");
+        ctx->exit_code = EXIT_FAILURE;
+        free(subscribers);
+        free(publishers);
+        return;
+    }
+
+    bool ok = bench_subscribers_init(ctx, subscribers, filter, qos);
+
+    for (int waited = 0; ok && (waited < SUBSCRIBE_TIMEOUT); waited += POLL_INTERVAL_MS)
+    {
+        int subscribed = 0;
+        for (int i = 0; i < ctx->subscribers; i++)
+        {
+            subscribed += atomic_load(&subscribers[i].subscribed) ? 1 : 0;
+        }
+        if (subscribed == ctx->subscribers)
+        {
+            break;
+        }
+        sleep_ms(POLL_INTERVAL_MS);
+    }
+
+    int started = 0;
+    for (int i = 0; ok && (i < ctx->publishers); i++)
+    {
+        struct publisher * publisher = &publishers[i];
+        publisher->ctx = ctx;
+        publisher->index = i;
+        publisher->qos = qos;
+        publisher->size = size;
+        pthread_mutex_init(&publisher->lock, NULL);
+        pthread_cond_init(&publisher->cond, NULL);
+        snprintf(publisher->topic, sizeof(publisher->topic), "%s/%d/%d/%d", ctx->topic, (int) getpid(), run, i);
+
+        publisher->mosq = bench_connect(ctx, "pub", i, publisher);
+        ok = (NULL != publisher->mosq);
+        if (ok)
+        {
+            mosquitto_disconnect_callback_set(publisher->mosq, &publisher_on_disconnect);
+            mosquitto_publish_callback_set(publisher->mosq, &publisher_on_publish);
+            ok = (MOSQ_ERR_SUCCESS == mosquitto_loop_start(publisher->mosq));
+        }
+    }
+
+    uint64_t const start = now_ns();
+    for (int i = 0; ok && (i < ctx->publishers); i++)
+    {
+        ok = (0 == pthread_create(&publishers[i].thread, NULL, &publisher_run, &publishers[i]));
+        started += ok ? 1 : 0;
+    }
+
+    unsigned int sent = 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(publishers[i].thread, NULL);
+        publisher_wait(&publishers[i], 0);
+        sent += publishers[i].sent;
+    }
+    uint64_t const published = now_ns();
+
+    // wait until every subscriber received all messages or no message
+    // arrived within the timeout
+    unsigned int const expected = sent * (unsigned int) ctx->subscribers;
+    unsigned int received = bench_received(subscribers, ctx->subscribers);
+    unsigned int idle = 0;
+    while (ok && (received < expected) && (idle < ctx->timeout))
+    {
+        sleep_ms(POLL_INTERVAL_MS);
+        unsigned int const current = bench_received(subscribers, ctx->subscribers);
+        idle = (current == received) ? idle + POLL_INTERVAL_MS : 0;
+        received = current;
+    }
+
+    for (int i = 0; i < ctx->publishers; i++)
+    {
+        bench_disconnect(publishers[i].mosq);
+        pthread_cond_destroy(&publishers[i].cond);
+        pthread_mutex_destroy(&publishers[i].lock);
+    }
+
+    uint64_t finished = published;
+    size_t latency_count = 0;
+    unsigned int reordered = 0;
+    unsigned int duplicates = 0;
+    for (int i = 0; i < ctx->subscribers; i++)
+    {
+        bench_disconnect(subscribers[i].mosq);
+        uint64_t const last = atomic_load(&subscribers[i].last_received);
+        finished = (last > finished) ? last : finished;
+        latency_count += subscribers[i].latency_count;
+        reordered += subscribers[i].reordered;
+        duplicates += subscribers[i].duplicates;
+    }
+
+    uint64_t * latencies = malloc(sizeof(uint64_t) * (latency_count + 1));
+    if (ok && (NULL != latencies))
+    {
+        size_t offset = 0;
+        for (int i = 0; i < ctx->subscribers; i++)
+        {
+            memcpy(&latencies[offset], subscribers[i].latencies, sizeof(uint64_t) * subscribers[i].latency_count);
+            offset += subscribers[i].latency_count;
+        }
+        qsort(latencies, latency_count, sizeof(uint64_t), &compare_u64);
+
+        double const seconds = (double) (finished - start) / 1e9;
+        double const rate = (seconds > 0.0) ? (double) received / seconds : 0.0;
+        printf("%3d %8zu %12.0f %10.2f %10.1f %10.1f %10.1f %10.1f %10u %10u %10u\n",
+            qos, size, rate, (rate * (double) size) / (1024.0 * 1024.0),
+            percentile_us(latencies, latency_count, 50.0),
+            percentile_us(latencies, latency_count, 99.0),
+            percentile_us(latencies, latency_count, 99.9),
+            (0 < latency_count) ? (double) latencies[latency_count - 1] / 1000.0 : 0.0,
+            expected - ((received < expected) ? received : expected), reordered, duplicates);
+        fflush(stdout);
+    }
+    else
+    {
+        fprintf(stderr, "error: benchmark failed (qos %d, size %zu)\n", qos, size);
+        ctx->exit_code = EXIT_FAILURE;
+    }
+
+    free(latencies);
+    for (int i = 0; i < ctx->subscribers; i++)
+    {
+        free(subscribers[i].latencies);
+        free(subscribers[i].seen);
+        free(subscribers[i].next_sequence);
+    }
+    free(subscribers);
+    free(publishers);
+}
+
+static void mqtt_bench(struct context * ctx)
+{
+    for (int i = 0; i < ctx->size_count; i++)
+    {
+        if (ctx->sizes[i] < sizeof(struct bench_header))
+        {
+            fprintf(stderr, "error: payload size must be at least %zu bytes\n", sizeof(struct bench_header));
+            ctx->exit_code = EXIT_FAILURE;
+            return;
+        }
+    }
+
+    int rc = mosquitto_lib_init();
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to init mosquitto library\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    printf("%3s %8s %12s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+        "qos", "size", "msgs/s", "MB/s", "p50 us", "p99 us", "p99.9 us", "max us",
+        "lost", "reordered", "duplicate");
+
+    int run = 0;
+    for (int q = 0; q < ctx->qos_count; q++)
+    {
+        for (int s = 0; s < ctx->size_count; s++)
+        {
+            bench_run(ctx, run++, ctx->qos[q], ctx->sizes[s]);
+        }
+    }
+
+    mosquitto_lib_cleanup();
+}
+
+int main(int argc, char* argv[])
+{
+    struct context ctx;
+    context_init(&ctx, argc, argv);
+
+    switch (ctx.cmd)
+    {
+        case COMMAND_BENCH:
+            mqtt_bench(&ctx);
+            break;
+        case COMMAND_SHOW_HELP:
+            // fall-through
+        default:
+            print_usage();
+            break;
+    }
+
+    int const exit_code = context_cleanup(&ctx);
+    return exit_code;
+}
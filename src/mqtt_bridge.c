@@ -0,0 +1,1283 @@
+#include "mqtt_options.h"
+#include "mqtt_connection.h"
+#include "spsc_ring.h"
+#include "slab.h"
+#include "mqtt_stats.h"
+#include "mqtt_capture.h"
+#include "mqtt_spool.h"
+
+#include <mosquitto.h>
+#include <mqtt_protocol.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_QUEUE_SIZE (1024)
+#define DEFAULT_WINDOW (1024)
+#define DEFAULT_FLUSH_TIMEOUT (10 * 1000)
+
+// interval to check, whether the uplink is back, while the queue is full
+#define WAIT_INTERVAL (100)
+
+#define DEFAULT_SPOOL_SYNC (256)
+
+// spilled messages are committed in batches, since each commit waits for the broker
+#define SPOOL_COMMIT_INTERVAL (1024)
+
+// codes of long options without a short option
+#define OPTION_SPOOL_SIZE   (512)
+#define OPTION_SPOOL_POLICY (513)
+#define OPTION_SPOOL_SYNC   (514)
+
+#define MQTT_CONNACK_SESSION_PRESENT (0x01)
+
+enum command {
+    COMMAND_BRIDGE,
+    COMMAND_SHOW_HELP
+};
+
+// replaces the prefix from of a topic by to
+struct mapping
+{
+    char * from;
+    size_t from_length;
+    char * to;
+    size_t to_length;
+};
+
+struct context
+{
+    struct mqtt_options source;
+    struct mqtt_options dest;
+    char * * topics;
+    int topic_count;
+    bool persistent;
+    struct mapping * mappings;
+    size_t mapping_count;
+    unsigned int queue_size;
+    unsigned int window;
+    unsigned int flush_timeout;
+    char * spool;
+    unsigned int spool_size;
+    enum mqtt_spool_policy spool_policy;
+    unsigned int spool_sync;
+    struct mqtt_stats stats;
+    enum command cmd;
+    int exit_code;
+};
+
+static void print_usage(void)
+{
+    printf(
+        "mqtt_bridge, (c) 2024 Falk Werner <github.com/falk-werner>\n"
+        "Forward messages from one MQTT broker to another\n"
+        "\n"
+        "Usage:\n"
+        "    mqtt_bridge [source options] [-c] [-m from=to ...]\n"
+        "             [-Q queue-size] [-w window] [-T timeout]\n"
+        "             [-S directory [--spool-size size] [--spool-policy policy]\n"
+        "             [--spool-sync messages]]\n"
+        "             -t topic [-t topic ...] -D [destination options]\n"
+        "\n"
+        "    Source and destination options:\n"
+        "             [-h host] [-p port] [-u user] [-P password] [-i client-id]\n"
+        "             [-q qos] [-V 311|5] [-b min-delay] [-B max-delay]\n"
+        "             [--tls] [--cafile file] [--cert file [--key file]]\n"
+        "             [--tls-version version] [--tls-session file]\n"
+        "             [--keepalive seconds] [--nodelay] [--send-buffer bytes]\n"
+        "             [--receive-buffer bytes] [--bind-address address]\n"
+        "             [--stats-interval interval] [--stats-file file]\n"
+        "\n"
+        "Options:\n"
+        "    -D, --dest     : broker options following -D apply to the destination\n"
+        "                     broker, options before to the source broker\n"
+        "    -h, --host     : hostname of MQTT broker (default: localhost)\n"
+        "    -p, --port     : port of MQTT broker (default: 1883, 8883 with TLS)\n"
+        "    -u, --user     : name of the MQTT user (default: <unset>)\n"
+        "    -p, --password : password of the MQTT user (default: <unset>)\n"
+        "    -i, --client-id: MQTT client id (default: <unset>)\n"
+        "    -q, --qos      : quality of service level 0, 1 or 2 to subscribe\n"
+        "                     with; messages are forwarded with the QoS they are\n"
+        "                     received with (default: 0)\n"
+        "    -V, --protocol-version: MQTT protocol version 311 or 5; with 5 on both\n"
+        "                     sides, message properties are forwarded (default: 311)\n"
+        "    -c, --persistent: keep the session on the source broker, so that\n"
+        "                     QoS 1 and 2 messages are queued while the bridge is\n"
+        "                     down (requires -i)\n"
+        "    -t, --topic    : MQTT topic to subscribe on the source broker\n"
+        "                     (required, may be repeated)\n"
+        "    -m, --map      : replace the topic prefix from by to, e.g.\n"
+        "                     sensors/=site1/sensors/; the first matching mapping\n"
+        "                     is applied (may be repeated, default: topics are kept)\n"
+        "    -Q, --queue-size: maximum number of messages queued in memory; while\n"
+        "                     the queue is full, no messages are read from the\n"
+        "                     source broker (default: 1024)\n"
+        "    -w, --window   : maximum number of messages waiting for delivery\n"
+        "                     to the destination broker (default: 1024)\n"
+        "    -S, --spool    : directory to spill messages to, while the queue is full\n"
+        "                     and the destination broker is unreachable; spilled\n"
+        "                     messages are forwarded in order with their properties,\n"
+        "                     once it is back\n"
+        "                     (default: <unset>)\n"
+        "    --spool-size   : maximum size of the spool in MiB; 0 is unlimited\n"
+        "                     (default: 0)\n"
+        "    --spool-policy : what to do when the spool is full (default: drop-oldest)\n"
+        "                     drop-oldest: discard the oldest spilled messages\n"
+        "                     drop-newest: discard the spilled message\n"
+        "    --spool-sync   : number of spilled messages to batch before they are\n"
+        "                     synced to disk; 0 syncs full segments only (default: 256)\n"
+        "    -T, --flush-timeout: time in milliseconds to wait for queued messages\n"
+        "                     on exit; 0 waits forever (default: 10000)\n"
+    );
+
+    // split, since ISO C limits the length of string literals
+    printf(
+        "    -b, --reconnect-min: initial delay in milliseconds before reconnecting\n"
+        "                     (default: 1000)\n"
+        "    -B, --reconnect-max: maximum delay in milliseconds before reconnecting\n"
+        "                     (default: 30000)\n"
+        "    --stats-interval: interval in milliseconds to print statistics to\n"
+        "                     stderr; 0 prints on SIGUSR1 only (default: 0)\n"
+        "    --stats-file   : file to write statistics to in Prometheus text\n"
+        "                     format, e.g. for node_exporter (default: <unset>)\n"
+        "\n"
+        "    TLS and socket options are described by mqtt_pub --help.\n"
+        "\n"
+        "Example:\n"
+        "    mqtt_bridge -h site -t 'sensors/#' -m sensors/=site1/sensors/ \\\n"
+        "        -S /var/spool/mqtt_bridge -D -h cloud --cafile ca.pem -q 1\n"
+    );
+}
+
+static bool mapping_add(struct context * ctx, char const * value)
+{
+    char const * const separator = strchr(value, '=');
+    if ((NULL == separator) || (separator == value))
+    {
+        return false;
+    }
+
+    struct mapping * const mappings = realloc(ctx->mappings, sizeof(struct mapping) * (ctx->mapping_count + 1));
+    if (NULL == mappings)
+    {
+        return false;
+    }
+    ctx->mappings = mappings;
+
+    struct mapping * mapping = &ctx->mappings[ctx->mapping_count];
+    mapping->from_length = (size_t) (separator - value);
+    mapping->from = strndup(value, mapping->from_length);
+    mapping->to = strdup(separator + 1);
+    mapping->to_length = strlen(mapping->to);
+    ctx->mapping_count++;
+
+    return true;
+}
+
+static void context_init(struct context * ctx, int argc, char* argv[])
+{
+    mqtt_options_init(&ctx->source);
+    mqtt_options_init(&ctx->dest);
+    ctx->topics = NULL;
+    ctx->topic_count = 0;
+    ctx->persistent = false;
+    ctx->mappings = NULL;
+    ctx->mapping_count = 0;
+    ctx->queue_size = DEFAULT_QUEUE_SIZE;
+    ctx->window = DEFAULT_WINDOW;
+    ctx->flush_timeout = DEFAULT_FLUSH_TIMEOUT;
+    ctx->spool = NULL;
+    ctx->spool_size = 0;
+    ctx->spool_policy = MQTT_SPOOL_DROP_OLDEST;
+    ctx->spool_sync = DEFAULT_SPOOL_SYNC;
+    mqtt_stats_init(&ctx->stats);
+    ctx->cmd = COMMAND_BRIDGE;
+    ctx->exit_code = EXIT_SUCCESS;
+
+    optind = 0;
+    opterr = 0;
+
+    struct option const long_opts[] = {
+        MQTT_OPTIONS_LONG,
+        {"dest", no_argument, 0, 'D'},
+        {"persistent", no_argument, 0, 'c'},
+        {"topic", required_argument, 0, 't'},
+        {"map", required_argument, 0, 'm'},
+        {"queue-size", required_argument, 0, 'Q'},
+        {"window", required_argument, 0, 'w'},
+        {"spool", required_argument, 0, 'S'},
+        {"spool-size", required_argument, 0, OPTION_SPOOL_SIZE},
+        {"spool-policy", required_argument, 0, OPTION_SPOOL_POLICY},
+        {"spool-sync", required_argument, 0, OPTION_SPOOL_SYNC},
+        {"flush-timeout", required_argument, 0, 'T'},
+        {"help", no_argument, 0, 'H'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // the shared broker options are parsed into the source options until -D
+    struct mqtt_options * options = &ctx->source;
+    bool done = false;
+    while (!done)
+    {
+        int option_index = 0;
+        int const c = getopt_long(argc, argv, MQTT_OPTIONS_SHORT "Dct:m:Q:w:S:T:H", long_opts, &option_index);
+        if (mqtt_options_parse(options, c, optarg))
+        {
+            continue;
+        }
+
+        switch (c)
+        {
+            case -1:
+                done = true;
+                break;
+            case 'D':
+                options = &ctx->dest;
+                break;
+            case 'c':
+                ctx->persistent = true;
+                ctx->source.clean_session = false;
+                break;
+            case 't':
+                {
+                    char * * const topics = realloc(ctx->topics, sizeof(char *) * (size_t) (ctx->topic_count + 1));
+                    if (NULL != topics)
+                    {
+                        ctx->topics = topics;
+                        ctx->topics[ctx->topic_count++] = strdup(optarg);
+                    }
+                }
+                break;
+            case 'm':
+                if (!mapping_add(ctx, optarg))
+                {
+                    fprintf(stderr, "error: invalid mapping\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
+                break;
+            case 'Q':
+                ctx->queue_size = (unsigned int) atoi(optarg);
+                break;
+            case 'w':
+                ctx->window = (unsigned int) atoi(optarg);
+                break;
+            case 'S':
+                free(ctx->spool);
+                ctx->spool = strdup(optarg);
+                break;
+            case OPTION_SPOOL_SIZE:
+                ctx->spool_size = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_SPOOL_POLICY:
+                if (!mqtt_spool_policy_parse(optarg, &ctx->spool_policy))
+                {
+                    fprintf(stderr, "error: unknown spool policy\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
+                break;
+            case OPTION_SPOOL_SYNC:
+                ctx->spool_sync = (unsigned int) atoi(optarg);
+                break;
+            case 'T':
+                ctx->flush_timeout = (unsigned int) atoi(optarg);
+                break;
+            case 'H':
+                ctx->cmd = COMMAND_SHOW_HELP;
+                done = true;
+                break;
+            default:
+                fprintf(stderr, "error: unknown option\n");
+                ctx->exit_code = EXIT_FAILURE;
+                ctx->cmd = COMMAND_SHOW_HELP;
+                done = true;
+        }
+    }
+
+    if ((ctx->cmd == COMMAND_BRIDGE) && (0 == ctx->topic_count))
+    {
+        fprintf(stderr, "error: missing topic\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_BRIDGE) && (options != &ctx->dest))
+    {
+        fprintf(stderr, "error: missing destination (-D)\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_BRIDGE) && ((0 == ctx->queue_size) || (0 == ctx->window)))
+    {
+        fprintf(stderr, "error: invalid queue size or window\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_BRIDGE) &&
+        ((!mqtt_options_validate(&ctx->source)) || (!mqtt_options_validate(&ctx->dest))))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // keep the whole window in flight, so that QoS 1 and 2 messages
+    // are pipelined instead of waiting for each acknowledgement
+    if (0 == ctx->dest.max_inflight)
+    {
+        ctx->dest.max_inflight = ctx->window;
+    }
+}
+
+static int context_cleanup(struct context * ctx)
+{
+    mqtt_options_cleanup(&ctx->source);
+    mqtt_options_cleanup(&ctx->dest);
+    for (int i = 0; i < ctx->topic_count; i++)
+    {
+        free(ctx->topics[i]);
+    }
+    free(ctx->topics);
+    for (size_t i = 0; i < ctx->mapping_count; i++)
+    {
+        free(ctx->mappings[i].from);
+        free(ctx->mappings[i].to);
+    }
+    free(ctx->mappings);
+    free(ctx->spool);
+
+    return ctx->exit_code;
+}
+
+// copy of a received message, which is released by libmosquitto
+// when the message callback returns
+struct queued_message
+{
+    uint64_t received;
+    int qos;
+    bool retain;
+    size_t payloadlen;
+    void * payload;
+    mosquitto_property * properties;
+    char topic[];
+};
+
+// messages are received on the source connection's loop thread and
+// forwarded by a thread of their own, so that a slow or unreachable
+// destination does not stall the source connection until the queue is full
+struct bridge
+{
+    struct context * ctx;
+    struct mqtt_connection * source;
+    struct mqtt_connection * dest;
+    struct spsc_ring ring;
+    struct slab slab;
+    struct mqtt_spool * spool;
+
+    // set once the source broker acknowledged the subscription; a session
+    // kept by the broker still holds it after a reconnect
+    bool subscribed;
+
+    // once spilling, all messages are spilled until the spool is drained,
+    // so that messages keep their order; changed with lock held
+    pthread_mutex_t lock;
+    atomic_bool spilling;
+
+    // set on shutdown; once aborted, the destination is stopped and
+    // remaining messages are spilled or lost
+    atomic_bool closing;
+    atomic_bool aborted;
+    atomic_ulong lost;
+
+    // QoS 0 messages lost by the destination, which are forwarded again
+    // from the spool
+    atomic_ulong resent;
+
+    // topic buffer of the forwarding thread
+    char * topic;
+    size_t topic_capacity;
+
+    // buffer of encoded properties of spilled messages; used with lock held
+    unsigned char * spilled;
+    size_t spilled_capacity;
+
+    pthread_t thread;
+    sem_t done;
+};
+
+static struct queued_message * queued_message_create(struct slab * slab,
+    struct mosquitto_message const * message, mosquitto_property const * properties)
+{
+    size_t const topic_length = strlen(message->topic) + 1;
+    size_t const payload_length = (0 < message->payloadlen) ? (size_t) message->payloadlen : 0;
+
+    // topic and payload are stored with the message in a single allocation
+    struct queued_message * queued = slab_alloc(slab, sizeof(struct queued_message) + topic_length + payload_length);
+    if (NULL != queued)
+    {
+        queued->received = mqtt_capture_now();
+        queued->qos = message->qos;
+        queued->retain = message->retain;
+        queued->payloadlen = payload_length;
+        queued->payload = &queued->topic[topic_length];
+        memcpy(queued->topic, message->topic, topic_length);
+        memcpy(queued->payload, message->payload, payload_length);
+
+        // properties are only copied, if there are any, i.e. with MQTT 5
+        queued->properties = NULL;
+        if (NULL != properties)
+        {
+            mosquitto_property_copy_all(&queued->properties, properties);
+        }
+    }
+
+    return queued;
+}
+
+static void queued_message_release(struct slab * slab, struct queued_message * queued)
+{
+    if (NULL != queued)
+    {
+        mosquitto_property_free_all(&queued->properties);
+        slab_free(slab, queued);
+    }
+}
+
+static bool bridge_put(struct bridge * bridge, size_t * offset, void const * data, size_t length)
+{
+    if (bridge->spilled_capacity < (*offset + length))
+    {
+        size_t capacity = (0 < bridge->spilled_capacity) ? bridge->spilled_capacity : 256;
+        while (capacity < (*offset + length))
+        {
+            capacity *= 2;
+        }
+
+        unsigned char * const buffer = realloc(bridge->spilled, capacity);
+        if (NULL == buffer)
+        {
+            return false;
+        }
+        bridge->spilled = buffer;
+        bridge->spilled_capacity = capacity;
+    }
+
+    memcpy(&bridge->spilled[*offset], data, length);
+    *offset += length;
+    return true;
+}
+
+static bool bridge_put_fixed(struct bridge * bridge, size_t * offset, uint32_t value, size_t size)
+{
+    unsigned char buffer[4];
+    for (size_t i = 0; i < size; i++)
+    {
+        buffer[i] = (unsigned char) (value >> (8 * i));
+    }
+
+    return bridge_put(bridge, offset, buffer, size);
+}
+
+// strings are stored with their terminator, so that they are used in place
+static bool bridge_put_string(struct bridge * bridge, size_t * offset, char const * value)
+{
+    size_t const length = strlen(value) + 1;
+    return (bridge_put_fixed(bridge, offset, (uint32_t) length, 4)) && (bridge_put(bridge, offset, value, length));
+}
+
+// encodes the properties of a spilled message as a sequence of the identifier
+// byte and its value: a byte, a u32 or strings and binary data as u32 length
+// followed by their bytes, little endian; a user property is a pair of strings;
+// subscription identifiers and topic aliases belong to the source connection
+// and are not kept; returns the length of the encoded properties in spilled
+// or 0 for none; called with lock held
+static size_t bridge_encode_properties(struct bridge * bridge, mosquitto_property const * properties)
+{
+    size_t length = 0;
+    bool result = true;
+    for (mosquitto_property const * property = properties; (result) && (NULL != property);
+        property = mosquitto_property_next(property))
+    {
+        int const identifier = mosquitto_property_identifier(property);
+        unsigned char const id = (unsigned char) identifier;
+        switch (identifier)
+        {
+            case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+                {
+                    uint8_t value = 0;
+                    result = (NULL != mosquitto_property_read_byte(property, identifier, &value, false)) &&
+                        (bridge_put(bridge, &length, &id, 1)) && (bridge_put(bridge, &length, &value, 1));
+                }
+                break;
+            case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+                {
+                    uint32_t value = 0;
+                    result = (NULL != mosquitto_property_read_int32(property, identifier, &value, false)) &&
+                        (bridge_put(bridge, &length, &id, 1)) && (bridge_put_fixed(bridge, &length, value, 4));
+                }
+                break;
+            case MQTT_PROP_CONTENT_TYPE:
+                // fall-through
+            case MQTT_PROP_RESPONSE_TOPIC:
+                {
+                    char * value = NULL;
+                    result = (NULL != mosquitto_property_read_string(property, identifier, &value, false)) &&
+                        (bridge_put(bridge, &length, &id, 1)) && (bridge_put_string(bridge, &length, value));
+                    free(value);
+                }
+                break;
+            case MQTT_PROP_CORRELATION_DATA:
+                {
+                    void * value = NULL;
+                    uint16_t size = 0;
+                    result = (NULL != mosquitto_property_read_binary(property, identifier, &value, &size, false)) &&
+                        (bridge_put(bridge, &length, &id, 1)) && (bridge_put_fixed(bridge, &length, size, 4)) &&
+                        (bridge_put(bridge, &length, value, size));
+                    free(value);
+                }
+                break;
+            case MQTT_PROP_USER_PROPERTY:
+                {
+                    char * name = NULL;
+                    char * value = NULL;
+                    result = (NULL != mosquitto_property_read_string_pair(property, identifier, &name, &value, false)) &&
+                        (bridge_put(bridge, &length, &id, 1)) && (bridge_put_string(bridge, &length, name)) &&
+                        (bridge_put_string(bridge, &length, value));
+                    free(name);
+                    free(value);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (!result)
+    {
+        fprintf(stderr, "warning: failed to spill message properties\n");
+        length = 0;
+    }
+
+    return length;
+}
+
+static bool bridge_get_fixed(unsigned char const * data, size_t length, size_t * offset, size_t size, uint32_t * value)
+{
+    if ((length - *offset) < size)
+    {
+        return false;
+    }
+
+    *value = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        *value |= (uint32_t) data[*offset + i] << (8 * i);
+    }
+    *offset += size;
+    return true;
+}
+
+static bool bridge_get_binary(unsigned char const * data, size_t length, size_t * offset,
+    void const * * value, uint32_t * size)
+{
+    if ((!bridge_get_fixed(data, length, offset, 4, size)) || ((length - *offset) < *size))
+    {
+        return false;
+    }
+
+    *value = &data[*offset];
+    *offset += *size;
+    return true;
+}
+
+static bool bridge_get_string(unsigned char const * data, size_t length, size_t * offset, char const * * value)
+{
+    void const * string = NULL;
+    uint32_t size = 0;
+    bool const result = (bridge_get_binary(data, length, offset, &string, &size)) &&
+        (0 < size) && ('\0' == ((char const *) string)[size - 1]);
+    *value = string;
+    return result;
+}
+
+// decodes the properties encoded by bridge_encode_properties; the message
+// expiry interval is reduced by the age of the message in seconds, i.e. the
+// time it was spilled; returns false, if the properties are corrupt
+static bool bridge_decode_properties(unsigned char const * data, size_t length, uint32_t age,
+    mosquitto_property * * properties, bool * expired)
+{
+    *expired = false;
+    size_t offset = 0;
+    bool result = true;
+    while ((result) && (offset < length))
+    {
+        int const identifier = data[offset++];
+        switch (identifier)
+        {
+            case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+                {
+                    uint32_t value = 0;
+                    result = (bridge_get_fixed(data, length, &offset, 1, &value)) &&
+                        (MOSQ_ERR_SUCCESS == mosquitto_property_add_byte(properties, identifier, (uint8_t) value));
+                }
+                break;
+            case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+                {
+                    uint32_t value = 0;
+                    result = bridge_get_fixed(data, length, &offset, 4, &value);
+                    *expired = (result) && (0 < age) && (value <= age);
+                    result = (result) && ((*expired) ||
+                        (MOSQ_ERR_SUCCESS == mosquitto_property_add_int32(properties, identifier, value - age)));
+                }
+                break;
+            case MQTT_PROP_CONTENT_TYPE:
+                // fall-through
+            case MQTT_PROP_RESPONSE_TOPIC:
+                {
+                    char const * value = NULL;
+                    result = (bridge_get_string(data, length, &offset, &value)) &&
+                        (MOSQ_ERR_SUCCESS == mosquitto_property_add_string(properties, identifier, value));
+                }
+                break;
+            case MQTT_PROP_CORRELATION_DATA:
+                {
+                    void const * value = NULL;
+                    uint32_t size = 0;
+                    result = (bridge_get_binary(data, length, &offset, &value, &size)) && (size <= UINT16_MAX) &&
+                        (MOSQ_ERR_SUCCESS == mosquitto_property_add_binary(properties, identifier, value, (uint16_t) size));
+                }
+                break;
+            case MQTT_PROP_USER_PROPERTY:
+                {
+                    char const * name = NULL;
+                    char const * value = NULL;
+                    result = (bridge_get_string(data, length, &offset, &name)) &&
+                        (bridge_get_string(data, length, &offset, &value)) &&
+                        (MOSQ_ERR_SUCCESS == mosquitto_property_add_string_pair(properties, identifier, name, value));
+                }
+                break;
+            default:
+                result = false;
+                break;
+        }
+    }
+
+    return result;
+}
+
+// spills a message to disk; called with lock held
+static void bridge_spill(struct bridge * bridge, char const * topic, void const * payload, size_t length,
+    int qos, bool retain, mosquitto_property const * properties)
+{
+    size_t const properties_length = bridge_encode_properties(bridge, properties);
+    struct mqtt_capture_message const message = {
+        .timestamp = mqtt_capture_now(),
+        .topic = topic,
+        .payload = payload,
+        .payloadlen = length,
+        .qos = qos,
+        .retain = retain,
+        .properties = (0 < properties_length) ? bridge->spilled : NULL,
+        .propertieslen = properties_length
+    };
+
+    if (!mqtt_spool_add(bridge->spool, &message))
+    {
+        fprintf(stderr, "warning: failed to spill message\n");
+        atomic_fetch_add(&bridge->lost, 1);
+    }
+}
+
+// spills the message, if spilling; returns false otherwise
+static bool bridge_spill_if_spilling(struct bridge * bridge, struct mosquitto_message const * message,
+    mosquitto_property const * properties)
+{
+    if (!atomic_load(&bridge->spilling))
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&bridge->lock);
+    bool const spilling = atomic_load(&bridge->spilling);
+    if (spilling)
+    {
+        bridge_spill(bridge, message->topic, message->payload,
+            (0 < message->payloadlen) ? (size_t) message->payloadlen : 0, message->qos, message->retain, properties);
+    }
+    pthread_mutex_unlock(&bridge->lock);
+
+    return spilling;
+}
+
+static void bridge_subscribe(struct context * ctx, struct mosquitto * mosq)
+{
+    // with MQTT 5, topics subscribed again, e.g. of a session kept since
+    // the last run, do not forward their retained messages again
+    int const options = (MQTT_PROTOCOL_V5 == ctx->source.protocol_version) ? MQTT_SUB_OPT_SEND_RETAIN_NEW : 0;
+
+    // all topics are subscribed with a single SUBSCRIBE packet
+    int const rc = mosquitto_subscribe_multiple(mosq, NULL,
+        ctx->topic_count, ctx->topics, ctx->source.qos, options, NULL);
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to subscribe\n");
+        ctx->exit_code = EXIT_FAILURE;
+    }
+}
+
+static void bridge_on_connect(struct mqtt_connection * connection, void * user_data, int rc, int flags)
+{
+    struct bridge * bridge = user_data;
+
+    // a session kept since the last subscription holds the topics, so they
+    // are only subscribed on the first connect, e.g. to add topics to a
+    // session of the last run, or if the broker did not keep the session
+    bool const session_present = (0 != (flags & MQTT_CONNACK_SESSION_PRESENT));
+    if ((0 == rc) && ((!session_present) || (!bridge->subscribed)))
+    {
+        bridge_subscribe(bridge->ctx, mqtt_connection_mosq(connection));
+    }
+}
+
+static void bridge_on_subscribe(struct mqtt_connection * connection, void * user_data,
+    int mid, int qos_count, int const * granted_qos)
+{
+    (void) connection; // unused
+    (void) mid; // unused
+    (void) qos_count; // unused
+    (void) granted_qos; // unused
+    struct bridge * bridge = user_data;
+
+    bridge->subscribed = true;
+}
+
+// called on the source connection's loop thread; while the queue is full,
+// it waits, so that the source broker holds back further messages
+static void bridge_on_message(struct mqtt_connection * connection,
+    void * user_data, struct mosquitto_message const * message, mosquitto_property const * properties)
+{
+    (void) connection; // unused
+    struct bridge * bridge = user_data;
+
+    if (bridge_spill_if_spilling(bridge, message, properties))
+    {
+        return;
+    }
+
+    struct queued_message * queued = queued_message_create(&bridge->slab, message, properties);
+    if (NULL == queued)
+    {
+        fprintf(stderr, "warning: failed to queue message\n");
+        atomic_fetch_add(&bridge->lost, 1);
+        return;
+    }
+
+    while (!spsc_ring_push_timeout(&bridge->ring, queued, WAIT_INTERVAL))
+    {
+        bool const closing = atomic_load(&bridge->closing);
+        if ((NULL != bridge->spool) && ((closing) || (!mqtt_connection_connected(bridge->dest))))
+        {
+            // queued messages are older than spilled ones, so they are
+            // forwarded first, before the spool is drained
+            pthread_mutex_lock(&bridge->lock);
+            atomic_store(&bridge->spilling, true);
+            bridge_spill(bridge, queued->topic, queued->payload, queued->payloadlen, queued->qos, queued->retain,
+                queued->properties);
+            pthread_mutex_unlock(&bridge->lock);
+            queued_message_release(&bridge->slab, queued);
+            return;
+        }
+        else if (closing)
+        {
+            atomic_fetch_add(&bridge->lost, 1);
+            queued_message_release(&bridge->slab, queued);
+            return;
+        }
+    }
+}
+
+// returns the topic with the first matching mapping applied;
+// the result is valid until the next call
+static char const * bridge_map_topic(struct bridge * bridge, char const * topic)
+{
+    struct context const * ctx = bridge->ctx;
+    for (size_t i = 0; i < ctx->mapping_count; i++)
+    {
+        struct mapping const * mapping = &ctx->mappings[i];
+        if (0 == strncmp(topic, mapping->from, mapping->from_length))
+        {
+            size_t const length = mapping->to_length + strlen(&topic[mapping->from_length]) + 1;
+            if (bridge->topic_capacity < length)
+            {
+                char * const buffer = realloc(bridge->topic, length);
+                if (NULL == buffer)
+                {
+                    return NULL;
+                }
+                bridge->topic = buffer;
+                bridge->topic_capacity = length;
+            }
+
+            memcpy(bridge->topic, mapping->to, mapping->to_length);
+            strcpy(&bridge->topic[mapping->to_length], &topic[mapping->from_length]);
+            return bridge->topic;
+        }
+    }
+
+    return topic;
+}
+
+// publishes a message to the destination; waits, while it is unreachable;
+// returns false, if the destination was refused or stopped
+static bool bridge_forward(struct bridge * bridge, char const * topic, void const * payload, size_t length,
+    int qos, bool retain, mosquitto_property const * properties)
+{
+    struct context * ctx = bridge->ctx;
+    uint64_t const start = mqtt_stats_now();
+
+    // the window is only left by a refused or stopped connection
+    if (!mqtt_connection_wait(bridge->dest, ctx->window - 1, 0))
+    {
+        return false;
+    }
+
+    bool const both_v5 = (MQTT_PROTOCOL_V5 == ctx->source.protocol_version) &&
+        (MQTT_PROTOCOL_V5 == ctx->dest.protocol_version);
+    char const * const mapped = bridge_map_topic(bridge, topic);
+    bool const result = (NULL != mapped) && (mqtt_connection_publish_v5(bridge->dest, mapped, payload, length,
+        qos, retain, both_v5 ? properties : NULL, 0));
+    if (result)
+    {
+        mqtt_stats_record(&ctx->stats, length, start);
+    }
+    else
+    {
+        atomic_fetch_add(&ctx->stats.errors, 1);
+    }
+
+    // a message, which is rejected by the broker, is skipped
+    return (result) || (!atomic_load(&bridge->aborted));
+}
+
+// waits until the destination confirmed the forwarded spilled messages, which
+// are committed then; messages are read again, if some of them may be lost;
+// returns false, if the destination was refused or stopped
+static bool bridge_confirm(struct bridge * bridge, unsigned int * lost)
+{
+    // the wait is ended by stopping the destination after the flush timeout
+    if (!mqtt_connection_wait(bridge->dest, 0, 0))
+    {
+        mqtt_spool_rewind(bridge->spool);
+        return false;
+    }
+
+    unsigned int const current = mqtt_connection_lost(bridge->dest);
+    if (current == *lost)
+    {
+        mqtt_spool_commit(bridge->spool);
+    }
+    else
+    {
+        atomic_fetch_add(&bridge->resent, current - *lost);
+        mqtt_spool_rewind(bridge->spool);
+        *lost = current;
+    }
+
+    return true;
+}
+
+// returns the seconds since a message was spilled
+static uint32_t bridge_spill_age(struct mqtt_capture_message const * message)
+{
+    uint64_t const now = mqtt_capture_now();
+    uint64_t const age = (message->timestamp < now) ? ((now - message->timestamp) / 1000000000ULL) : 0;
+    return (age < UINT32_MAX) ? (uint32_t) age : UINT32_MAX;
+}
+
+// forwards spilled messages, until the spool is drained; returns false,
+// if forwarding failed and the remaining messages are kept on disk
+static bool bridge_drain(struct bridge * bridge)
+{
+    unsigned int lost = mqtt_connection_lost(bridge->dest);
+    unsigned int unconfirmed = 0;
+    bool forwarded = true;
+    struct mqtt_capture_message message;
+    while ((forwarded) && (!atomic_load(&bridge->closing)) && (mqtt_spool_next(bridge->spool, &message)))
+    {
+        // messages, whose expiry interval passed in the spool, are discarded
+        mosquitto_property * properties = NULL;
+        bool expired = false;
+        if ((0 < message.propertieslen) && (!bridge_decode_properties(message.properties, message.propertieslen,
+            bridge_spill_age(&message), &properties, &expired)))
+        {
+            fprintf(stderr, "warning: failed to read properties of spilled message\n");
+            mosquitto_property_free_all(&properties);
+        }
+
+        forwarded = (expired) || (bridge_forward(bridge, message.topic, message.payload, message.payloadlen,
+            message.qos, message.retain, properties));
+        mosquitto_property_free_all(&properties);
+        unconfirmed++;
+        if ((forwarded) && (SPOOL_COMMIT_INTERVAL <= unconfirmed))
+        {
+            forwarded = bridge_confirm(bridge, &lost);
+            unconfirmed = 0;
+        }
+    }
+
+    if (!forwarded)
+    {
+        mqtt_spool_rewind(bridge->spool);
+        return false;
+    }
+    if ((0 < unconfirmed) && (!bridge_confirm(bridge, &lost)))
+    {
+        return false;
+    }
+
+    // the receiving thread may have spilled another message in between
+    pthread_mutex_lock(&bridge->lock);
+    if (mqtt_spool_empty(bridge->spool))
+    {
+        atomic_store(&bridge->spilling, false);
+    }
+    pthread_mutex_unlock(&bridge->lock);
+
+    return true;
+}
+
+static void bridge_fail(struct bridge * bridge)
+{
+    fprintf(stderr, "error: failed to forward messages to destination broker\n");
+    bridge->ctx->exit_code = EXIT_FAILURE;
+
+    // the signal is received by the main thread, which shuts down
+    kill(getpid(), SIGTERM);
+}
+
+static void * bridge_run(void * arg)
+{
+    struct bridge * bridge = arg;
+
+    bool failed = false;
+    bool done = false;
+    while (!done)
+    {
+        // spilled messages are drained, once the queue is empty
+        bool const spilling = (NULL != bridge->spool) && (atomic_load(&bridge->spilling));
+        bool timed_out = false;
+        struct queued_message * queued = spsc_ring_pop_timeout(&bridge->ring,
+            spilling ? 0 : WAIT_INTERVAL, &timed_out);
+        if (NULL != queued)
+        {
+            if ((failed) || (!bridge_forward(bridge, queued->topic, queued->payload, queued->payloadlen,
+                queued->qos, queued->retain, queued->properties)))
+            {
+                // a refused connection is fatal, while a stopped one is expected
+                if ((!failed) && (!atomic_load(&bridge->aborted)))
+                {
+                    failed = true;
+                    bridge_fail(bridge);
+                }
+
+                if (NULL != bridge->spool)
+                {
+                    pthread_mutex_lock(&bridge->lock);
+                    bridge_spill(bridge, queued->topic, queued->payload, queued->payloadlen, queued->qos,
+                        queued->retain, queued->properties);
+                    pthread_mutex_unlock(&bridge->lock);
+                }
+                else
+                {
+                    atomic_fetch_add(&bridge->lost, 1);
+                }
+            }
+            queued_message_release(&bridge->slab, queued);
+        }
+        else if ((timed_out) && (spilling) && (!failed) && (!bridge_drain(bridge)))
+        {
+            failed = true;
+            if (!atomic_load(&bridge->aborted))
+            {
+                bridge_fail(bridge);
+            }
+        }
+        else
+        {
+            done = !timed_out;
+        }
+    }
+
+    sem_post(&bridge->done);
+    return NULL;
+}
+
+static bool bridge_init(struct bridge * bridge, struct context * ctx)
+{
+    bridge->ctx = ctx;
+    bridge->source = NULL;
+    bridge->dest = NULL;
+    bridge->spool = NULL;
+    bridge->subscribed = false;
+    bridge->topic = NULL;
+    bridge->topic_capacity = 0;
+    bridge->spilled = NULL;
+    bridge->spilled_capacity = 0;
+    atomic_init(&bridge->spilling, false);
+    atomic_init(&bridge->closing, false);
+    atomic_init(&bridge->aborted, false);
+    atomic_init(&bridge->lost, 0);
+    atomic_init(&bridge->resent, 0);
+    if (!spsc_ring_init(&bridge->ring, ctx->queue_size, SPSC_RING_BLOCK))
+    {
+        fprintf(stderr, "error: failed to allocate queue\n");
+        return false;
+    }
+
+    // messages left by a previous run are forwarded before new ones
+    if (NULL != ctx->spool)
+    {
+        bridge->spool = mqtt_spool_open(ctx->spool, (unsigned long long) ctx->spool_size * 1024 * 1024,
+            ctx->spool_policy, ctx->spool_sync);
+        if (NULL == bridge->spool)
+        {
+            spsc_ring_cleanup(&bridge->ring);
+            return false;
+        }
+        atomic_store(&bridge->spilling, !mqtt_spool_empty(bridge->spool));
+    }
+
+    slab_init(&bridge->slab, 0);
+    pthread_mutex_init(&bridge->lock, NULL);
+    sem_init(&bridge->done, 0, 0);
+
+    return true;
+}
+
+static void bridge_cleanup(struct bridge * bridge)
+{
+    sem_destroy(&bridge->done);
+    pthread_mutex_destroy(&bridge->lock);
+    slab_cleanup(&bridge->slab);
+    mqtt_spool_close(bridge->spool);
+    spsc_ring_cleanup(&bridge->ring);
+    free(bridge->topic);
+    free(bridge->spilled);
+}
+
+// waits for the forwarding thread to finish; returns false on timeout
+static bool bridge_wait_done(struct bridge * bridge, unsigned int timeout_ms)
+{
+    if (0 == timeout_ms)
+    {
+        while ((0 != sem_wait(&bridge->done)) && (EINTR == errno)) { }
+        return true;
+    }
+
+    // sem_timedwait only accepts a deadline of the realtime clock
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (1000000000L <= deadline.tv_nsec)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc;
+    while ((0 != (rc = sem_timedwait(&bridge->done, &deadline))) && (EINTR == errno)) { }
+    return (0 == rc);
+}
+
+// counters maintained by the connections are collected on each report
+static void mqtt_bridge_collect(void * user_data, struct mqtt_stats * stats)
+{
+    struct bridge * bridge = user_data;
+
+    unsigned long reconnects = mqtt_connection_disconnects(bridge->source) +
+        mqtt_connection_disconnects(bridge->dest);
+    size_t const tail = atomic_load(&bridge->ring.tail);
+    size_t const head = atomic_load(&bridge->ring.head);
+
+    atomic_store(&stats->reconnects, reconnects);
+    atomic_store(&stats->queue_depth, (tail > head) ? (tail - head) : 0);
+    unsigned long const evicted = (NULL != bridge->spool) ? mqtt_spool_dropped(bridge->spool) : 0;
+    atomic_store(&stats->dropped, atomic_load(&bridge->lost) + mqtt_connection_lost(bridge->dest) + evicted -
+        atomic_load(&bridge->resent));
+}
+
+// an unreachable broker is retried by the loop,
+// other errors, e.g. invalid arguments, are fatal
+static struct mqtt_connection * bridge_connect(struct mqtt_options const * options,
+    struct mqtt_connection_callbacks const * callbacks, struct bridge * bridge)
+{
+    struct mqtt_connection * connection = mqtt_connection_create(options, NULL, callbacks, bridge);
+    if (NULL == connection)
+    {
+        return NULL;
+    }
+
+    int const rc = mqtt_connection_connect(connection, 0);
+    if ((MOSQ_ERR_ERRNO == rc) || (MOSQ_ERR_EAI == rc))
+    {
+        fprintf(stderr, "warning: failed to connect to MQTT broker %s\n", options->host);
+    }
+    else if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to connect to MQTT broker %s\n", options->host);
+        mqtt_connection_destroy(connection);
+        return NULL;
+    }
+
+    if (!mqtt_connection_start(connection))
+    {
+        mqtt_connection_destroy(connection);
+        return NULL;
+    }
+
+    return connection;
+}
+
+static void mqtt_bridge(struct context * ctx)
+{
+    // signals are blocked before any thread is started,
+    // so that they are only delivered to sigwait below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int rc = mosquitto_lib_init();
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to init mosquitto library\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    struct bridge bridge;
+    if (!bridge_init(&bridge, ctx))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        mosquitto_lib_cleanup();
+        return;
+    }
+
+    struct mqtt_stats_reporter reporter;
+    mqtt_stats_reporter_init(&reporter, &ctx->stats, "mqtt_bridge",
+        ctx->source.stats_interval, ctx->source.stats_file);
+
+    // the destination is connected first, so that it is ready for the
+    // messages received from the source
+    struct mqtt_connection_callbacks const callbacks = {
+        .on_connect = &bridge_on_connect,
+        .on_message = &bridge_on_message,
+        .on_subscribe = &bridge_on_subscribe
+    };
+    bridge.dest = bridge_connect(&ctx->dest, NULL, &bridge);
+    bool const forwarding = (NULL != bridge.dest) &&
+        (0 == pthread_create(&bridge.thread, NULL, &bridge_run, &bridge));
+    bridge.source = forwarding ? bridge_connect(&ctx->source, &callbacks, &bridge) : NULL;
+
+    if (NULL != bridge.source)
+    {
+        mqtt_stats_reporter_start(&reporter, &mqtt_bridge_collect, &bridge);
+
+        int signal_number = 0;
+        sigwait(&signals, &signal_number);
+    }
+    else
+    {
+        fprintf(stderr, "error: failed to start bridge\n");
+        ctx->exit_code = EXIT_FAILURE;
+    }
+
+    // no more messages are received, when the source is stopped
+    atomic_store(&bridge.closing, true);
+    if (NULL != bridge.source)
+    {
+        if (!ctx->persistent)
+        {
+            mosquitto_unsubscribe_multiple(mqtt_connection_mosq(bridge.source), NULL,
+                ctx->topic_count, ctx->topics, NULL);
+        }
+        mqtt_connection_stop(bridge.source);
+    }
+    spsc_ring_close(&bridge.ring);
+
+    if (forwarding)
+    {
+        // an unreachable destination is given up after the timeout
+        if (!bridge_wait_done(&bridge, ctx->flush_timeout))
+        {
+            atomic_store(&bridge.aborted, true);
+            mqtt_connection_stop(bridge.dest);
+        }
+        pthread_join(bridge.thread, NULL);
+    }
+
+    if ((NULL != bridge.dest) && (!atomic_load(&bridge.aborted)) &&
+        (!mqtt_connection_wait(bridge.dest, 0, ctx->flush_timeout)))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+    }
+    if (NULL != bridge.dest)
+    {
+        mqtt_connection_stop(bridge.dest);
+    }
+
+    // lost messages, which were forwarded again from the spool, are not counted
+    unsigned long const lost = atomic_load(&bridge.lost) +
+        ((NULL != bridge.dest) ? mqtt_connection_lost(bridge.dest) : 0) +
+        ((NULL != bridge.spool) ? mqtt_spool_dropped(bridge.spool) : 0) - atomic_load(&bridge.resent);
+    if (0 < lost)
+    {
+        fprintf(stderr, "error: %lu message(s) lost\n", lost);
+        ctx->exit_code = EXIT_FAILURE;
+    }
+    mqtt_stats_reporter_stop(&reporter);
+
+    mqtt_connection_destroy(bridge.source);
+    mqtt_connection_destroy(bridge.dest);
+    bridge_cleanup(&bridge);
+    mosquitto_lib_cleanup();
+}
+
+int main(int argc, char* argv[])
+{
+    struct context ctx;
+    context_init(&ctx, argc, argv);
+
+    switch (ctx.cmd)
+    {
+        case COMMAND_BRIDGE:
+            mqtt_bridge(&ctx);
+            break;
+        case COMMAND_SHOW_HELP:
+            // fall-through
+        default:
+            print_usage();
+            break;
+    }
+
+    int const exit_code = context_cleanup(&ctx);
+    return exit_code;
+}
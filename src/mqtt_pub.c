@@ -1,31 +1,137 @@
+#include "mqtt_options.h"
+#include "mqtt_connection.h"
+#include "mqtt_pool.h"
+#include "mqtt_stats.h"
+#include "mqtt_pacer.h"
+#include "mqtt_capture.h"
+#include "mqtt_compress.h"
+#include "mqtt_spool.h"
+#include "mqtt_event_loop.h"
+#include "mqtt_trace.h"
+
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
 
 #include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <signal.h>
+
+#define DEFAULT_WINDOW (1024)
+#define DEFAULT_FLUSH_TIMEOUT (10 * 1000)
+#define DEFAULT_QUEUE_SIZE (100)
+#define DEFAULT_QUEUE_SYNC (256)
+
+// queued messages are committed in batches, since each commit waits for the broker
+#define QUEUE_COMMIT_INTERVAL (1024)
+
+#define RECORD_HEADER_SIZE (4)
+
+// maximum payload size of a MQTT message
+#define MQTT_MAX_PAYLOAD (268435455)
+
+// request of the daemon's socket API: u32 length of the remainder,
+// flags (qos | retain << 2), u16 length of the topic including its
+// terminator, topic, '\0', payload; numbers are big endian
+//
+// Once a client shut down writing, the daemon answers with the u32 number
+// of rejected messages and closes the connection.
+#define REQUEST_HEADER_SIZE (4 + 1 + 2)
+#define DAEMON_BUFFER_SIZE (64 * 1024)
+
+// while clients are stalled, they are checked at least this often (in ms),
+// e.g. to reject requests once the broker was unreachable for the flush timeout
+#define DAEMON_RETRY_INTERVAL (100)
+
+// the daemon publishes once the connection is ready, so it only waits for
+// a reconnect, if the connection was lost in between (in ms)
+#define DAEMON_SEND_TIMEOUT (1)
 
-#define MQTT_DEFAULT_PORT (1883)
-#define MQTT_KEEPALIVE    (60 * 1000)
-#define MQTT_QOS             (0)
+// codes of long options without a short option
+#define OPTION_RATE  (512)
+#define OPTION_BURST (513)
+#define OPTION_REPLAY (514)
+#define OPTION_SPEED  (515)
+#define OPTION_COMPRESS   (516)
+#define OPTION_DICTIONARY (517)
+#define OPTION_QUEUE        (518)
+#define OPTION_QUEUE_SIZE   (519)
+#define OPTION_QUEUE_POLICY (520)
+#define OPTION_QUEUE_SYNC   (521)
+#define OPTION_DAEMON (522)
+#define OPTION_SOCKET (523)
+#define OPTION_TRACE  (524)
 
 enum command {
     COMMAND_PUB,
     COMMAND_SHOW_HELP
 };
 
+enum input_mode {
+    INPUT_MESSAGE,
+    INPUT_LINES,
+    INPUT_RECORDS,
+    INPUT_FILE,
+    INPUT_STDIN,
+    INPUT_DIRECTORY,
+    INPUT_REPLAY,
+    INPUT_DAEMON
+};
+
 struct context
 {
-    char * id;
-    char * user;
-    char * password;
-    char * host;
-    int port;
+    struct mqtt_options mqtt;
     char * topic;
     char * message;
+    char * input;
+    enum input_mode mode;
+    unsigned int window;
+    unsigned int flush_timeout;
+    unsigned int connect_retries;
+    unsigned int connections;
+    bool keyed;
     bool retain;
+    unsigned int rate;
+    unsigned int burst;
+    double speed;
+    struct mqtt_pacer pacer;
+    enum mqtt_compression compression;
+    char * dictionary_path;
+    struct mqtt_dictionary dictionary;
+    struct mqtt_codec codec;
+    mosquitto_property * properties;
+    char * queue_path;
+    unsigned int queue_size;
+    enum mqtt_spool_policy queue_policy;
+    unsigned int queue_sync;
+    struct mqtt_spool * queue;
+    struct mqtt_pool * pool;
+
+    // QoS 0 messages lost by the connections, which are published again
+    // from the queue
+    atomic_uint resent;
+    char * socket_path;
+    FILE * client;
+    bool tracing;
+    struct mqtt_trace trace;
+    unsigned char * trace_buffer;
+    size_t trace_buffer_size;
+    struct mqtt_stats stats;
     enum command cmd;
     int exit_code;
 };
@@ -38,34 +144,175 @@ static void print_usage(void)
         "\n"
         "Usage:\n"
         "    mqtt_pub [-h host] [-p port] [-u user] [-P password]\n"
-        "             [-i client-id] [-r]\n"
-        "             -t topic -m message\n"
+        "             [-i client-id] [-q qos] [-V 311|5] [-r] [-T timeout]\n"
+        "             [-R retries] [-b min-delay] [-B max-delay]\n"
+        "             -t topic -m message | -f file | -s | -D directory\n"
+        "    mqtt_pub [...] [-I file] [-w window] [-M max-inflight]\n"
+        "             [-C connections] [-k] -t topic -l | -L\n"
+        "    mqtt_pub [...] [--rate rate [--burst burst]] -D directory | -l | -L\n"
+        "    mqtt_pub [...] [-C connections] [--speed factor] --replay file\n"
+        "    mqtt_pub [...] -V 5 --compress zstd|lz4 [--dictionary file] ...\n"
+        "    mqtt_pub [...] --daemon socket\n"
+        "    mqtt_pub [...] --trace ...\n"
+        "    mqtt_pub --socket socket [-q qos] [-r] [-t topic] ...\n"
+        "    mqtt_pub [...] --queue directory [--queue-size size]\n"
+        "             [--queue-policy policy] [--queue-sync messages] ...\n"
+        "    mqtt_pub [...] [--stats-interval interval] [--stats-file file]\n"
+        "    mqtt_pub [...] [--tls] [--cafile file] [--cert file [--key file]]\n"
+        "             [--tls-version version] [--tls-session file] ...\n"
+        "    mqtt_pub [...] [--keepalive seconds] [--nodelay] [--send-buffer bytes]\n"
+        "             [--receive-buffer bytes] [--bind-address address] ...\n"
         "\n"
         "Options:\n"
         "    -h, --host     : hostname of MQTT broker (default: localhost)\n"
-        "    -p, --port     : port of MQTT broker (default: 1883)\n"
+        "    -p, --port     : port of MQTT broker (default: 1883, 8883 with TLS)\n"
         "    -u, --user     : name of the MQTT user (default: <unset>)\n"
         "    -p, --password : password of the MQTT user (default: <unset>)\n"
         "    -i, --client-id: MQTT client id (default: <unset>)\n"
+        "    -q, --qos      : quality of service level 0, 1 or 2 (default: 0)\n"
+        "    -V, --protocol-version: MQTT protocol version 311 or 5; with 5, QoS 0\n"
+        "                     messages are sent with topic aliases (default: 311)\n"
         "    -r, --retain   : retain message (default: message is not retained)\n"
         "    -t, --topic    : MQTT topic to publish (required)\n"
         "    -m, --message  : message to public (required)\n"
+        "    -f, --file     : publish the contents of a file as message\n"
+        "    -s, --stdin    : publish all of stdin as a single message\n"
+        "    -D, --directory: publish each file of a directory as a message\n"
+        "    -l, --lines    : publish each line of input as a message\n"
+        "    -L, --records  : publish length-prefixed records of input as messages\n"
+        "                     (4 byte big endian length followed by payload)\n"
+        "    -I, --input    : file to read messages from (default: stdin)\n"
+        "    --replay       : publish the messages of a capture recorded with\n"
+        "                     mqtt_sub --record using their topic, QoS and retain flag\n"
+        "    --speed        : speed of the replay relative to the recorded timing;\n"
+        "                     0 replays as fast as possible (default: 1)\n"
+        "    -w, --window   : maximum number of messages waiting for delivery\n"
+        "                     when reading from input (default: 1024)\n"
+        "    -C, --connections: number of connections to publish input on; records\n"
+        "                     are distributed by topic, so that messages of a topic\n"
+        "                     keep their order (default: 1)\n"
+        "    -k, --keyed    : each record of input starts with its topic followed\n"
+        "                     by a single space; -t is not required\n"
+        "    --rate         : maximum number of messages per second published\n"
+        "                     from a directory or input (default: unlimited)\n"
+        "    --burst        : number of messages published at once after being\n"
+        "                     idle, when the rate is limited (default: 1)\n"
+    );
+
+    // split, since ISO C limits the length of string literals
+    printf(
+        "    --compress     : compress payloads with zstd or lz4, marked by the user\n"
+        "                     property " MQTT_COMPRESS_PROPERTY "; requires -V 5 (default: <unset>)\n"
+        "    --dictionary   : file of a dictionary to compress payloads with, e.g.\n"
+        "                     trained by zstd --train (default: <unset>)\n"
+        "    -M, --max-inflight: maximum number of QoS 1 and 2 messages\n"
+        "                     awaiting acknowledgement (default: window)\n"
+        "    -T, --flush-timeout: time in milliseconds to wait for outstanding\n"
+        "                     messages before exit; 0 waits forever (default: 10000)\n"
+        "    -R, --connect-retries: number of retries, if the initial connect\n"
+        "                     fails (default: 0)\n"
+        "    --queue        : directory to queue messages in, while the broker is\n"
+        "                     unreachable; queued messages are published first,\n"
+        "                     once it is back, also by later invocations\n"
+        "                     (default: <unset>, messages are lost)\n"
+        "    --queue-size   : maximum size of the queue in MiB; 0 is unlimited\n"
+        "                     (default: 100)\n"
+        "    --queue-policy : what to do when the queue is full (default: drop-oldest)\n"
+        "                     drop-oldest: discard the oldest queued messages\n"
+        "                     drop-newest: discard the message to queue\n"
+        "    --queue-sync   : number of queued messages to batch before they are\n"
+        "                     synced to disk; 0 syncs full segments and on exit only\n"
+        "                     (default: 256)\n"
+        "    --daemon       : keep the connections and publish messages received\n"
+        "                     on the Unix domain socket, until SIGINT or SIGTERM;\n"
+        "                     with -C, topics are distributed like with -k\n"
+        "    --socket       : send messages to the daemon listening on the socket\n"
+        "                     instead of connecting to the broker; broker options\n"
+        "                     are ignored, -q, -r and -t apply; messages are traced\n"
+        "                     and compressed as configured for the daemon, so\n"
+        "                     --trace, --compress and --dictionary are rejected\n"
+        "                     (default: <unset>)\n"
+        "    --trace        : stamp messages with a sequence number and send time for\n"
+        "                     mqtt_sub --trace; with -V 5 as user property " MQTT_TRACE_PROPERTY ",\n"
+        "                     otherwise as 24 byte header preceding the payload\n"
+    );
+
+    // split, since ISO C limits the length of string literals
+    printf(
+        "    -b, --reconnect-min: initial delay in milliseconds before reconnecting\n"
+        "                     (default: 1000)\n"
+        "    -B, --reconnect-max: maximum delay in milliseconds before reconnecting\n"
+        "                     (default: 30000)\n"
+        "    --stats-interval: interval in milliseconds to print statistics to\n"
+        "                     stderr; 0 prints on SIGUSR1 only (default: 0)\n"
+        "    --stats-file   : file to write statistics to in Prometheus text\n"
+        "                     format, e.g. for node_exporter (default: <unset>)\n"
+        "    --tls          : connect via TLS, verifying the broker with the system's\n"
+        "                     CA certificates (default port: 8883)\n"
+        "    --cafile       : file of CA certificates to verify the broker; implies --tls\n"
+        "    --cert         : file of the client certificate chain; implies --tls\n"
+        "    --key          : file of the client key (default: --cert)\n"
+        "    --tls-version  : minimum TLS version tlsv1.2 or tlsv1.3 (default: tlsv1.2)\n"
+        "    --tls-session  : file to keep the TLS session in, so that it is resumed\n"
+        "                     by the next invocation; implies --tls (default: <unset>)\n"
+        "    --keepalive    : keepalive interval in seconds, after which a dead\n"
+        "                     connection is detected; 0 disables it (default: 60)\n"
+        "    --nodelay      : disable Nagle's algorithm (TCP_NODELAY), which trades\n"
+        "                     throughput for latency of small messages\n"
+        "    --send-buffer  : size of the socket send buffer in bytes\n"
+        "                     (default: chosen by the kernel)\n"
+        "    --receive-buffer: size of the socket receive buffer in bytes; it is\n"
+        "                     set after connect, so the TCP window scale agreed in the\n"
+        "                     handshake limits large sizes (default: chosen by the kernel)\n"
+        "    --bind-address : local address to connect from (default: <unset>)\n"
         "\n"
         "Example:\n"
         "    mqtt_pub -t test -m hello\n"
+        "    seq 1 1000 | mqtt_pub -t test -l\n"
+        "    seq 1 100000 | mqtt_pub -t test -l --rate 5000\n"
+        "    seq 1 100000 | mqtt_pub -t test -l --trace\n"
+        "    printf 'a 1\\nb 2\\n' | mqtt_pub -C 2 -k -l\n"
+        "    mqtt_pub -V 5 --compress zstd -t test -f data.json\n"
+        "    mqtt_pub --cafile ca.pem --tls-session ~/.mqtt_session -t test -m hello\n"
+        "    mqtt_pub -q 1 --queue /var/spool/mqtt_pub -t test -m hello\n"
+        "    mqtt_pub --cafile ca.pem --daemon /run/mqtt_pub.sock &\n"
+        "    mqtt_pub --socket /run/mqtt_pub.sock -t test -m hello\n"
     );
 }
 
 static void context_init(struct context * ctx, int argc, char* argv[])
 {
-    ctx->id = NULL;
-    ctx->user = NULL;
-    ctx->password = NULL;
-    ctx->host = strdup("localhost");
-    ctx->port = MQTT_DEFAULT_PORT;
+    mqtt_options_init(&ctx->mqtt);
     ctx->topic = NULL;
     ctx->message = NULL;
+    ctx->input = NULL;
+    ctx->mode = INPUT_MESSAGE;
+    ctx->window = DEFAULT_WINDOW;
+    ctx->flush_timeout = DEFAULT_FLUSH_TIMEOUT;
+    ctx->connect_retries = 0;
+    ctx->connections = 1;
+    ctx->keyed = false;
     ctx->retain = false;
+    ctx->rate = 0;
+    ctx->burst = 1;
+    ctx->speed = 1.0;
+    ctx->compression = MQTT_COMPRESSION_NONE;
+    ctx->dictionary_path = NULL;
+    mqtt_dictionary_init(&ctx->dictionary);
+    ctx->properties = NULL;
+    ctx->queue_path = NULL;
+    ctx->queue_size = DEFAULT_QUEUE_SIZE;
+    ctx->queue_policy = MQTT_SPOOL_DROP_OLDEST;
+    ctx->queue_sync = DEFAULT_QUEUE_SYNC;
+    ctx->queue = NULL;
+    ctx->pool = NULL;
+    atomic_init(&ctx->resent, 0);
+    ctx->socket_path = NULL;
+    ctx->client = NULL;
+    ctx->tracing = false;
+    ctx->trace_buffer = NULL;
+    ctx->trace_buffer_size = 0;
+    mqtt_stats_init(&ctx->stats);
     ctx->cmd = COMMAND_PUB;
     ctx->exit_code = EXIT_SUCCESS;
 
@@ -73,14 +320,35 @@ static void context_init(struct context * ctx, int argc, char* argv[])
     opterr = 0;
 
     struct option const long_opts[] = {
-        {"client-id", no_argument, 0, 'i'},
-        {"host", no_argument, 0, 'h'},
-        {"port", no_argument, 0, 'p'},
-        {"user", no_argument, 0, 'u'},
-        {"password", no_argument, 0, 'P'},
-        {"retain", no_argument, 0, 'r'},        
-        {"topic", no_argument, 0, 't'},
-        {"message", no_argument, 0, 'm'},
+        MQTT_OPTIONS_LONG,
+        {"retain", no_argument, 0, 'r'},
+        {"topic", required_argument, 0, 't'},
+        {"message", required_argument, 0, 'm'},
+        {"file", required_argument, 0, 'f'},
+        {"stdin", no_argument, 0, 's'},
+        {"directory", required_argument, 0, 'D'},
+        {"lines", no_argument, 0, 'l'},
+        {"records", no_argument, 0, 'L'},
+        {"input", required_argument, 0, 'I'},
+        {"window", required_argument, 0, 'w'},
+        {"max-inflight", required_argument, 0, 'M'},
+        {"flush-timeout", required_argument, 0, 'T'},
+        {"connect-retries", required_argument, 0, 'R'},
+        {"connections", required_argument, 0, 'C'},
+        {"keyed", no_argument, 0, 'k'},
+        {"rate", required_argument, 0, OPTION_RATE},
+        {"burst", required_argument, 0, OPTION_BURST},
+        {"replay", required_argument, 0, OPTION_REPLAY},
+        {"speed", required_argument, 0, OPTION_SPEED},
+        {"compress", required_argument, 0, OPTION_COMPRESS},
+        {"dictionary", required_argument, 0, OPTION_DICTIONARY},
+        {"queue", required_argument, 0, OPTION_QUEUE},
+        {"queue-size", required_argument, 0, OPTION_QUEUE_SIZE},
+        {"queue-policy", required_argument, 0, OPTION_QUEUE_POLICY},
+        {"queue-sync", required_argument, 0, OPTION_QUEUE_SYNC},
+        {"daemon", required_argument, 0, OPTION_DAEMON},
+        {"socket", required_argument, 0, OPTION_SOCKET},
+        {"trace", no_argument, 0, OPTION_TRACE},
         {"help", no_argument, 0, 'H'},
         {NULL, 0, NULL, 0}
     };
@@ -89,31 +357,17 @@ static void context_init(struct context * ctx, int argc, char* argv[])
     while (!done)
     {
         int option_index = 0;
-        int const c = getopt_long(argc, argv, "i:h:p:u:P:rt:m:H", long_opts, &option_index);
+        int const c = getopt_long(argc, argv, MQTT_OPTIONS_SHORT "rt:m:f:sD:lLI:w:M:T:R:C:kH", long_opts, &option_index);
+        if (mqtt_options_parse(&ctx->mqtt, c, optarg))
+        {
+            continue;
+        }
+
         switch (c)
         {
             case -1:
                 done = true;
                 break;
-            case 'i':
-                free(ctx->id);
-                ctx->id = strdup(optarg);
-                break;
-            case 'h':
-                free(ctx->host);
-                ctx->host = strdup(optarg);
-                break;
-            case 'p':
-                ctx->port = atoi(optarg);
-                break;
-            case 'u':
-                free(ctx->user);
-                ctx->user = strdup(optarg);
-                break;
-            case 'P':
-                free(ctx->password);
-                ctx->password = strdup(optarg);
-                break;
             case 'r':
                 ctx->retain = true;
                 break;
@@ -125,6 +379,105 @@ static void context_init(struct context * ctx, int argc, char* argv[])
                 free(ctx->message);
                 ctx->message = strdup(optarg);
                 break;
+            case 'f':
+                ctx->mode = INPUT_FILE;
+                free(ctx->input);
+                ctx->input = strdup(optarg);
+                break;
+            case 's':
+                ctx->mode = INPUT_STDIN;
+                break;
+            case 'D':
+                ctx->mode = INPUT_DIRECTORY;
+                free(ctx->input);
+                ctx->input = strdup(optarg);
+                break;
+            case 'l':
+                ctx->mode = INPUT_LINES;
+                break;
+            case 'L':
+                ctx->mode = INPUT_RECORDS;
+                break;
+            case 'I':
+                free(ctx->input);
+                ctx->input = strdup(optarg);
+                break;
+            case 'w':
+                ctx->window = (unsigned int) atoi(optarg);
+                break;
+            case 'M':
+                ctx->mqtt.max_inflight = (unsigned int) atoi(optarg);
+                break;
+            case 'T':
+                ctx->flush_timeout = (unsigned int) atoi(optarg);
+                break;
+            case 'R':
+                ctx->connect_retries = (unsigned int) atoi(optarg);
+                break;
+            case 'C':
+                ctx->connections = (unsigned int) atoi(optarg);
+                break;
+            case 'k':
+                ctx->keyed = true;
+                break;
+            case OPTION_RATE:
+                ctx->rate = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_BURST:
+                ctx->burst = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_REPLAY:
+                ctx->mode = INPUT_REPLAY;
+                free(ctx->input);
+                ctx->input = strdup(optarg);
+                break;
+            case OPTION_SPEED:
+                ctx->speed = atof(optarg);
+                break;
+            case OPTION_COMPRESS:
+                if (!mqtt_compression_parse(optarg, &ctx->compression))
+                {
+                    fprintf(stderr, "error: unknown compression\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
+                break;
+            case OPTION_DICTIONARY:
+                free(ctx->dictionary_path);
+                ctx->dictionary_path = strdup(optarg);
+                break;
+            case OPTION_QUEUE:
+                free(ctx->queue_path);
+                ctx->queue_path = strdup(optarg);
+                break;
+            case OPTION_QUEUE_SIZE:
+                ctx->queue_size = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_QUEUE_POLICY:
+                if (!mqtt_spool_policy_parse(optarg, &ctx->queue_policy))
+                {
+                    fprintf(stderr, "error: unknown queue policy\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
+                break;
+            case OPTION_QUEUE_SYNC:
+                ctx->queue_sync = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_DAEMON:
+                ctx->mode = INPUT_DAEMON;
+                free(ctx->input);
+                ctx->input = strdup(optarg);
+                break;
+            case OPTION_SOCKET:
+                free(ctx->socket_path);
+                ctx->socket_path = strdup(optarg);
+                break;
+            case OPTION_TRACE:
+                ctx->tracing = true;
+                break;
             case 'H':
                 ctx->cmd = COMMAND_SHOW_HELP;
                 done = true;
@@ -137,77 +490,1645 @@ static void context_init(struct context * ctx, int argc, char* argv[])
         }
     }
 
+    // a replay publishes each message to its recorded topic
+    bool const is_stream = (ctx->mode == INPUT_LINES) || (ctx->mode == INPUT_RECORDS);
+    bool const is_replay = (ctx->mode == INPUT_REPLAY);
+    bool const is_daemon = (ctx->mode == INPUT_DAEMON);
     if ((ctx->cmd == COMMAND_PUB) &&
-        ((ctx->topic == NULL) || ((ctx->message == NULL))) )
+        (((ctx->topic == NULL) && (!ctx->keyed) && (!is_replay) && (!is_daemon)) ||
+        ((ctx->mode == INPUT_MESSAGE) && (ctx->message == NULL))) )
     {
         fprintf(stderr, "error: topic or message not specified\n");
         ctx->exit_code = EXIT_FAILURE;
         ctx->cmd = COMMAND_SHOW_HELP;
     }
 
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->connections == 0))
+    {
+        fprintf(stderr, "error: invalid number of connections\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (!is_stream) && (((1 < ctx->connections) && (!is_replay) && (!is_daemon)) || (ctx->keyed)))
+    {
+        fprintf(stderr, "error: connections and keyed input require -l or -L\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (is_daemon) && (ctx->socket_path != NULL))
+    {
+        fprintf(stderr, "error: daemon cannot publish via another daemon\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // messages are traced and compressed by the daemon, using its options
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->socket_path != NULL) &&
+        ((ctx->tracing) || (ctx->compression != MQTT_COMPRESSION_NONE) || (ctx->dictionary_path != NULL)))
+    {
+        fprintf(stderr, "error: socket cannot be combined with --trace, --compress or --dictionary\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->speed < 0.0))
+    {
+        fprintf(stderr, "error: invalid speed\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->burst == 0))
+    {
+        fprintf(stderr, "error: invalid burst\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->window == 0))
+    {
+        fprintf(stderr, "error: invalid window\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (!mqtt_options_validate(&ctx->mqtt)))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // the compression is announced by a property, which MQTT 3.1.1 lacks
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->compression != MQTT_COMPRESSION_NONE) &&
+        (ctx->mqtt.protocol_version != MQTT_PROTOCOL_V5))
+    {
+        fprintf(stderr, "error: compression requires -V 5\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (!mqtt_compression_supported(ctx->compression)))
+    {
+        fprintf(stderr, "error: %s compression is not supported by this build\n",
+            mqtt_compression_name(ctx->compression));
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->dictionary_path != NULL) &&
+        (ctx->compression == MQTT_COMPRESSION_NONE))
+    {
+        fprintf(stderr, "error: dictionary requires --compress\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->dictionary_path != NULL) &&
+        (!mqtt_dictionary_load(&ctx->dictionary, ctx->dictionary_path)))
+    {
+        fprintf(stderr, "error: failed to load dictionary %s\n", ctx->dictionary_path);
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->compression != MQTT_COMPRESSION_NONE) &&
+        (MOSQ_ERR_SUCCESS != mosquitto_property_add_string_pair(&ctx->properties, MQTT_PROP_USER_PROPERTY,
+            MQTT_COMPRESS_PROPERTY, mqtt_compression_name(ctx->compression))))
+    {
+        fprintf(stderr, "error: failed to create properties\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_PUB) && (ctx->tracing) && (!mqtt_trace_init(&ctx->trace)))
+    {
+        fprintf(stderr, "error: failed to initialize tracing\n");
+        ctx->tracing = false;
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // messages are published by the main thread only, so a single codec suffices
+    mqtt_codec_init(&ctx->codec, &ctx->dictionary);
+
+    mqtt_pacer_init(&ctx->pacer, ctx->rate, ctx->burst);
+
+    // keep the whole window in flight, so that QoS 1 and 2 messages
+    // are pipelined instead of waiting for each acknowledgement
+    if (0 == ctx->mqtt.max_inflight)
+    {
+        ctx->mqtt.max_inflight = ctx->window;
+    }
 }
 
 static int context_cleanup(struct context * ctx)
 {
-    free(ctx->id);
-    free(ctx->user);
-    free(ctx->password);
-    free(ctx->host);
+    mqtt_options_cleanup(&ctx->mqtt);
     free(ctx->topic);
     free(ctx->message);
+    free(ctx->input);
+    free(ctx->dictionary_path);
+    free(ctx->queue_path);
+    free(ctx->socket_path);
+    mosquitto_property_free_all(&ctx->properties);
+    mqtt_codec_cleanup(&ctx->codec);
+    mqtt_dictionary_cleanup(&ctx->dictionary);
+    free(ctx->trace_buffer);
+    if (ctx->tracing)
+    {
+        mqtt_trace_cleanup(&ctx->trace);
+    }
 
     return ctx->exit_code;
 }
 
-static void mqtt_pub(struct context * ctx)
+// prepends the trace header to the payload; returns false on error
+static bool trace_header(struct context * ctx, struct mqtt_trace_stamp const * stamp,
+    void const * * payload, size_t * length)
 {
-    int rc = mosquitto_lib_init();
-    if (MOSQ_ERR_SUCCESS != rc)
+    size_t const size = MQTT_TRACE_HEADER_SIZE + *length;
+    if (ctx->trace_buffer_size < size)
     {
-        fprintf(stderr, "error: failed to init mosquitto library\n");
-        ctx->exit_code = EXIT_FAILURE;
-        return;
+        unsigned char * buffer = realloc(ctx->trace_buffer, size);
+        if (NULL == buffer)
+        {
+            return false;
+        }
+        ctx->trace_buffer = buffer;
+        ctx->trace_buffer_size = size;
+    }
+
+    mqtt_trace_write_header(ctx->trace_buffer, stamp);
+    if (0 < *length)
+    {
+        memcpy(&ctx->trace_buffer[MQTT_TRACE_HEADER_SIZE], *payload, *length);
+    }
+    *payload = ctx->trace_buffer;
+    *length = size;
+
+    return true;
+}
+
+static bool send_message(struct context * ctx, struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length, int qos, bool retain)
+{
+    uint64_t const start = mqtt_stats_now();
+
+    // MQTT 3.1.1 lacks properties, so the stamp precedes the payload instead
+    struct mqtt_trace_stamp stamp;
+    if (ctx->tracing)
+    {
+        mqtt_trace_stamp(&ctx->trace, topic, &stamp);
+        if ((ctx->mqtt.protocol_version != MQTT_PROTOCOL_V5) && (!trace_header(ctx, &stamp, &payload, &length)))
+        {
+            fprintf(stderr, "error: failed to trace message\n");
+            atomic_fetch_add(&ctx->stats.errors, 1);
+            return false;
+        }
+    }
+
+    // payloads, which do not shrink, are sent uncompressed and unmarked
+    mosquitto_property const * properties = NULL;
+    void const * compressed = NULL;
+    size_t compressed_length = 0;
+    if (ctx->compression != MQTT_COMPRESSION_NONE)
+    {
+        if (!mqtt_codec_compress(&ctx->codec, ctx->compression, payload, length, &compressed, &compressed_length))
+        {
+            fprintf(stderr, "error: failed to compress message\n");
+            atomic_fetch_add(&ctx->stats.errors, 1);
+            return false;
+        }
+
+        if (compressed_length < length)
+        {
+            payload = compressed;
+            length = compressed_length;
+            properties = ctx->properties;
+        }
+    }
+
+    // the stamp differs per message, so it is added to a copy of the properties
+    mosquitto_property * traced = NULL;
+    if ((ctx->tracing) && (ctx->mqtt.protocol_version == MQTT_PROTOCOL_V5))
+    {
+        if ((MOSQ_ERR_SUCCESS != mosquitto_property_copy_all(&traced, properties)) ||
+            (!mqtt_trace_add_property(&traced, &stamp)))
+        {
+            fprintf(stderr, "error: failed to trace message\n");
+            mosquitto_property_free_all(&traced);
+            atomic_fetch_add(&ctx->stats.errors, 1);
+            return false;
+        }
+        properties = traced;
+    }
+
+    bool const result = mqtt_connection_publish_v5(connection, topic, payload, length,
+        qos, retain, properties, (ctx->mode == INPUT_DAEMON) ? DAEMON_SEND_TIMEOUT : ctx->flush_timeout);
+    mosquitto_property_free_all(&traced);
+    if (result)
+    {
+        mqtt_stats_record(&ctx->stats, length, start);
+    }
+    else
+    {
+        atomic_fetch_add(&ctx->stats.errors, 1);
+    }
+
+    return result;
+}
+
+// returns the number of outstanding messages to wait for before the next one
+// is published; QoS 1 and 2 messages are also limited by the receive maximum
+// of the broker, so that they are not queued by libmosquitto instead
+static unsigned int window_limit(struct context * ctx, struct mqtt_connection * connection, int qos)
+{
+    unsigned int window = ctx->window;
+    if (0 < qos)
+    {
+        unsigned int const receive_maximum = mqtt_connection_receive_maximum(connection);
+        window = ((0 < receive_maximum) && (receive_maximum < window)) ? receive_maximum : window;
+    }
+
+    return window - 1;
+}
+
+// FNV-1a, used to map topics to connections
+static uint32_t topic_hash(char const * topic)
+{
+    uint32_t hash = 2166136261U;
+    for (unsigned char const * c = (unsigned char const *) topic; '\0' != *c; c++)
+    {
+        hash ^= *c;
+        hash *= 16777619U;
     }
 
-    struct mosquitto * mosq = mosquitto_new(ctx->id, true, NULL);
-    if (NULL == mosq)
+    return hash;
+}
+
+// returns the connection to publish a topic with the given hash on;
+// returns NULL without pool, i.e. for a client of the daemon
+static struct mqtt_connection * pool_connection(struct mqtt_pool * pool, uint32_t hash)
+{
+    return (NULL != pool) ? mqtt_pool_get(pool, hash % mqtt_pool_size(pool)) : NULL;
+}
+
+static bool pool_connected(struct mqtt_pool * pool)
+{
+    bool connected = (NULL != pool);
+    for (size_t i = 0; (connected) && (i < mqtt_pool_size(pool)); i++)
+    {
+        connected = mqtt_connection_connected(mqtt_pool_get(pool, i));
+    }
+
+    return connected;
+}
+
+static bool queue_message(struct context * ctx, char const * topic, void const * payload, size_t length,
+    int qos, bool retain)
+{
+    struct mqtt_capture_message const message = {
+        .timestamp = mqtt_capture_now(),
+        .topic = topic,
+        .payload = payload,
+        .payloadlen = length,
+        .qos = qos,
+        .retain = retain
+    };
+
+    if (!mqtt_spool_add(ctx->queue, &message))
     {
-        fprintf(stderr, "error: failed to create mosquitto instance\n");
+        fprintf(stderr, "error: failed to queue message\n");
+        atomic_fetch_add(&ctx->stats.errors, 1);
         ctx->exit_code = EXIT_FAILURE;
-        mosquitto_lib_cleanup();
-        return;
+        return false;
     }
 
-    rc = mosquitto_username_pw_set(mosq, ctx->user, ctx->password);
-    if (MOSQ_ERR_SUCCESS != rc)
+    return true;
+}
+
+// waits until the broker confirmed the messages read from the queue, which
+// are committed then; returns false, if some of them may be lost, so that
+// they are read again
+static bool confirm_queue(struct context * ctx, unsigned int * lost)
+{
+    bool const delivered = mqtt_pool_wait(ctx->pool, ctx->flush_timeout);
+    unsigned int const current = mqtt_pool_lost(ctx->pool);
+    if ((delivered) && (current == *lost))
+    {
+        mqtt_spool_commit(ctx->queue);
+        return true;
+    }
+
+    atomic_fetch_add(&ctx->resent, current - *lost);
+    mqtt_spool_rewind(ctx->queue);
+    *lost = current;
+    return false;
+}
+
+// publishes queued messages as fast as the window allows, while all
+// connections are accepted; messages are kept in the queue, until the broker
+// confirmed them, and are published again in order after a connection loss;
+// returns true, once the queue is empty
+static bool drain_queue(struct context * ctx)
+{
+    bool connected = pool_connected(ctx->pool);
+    unsigned int lost = mqtt_pool_lost(ctx->pool);
+    unsigned int unconfirmed = 0;
+    struct mqtt_capture_message message;
+    while ((connected) && (mqtt_spool_next(ctx->queue, &message)))
+    {
+        // queued messages are distributed by topic like streamed input
+        struct mqtt_connection * connection = pool_connection(ctx->pool, topic_hash(message.topic));
+        bool const sent = (mqtt_connection_wait(connection, window_limit(ctx, connection, message.qos), 0)) &&
+            (send_message(ctx, connection, message.topic, message.payload, message.payloadlen,
+                message.qos, message.retain));
+        unconfirmed++;
+
+        // a message, which failed while connected, is not published again
+        connected = pool_connected(ctx->pool);
+        if ((!sent) && (connected))
+        {
+            ctx->exit_code = EXIT_FAILURE;
+        }
+        else if (!sent)
+        {
+            mqtt_spool_rewind(ctx->queue);
+            unconfirmed = 0;
+        }
+
+        // segments are only removed once committed, so commits are periodic
+        if ((connected) && (QUEUE_COMMIT_INTERVAL <= unconfirmed))
+        {
+            connected = confirm_queue(ctx, &lost);
+            unconfirmed = 0;
+        }
+    }
+
+    if ((connected) && (0 < unconfirmed))
+    {
+        connected = confirm_queue(ctx, &lost);
+    }
+
+    return (connected) && (mqtt_spool_empty(ctx->queue));
+}
+
+// sends a publish request to the daemon; requests are buffered,
+// so that the daemon receives many of them per read
+static bool client_send(struct context * ctx, char const * topic, void const * payload, size_t length,
+    int qos, bool retain)
+{
+    size_t const topic_length = strlen(topic) + 1;
+    if ((UINT16_MAX < topic_length) || (MQTT_MAX_PAYLOAD < length))
     {
-        fprintf(stderr, "error: failed to set user and password\n");
+        fprintf(stderr, "error: message too large\n");
         ctx->exit_code = EXIT_FAILURE;
-        mosquitto_destroy(mosq);
-        mosquitto_lib_cleanup();
-        return;
+        return false;
     }
 
-    rc = mosquitto_connect(mosq, ctx->host, ctx->port, MQTT_KEEPALIVE);
-    if (MOSQ_ERR_SUCCESS != rc)
+    size_t const size = 1 + 2 + topic_length + length;
+    unsigned char const header[REQUEST_HEADER_SIZE] = {
+        (unsigned char) (size >> 24), (unsigned char) (size >> 16),
+        (unsigned char) (size >> 8), (unsigned char) size,
+        (unsigned char) ((qos & 0x03) | (retain ? 0x04 : 0x00)),
+        (unsigned char) (topic_length >> 8), (unsigned char) topic_length
+    };
+
+    bool const result = (REQUEST_HEADER_SIZE == fwrite(header, 1, REQUEST_HEADER_SIZE, ctx->client)) &&
+        (topic_length == fwrite(topic, 1, topic_length, ctx->client)) &&
+        (length == fwrite(payload, 1, length, ctx->client));
+    if (!result)
     {
-        fprintf(stderr, "error: failed to connect to MQTT broker\n");
+        fprintf(stderr, "error: failed to send message to daemon\n");
         ctx->exit_code = EXIT_FAILURE;
-        mosquitto_destroy(mosq);
-        mosquitto_lib_cleanup();
-        return;
     }
 
-    int const message_length = (int) strlen(ctx->message);
-    rc = mosquitto_publish(mosq, NULL, ctx->topic,
-        message_length, ctx->message, MQTT_QOS, ctx->retain);
-    if (MOSQ_ERR_SUCCESS != rc)
+    return result;
+}
+
+// publishes a message or, while the broker is unreachable, queues it;
+// once queued, messages are queued until the queue is drained, so that
+// they keep their order
+static bool publish_message(struct context * ctx, struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length, int qos, bool retain)
+{
+    if (NULL != ctx->client)
+    {
+        return client_send(ctx, topic, payload, length, qos, retain);
+    }
+
+    if ((NULL != ctx->queue) && ((!drain_queue(ctx)) || (!mqtt_connection_connected(connection))))
+    {
+        return queue_message(ctx, topic, payload, length, qos, retain);
+    }
+
+    bool const result = send_message(ctx, connection, topic, payload, length, qos, retain);
+    if (!result)
     {
-        fprintf(stderr, "error: failed to publish message\n");
         ctx->exit_code = EXIT_FAILURE;
     }
 
-    mosquitto_destroy(mosq);
+    return result;
+}
+
+// waits until the window of the connection allows to publish the next message;
+// messages, which are queued or sent to a daemon, do not wait
+static bool wait_window(struct context * ctx, struct mqtt_connection * connection, int qos)
+{
+    if (NULL != ctx->client)
+    {
+        return true;
+    }
+
+    if ((NULL != ctx->queue) && ((NULL == connection) || (!mqtt_connection_connected(connection))))
+    {
+        return true;
+    }
+
+    return mqtt_connection_wait(connection, window_limit(ctx, connection, qos), 0);
+}
+
+static bool publish(struct context * ctx, struct mqtt_connection * connection,
+    char const * topic, void const * payload, size_t length)
+{
+    return publish_message(ctx, connection, topic, payload, length, ctx->mqtt.qos, ctx->retain);
+}
+
+// reads the next message from input;
+// returns 1 if a message was read, 0 at end of input and -1 on error
+static int read_message(FILE * input, enum input_mode mode,
+    char * * buffer, size_t * capacity, size_t * length)
+{
+    if (mode == INPUT_LINES)
+    {
+        ssize_t const count = getline(buffer, capacity, input);
+        if (count < 0)
+        {
+            return ferror(input) ? -1 : 0;
+        }
+
+        *length = (size_t) count;
+        if ((0 < *length) && ((*buffer)[*length - 1] == '\n'))
+        {
+            (*length)--;
+        }
+
+        return 1;
+    }
+
+    unsigned char header[RECORD_HEADER_SIZE];
+    size_t const header_length = fread(header, 1, RECORD_HEADER_SIZE, input);
+    if (header_length != RECORD_HEADER_SIZE)
+    {
+        return ((0 == header_length) && (!ferror(input))) ? 0 : -1;
+    }
+
+    *length = ((size_t) header[0] << 24) | ((size_t) header[1] << 16) |
+        ((size_t) header[2] << 8) | ((size_t) header[3]);
+
+    // a misframed stream, e.g. text, would allocate and wait for up to 4 GiB
+    if (MQTT_MAX_PAYLOAD < *length)
+    {
+        fprintf(stderr, "error: invalid record length %zu; input is not framed as records\n", *length);
+        return -1;
+    }
+
+    if (*capacity < *length)
+    {
+        char * const resized = realloc(*buffer, *length);
+        if (NULL == resized)
+        {
+            return -1;
+        }
+        *buffer = resized;
+        *capacity = *length;
+    }
+
+    return (fread(*buffer, 1, *length, input) == *length) ? 1 : -1;
+}
+
+// splits a keyed record into topic and payload at the first space;
+// the space is replaced by a terminator, so that the topic can be used as is
+static bool split_record(char * buffer, size_t length, char * * topic, char * * payload, size_t * payload_length)
+{
+    char * const separator = memchr(buffer, ' ', length);
+    if ((NULL == separator) || (separator == buffer))
+    {
+        return false;
+    }
+
+    *separator = '\0';
+    *topic = buffer;
+    *payload = separator + 1;
+    *payload_length = length - (size_t) (*payload - buffer);
+    return true;
+}
+
+static void mqtt_pub_stream(struct context * ctx, struct mqtt_pool * pool)
+{
+    FILE * input = stdin;
+    if ((NULL != ctx->input) && (0 != strcmp(ctx->input, "-")))
+    {
+        input = fopen(ctx->input, "rb");
+        if (NULL == input)
+        {
+            fprintf(stderr, "error: failed to open input file\n");
+            ctx->exit_code = EXIT_FAILURE;
+            return;
+        }
+    }
+
+    uint32_t const default_shard = (NULL != ctx->topic) ? topic_hash(ctx->topic) : 0;
+
+    char * buffer = NULL;
+    size_t capacity = 0;
+    size_t length = 0;
+    bool done = false;
+    while (!done)
+    {
+        int const result = read_message(input, ctx->mode, &buffer, &capacity, &length);
+        if (result > 0)
+        {
+            char * topic = ctx->topic;
+            char * payload = buffer;
+            size_t payload_length = length;
+            uint32_t shard = default_shard;
+            if (ctx->keyed)
+            {
+                if (!split_record(buffer, length, &topic, &payload, &payload_length))
+                {
+                    fprintf(stderr, "error: record without topic\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    break;
+                }
+                shard = topic_hash(topic);
+            }
+
+            if (0 < ctx->rate)
+            {
+                mqtt_pacer_wait(&ctx->pacer);
+            }
+
+            // all messages of a topic are published on the same connection,
+            // since the order is only kept within a connection
+            struct mqtt_connection * connection = pool_connection(pool, shard);
+            done = (!wait_window(ctx, connection, ctx->mqtt.qos)) ||
+                (!publish(ctx, connection, topic, payload, payload_length));
+        }
+        else
+        {
+            if (result < 0)
+            {
+                fprintf(stderr, "error: failed to read input\n");
+                ctx->exit_code = EXIT_FAILURE;
+            }
+            done = true;
+        }
+    }
+
+    free(buffer);
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+}
+
+// publishes the messages of a capture, keeping the recorded intervals
+// scaled by the speed; payloads are published from the mapping
+static void mqtt_pub_replay(struct context * ctx, struct mqtt_pool * pool)
+{
+    struct mqtt_capture_reader reader;
+    if (!mqtt_capture_reader_open(&reader, ctx->input))
+    {
+        fprintf(stderr, "error: failed to open capture\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    uint64_t first = 0;
+    uint64_t start = 0;
+    bool done = false;
+    struct mqtt_capture_message message;
+    while ((!done) && (mqtt_capture_reader_next(&reader, &message)))
+    {
+        if (0 == start)
+        {
+            first = message.timestamp;
+            start = mqtt_pacer_now();
+        }
+
+        if (0.0 < ctx->speed)
+        {
+            double const offset = (double) (message.timestamp - first) / ctx->speed;
+            mqtt_pacer_sleep_until(start + (uint64_t) offset);
+        }
+        if (0 < ctx->rate)
+        {
+            mqtt_pacer_wait(&ctx->pacer);
+        }
+
+        // as with streamed input, a topic is always published on the same connection
+        struct mqtt_connection * connection = pool_connection(pool, topic_hash(message.topic));
+        done = (!wait_window(ctx, connection, message.qos)) ||
+            (!publish_message(ctx, connection, message.topic, message.payload, message.payloadlen,
+                message.qos, message.retain));
+    }
+
+    if (reader.failed)
+    {
+        fprintf(stderr, "error: capture is truncated or corrupt\n");
+        ctx->exit_code = EXIT_FAILURE;
+    }
+    mqtt_capture_reader_close(&reader);
+}
+
+struct payload
+{
+    void * data;
+    size_t length;
+    bool mapped;
+    void * map;
+    size_t map_length;
+};
+
+static void payload_release(struct payload * payload)
+{
+    if (payload->mapped)
+    {
+        munmap(payload->map, payload->map_length);
+    }
+    else
+    {
+        free(payload->data);
+    }
+
+    payload->data = NULL;
+    payload->length = 0;
+    payload->mapped = false;
+}
+
+// maps a regular file into memory, so that it is passed to
+// mosquitto_publish without copying it before
+static bool payload_map(int fd, struct payload * payload)
+{
+    struct stat info;
+    if ((0 != fstat(fd, &info)) || (!S_ISREG(info.st_mode)))
+    {
+        return false;
+    }
+
+    // the payload starts at the current position, e.g. of a shared stdin,
+    // which may already be read in part; mappings start at a page boundary
+    off_t const offset = lseek(fd, 0, SEEK_CUR);
+    if (0 > offset)
+    {
+        return false;
+    }
+    off_t const size = (offset < info.st_size) ? (info.st_size - offset) : 0;
+
+    if (MQTT_MAX_PAYLOAD < size)
+    {
+        fprintf(stderr, "error: payload too large\n");
+        return false;
+    }
+
+    off_t const page_size = (off_t) sysconf(_SC_PAGESIZE);
+    off_t const base = offset - (offset % page_size);
+
+    payload->length = (size_t) size;
+    payload->mapped = (0 < payload->length);
+    payload->data = NULL;
+    payload->map = NULL;
+    payload->map_length = 0;
+    if (payload->mapped)
+    {
+        payload->map_length = payload->length + (size_t) (offset - base);
+        payload->map = mmap(NULL, payload->map_length, PROT_READ, MAP_PRIVATE, fd, base);
+        if (MAP_FAILED == payload->map)
+        {
+            payload->map = NULL;
+            payload->mapped = false;
+            return false;
+        }
+        payload->data = &((char *) payload->map)[offset - base];
+    }
+
+    // the payload is consumed as if it was read
+    lseek(fd, offset + size, SEEK_SET);
+
+    return true;
+}
+
+// reads a payload from a stream that cannot be mapped, e.g. a pipe
+static bool payload_read(int fd, struct payload * payload)
+{
+    size_t capacity = 64 * 1024;
+    payload->data = malloc(capacity);
+    payload->length = 0;
+    payload->mapped = false;
+
+    bool result = (NULL != payload->data);
+    while (result)
+    {
+        if (payload->length == capacity)
+        {
+            capacity *= 2;
+            void * const data = realloc(payload->data, capacity);
+            if (NULL == data)
+            {
+                result = false;
+                break;
+            }
+            payload->data = data;
+        }
+
+        ssize_t const count = read(fd, &((char *) payload->data)[payload->length], capacity - payload->length);
+        if (0 < count)
+        {
+            payload->length += (size_t) count;
+        }
+        else if ((0 > count) && (EINTR == errno))
+        {
+            continue;
+        }
+        else
+        {
+            result = (0 == count);
+            break;
+        }
+
+        if (MQTT_MAX_PAYLOAD < payload->length)
+        {
+            fprintf(stderr, "error: payload too large\n");
+            result = false;
+        }
+    }
+
+    if (!result)
+    {
+        payload_release(payload);
+    }
+
+    return result;
+}
+
+static bool payload_load(char const * path, struct payload * payload)
+{
+    int const fd = open(path, O_RDONLY);
+    if (0 > fd)
+    {
+        return false;
+    }
+
+    // files, which cannot be mapped, e.g. /dev/stdin or FIFOs, are read
+    bool const result = (payload_map(fd, payload)) || (payload_read(fd, payload));
+    close(fd);
+
+    return result;
+}
+
+static void mqtt_pub_file(struct context * ctx, struct mqtt_connection * connection)
+{
+    struct payload payload;
+    bool loaded = false;
+    if (ctx->mode == INPUT_STDIN)
+    {
+        loaded = payload_map(STDIN_FILENO, &payload) || payload_read(STDIN_FILENO, &payload);
+    }
+    else
+    {
+        loaded = payload_load(ctx->input, &payload);
+    }
+
+    if (!loaded)
+    {
+        fprintf(stderr, "error: failed to read payload\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    publish(ctx, connection, ctx->topic, payload.data, payload.length);
+    payload_release(&payload);
+}
+
+static int is_entry_visible(struct dirent const * entry)
+{
+    return ('.' != entry->d_name[0]);
+}
+
+static void mqtt_pub_directory(struct context * ctx, struct mqtt_connection * connection)
+{
+    int const dir_fd = open(ctx->input, O_RDONLY | O_DIRECTORY);
+    struct dirent * * entries = NULL;
+    int const count = (0 <= dir_fd) ? scandir(ctx->input, &entries, &is_entry_visible, &alphasort) : -1;
+    if (0 > count)
+    {
+        fprintf(stderr, "error: failed to read directory\n");
+        ctx->exit_code = EXIT_FAILURE;
+        if (0 <= dir_fd)
+        {
+            close(dir_fd);
+        }
+        return;
+    }
+
+    bool done = false;
+    for (int i = 0; i < count; i++)
+    {
+        if ((!done) && (wait_window(ctx, connection, ctx->mqtt.qos)))
+        {
+            int const fd = openat(dir_fd, entries[i]->d_name, O_RDONLY);
+            struct payload payload;
+            // entries other than regular files, e.g. sub directories, are skipped
+            if ((0 <= fd) && (payload_map(fd, &payload)))
+            {
+                if (0 < ctx->rate)
+                {
+                    mqtt_pacer_wait(&ctx->pacer);
+                }
+                done = !publish(ctx, connection, ctx->topic, payload.data, payload.length);
+                payload_release(&payload);
+            }
+            if (0 <= fd)
+            {
+                close(fd);
+            }
+        }
+        else
+        {
+            done = true;
+        }
+        free(entries[i]);
+    }
+
+    free(entries);
+    close(dir_fd);
+}
+
+// connection of a local client to the daemon; requests are read into
+// the buffer and published, once they are complete; while the next request
+// cannot be published without waiting, the client is stalled and not read
+struct daemon_client
+{
+    struct daemon * daemon;
+    struct daemon_client * next;
+    int fd;
+    unsigned char * buffer;
+    size_t length;
+    size_t capacity;
+    uint32_t rejected;
+    bool watched;
+    bool stalled;
+    uint64_t stalled_since;
+};
+
+// the daemon never waits for a connection, so that signals and other clients
+// are handled meanwhile; connections signal ready_fd, once they may accept
+// a message again
+struct daemon
+{
+    struct context * ctx;
+    struct mqtt_event_loop * loop;
+    struct daemon_client * clients;
+    int ready_fd;
+
+    // once queued, messages are queued, until the queue is drained and
+    // committed, so that they keep their order (see drain_queue)
+    bool draining;
+    unsigned int unconfirmed;
+    unsigned int lost;
+};
+
+static void daemon_client_close(struct daemon_client * client)
+{
+    struct daemon_client * * current = &client->daemon->clients;
+    while (*current != client)
+    {
+        current = &(*current)->next;
+    }
+    *current = client->next;
+
+    if (client->watched)
+    {
+        mqtt_event_loop_remove(client->daemon->loop, client->fd);
+    }
+    close(client->fd);
+    free(client->buffer);
+    free(client);
+}
+
+// returns true, if all connections are ready to publish; with confirm, all
+// published messages must be delivered, otherwise the window must allow one more
+static bool daemon_pool_ready(struct daemon * daemon, bool confirm)
+{
+    struct context * ctx = daemon->ctx;
+
+    bool ready = true;
+    for (size_t i = 0; (ready) && (i < mqtt_pool_size(ctx->pool)); i++)
+    {
+        struct mqtt_connection * connection = mqtt_pool_get(ctx->pool, i);
+        ready = mqtt_connection_ready(connection, confirm ? 0 : window_limit(ctx, connection, 1), daemon->ready_fd);
+    }
+
+    return ready;
+}
+
+static void daemon_start_draining(struct daemon * daemon)
+{
+    if (!daemon->draining)
+    {
+        daemon->draining = true;
+        daemon->unconfirmed = 0;
+        daemon->lost = mqtt_pool_lost(daemon->ctx->pool);
+    }
+}
+
+// publishes queued messages like drain_queue, but only as long as this does
+// not need to wait; called whenever a connection may have become ready
+static void daemon_drain(struct daemon * daemon)
+{
+    struct context * ctx = daemon->ctx;
+
+    bool progress = daemon->draining;
+    while (progress)
+    {
+        // messages are committed in batches, once all of them are delivered
+        bool const confirm = (QUEUE_COMMIT_INTERVAL <= daemon->unconfirmed) || (mqtt_spool_empty(ctx->queue));
+        progress = daemon_pool_ready(daemon, confirm);
+        if ((progress) && (confirm))
+        {
+            unsigned int const lost = mqtt_pool_lost(ctx->pool);
+            if (lost == daemon->lost)
+            {
+                mqtt_spool_commit(ctx->queue);
+                daemon->draining = !mqtt_spool_empty(ctx->queue);
+                progress = daemon->draining;
+            }
+            else
+            {
+                atomic_fetch_add(&ctx->resent, lost - daemon->lost);
+                mqtt_spool_rewind(ctx->queue);
+                daemon->lost = lost;
+            }
+            daemon->unconfirmed = 0;
+        }
+        else if (progress)
+        {
+            struct mqtt_capture_message message;
+            if (mqtt_spool_next(ctx->queue, &message))
+            {
+                struct mqtt_connection * connection = pool_connection(ctx->pool, topic_hash(message.topic));
+                bool const sent = send_message(ctx, connection, message.topic, message.payload,
+                    message.payloadlen, message.qos, message.retain);
+                daemon->unconfirmed++;
+
+                // as with drain_queue, a message, which failed while connected, is skipped
+                if ((!sent) && (mqtt_connection_connected(connection)))
+                {
+                    ctx->exit_code = EXIT_FAILURE;
+                }
+                else if (!sent)
+                {
+                    mqtt_spool_rewind(ctx->queue);
+                    daemon->unconfirmed = 0;
+                    progress = false;
+                }
+            }
+        }
+    }
+}
+
+// publishes or queues a request without waiting; returns false, if the
+// client is stalled, since the connection is not ready
+static bool daemon_publish(struct daemon_client * client, char const * topic,
+    void const * payload, size_t length, int qos, bool retain)
+{
+    struct daemon * daemon = client->daemon;
+    struct context * ctx = daemon->ctx;
+
+    // as with streamed input, a topic is always published on the same connection
+    struct mqtt_connection * connection = pool_connection(ctx->pool, topic_hash(topic));
+    if ((NULL != ctx->queue) && ((daemon->draining) || (!mqtt_connection_connected(connection))))
+    {
+        daemon_start_draining(daemon);
+        client->stalled = false;
+        if (!queue_message(ctx, topic, payload, length, qos, retain))
+        {
+            client->rejected++;
+        }
+        return true;
+    }
+
+    uint64_t const now = mqtt_stats_now();
+    if (!mqtt_connection_ready(connection, window_limit(ctx, connection, qos), daemon->ready_fd))
+    {
+        if (!client->stalled)
+        {
+            client->stalled = true;
+            client->stalled_since = now;
+        }
+
+        // as without daemon, waiting for a reconnect is given up after the flush timeout
+        bool const expired = (0 < ctx->flush_timeout) &&
+            (((uint64_t) ctx->flush_timeout * 1000000ULL) <= now - client->stalled_since);
+        if ((!expired) || (mqtt_connection_connected(connection)))
+        {
+            return false;
+        }
+
+        fprintf(stderr, "error: failed to publish message, since the broker is unreachable\n");
+        ctx->exit_code = EXIT_FAILURE;
+        client->stalled = false;
+        client->rejected++;
+        return true;
+    }
+
+    client->stalled = false;
+    if (!send_message(ctx, connection, topic, payload, length, qos, retain))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        client->rejected++;
+    }
+
+    return true;
+}
+
+static void daemon_on_client(void * user_data, int fd, uint32_t events);
+
+// publishes all complete requests of the buffer, until the client is stalled;
+// the client is read only while it is not stalled;
+// returns false, if a request is malformed
+static bool daemon_client_process(struct daemon_client * client)
+{
+    size_t offset = 0;
+    size_t needed = 0;
+    bool stalled = false;
+    while ((0 == needed) && (!stalled) && (REQUEST_HEADER_SIZE <= client->length - offset))
+    {
+        unsigned char * const request = &client->buffer[offset];
+        size_t const size = ((size_t) request[0] << 24) | ((size_t) request[1] << 16) |
+            ((size_t) request[2] << 8) | ((size_t) request[3]);
+        size_t const topic_length = ((size_t) request[5] << 8) | ((size_t) request[6]);
+        if ((size < 1 + 2 + topic_length) || (0 == topic_length) ||
+            (MQTT_MAX_PAYLOAD < size - (1 + 2 + topic_length)))
+        {
+            return false;
+        }
+
+        if (client->length - offset < 4 + size)
+        {
+            needed = 4 + size;
+        }
+        else
+        {
+            char const * const topic = (char const *) &request[REQUEST_HEADER_SIZE];
+            if ('\0' != topic[topic_length - 1])
+            {
+                return false;
+            }
+
+            int const qos = request[4] & 0x03;
+            bool const retain = (0 != (request[4] & 0x04));
+            void const * const payload = &request[REQUEST_HEADER_SIZE + topic_length];
+            size_t const payload_length = size - (1 + 2 + topic_length);
+
+            stalled = !daemon_publish(client, topic, payload, payload_length, qos, retain);
+            if (!stalled)
+            {
+                offset += 4 + size;
+            }
+        }
+    }
+
+    client->length -= offset;
+    memmove(client->buffer, &client->buffer[offset], client->length);
+
+    // the buffer grows for requests larger than it
+    if (client->capacity < needed)
+    {
+        unsigned char * const buffer = realloc(client->buffer, needed);
+        if (NULL == buffer)
+        {
+            return false;
+        }
+        client->buffer = buffer;
+        client->capacity = needed;
+    }
+
+    // a stalled client is not watched, since its socket stays readable
+    if ((stalled) && (client->watched))
+    {
+        mqtt_event_loop_remove(client->daemon->loop, client->fd);
+        client->watched = false;
+    }
+    else if ((!stalled) && (!client->watched))
+    {
+        client->watched = mqtt_event_loop_add(client->daemon->loop, client->fd, EPOLLIN,
+            &daemon_on_client, client);
+        if (!client->watched)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void daemon_on_client(void * user_data, int fd, uint32_t events)
+{
+    (void) events; // unused
+    struct daemon_client * client = user_data;
+
+    ssize_t const count = read(fd, &client->buffer[client->length], client->capacity - client->length);
+    if (0 < count)
+    {
+        client->length += (size_t) count;
+        if (!daemon_client_process(client))
+        {
+            fprintf(stderr, "warning: malformed request from client\n");
+            daemon_client_close(client);
+        }
+    }
+    else if ((0 == count) || (EINTR != errno))
+    {
+        // the client waits for the result, once it sent all requests
+        if ((0 == count) && (0 == client->length))
+        {
+            unsigned char const result[4] = {
+                (unsigned char) (client->rejected >> 24), (unsigned char) (client->rejected >> 16),
+                (unsigned char) (client->rejected >> 8), (unsigned char) client->rejected
+            };
+            if (sizeof(result) != write(fd, result, sizeof(result)))
+            {
+                fprintf(stderr, "warning: failed to send result to client\n");
+            }
+        }
+        else
+        {
+            fprintf(stderr, "warning: connection to client lost\n");
+        }
+        daemon_client_close(client);
+    }
+}
+
+// resumes the queue and the stalled clients, once a connection signaled
+// ready_fd or the retry interval elapsed
+static void daemon_resume(struct daemon * daemon)
+{
+    daemon_drain(daemon);
+
+    struct daemon_client * next = NULL;
+    for (struct daemon_client * client = daemon->clients; NULL != client; client = next)
+    {
+        next = client->next;
+        if ((client->stalled) && (!daemon_client_process(client)))
+        {
+            fprintf(stderr, "warning: malformed request from client\n");
+            daemon_client_close(client);
+        }
+    }
+}
+
+static void daemon_on_ready(void * user_data, int fd, uint32_t events)
+{
+    (void) user_data; // unused
+    (void) events; // unused
+
+    // the daemon resumes after each dispatch
+    uint64_t value = 0;
+    ssize_t const count = read(fd, &value, sizeof(value));
+    (void) count; // unused
+}
+
+static bool daemon_stalled(struct daemon * daemon)
+{
+    bool stalled = daemon->draining;
+    for (struct daemon_client * client = daemon->clients; (!stalled) && (NULL != client); client = client->next)
+    {
+        stalled = client->stalled;
+    }
+
+    return stalled;
+}
+
+static void daemon_on_accept(void * user_data, int fd, uint32_t events)
+{
+    (void) events; // unused
+    struct daemon * daemon = user_data;
+
+    int const client_fd = accept(fd, NULL, NULL);
+    if (0 > client_fd)
+    {
+        return;
+    }
+
+    struct daemon_client * client = malloc(sizeof(struct daemon_client));
+    unsigned char * buffer = malloc(DAEMON_BUFFER_SIZE);
+    if ((NULL == client) || (NULL == buffer))
+    {
+        fprintf(stderr, "error: failed to allocate client\n");
+        free(buffer);
+        free(client);
+        close(client_fd);
+        return;
+    }
+
+    client->daemon = daemon;
+    client->fd = client_fd;
+    client->buffer = buffer;
+    client->length = 0;
+    client->capacity = DAEMON_BUFFER_SIZE;
+    client->rejected = 0;
+    client->stalled = false;
+    client->stalled_since = 0;
+    client->next = daemon->clients;
+    daemon->clients = client;
+
+    client->watched = mqtt_event_loop_add(daemon->loop, client_fd, EPOLLIN, &daemon_on_client, client);
+    if (!client->watched)
+    {
+        daemon_client_close(client);
+    }
+}
+
+static void daemon_on_signal(void * user_data, int fd, uint32_t events)
+{
+    (void) events; // unused
+
+    struct signalfd_siginfo info;
+    if (sizeof(info) == read(fd, &info, sizeof(info)))
+    {
+        mqtt_event_loop_stop(user_data);
+    }
+}
+
+// fills the address of the daemon's socket; returns false, if the path
+// does not fit
+static bool daemon_address(char const * path, struct sockaddr_un * address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (sizeof(address->sun_path) <= strlen(path))
+    {
+        fprintf(stderr, "error: socket path too long\n");
+        return false;
+    }
+    strcpy(address->sun_path, path);
+
+    return true;
+}
+
+// returns 0, if a daemon accepts connections on the socket,
+// or the error of the connect otherwise
+static int daemon_probe(struct sockaddr_un const * address)
+{
+    int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (0 > fd)
+    {
+        return errno;
+    }
+
+    int const error = (0 == connect(fd, (struct sockaddr const *) address, sizeof(*address))) ? 0 : errno;
+    close(fd);
+
+    return error;
+}
+
+// returns the listening socket or -1 on error; a socket left by a
+// previous daemon is replaced, unless the daemon is still running
+static int daemon_listen(char const * path)
+{
+    struct sockaddr_un address;
+    if (!daemon_address(path, &address))
+    {
+        return -1;
+    }
+
+    struct stat info;
+    if ((0 == stat(path, &info)) && (S_ISSOCK(info.st_mode)))
+    {
+        int const error = daemon_probe(&address);
+        if (0 == error)
+        {
+            fprintf(stderr, "error: daemon already running on %s\n", path);
+            return -1;
+        }
+
+        // only a socket, which refuses connections, is stale
+        if (ECONNREFUSED == error)
+        {
+            unlink(path);
+        }
+    }
+
+    int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((0 > fd) || (0 != bind(fd, (struct sockaddr const *) &address, sizeof(address))) ||
+        (0 != listen(fd, SOMAXCONN)))
+    {
+        fprintf(stderr, "error: failed to listen on %s\n", path);
+        if (0 <= fd)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+// the signals, which stop the daemon, are blocked before any thread
+// is created, so that they are only received via signalfd
+static void daemon_signals(sigset_t * signals)
+{
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+}
+
+// publishes requests of local clients on the connections of the pool,
+// until SIGINT or SIGTERM is received; all requests are handled by
+// the calling thread
+static void mqtt_pub_daemon(struct context * ctx)
+{
+    sigset_t signals;
+    daemon_signals(&signals);
+
+    struct daemon daemon = {
+        .ctx = ctx,
+        .loop = mqtt_event_loop_create(),
+        .clients = NULL,
+        .ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        .draining = false,
+        .unconfirmed = 0,
+        .lost = 0
+    };
+    int const listen_fd = daemon_listen(ctx->input);
+    int const signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    bool const ok = (NULL != daemon.loop) && (0 <= listen_fd) && (0 <= signal_fd) && (0 <= daemon.ready_fd) &&
+        (mqtt_event_loop_add(daemon.loop, signal_fd, EPOLLIN, &daemon_on_signal, daemon.loop)) &&
+        (mqtt_event_loop_add(daemon.loop, daemon.ready_fd, EPOLLIN, &daemon_on_ready, &daemon)) &&
+        (mqtt_event_loop_add(daemon.loop, listen_fd, EPOLLIN, &daemon_on_accept, &daemon));
+    if (ok)
+    {
+        // messages queued by a previous process are published first
+        if ((NULL != ctx->queue) && (!mqtt_spool_empty(ctx->queue)))
+        {
+            daemon_start_draining(&daemon);
+        }
+
+        daemon_resume(&daemon);
+        while (mqtt_event_loop_dispatch(daemon.loop, daemon_stalled(&daemon) ? DAEMON_RETRY_INTERVAL : -1))
+        {
+            daemon_resume(&daemon);
+        }
+
+        // messages, which are not confirmed, are published again
+        if ((daemon.draining) && (0 < daemon.unconfirmed))
+        {
+            mqtt_spool_rewind(ctx->queue);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "error: failed to start daemon\n");
+        ctx->exit_code = EXIT_FAILURE;
+    }
+
+    while (NULL != daemon.clients)
+    {
+        daemon_client_close(daemon.clients);
+    }
+    mqtt_event_loop_destroy(daemon.loop);
+    if (0 <= daemon.ready_fd)
+    {
+        close(daemon.ready_fd);
+    }
+    if (0 <= signal_fd)
+    {
+        close(signal_fd);
+    }
+    if (0 <= listen_fd)
+    {
+        close(listen_fd);
+        unlink(ctx->input);
+    }
+}
+
+// counters maintained by the connections are collected on each report
+static void mqtt_pub_collect(void * user_data, struct mqtt_stats * stats)
+{
+    struct context * ctx = user_data;
+    struct mqtt_pool * pool = ctx->pool;
+
+    unsigned long reconnects = 0;
+    unsigned long pending = 0;
+    unsigned long dropped = (NULL != ctx->queue) ? mqtt_spool_dropped(ctx->queue) : 0;
+    if (NULL != pool)
+    {
+        for (size_t i = 0; i < mqtt_pool_size(pool); i++)
+        {
+            struct mqtt_connection * connection = mqtt_pool_get(pool, i);
+            reconnects += mqtt_connection_disconnects(connection);
+            pending += mqtt_connection_pending(connection);
+        }
+        dropped += mqtt_pool_lost(pool) - atomic_load(&ctx->resent);
+    }
+
+    atomic_store(&stats->reconnects, reconnects);
+    atomic_store(&stats->queue_depth, pending);
+    atomic_store(&stats->dropped, dropped);
+}
+
+// publishes the input on the connections of the pool or, with a socket, via the daemon
+static void mqtt_pub_input(struct context * ctx)
+{
+    struct mqtt_connection * connection = pool_connection(ctx->pool, 0);
+    switch (ctx->mode)
+    {
+        case INPUT_MESSAGE:
+            publish(ctx, connection, ctx->topic, ctx->message, strlen(ctx->message));
+            break;
+        case INPUT_FILE:
+            // fall-through
+        case INPUT_STDIN:
+            mqtt_pub_file(ctx, connection);
+            break;
+        case INPUT_DIRECTORY:
+            mqtt_pub_directory(ctx, connection);
+            break;
+        case INPUT_REPLAY:
+            mqtt_pub_replay(ctx, ctx->pool);
+            break;
+        case INPUT_DAEMON:
+            mqtt_pub_daemon(ctx);
+            break;
+        default:
+            mqtt_pub_stream(ctx, ctx->pool);
+            break;
+    }
+}
+
+// client of the daemon: input is read as without the daemon, but sent to the
+// daemon, which holds the connections, e.g. to skip connect and TLS handshake
+static void mqtt_pub_client(struct context * ctx)
+{
+    struct sockaddr_un address;
+    if (!daemon_address(ctx->socket_path, &address))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((0 > fd) || (0 != connect(fd, (struct sockaddr const *) &address, sizeof(address))))
+    {
+        fprintf(stderr, "error: failed to connect to daemon %s\n", ctx->socket_path);
+        ctx->exit_code = EXIT_FAILURE;
+        if (0 <= fd)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    ctx->client = fdopen(fd, "wb");
+    if (NULL == ctx->client)
+    {
+        fprintf(stderr, "error: failed to connect to daemon %s\n", ctx->socket_path);
+        ctx->exit_code = EXIT_FAILURE;
+        close(fd);
+        return;
+    }
+
+    mqtt_pub_input(ctx);
+
+    // the daemon answers with the number of rejected messages,
+    // once it has read all requests
+    unsigned char result[4];
+    if ((0 != fflush(ctx->client)) || (0 != shutdown(fd, SHUT_WR)) ||
+        (sizeof(result) != read(fd, result, sizeof(result))))
+    {
+        fprintf(stderr, "error: connection to daemon lost\n");
+        ctx->exit_code = EXIT_FAILURE;
+    }
+    else
+    {
+        uint32_t const rejected = ((uint32_t) result[0] << 24) | ((uint32_t) result[1] << 16) |
+            ((uint32_t) result[2] << 8) | ((uint32_t) result[3]);
+        if (0 < rejected)
+        {
+            fprintf(stderr, "error: %u message(s) rejected by daemon\n", rejected);
+            ctx->exit_code = EXIT_FAILURE;
+        }
+    }
+
+    fclose(ctx->client);
+    ctx->client = NULL;
+}
+
+static void mqtt_pub(struct context * ctx)
+{
+    // the client does not connect to the broker at all
+    if (NULL != ctx->socket_path)
+    {
+        mqtt_pub_client(ctx);
+        return;
+    }
+
+    if (ctx->mode == INPUT_DAEMON)
+    {
+        sigset_t signals;
+        daemon_signals(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+
+    int rc = mosquitto_lib_init();
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to init mosquitto library\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    if (NULL != ctx->queue_path)
+    {
+        ctx->queue = mqtt_spool_open(ctx->queue_path, (unsigned long long) ctx->queue_size * 1024 * 1024,
+            ctx->queue_policy, ctx->queue_sync);
+        if (NULL == ctx->queue)
+        {
+            ctx->exit_code = EXIT_FAILURE;
+            mosquitto_lib_cleanup();
+            return;
+        }
+    }
+
+    // the reporter is set up before the first connection thread is created
+    struct mqtt_stats_reporter reporter;
+    mqtt_stats_reporter_init(&reporter, &ctx->stats, "mqtt_pub",
+        ctx->mqtt.stats_interval, ctx->mqtt.stats_file);
+
+    // each connection runs its network loop in a thread of its own;
+    // with a queue, messages are queued, if the broker is unreachable
+    ctx->pool = mqtt_pool_create(&ctx->mqtt, ctx->connections, ctx->connect_retries, NULL != ctx->queue);
+    if (NULL == ctx->pool)
+    {
+        mqtt_spool_close(ctx->queue);
+        ctx->queue = NULL;
+        ctx->exit_code = EXIT_FAILURE;
+        mosquitto_lib_cleanup();
+        return;
+    }
+    mqtt_stats_reporter_start(&reporter, &mqtt_pub_collect, ctx);
+
+    mqtt_pub_input(ctx);
+
+    // messages queued during an outage, which is over, are published before exit
+    if (NULL != ctx->queue)
+    {
+        drain_queue(ctx);
+    }
+
+    if (!mqtt_pool_wait(ctx->pool, ctx->flush_timeout))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+    }
+
+    // connections are stopped first, so that losses are final when counted
+    for (size_t i = 0; i < mqtt_pool_size(ctx->pool); i++)
+    {
+        mqtt_connection_stop(mqtt_pool_get(ctx->pool, i));
+    }
+
+    // lost messages, which were published again from the queue, are not counted
+    unsigned int const lost = mqtt_pool_lost(ctx->pool) - atomic_load(&ctx->resent);
+    if (0 < lost)
+    {
+        fprintf(stderr, "error: %u message(s) lost due to connection loss\n", lost);
+        ctx->exit_code = EXIT_FAILURE;
+    }
+
+    if (NULL != ctx->queue)
+    {
+        unsigned long const dropped = mqtt_spool_dropped(ctx->queue);
+        if (0 < dropped)
+        {
+            fprintf(stderr, "error: %lu message(s) dropped, since the queue is full\n", dropped);
+            ctx->exit_code = EXIT_FAILURE;
+        }
+        if (!mqtt_spool_empty(ctx->queue))
+        {
+            fprintf(stderr, "warning: messages are queued in %s, until the broker is reachable\n",
+                ctx->queue_path);
+        }
+    }
+    mqtt_stats_reporter_stop(&reporter);
+
+    mqtt_pool_destroy(ctx->pool);
+    ctx->pool = NULL;
+    mqtt_spool_close(ctx->queue);
+    ctx->queue = NULL;
     mosquitto_lib_cleanup();
 }
 
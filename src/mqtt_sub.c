@@ -1,34 +1,118 @@
+#include "mqtt_options.h"
+#include "mqtt_connection.h"
+#include "mpsc_queue.h"
+#include "spsc_ring.h"
+#include "slab.h"
+#include "mqtt_stats.h"
+#include "topic_filter.h"
+#include "mqtt_capture.h"
+#include "mqtt_compress.h"
+#include "mqtt_event_loop.h"
+#include "mqtt_trace.h"
+
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
 
 #include <getopt.h>
 #include <errno.h>
+#include <regex.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/signalfd.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #define LOOP_INTERVAL (1000)
 
-#define MQTT_DEFAULT_PORT (1883)
-#define MQTT_KEEPALIVE    (60 * 1000)
-#define MQTT_QOS             (0)
+#define MQTT_CONNACK_SESSION_PRESENT (0x01)
+
+#define DEFAULT_QUEUE_SIZE (1024)
+
+// retained messages are sent right after SUBACK, so a short pause ends them
+#define DEFAULT_SNAPSHOT_IDLE (1000)
+#define SNAPSHOT_POLL_INTERVAL (50)
+#define SNAPSHOT_INITIAL_CAPACITY (1024)
+
+// a batch is written early, when it exceeds this size
+#define BATCH_MAX_BYTES (16 * 1024 * 1024)
+
+// codes of long options without a short option
+#define OPTION_BATCH_SIZE    (512)
+#define OPTION_BATCH_TIMEOUT (513)
+#define OPTION_BATCH_FRAMING (514)
+#define OPTION_BATCH_DIR     (515)
+#define OPTION_RECORD        (516)
+#define OPTION_DICTIONARY    (517)
+#define OPTION_TRACE         (518)
+#define OPTION_SNAPSHOT_IDLE (519)
+#define OPTION_SNAPSHOT_FILE (520)
 
 enum command {
     COMMAND_SUB,
     COMMAND_SHOW_HELP
 };
 
+enum loop_mode {
+    LOOP_POLL,
+    LOOP_THREAD,
+    LOOP_EPOLL
+};
+
+enum output_format {
+    OUTPUT_VERBOSE,
+    OUTPUT_LINE,
+    OUTPUT_RAW,
+    OUTPUT_JSON
+};
+
+enum batch_framing {
+    FRAMING_NEWLINE,
+    FRAMING_LENGTH
+};
+
 struct context
 {
-    char * id;
-    char * user;
-    char * password;
-    char * host;
-    int port;
-    char * topic;
+    struct mqtt_options mqtt;
+    char * * topics;
+    int topic_count;
     bool retain;
+    unsigned int snapshot_idle;
+    char * snapshot_file;
+    bool persistent;
+    char * group;
+    unsigned int connections;
+    enum loop_mode loop_mode;
+    enum output_format format;
+    unsigned int queue_size;
+    enum spsc_ring_policy overflow;
+    size_t pool_limit;
+    bool pool_stats;
+    struct topic_filter filter;
+    char * grep;
+    size_t grep_length;
+    char * regex_pattern;
+    regex_t regex;
+    bool has_regex;
+    bool batching;
+    unsigned int batch_size;
+    unsigned int batch_timeout;
+    enum batch_framing framing;
+    char * batch_dir;
+    char * record;
+    char * dictionary_path;
+    struct mqtt_dictionary dictionary;
+    bool tracing;
+    struct mqtt_trace trace;
+    struct mqtt_stats stats;
     enum command cmd;
     int exit_code;
 };
@@ -37,35 +121,177 @@ static void print_usage(void)
 {
     printf(
         "mqtt_sub, (c) 2024 Falk Werner <github.com/falk-werner>\n"
-        "Subscribe to a MQTT topic\n"
+        "Subscribe to MQTT topics\n"
         "\n"
         "Usage:\n"
         "    mqtt_sub [-h host] [-p port] [-u user] [-P password]\n"
-        "             [-i client-id] [-r] -t topic\n"
+        "             [-i client-id [-c]] [-q qos] [-V 311|5] [-r]\n"
+        "             [-b min-delay] [-B max-delay]\n"
+        "             [-l poll|thread|epoll] [-n max-packets] [-g group [-C connections]]\n"
+        "             [-Q queue-size] [-O block|drop-oldest|drop-newest]\n"
+        "             [-m pool-limit] [-s]\n"
+        "             [-f filter ...] [-e text] [-E regex]\n"
+        "             [--batch-size count] [--batch-timeout timeout]\n"
+        "             [--batch-framing newline|length] [--batch-dir directory]\n"
+        "             [--record file] [--dictionary file] [--trace]\n"
+        "             [--stats-interval interval] [--stats-file file]\n"
+        "             [--tls] [--cafile file] [--cert file [--key file]]\n"
+        "             [--tls-version version] [--tls-session file]\n"
+        "             [--keepalive seconds] [--nodelay] [--send-buffer bytes]\n"
+        "             [--receive-buffer bytes] [--bind-address address]\n"
+        "             [-F verbose|line|raw|json] -t topic [-t topic ...]\n"
+        "    mqtt_sub [...] -r [--snapshot-idle idle] [--snapshot-file file]\n"
+        "             -t topic [-t topic ...]\n"
         "\n"
         "Options:\n"
         "    -h, --host     : hostname of MQTT broker (default: localhost)\n"
-        "    -p, --port     : port of MQTT broker (default: 1883)\n"
+        "    -p, --port     : port of MQTT broker (default: 1883, 8883 with TLS)\n"
         "    -u, --user     : name of the MQTT user (default: <unset>)\n"
         "    -p, --password : password of the MQTT user (default: <unset>)\n"
         "    -i, --client-id: MQTT client id (default: <unset>)\n"
-        "    -r, --retain   : retain message (default: message is not retained)\n"
-        "    -t, --topic    : MQTT topic to publish (required)\n"
+        "    -c, --persistent: keep the session on the broker, so that QoS 1 and 2\n"
+        "                     messages are queued while disconnected (requires -i)\n"
+        "    -b, --reconnect-min: initial delay in milliseconds before reconnecting\n"
+        "                     (default: 1000)\n"
+        "    -B, --reconnect-max: maximum delay in milliseconds before reconnecting\n"
+        "                     (default: 30000)\n"
+        "    -q, --qos      : quality of service level 0, 1 or 2 (default: 0)\n"
+        "    -V, --protocol-version: MQTT protocol version 311 or 5; with 5, the\n"
+        "                     verbose and json formats include the message expiry\n"
+        "                     interval and user properties (default: 311)\n"
+        "    -r, --retain   : write a snapshot of the retained messages of the topics\n"
+        "                     and exit; the latest message of each topic is written\n"
+        "                     sorted by topic as record of mqtt_pub -k -L, i.e. 4 byte\n"
+        "                     big endian length followed by topic, space and payload;\n"
+        "                     cannot be combined with -l, -C, -Q or -O\n"
+        "    --snapshot-idle: time in milliseconds without retained messages, after\n"
+        "                     which the snapshot is complete (default: 1000)\n"
+        "    --snapshot-file: file to write the snapshot to, which is replaced at once\n"
+        "                     (default: stdout)\n"
+        "    -t, --topic    : MQTT topic to subscribe (required, may be repeated)\n"
+        "    -g, --group    : subscribe as member of a shared subscription group\n"
+        "                     using MQTT 5 ($share/<group>/<topic>)\n"
+        "    -C, --connections: number of connections of the group, each handling\n"
+        "                     messages in a thread of its own unless -l epoll\n"
+        "                     is used (default: 1)\n"
+    );
+
+    // split, since ISO C limits the length of string literals
+    printf(
+        "    -l, --loop     : network loop to use (default: poll)\n"
+        "                     poll:   poll the network from the main thread\n"
+        "                     thread: run the network loop in its own thread\n"
+        "                     epoll:  drive all connections from the main thread\n"
+        "                             using epoll, without a thread per connection\n"
+        "    -n, --max-packets: maximum number of packets to process per\n"
+        "                     loop iteration (default: 1)\n"
+        "    -F, --format   : output format of received messages (default: verbose)\n"
+        "                     verbose: multi-line description of each message\n"
+        "                     line:    topic and payload on a single line\n"
+        "                     raw:     payload only, one message per line\n"
+        "                     json:    newline-delimited JSON objects; payloads,\n"
+        "                              which are not UTF-8, are base64 encoded\n"
+        "    -Q, --queue-size: number of received messages queued for output;\n"
+        "                     0 writes output from the network loop (default: 1024)\n"
+        "    -O, --overflow : what to do when the queue is full (default: block)\n"
+        "                     block:       wait for the output to catch up\n"
+        "                     drop-oldest: discard the oldest queued message\n"
+        "                     drop-newest: discard the received message\n"
+        "    -m, --pool-limit: maximum size of the pool for queued messages in MiB;\n"
+        "                     0 is unlimited (default: 0)\n"
+        "    -s, --pool-stats: print usage of the message pool on exit\n"
+    );
+
+    // split, since ISO C limits the length of string literals
+    printf(
+        "    -f, --filter   : only output messages, whose topic matches the filter;\n"
+        "                     supports + and # wildcards (may be repeated)\n"
+        "    -e, --grep     : only output messages, whose payload contains text\n"
+        "    -E, --regex    : only output messages, whose payload matches the\n"
+        "                     POSIX extended regular expression\n"
+        "    --batch-size   : number of messages written at once (default: 1)\n"
+        "    --batch-timeout: maximum time in milliseconds a message waits in\n"
+        "                     an incomplete batch; 0 waits for a full batch\n"
+        "                     (default: 0)\n"
+        "    --batch-framing: how messages are delimited in a batch\n"
+        "                     (default: newline)\n"
+        "                     newline: output of the format as is\n"
+        "                     length:  4 byte big endian length followed by\n"
+        "                              the output without trailing newline\n"
+        "    --batch-dir    : write each batch to a new file in the directory\n"
+        "                     instead of stdout (default: <unset>)\n"
+        "    --record       : write received messages to a capture file instead of\n"
+        "                     stdout, which can be replayed by mqtt_pub --replay\n"
+        "    --dictionary   : dictionary to decompress payloads with, which were\n"
+        "                     compressed by mqtt_pub --compress; compressed payloads\n"
+        "                     of MQTT 5 are decompressed in any case (default: <unset>)\n"
+        "    --trace        : measure the latency of messages stamped by mqtt_pub --trace\n"
+        "                     and check their sequence for gaps, reordering and duplicates;\n"
+        "                     a summary is added to the statistics, a report is\n"
+        "                     printed on exit\n"
+        "    --stats-interval: interval in milliseconds to print statistics to\n"
+        "                     stderr; 0 prints on SIGUSR1 only (default: 0)\n"
+        "    --stats-file   : file to write statistics to in Prometheus text\n"
+        "                     format, e.g. for node_exporter (default: <unset>)\n"
+        "    --tls          : connect via TLS, verifying the broker with the system's\n"
+        "                     CA certificates (default port: 8883)\n"
+        "    --cafile       : file of CA certificates to verify the broker; implies --tls\n"
+        "    --cert         : file of the client certificate chain; implies --tls\n"
+        "    --key          : file of the client key (default: --cert)\n"
+        "    --tls-version  : minimum TLS version tlsv1.2 or tlsv1.3 (default: tlsv1.2)\n"
+        "    --tls-session  : file to keep the TLS session in, so that it is resumed\n"
+        "                     by the next invocation; implies --tls (default: <unset>)\n"
+        "    --keepalive    : keepalive interval in seconds, after which a dead\n"
+        "                     connection is detected; 0 disables it (default: 60)\n"
+        "    --nodelay      : disable Nagle's algorithm (TCP_NODELAY), which trades\n"
+        "                     throughput for latency of small messages\n"
+        "    --send-buffer  : size of the socket send buffer in bytes\n"
+        "                     (default: chosen by the kernel)\n"
+        "    --receive-buffer: size of the socket receive buffer in bytes; it is\n"
+        "                     set after connect, so the TCP window scale agreed in the\n"
+        "                     handshake limits large sizes (default: chosen by the kernel)\n"
+        "    --bind-address : local address to connect from (default: <unset>)\n"
         "\n"
         "Example:\n"
         "    mqtt_sub -t test\n"
+        "    mqtt_sub -t 'sensors/#' -f 'sensors/+/temperature' -E '^-'\n"
+        "    mqtt_sub -t test --trace --stats-interval 1000\n"
+        "    mqtt_sub -r -t 'config/#' --snapshot-file config.snapshot\n"
     );
 }
 
 static void context_init(struct context * ctx, int argc, char* argv[])
 {
-    ctx->id = NULL;
-    ctx->user = NULL;
-    ctx->password = NULL;
-    ctx->host = strdup("localhost");
-    ctx->port = MQTT_DEFAULT_PORT;
-    ctx->topic = NULL;
+    mqtt_options_init(&ctx->mqtt);
+    ctx->topics = NULL;
+    ctx->topic_count = 0;
     ctx->retain = false;
+    ctx->snapshot_idle = DEFAULT_SNAPSHOT_IDLE;
+    ctx->snapshot_file = NULL;
+    ctx->persistent = false;
+    ctx->group = NULL;
+    ctx->connections = 1;
+    ctx->loop_mode = LOOP_POLL;
+    ctx->format = OUTPUT_VERBOSE;
+    ctx->queue_size = DEFAULT_QUEUE_SIZE;
+    ctx->overflow = SPSC_RING_BLOCK;
+    ctx->pool_limit = 0;
+    ctx->pool_stats = false;
+    topic_filter_init(&ctx->filter);
+    ctx->grep = NULL;
+    ctx->grep_length = 0;
+    ctx->regex_pattern = NULL;
+    ctx->has_regex = false;
+    ctx->batching = false;
+    ctx->batch_size = 0;
+    ctx->batch_timeout = 0;
+    ctx->framing = FRAMING_NEWLINE;
+    ctx->batch_dir = NULL;
+    ctx->record = NULL;
+    ctx->dictionary_path = NULL;
+    mqtt_dictionary_init(&ctx->dictionary);
+    ctx->tracing = false;
+    mqtt_stats_init(&ctx->stats);
     ctx->cmd = COMMAND_SUB;
     ctx->exit_code = EXIT_SUCCESS;
 
@@ -73,13 +299,31 @@ static void context_init(struct context * ctx, int argc, char* argv[])
     opterr = 0;
 
     struct option const long_opts[] = {
-        {"client-id", no_argument, 0, 'i'},
-        {"host", no_argument, 0, 'h'},
-        {"port", no_argument, 0, 'p'},
-        {"user", no_argument, 0, 'u'},
-        {"password", no_argument, 0, 'P'},
-        {"retain", no_argument, 0, 'r'},        
-        {"topic", no_argument, 0, 't'},
+        MQTT_OPTIONS_LONG,
+        {"retain", no_argument, 0, 'r'},
+        {"persistent", no_argument, 0, 'c'},
+        {"topic", required_argument, 0, 't'},
+        {"group", required_argument, 0, 'g'},
+        {"connections", required_argument, 0, 'C'},
+        {"loop", required_argument, 0, 'l'},
+        {"max-packets", required_argument, 0, 'n'},
+        {"format", required_argument, 0, 'F'},
+        {"queue-size", required_argument, 0, 'Q'},
+        {"overflow", required_argument, 0, 'O'},
+        {"pool-limit", required_argument, 0, 'm'},
+        {"pool-stats", no_argument, 0, 's'},
+        {"filter", required_argument, 0, 'f'},
+        {"grep", required_argument, 0, 'e'},
+        {"regex", required_argument, 0, 'E'},
+        {"batch-size", required_argument, 0, OPTION_BATCH_SIZE},
+        {"batch-timeout", required_argument, 0, OPTION_BATCH_TIMEOUT},
+        {"batch-framing", required_argument, 0, OPTION_BATCH_FRAMING},
+        {"batch-dir", required_argument, 0, OPTION_BATCH_DIR},
+        {"record", required_argument, 0, OPTION_RECORD},
+        {"dictionary", required_argument, 0, OPTION_DICTIONARY},
+        {"trace", no_argument, 0, OPTION_TRACE},
+        {"snapshot-idle", required_argument, 0, OPTION_SNAPSHOT_IDLE},
+        {"snapshot-file", required_argument, 0, OPTION_SNAPSHOT_FILE},
         {"help", no_argument, 0, 'H'},
         {NULL, 0, NULL, 0}
     };
@@ -88,37 +332,186 @@ static void context_init(struct context * ctx, int argc, char* argv[])
     while (!done)
     {
         int option_index = 0;
-        int const c = getopt_long(argc, argv, "i:h:p:u:P:rt:m:H", long_opts, &option_index);
+        int const c = getopt_long(argc, argv, MQTT_OPTIONS_SHORT "rct:g:C:l:n:F:Q:O:m:sf:e:E:H", long_opts, &option_index);
+        if (mqtt_options_parse(&ctx->mqtt, c, optarg))
+        {
+            continue;
+        }
+
         switch (c)
         {
             case -1:
                 done = true;
                 break;
-            case 'i':
-                free(ctx->id);
-                ctx->id = strdup(optarg);
+            case 'r':
+                ctx->retain = true;
+                break;
+            case 'c':
+                ctx->persistent = true;
+                ctx->mqtt.clean_session = false;
                 break;
-            case 'h':
-                free(ctx->host);
-                ctx->host = strdup(optarg);
+            case 't':
+                {
+                    char * * const topics = realloc(ctx->topics, sizeof(char *) * (size_t) (ctx->topic_count + 1));
+                    if (NULL != topics)
+                    {
+                        ctx->topics = topics;
+                        ctx->topics[ctx->topic_count++] = strdup(optarg);
+                    }
+                }
                 break;
-            case 'p':
-                ctx->port = atoi(optarg);
+            case 'g':
+                free(ctx->group);
+                ctx->group = strdup(optarg);
                 break;
-            case 'u':
-                free(ctx->user);
-                ctx->user = strdup(optarg);
+            case 'C':
+                ctx->connections = (unsigned int) atoi(optarg);
                 break;
-            case 'P':
-                free(ctx->password);
-                ctx->password = strdup(optarg);
+            case 'l':
+                if (0 == strcmp(optarg, "poll"))
+                {
+                    ctx->loop_mode = LOOP_POLL;
+                }
+                else if (0 == strcmp(optarg, "thread"))
+                {
+                    ctx->loop_mode = LOOP_THREAD;
+                }
+                else if (0 == strcmp(optarg, "epoll"))
+                {
+                    ctx->loop_mode = LOOP_EPOLL;
+                }
+                else
+                {
+                    fprintf(stderr, "error: unknown loop mode\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
                 break;
-            case 'r':
-                ctx->retain = true;
+            case 'n':
+                ctx->mqtt.max_packets = atoi(optarg);
                 break;
-            case 't':
-                free(ctx->topic);
-                ctx->topic = strdup(optarg);
+            case 'F':
+                if (0 == strcmp(optarg, "verbose"))
+                {
+                    ctx->format = OUTPUT_VERBOSE;
+                }
+                else if (0 == strcmp(optarg, "line"))
+                {
+                    ctx->format = OUTPUT_LINE;
+                }
+                else if (0 == strcmp(optarg, "raw"))
+                {
+                    ctx->format = OUTPUT_RAW;
+                }
+                else if (0 == strcmp(optarg, "json"))
+                {
+                    ctx->format = OUTPUT_JSON;
+                }
+                else
+                {
+                    fprintf(stderr, "error: unknown output format\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
+                break;
+            case 'Q':
+                ctx->queue_size = (unsigned int) atoi(optarg);
+                break;
+            case 'm':
+                ctx->pool_limit = (size_t) atoi(optarg) * 1024 * 1024;
+                break;
+            case 's':
+                ctx->pool_stats = true;
+                break;
+            case 'f':
+                if (!topic_filter_add(&ctx->filter, optarg))
+                {
+                    fprintf(stderr, "error: invalid topic filter\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
+                break;
+            case 'e':
+                free(ctx->grep);
+                ctx->grep = strdup(optarg);
+                ctx->grep_length = strlen(optarg);
+                break;
+            case 'E':
+                free(ctx->regex_pattern);
+                ctx->regex_pattern = strdup(optarg);
+                break;
+            case OPTION_BATCH_SIZE:
+                ctx->batching = true;
+                ctx->batch_size = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_BATCH_TIMEOUT:
+                ctx->batching = true;
+                ctx->batch_timeout = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_BATCH_FRAMING:
+                ctx->batching = true;
+                if (0 == strcmp(optarg, "newline"))
+                {
+                    ctx->framing = FRAMING_NEWLINE;
+                }
+                else if (0 == strcmp(optarg, "length"))
+                {
+                    ctx->framing = FRAMING_LENGTH;
+                }
+                else
+                {
+                    fprintf(stderr, "error: unknown batch framing\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
+                break;
+            case OPTION_BATCH_DIR:
+                ctx->batching = true;
+                free(ctx->batch_dir);
+                ctx->batch_dir = strdup(optarg);
+                break;
+            case OPTION_RECORD:
+                free(ctx->record);
+                ctx->record = strdup(optarg);
+                break;
+            case OPTION_DICTIONARY:
+                free(ctx->dictionary_path);
+                ctx->dictionary_path = strdup(optarg);
+                break;
+            case OPTION_TRACE:
+                ctx->tracing = true;
+                break;
+            case OPTION_SNAPSHOT_IDLE:
+                ctx->snapshot_idle = (unsigned int) atoi(optarg);
+                break;
+            case OPTION_SNAPSHOT_FILE:
+                free(ctx->snapshot_file);
+                ctx->snapshot_file = strdup(optarg);
+                break;
+            case 'O':
+                if (0 == strcmp(optarg, "block"))
+                {
+                    ctx->overflow = SPSC_RING_BLOCK;
+                }
+                else if (0 == strcmp(optarg, "drop-oldest"))
+                {
+                    ctx->overflow = SPSC_RING_DROP_OLDEST;
+                }
+                else if (0 == strcmp(optarg, "drop-newest"))
+                {
+                    ctx->overflow = SPSC_RING_DROP_NEWEST;
+                }
+                else
+                {
+                    fprintf(stderr, "error: unknown overflow policy\n");
+                    ctx->exit_code = EXIT_FAILURE;
+                    ctx->cmd = COMMAND_SHOW_HELP;
+                    done = true;
+                }
                 break;
             case 'H':
                 ctx->cmd = COMMAND_SHOW_HELP;
@@ -132,129 +525,2156 @@ static void context_init(struct context * ctx, int argc, char* argv[])
         }
     }
 
-    if ((ctx->cmd == COMMAND_SUB) && (ctx->topic == NULL))
+    if ((ctx->cmd == COMMAND_SUB) && (ctx->topic_count == 0))
     {
         fprintf(stderr, "error: missing topic\n");
         ctx->exit_code = EXIT_FAILURE;
         ctx->cmd = COMMAND_SHOW_HELP;
     }
 
+    if ((ctx->cmd == COMMAND_SUB) && (!mqtt_options_validate(&ctx->mqtt)))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // batches are written by the output thread, which also flushes
+    // incomplete batches on timeout
+    if ((ctx->cmd == COMMAND_SUB) && (ctx->batching) && (ctx->queue_size == 0) && (ctx->group == NULL))
+    {
+        fprintf(stderr, "error: batching requires a queue (-Q) or a group (-g)\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_SUB) && (ctx->batching) && (ctx->record != NULL))
+    {
+        fprintf(stderr, "error: batching cannot be combined with --record\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // a snapshot is written at once by a single connection
+    if ((ctx->cmd == COMMAND_SUB) && (ctx->retain) &&
+        ((ctx->batching) || (ctx->record != NULL) || (ctx->group != NULL)))
+    {
+        fprintf(stderr, "error: snapshot cannot be combined with batching, --record or -g\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // the snapshot is collected by the connection's network thread without
+    // output queue, so that these options would have no effect
+    if ((ctx->cmd == COMMAND_SUB) && (ctx->retain) &&
+        ((ctx->loop_mode != LOOP_POLL) || (1 != ctx->connections) ||
+        (DEFAULT_QUEUE_SIZE != ctx->queue_size) || (SPSC_RING_BLOCK != ctx->overflow)))
+    {
+        fprintf(stderr, "error: snapshot cannot be combined with -l, -C, -Q or -O\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->batching) && (0 == ctx->batch_size) && (0 == ctx->batch_timeout))
+    {
+        ctx->batch_size = 1;
+    }
+
+    // the expression is compiled once and only tells whether it matches
+    if ((ctx->cmd == COMMAND_SUB) && (NULL != ctx->regex_pattern))
+    {
+        ctx->has_regex = (0 == regcomp(&ctx->regex, ctx->regex_pattern, REG_EXTENDED | REG_NOSUB));
+        if (!ctx->has_regex)
+        {
+            fprintf(stderr, "error: invalid regex\n");
+            ctx->exit_code = EXIT_FAILURE;
+            ctx->cmd = COMMAND_SHOW_HELP;
+        }
+    }
+
+    if ((ctx->cmd == COMMAND_SUB) && (NULL != ctx->dictionary_path) &&
+        (!mqtt_dictionary_load(&ctx->dictionary, ctx->dictionary_path)))
+    {
+        fprintf(stderr, "error: failed to load dictionary %s\n", ctx->dictionary_path);
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_SUB) && (ctx->tracing) && (!mqtt_trace_init(&ctx->trace)))
+    {
+        fprintf(stderr, "error: failed to initialize tracing\n");
+        ctx->tracing = false;
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    // without a group, each connection would receive every message
+    if ((ctx->cmd == COMMAND_SUB) && ((ctx->connections == 0) ||
+        ((1 < ctx->connections) && (ctx->group == NULL))))
+    {
+        fprintf(stderr, "error: invalid number of connections\n");
+        ctx->exit_code = EXIT_FAILURE;
+        ctx->cmd = COMMAND_SHOW_HELP;
+    }
+
+    if ((ctx->cmd == COMMAND_SUB) && (ctx->group != NULL))
+    {
+        ctx->mqtt.protocol_version = MQTT_PROTOCOL_V5;
+        for (int i = 0; i < ctx->topic_count; i++)
+        {
+            size_t const length = strlen(ctx->group) + strlen(ctx->topics[i]) + 9;
+            char * topic = malloc(length);
+            if (NULL != topic)
+            {
+                snprintf(topic, length, "$share/%s/%s", ctx->group, ctx->topics[i]);
+                free(ctx->topics[i]);
+                ctx->topics[i] = topic;
+            }
+        }
+    }
 }
 
 static int context_cleanup(struct context * ctx)
 {
-    free(ctx->id);
-    free(ctx->user);
-    free(ctx->password);
-    free(ctx->host);
-    free(ctx->topic);
+    mqtt_options_cleanup(&ctx->mqtt);
+    free(ctx->group);
+    topic_filter_cleanup(&ctx->filter);
+    free(ctx->grep);
+    free(ctx->regex_pattern);
+    free(ctx->batch_dir);
+    free(ctx->record);
+    free(ctx->snapshot_file);
+    free(ctx->dictionary_path);
+    mqtt_dictionary_cleanup(&ctx->dictionary);
+    if (ctx->tracing)
+    {
+        mqtt_trace_cleanup(&ctx->trace);
+    }
+    if (ctx->has_regex)
+    {
+        regfree(&ctx->regex);
+    }
+    for (int i = 0; i < ctx->topic_count; i++)
+    {
+        free(ctx->topics[i]);
+    }
+    free(ctx->topics);
 
     return ctx->exit_code;
 }
 
-static void mqtt_on_message(struct mosquitto * mosq,
-    void * user_data, struct mosquitto_message const * message)
+#define OUTPUT_INITIAL_CAPACITY (64 * 1024)
+
+struct output
 {
-    (void) mosq; // unused
-    (void) user_data; // unused
+    enum output_format format;
+    FILE * file;
+    char * buffer;
+    size_t length;
+    size_t capacity;
+};
 
-    printf("message id: %d\n", message->mid);
-    printf("topic     : %s\n", message->topic);
-    printf("retained  : %s\n", message->retain ? "yes" : "no");
+static bool output_init(struct output * output, enum output_format format, FILE * file)
+{
+    output->format = format;
+    output->file = file;
+    output->length = 0;
+    output->capacity = OUTPUT_INITIAL_CAPACITY;
+    output->buffer = malloc(output->capacity);
 
-    if (0 < message->payloadlen)
+    // stdio's default buffer is small; a larger one reduces the number
+    // of write calls when the output is piped into another process
+    if (!isatty(fileno(file)))
     {
-        printf("payload   : %.*s\n", message->payloadlen, (char const*) message->payload);
+        setvbuf(file, NULL, _IOFBF, OUTPUT_INITIAL_CAPACITY);
     }
-    else
+
+    return (NULL != output->buffer);
+}
+
+static void output_cleanup(struct output * output)
+{
+    fflush(output->file);
+    free(output->buffer);
+}
+
+static bool output_reserve(struct output * output, size_t length)
+{
+    size_t const required = output->length + length;
+    if (required <= output->capacity)
+    {
+        return true;
+    }
+
+    size_t capacity = output->capacity;
+    while (capacity < required)
     {
-        printf("payload   : <empty>\n");
+        capacity *= 2;
     }
 
-    printf("\n");
+    char * const buffer = realloc(output->buffer, capacity);
+    if (NULL == buffer)
+    {
+        return false;
+    }
+
+    output->buffer = buffer;
+    output->capacity = capacity;
+    return true;
 }
 
-static bool g_shutdown_requested = false;
-static void on_shutdown_requested(int signal_number)
+// callers reserve space before appending
+static void output_append(struct output * output, void const * data, size_t length)
 {
-    (void) signal_number; // ignored;
-    g_shutdown_requested = true;
+    memcpy(&output->buffer[output->length], data, length);
+    output->length += length;
 }
 
-static void mqtt_sub(struct context * ctx)
+static void output_append_str(struct output * output, char const * value)
 {
-    signal(SIGINT, &on_shutdown_requested);
-    signal(SIGTERM, &on_shutdown_requested);
+    output_append(output, value, strlen(value));
+}
 
-    int rc = mosquitto_lib_init();
-    if (MOSQ_ERR_SUCCESS != rc)
+static void output_append_int(struct output * output, int value)
+{
+    char digits[12];
+    size_t position = sizeof(digits);
+    unsigned int remaining = (value < 0) ? (0U - (unsigned int) value) : (unsigned int) value;
+    do
     {
-        fprintf(stderr, "error: failed to init mosquitto library\n");
-        ctx->exit_code = EXIT_FAILURE;
-        return;
+        digits[--position] = (char) ('0' + (remaining % 10));
+        remaining /= 10;
+    } while (0 < remaining);
+
+    if (value < 0)
+    {
+        digits[--position] = '-';
     }
 
-    struct mosquitto * mosq = mosquitto_new(ctx->id, true, NULL);
-    if (NULL == mosq)
+    output_append(output, &digits[position], sizeof(digits) - position);
+}
+
+// worst case, each byte is escaped as \u00XX or \ufffd
+#define JSON_ESCAPED_SIZE(length) (((length) * 6) + 2)
+#define BASE64_SIZE(length) ((((length) + 2) / 3) * 4 + 2)
+
+// returns the length of the well-formed UTF-8 sequence at data (RFC 3629)
+// or 0, if it is malformed, overlong or encodes a surrogate
+static size_t utf8_sequence_length(unsigned char const * data, size_t length)
+{
+    unsigned char const c = data[0];
+    if (c < 0x80)
     {
-        fprintf(stderr, "error: failed to create mosquitto instance\n");
-        ctx->exit_code = EXIT_FAILURE;
-        mosquitto_lib_cleanup();
-        return;
+        return 1;
     }
 
-    rc = mosquitto_username_pw_set(mosq, ctx->user, ctx->password);
-    if (MOSQ_ERR_SUCCESS != rc)
+    // the range of the second byte excludes overlong forms,
+    // surrogates and code points beyond U+10FFFF
+    size_t count = 0;
+    unsigned char min = 0x80;
+    unsigned char max = 0xbf;
+    if ((0xc2 <= c) && (c <= 0xdf))
     {
-        fprintf(stderr, "error: failed to set user and password\n");
-        ctx->exit_code = EXIT_FAILURE;
-        mosquitto_destroy(mosq);
-        mosquitto_lib_cleanup();
-        return;
+        count = 2;
+    }
+    else if ((0xe0 <= c) && (c <= 0xef))
+    {
+        count = 3;
+        min = (0xe0 == c) ? 0xa0 : 0x80;
+        max = (0xed == c) ? 0x9f : 0xbf;
+    }
+    else if ((0xf0 <= c) && (c <= 0xf4))
+    {
+        count = 4;
+        min = (0xf0 == c) ? 0x90 : 0x80;
+        max = (0xf4 == c) ? 0x8f : 0xbf;
     }
 
-    mosquitto_message_callback_set(mosq, &mqtt_on_message);
+    if ((0 == count) || (length < count))
+    {
+        return 0;
+    }
 
-    rc = mosquitto_connect(mosq, ctx->host, ctx->port, MQTT_KEEPALIVE);
-    if (MOSQ_ERR_SUCCESS != rc)
+    for (size_t i = 1; i < count; i++)
     {
-        fprintf(stderr, "error: failed to connect to MQTT broker\n");
-        ctx->exit_code = EXIT_FAILURE;
-        mosquitto_destroy(mosq);
-        mosquitto_lib_cleanup();
+        if ((data[i] < ((1 == i) ? min : 0x80)) || (data[i] > ((1 == i) ? max : 0xbf)))
+        {
+            return 0;
+        }
+    }
+
+    return count;
+}
+
+static bool utf8_valid(char const * data, size_t length)
+{
+    unsigned char const * bytes = (unsigned char const *) data;
+    size_t i = 0;
+    while (i < length)
+    {
+        size_t const count = utf8_sequence_length(&bytes[i], length - i);
+        if (0 == count)
+        {
+            return false;
+        }
+        i += count;
+    }
+
+    return true;
+}
+
+// escapes data as JSON string; bytes, which are not valid UTF-8,
+// are replaced by U+FFFD, so that the output stays valid JSON
+static void output_append_json(struct output * output, char const * data, size_t length)
+{
+    static char const hex[] = "0123456789abcdef";
+
+    unsigned char const * bytes = (unsigned char const *) data;
+    char * target = &output->buffer[output->length];
+    *target++ = '"';
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char const c = bytes[i];
+        if (0x80 <= c)
+        {
+            size_t const count = utf8_sequence_length(&bytes[i], length - i);
+            if (0 == count)
+            {
+                memcpy(target, "\\ufffd", 6);
+                target += 6;
+            }
+            else
+            {
+                memcpy(target, &bytes[i], count);
+                target += count;
+                i += count - 1;
+            }
+            continue;
+        }
+
+        switch (c)
+        {
+            case '"':  *target++ = '\\'; *target++ = '"'; break;
+            case '\\': *target++ = '\\'; *target++ = '\\'; break;
+            case '\n': *target++ = '\\'; *target++ = 'n'; break;
+            case '\r': *target++ = '\\'; *target++ = 'r'; break;
+            case '\t': *target++ = '\\'; *target++ = 't'; break;
+            default:
+                if (c < 0x20)
+                {
+                    *target++ = '\\';
+                    *target++ = 'u';
+                    *target++ = '0';
+                    *target++ = '0';
+                    *target++ = hex[c >> 4];
+                    *target++ = hex[c & 0x0f];
+                }
+                else
+                {
+                    *target++ = (char) c;
+                }
+                break;
+        }
+    }
+    *target++ = '"';
+
+    output->length = (size_t) (target - output->buffer);
+}
+
+// appends data as base64 string (RFC 4648) with padding
+static void output_append_base64(struct output * output, char const * data, size_t length)
+{
+    static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    unsigned char const * bytes = (unsigned char const *) data;
+    char * target = &output->buffer[output->length];
+    *target++ = '"';
+    for (size_t i = 0; i < length; i += 3)
+    {
+        size_t const remaining = length - i;
+        uint32_t const group = ((uint32_t) bytes[i] << 16) |
+            ((1 < remaining) ? ((uint32_t) bytes[i + 1] << 8) : 0) |
+            ((2 < remaining) ? (uint32_t) bytes[i + 2] : 0);
+        *target++ = alphabet[(group >> 18) & 0x3f];
+        *target++ = alphabet[(group >> 12) & 0x3f];
+        *target++ = (1 < remaining) ? alphabet[(group >> 6) & 0x3f] : '=';
+        *target++ = (2 < remaining) ? alphabet[group & 0x3f] : '=';
+    }
+    *target++ = '"';
+
+    output->length = (size_t) (target - output->buffer);
+}
+
+// appends the message expiry interval and user properties of MQTT 5;
+// returns false, if the output could not be reserved
+static bool output_format_properties(struct output * output, mosquitto_property const * properties, bool json)
+{
+    uint32_t expiry = 0;
+    if (NULL != mosquitto_property_read_int32(properties, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, &expiry, false))
+    {
+        if (!output_reserve(output, 32)) { return false; }
+        output_append_str(output, json ? ",\"expiry\":" : "expiry    : ");
+        output_append_int(output, (int) (expiry & INT32_MAX));
+        output_append_str(output, json ? "" : "\n");
+    }
+
+    bool first = true;
+    char * name = NULL;
+    char * value = NULL;
+    bool result = true;
+    for (mosquitto_property const * property = mosquitto_property_read_string_pair(properties,
+            MQTT_PROP_USER_PROPERTY, &name, &value, false);
+        (result) && (NULL != property);
+        property = mosquitto_property_read_string_pair(property, MQTT_PROP_USER_PROPERTY, &name, &value, true))
+    {
+        size_t const name_length = strlen(name);
+        size_t const value_length = strlen(value);
+        result = output_reserve(output, JSON_ESCAPED_SIZE(name_length) + JSON_ESCAPED_SIZE(value_length) + 32);
+        if ((result) && (json))
+        {
+            output_append_str(output, first ? ",\"properties\":[[" : ",[");
+            output_append_json(output, name, name_length);
+            output_append_str(output, ",");
+            output_append_json(output, value, value_length);
+            output_append_str(output, "]");
+        }
+        else if (result)
+        {
+            output_append_str(output, "property  : ");
+            output_append(output, name, name_length);
+            output_append_str(output, "=");
+            output_append(output, value, value_length);
+            output_append_str(output, "\n");
+        }
+        first = false;
+
+        free(name);
+        free(value);
+        name = NULL;
+        value = NULL;
+    }
+
+    if ((result) && (json) && (!first))
+    {
+        result = output_reserve(output, 1);
+        if (result)
+        {
+            output_append_str(output, "]");
+        }
+    }
+
+    return result;
+}
+
+static void output_format_verbose(struct output * output, struct mosquitto_message const * message,
+    mosquitto_property const * properties, size_t topic_length, size_t payload_length)
+{
+    bool const has_payload = (0 < payload_length);
+    if (!output_reserve(output, topic_length + 128)) { return; }
+
+    output_append_str(output, "message id: ");
+    output_append_int(output, message->mid);
+    output_append_str(output, "\ntopic     : ");
+    output_append(output, message->topic, topic_length);
+    output_append_str(output, message->retain ? "\nretained  : yes\n" : "\nretained  : no\n");
+    if ((NULL != properties) && (!output_format_properties(output, properties, false)))
+    {
+        output->length = 0;
         return;
     }
 
-    rc = mosquitto_subscribe(mosq, NULL, ctx->topic, MQTT_QOS);
-    if (MOSQ_ERR_SUCCESS != rc)
+    if (!output_reserve(output, payload_length + 32))
     {
-        fprintf(stderr, "error: failed to subscribe\n");
-        ctx->exit_code = EXIT_FAILURE;
-        mosquitto_destroy(mosq);
-        mosquitto_lib_cleanup();
+        output->length = 0;
         return;
     }
+    output_append_str(output, "payload   : ");
+    if (has_payload)
+    {
+        output_append(output, message->payload, payload_length);
+    }
+    else
+    {
+        output_append_str(output, "<empty>");
+    }
+    output_append_str(output, "\n\n");
+}
+
+static void output_format_line(struct output * output, struct mosquitto_message const * message,
+    size_t topic_length, size_t payload_length)
+{
+    if (!output_reserve(output, topic_length + payload_length + 2)) { return; }
 
-    while ((rc == MOSQ_ERR_SUCCESS) && (!g_shutdown_requested))
+    output_append(output, message->topic, topic_length);
+    output_append(output, " ", 1);
+    output_append(output, message->payload, payload_length);
+    output_append(output, "\n", 1);
+}
+
+static void output_format_raw(struct output * output, struct mosquitto_message const * message,
+    size_t payload_length)
+{
+    if (!output_reserve(output, payload_length + 1)) { return; }
+
+    output_append(output, message->payload, payload_length);
+    output_append(output, "\n", 1);
+}
+
+static void output_format_json(struct output * output, struct mosquitto_message const * message,
+    mosquitto_property const * properties, size_t topic_length, size_t payload_length)
+{
+    if (!output_reserve(output, JSON_ESCAPED_SIZE(topic_length) + 128)) { return; }
+
+    output_append_str(output, "{\"mid\":");
+    output_append_int(output, message->mid);
+    output_append_str(output, ",\"topic\":");
+    output_append_json(output, message->topic, topic_length);
+    output_append_str(output, ",\"qos\":");
+    output_append_int(output, message->qos);
+    output_append_str(output, message->retain ? ",\"retain\":true" : ",\"retain\":false");
+    if ((NULL != properties) && (!output_format_properties(output, properties, true)))
     {
-        rc = mosquitto_loop(mosq, LOOP_INTERVAL, 1);
+        output->length = 0;
+        return;
     }
 
-    if ((MOSQ_ERR_SUCCESS == rc) && (errno != EINTR))
+    // binary payloads are encoded as base64, which is marked by a field
+    bool const text = utf8_valid(message->payload, payload_length);
+    if (!output_reserve(output, (text ? JSON_ESCAPED_SIZE(payload_length) : BASE64_SIZE(payload_length)) + 48))
     {
-        fprintf(stderr, "error: failed to execute message loop; %s\n", strerror(errno));
-        ctx->exit_code = EXIT_FAILURE;
+        output->length = 0;
+        return;
+    }
+    if (text)
+    {
+        output_append_str(output, ",\"payload\":");
+        output_append_json(output, message->payload, payload_length);
+    }
+    else
+    {
+        output_append_str(output, ",\"payload_encoding\":\"base64\",\"payload\":");
+        output_append_base64(output, message->payload, payload_length);
     }
+    output_append_str(output, "}\n");
+}
 
+// formats a message into the output buffer;
+// returns false, if the message could not be formatted
+static bool output_format(struct output * output, struct mosquitto_message const * message,
+    mosquitto_property const * properties)
+{
+    size_t const topic_length = strlen(message->topic);
+    size_t const payload_length = (0 < message->payloadlen) ? (size_t) message->payloadlen : 0;
 
-    rc = mosquitto_unsubscribe(mosq, NULL, ctx->topic);
-    if (MOSQ_ERR_SUCCESS != rc)
+    output->length = 0;
+    switch (output->format)
     {
-        fprintf(stderr, "warning: failed to unsubscribe\n");
+        case OUTPUT_LINE:
+            output_format_line(output, message, topic_length, payload_length);
+            break;
+        case OUTPUT_RAW:
+            output_format_raw(output, message, payload_length);
+            break;
+        case OUTPUT_JSON:
+            output_format_json(output, message, properties, topic_length, payload_length);
+            break;
+        case OUTPUT_VERBOSE:
+            // fall-through
+        default:
+            output_format_verbose(output, message, properties, topic_length, payload_length);
+            break;
     }
 
-    mosquitto_destroy(mosq);
-    mosquitto_lib_cleanup();
+    return (0 < output->length);
+}
+
+// formats a message into the output buffer and writes it at once
+static void output_write(struct output * output, struct mosquitto_message const * message,
+    mosquitto_property const * properties)
+{
+    if (output_format(output, message, properties))
+    {
+        fwrite(output->buffer, 1, output->length, output->file);
+    }
+    else
+    {
+        fprintf(stderr, "warning: failed to format message\n");
+    }
+}
+
+// accumulates formatted messages, so that they are written with a single
+// call, either to the output or to a new file per batch
+struct batch
+{
+    FILE * file;
+    char const * directory;
+    unsigned long sequence;
+    enum batch_framing framing;
+    unsigned int size;
+    unsigned int timeout;
+    unsigned int count;
+    uint64_t started;
+    char * buffer;
+    size_t length;
+    size_t capacity;
+};
+
+static uint64_t batch_now(void)
+{
+    return mqtt_stats_now() / 1000000;
+}
+
+static bool batch_init(struct batch * batch, struct context const * ctx, FILE * file)
+{
+    batch->file = file;
+    batch->directory = ctx->batch_dir;
+    batch->sequence = 0;
+    batch->framing = ctx->framing;
+    batch->size = ctx->batch_size;
+    batch->timeout = ctx->batch_timeout;
+    batch->count = 0;
+    batch->started = 0;
+    batch->length = 0;
+    batch->capacity = OUTPUT_INITIAL_CAPACITY;
+    batch->buffer = malloc(batch->capacity);
+
+    return (NULL != batch->buffer);
+}
+
+// writes the batch to a hidden file, which is renamed when complete,
+// so that a loader watching the directory never reads a partial batch
+static bool batch_write_file(struct batch * batch)
+{
+    char path[4096];
+    char temp_path[4096];
+    unsigned long long const now = (unsigned long long) time(NULL);
+    snprintf(path, sizeof(path), "%s/mqtt_sub-%llu-%d-%06lu", batch->directory, now, (int) getpid(), batch->sequence);
+    snprintf(temp_path, sizeof(temp_path), "%s/.mqtt_sub-%llu-%d-%06lu", batch->directory, now, (int) getpid(), batch->sequence);
+    batch->sequence++;
+
+    FILE * file = fopen(temp_path, "wb");
+    if (NULL == file)
+    {
+        return false;
+    }
+
+    bool const written = (batch->length == fwrite(batch->buffer, 1, batch->length, file));
+    bool const closed = (0 == fclose(file));
+    if ((!written) || (!closed) || (0 != rename(temp_path, path)))
+    {
+        remove(temp_path);
+        return false;
+    }
+
+    return true;
+}
+
+static void batch_flush(struct batch * batch)
+{
+    if (0 == batch->count)
+    {
+        return;
+    }
+
+    if (NULL != batch->directory)
+    {
+        if (!batch_write_file(batch))
+        {
+            fprintf(stderr, "warning: failed to write batch of %u message(s)\n", batch->count);
+        }
+    }
+    else
+    {
+        fwrite(batch->buffer, 1, batch->length, batch->file);
+        fflush(batch->file);
+    }
+
+    batch->count = 0;
+    batch->length = 0;
+}
+
+static void batch_cleanup(struct batch * batch)
+{
+    batch_flush(batch);
+    free(batch->buffer);
+}
+
+static void batch_add(struct batch * batch, char const * data, size_t length)
+{
+    if (FRAMING_LENGTH == batch->framing)
+    {
+        // records can be published again with mqtt_pub -L
+        if ((0 < length) && ('\n' == data[length - 1]))
+        {
+            length--;
+        }
+    }
+
+    size_t const header_length = (FRAMING_LENGTH == batch->framing) ? 4 : 0;
+    size_t const required = batch->length + header_length + length;
+    if (batch->capacity < required)
+    {
+        size_t capacity = batch->capacity;
+        while (capacity < required)
+        {
+            capacity *= 2;
+        }
+
+        char * const buffer = realloc(batch->buffer, capacity);
+        if (NULL == buffer)
+        {
+            fprintf(stderr, "warning: failed to batch message\n");
+            return;
+        }
+        batch->buffer = buffer;
+        batch->capacity = capacity;
+    }
+
+    if (FRAMING_LENGTH == batch->framing)
+    {
+        unsigned char * header = (unsigned char *) &batch->buffer[batch->length];
+        header[0] = (unsigned char) (length >> 24);
+        header[1] = (unsigned char) (length >> 16);
+        header[2] = (unsigned char) (length >> 8);
+        header[3] = (unsigned char) length;
+        batch->length += header_length;
+    }
+    memcpy(&batch->buffer[batch->length], data, length);
+    batch->length += length;
+
+    if (0 == batch->count)
+    {
+        batch->started = batch_now();
+    }
+    batch->count++;
+
+    if (((0 < batch->size) && (batch->size <= batch->count)) || (BATCH_MAX_BYTES <= batch->length))
+    {
+        batch_flush(batch);
+    }
+}
+
+// returns the time in milliseconds until an incomplete batch is due,
+// or -1, if there is nothing to wait for
+static int batch_wait_time(struct batch const * batch)
+{
+    if ((0 == batch->timeout) || (0 == batch->count))
+    {
+        return -1;
+    }
+
+    uint64_t const elapsed = batch_now() - batch->started;
+    return (elapsed < batch->timeout) ? (int) (batch->timeout - elapsed) : 0;
+}
+
+static void batch_flush_expired(struct batch * batch)
+{
+    if (0 == batch_wait_time(batch))
+    {
+        batch_flush(batch);
+    }
+}
+
+// formatted output of a message, passed from a connection to the writer
+struct output_chunk
+{
+    struct mpsc_node node;
+    size_t length;
+    char data[];
+};
+
+// writes the output of all connections of a group from a single thread,
+// so that connections never block on output and messages are not interleaved
+struct writer
+{
+    FILE * file;
+    struct batch * batch;
+    struct slab * slab;
+    struct mpsc_queue queue;
+    sem_t available;
+    atomic_bool stopped;
+    pthread_t thread;
+};
+
+// waits for the next chunk; returns false, if an incomplete batch is due
+static bool writer_wait(struct writer * writer)
+{
+    int const timeout = (NULL != writer->batch) ? batch_wait_time(writer->batch) : -1;
+    if (0 > timeout)
+    {
+        while ((0 != sem_wait(&writer->available)) && (EINTR == errno)) { }
+        return true;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long) (timeout % 1000) * 1000000L;
+    if (1000000000L <= deadline.tv_nsec)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc;
+    while ((0 != (rc = sem_timedwait(&writer->available, &deadline))) && (EINTR == errno)) { }
+    return (0 == rc);
+}
+
+static void * writer_run(void * arg)
+{
+    struct writer * writer = arg;
+
+    bool done = false;
+    while (!done)
+    {
+        if (!writer_wait(writer))
+        {
+            batch_flush_expired(writer->batch);
+            continue;
+        }
+
+        // each post belongs to a complete push, but the chunk becomes visible
+        // only when pushes of other connections started before are complete
+        struct mpsc_node * node = mpsc_queue_pop(&writer->queue);
+        while ((NULL == node) && (!atomic_load(&writer->stopped)))
+        {
+            sched_yield();
+            node = mpsc_queue_pop(&writer->queue);
+        }
+
+        if (NULL != node)
+        {
+            struct output_chunk * chunk = (struct output_chunk *) node;
+            if (NULL != writer->batch)
+            {
+                batch_add(writer->batch, chunk->data, chunk->length);
+            }
+            else
+            {
+                fwrite(chunk->data, 1, chunk->length, writer->file);
+            }
+            slab_free(writer->slab, chunk);
+        }
+        else
+        {
+            // connections are stopped before the writer, so the queue is drained
+            done = true;
+        }
+    }
+
+    return NULL;
+}
+
+static bool writer_start(struct writer * writer, FILE * file, struct batch * batch, struct slab * slab)
+{
+    writer->file = file;
+    writer->batch = batch;
+    writer->slab = slab;
+    mpsc_queue_init(&writer->queue);
+    sem_init(&writer->available, 0, 0);
+    atomic_init(&writer->stopped, false);
+
+    bool const result = (0 == pthread_create(&writer->thread, NULL, &writer_run, writer));
+    if (!result)
+    {
+        fprintf(stderr, "error: failed to start writer\n");
+        sem_destroy(&writer->available);
+    }
+
+    return result;
+}
+
+// writes all queued chunks and stops the writer;
+// must only be called when all connections are stopped
+static void writer_stop(struct writer * writer)
+{
+    atomic_store(&writer->stopped, true);
+    sem_post(&writer->available);
+    pthread_join(writer->thread, NULL);
+    sem_destroy(&writer->available);
+}
+
+static void writer_push(struct writer * writer, struct output const * output)
+{
+    struct output_chunk * chunk = slab_alloc(writer->slab, sizeof(struct output_chunk) + output->length);
+    if (NULL == chunk)
+    {
+        fprintf(stderr, "warning: failed to queue message\n");
+        return;
+    }
+
+    chunk->length = output->length;
+    memcpy(chunk->data, output->buffer, output->length);
+    mpsc_queue_push(&writer->queue, &chunk->node);
+    sem_post(&writer->available);
+}
+
+// copy of a received message, which is released by libmosquitto
+// when the message callback returns
+struct queued_message
+{
+    uint64_t received;
+    int mid;
+    int qos;
+    bool retain;
+    int payloadlen;
+    void * payload;
+    mosquitto_property * properties;
+    char topic[];
+};
+
+static struct queued_message * queued_message_create(struct slab * slab,
+    struct mosquitto_message const * message, mosquitto_property const * properties, uint64_t received)
+{
+    size_t const topic_length = strlen(message->topic) + 1;
+    size_t const payload_length = (0 < message->payloadlen) ? (size_t) message->payloadlen : 0;
+
+    // topic and payload are stored with the message in a single allocation
+    struct queued_message * queued = slab_alloc(slab, sizeof(struct queued_message) + topic_length + payload_length);
+    if (NULL != queued)
+    {
+        queued->received = received;
+        queued->mid = message->mid;
+        queued->qos = message->qos;
+        queued->retain = message->retain;
+        queued->payloadlen = (int) payload_length;
+        queued->payload = &queued->topic[topic_length];
+        memcpy(queued->topic, message->topic, topic_length);
+        memcpy(queued->payload, message->payload, payload_length);
+
+        // properties are only copied, if there are any, i.e. with MQTT 5
+        queued->properties = NULL;
+        if (NULL != properties)
+        {
+            mosquitto_property_copy_all(&queued->properties, properties);
+        }
+    }
+
+    return queued;
+}
+
+static void queued_message_release(struct slab * slab, struct queued_message * queued)
+{
+    if (NULL != queued)
+    {
+        mosquitto_property_free_all(&queued->properties);
+        slab_free(slab, queued);
+    }
+}
+
+// decouples the network loop from output, so that a stalled output
+// does not stall the connection, depending on the overflow policy
+struct message_queue
+{
+    struct spsc_ring ring;
+    struct output * output;
+    struct batch * batch;
+    struct mqtt_capture_writer * capture;
+    struct slab * slab;
+    pthread_t thread;
+};
+
+static void capture_add(struct mqtt_capture_writer * capture,
+    struct mosquitto_message const * message, uint64_t received)
+{
+    struct mqtt_capture_message const record = {
+        .timestamp = received,
+        .topic = message->topic,
+        .payload = message->payload,
+        .payloadlen = (0 < message->payloadlen) ? (size_t) message->payloadlen : 0,
+        .qos = message->qos,
+        .retain = message->retain
+    };
+    mqtt_capture_writer_add(capture, &record);
+}
+
+static void * message_queue_run(void * arg)
+{
+    struct message_queue * queue = arg;
+
+    bool done = false;
+    while (!done)
+    {
+        int const timeout = (NULL != queue->batch) ? batch_wait_time(queue->batch) : -1;
+        bool timed_out = false;
+        struct queued_message * queued = spsc_ring_pop_timeout(&queue->ring, timeout, &timed_out);
+        if (NULL == queued)
+        {
+            if (timed_out)
+            {
+                batch_flush_expired(queue->batch);
+            }
+            done = !timed_out;
+            continue;
+        }
+
+        struct mosquitto_message const message = {
+            .mid = queued->mid,
+            .topic = queued->topic,
+            .payload = queued->payload,
+            .payloadlen = queued->payloadlen,
+            .qos = queued->qos,
+            .retain = queued->retain
+        };
+        if (NULL != queue->capture)
+        {
+            capture_add(queue->capture, &message, queued->received);
+        }
+        else if (NULL == queue->batch)
+        {
+            output_write(queue->output, &message, queued->properties);
+        }
+        else if (output_format(queue->output, &message, queued->properties))
+        {
+            batch_add(queue->batch, queue->output->buffer, queue->output->length);
+        }
+        else
+        {
+            fprintf(stderr, "warning: failed to format message\n");
+        }
+        queued_message_release(queue->slab, queued);
+    }
+
+    return NULL;
+}
+
+static bool message_queue_start(struct message_queue * queue, struct context * ctx,
+    struct output * output, struct batch * batch, struct mqtt_capture_writer * capture, struct slab * slab)
+{
+    if (!spsc_ring_init(&queue->ring, ctx->queue_size, ctx->overflow))
+    {
+        fprintf(stderr, "error: failed to allocate message queue\n");
+        return false;
+    }
+    queue->output = output;
+    queue->batch = batch;
+    queue->capture = capture;
+    queue->slab = slab;
+
+    // shutdown signals are handled by the main thread only
+    sigset_t signals;
+    sigset_t previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    bool const result = (0 == pthread_create(&queue->thread, NULL, &message_queue_run, queue));
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (!result)
+    {
+        fprintf(stderr, "error: failed to start output thread\n");
+        spsc_ring_cleanup(&queue->ring);
+    }
+
+    return result;
+}
+
+// writes all queued messages and stops the output thread;
+// must only be called when the network loop is stopped
+static void message_queue_stop(struct message_queue * queue)
+{
+    spsc_ring_close(&queue->ring);
+    pthread_join(queue->thread, NULL);
+
+    unsigned long const dropped = atomic_load(&queue->ring.dropped);
+    unsigned long const blocked = atomic_load(&queue->ring.blocked);
+    if (0 < dropped)
+    {
+        fprintf(stderr, "warning: %lu of %lu message(s) dropped due to slow output\n",
+            dropped, atomic_load(&queue->ring.pushed) + ((SPSC_RING_DROP_NEWEST == queue->ring.policy) ? dropped : 0));
+    }
+    if (0 < blocked)
+    {
+        fprintf(stderr, "warning: network loop blocked %lu time(s) due to slow output\n", blocked);
+    }
+
+    spsc_ring_cleanup(&queue->ring);
+}
+
+static void message_queue_push(struct message_queue * queue,
+    struct mosquitto_message const * message, mosquitto_property const * properties, uint64_t received)
+{
+    struct queued_message * queued = queued_message_create(queue->slab, message, properties, received);
+    if (NULL == queued)
+    {
+        fprintf(stderr, "warning: failed to queue message\n");
+        return;
+    }
+
+    queued_message_release(queue->slab, spsc_ring_push(&queue->ring, queued));
+}
+
+struct snapshot_entry
+{
+    char * topic;
+    void * payload;
+    size_t length;
+    size_t order;
+};
+
+// retained messages collected until none arrived for the idle time
+struct snapshot
+{
+    pthread_mutex_t lock;
+    struct snapshot_entry * entries;
+    size_t count;
+    size_t capacity;
+    bool subscribed;
+    uint64_t last;
+};
+
+static bool snapshot_init(struct snapshot * snapshot)
+{
+    snapshot->capacity = SNAPSHOT_INITIAL_CAPACITY;
+    snapshot->count = 0;
+    snapshot->entries = malloc(snapshot->capacity * sizeof(struct snapshot_entry));
+    snapshot->subscribed = false;
+    snapshot->last = 0;
+    pthread_mutex_init(&snapshot->lock, NULL);
+
+    return (NULL != snapshot->entries);
+}
+
+static void snapshot_cleanup(struct snapshot * snapshot)
+{
+    for (size_t i = 0; i < snapshot->count; i++)
+    {
+        free(snapshot->entries[i].topic);
+        free(snapshot->entries[i].payload);
+    }
+    free(snapshot->entries);
+    pthread_mutex_destroy(&snapshot->lock);
+}
+
+// the idle time starts with each SUBACK, since the broker sends retained
+// messages after SUBACK, also after a reconnect; until then, the snapshot
+// cannot be complete
+static void snapshot_subscribed(struct snapshot * snapshot, bool subscribed)
+{
+    pthread_mutex_lock(&snapshot->lock);
+    snapshot->subscribed = subscribed;
+    snapshot->last = mqtt_stats_now();
+    pthread_mutex_unlock(&snapshot->lock);
+}
+
+// returns false, if the message could not be copied
+static bool snapshot_add(struct snapshot * snapshot, struct mosquitto_message const * message)
+{
+    size_t const length = (0 < message->payloadlen) ? (size_t) message->payloadlen : 0;
+    char * topic = strdup(message->topic);
+    void * payload = malloc((0 < length) ? length : 1);
+    if ((NULL == topic) || (NULL == payload))
+    {
+        free(topic);
+        free(payload);
+        return false;
+    }
+    if (0 < length)
+    {
+        memcpy(payload, message->payload, length);
+    }
+
+    pthread_mutex_lock(&snapshot->lock);
+
+    bool result = true;
+    if (snapshot->count == snapshot->capacity)
+    {
+        struct snapshot_entry * entries = realloc(snapshot->entries,
+            snapshot->capacity * 2 * sizeof(struct snapshot_entry));
+        result = (NULL != entries);
+        if (result)
+        {
+            snapshot->entries = entries;
+            snapshot->capacity *= 2;
+        }
+    }
+
+    if (result)
+    {
+        struct snapshot_entry * entry = &snapshot->entries[snapshot->count];
+        entry->topic = topic;
+        entry->payload = payload;
+        entry->length = length;
+        entry->order = snapshot->count;
+        snapshot->count++;
+        snapshot->last = mqtt_stats_now();
+    }
+
+    pthread_mutex_unlock(&snapshot->lock);
+
+    if (!result)
+    {
+        free(topic);
+        free(payload);
+    }
+    return result;
+}
+
+// returns true, if no retained message arrived for idle milliseconds
+static bool snapshot_complete(struct snapshot * snapshot, unsigned int idle)
+{
+    pthread_mutex_lock(&snapshot->lock);
+    bool const complete = (snapshot->subscribed) &&
+        ((mqtt_stats_now() - snapshot->last) >= ((uint64_t) idle * 1000000ULL));
+    pthread_mutex_unlock(&snapshot->lock);
+
+    return complete;
+}
+
+// sorts by topic and keeps later messages of a topic behind earlier ones
+static int snapshot_compare(void const * lhs, void const * rhs)
+{
+    struct snapshot_entry const * left = lhs;
+    struct snapshot_entry const * right = rhs;
+
+    int const result = strcmp(left->topic, right->topic);
+    if (0 != result)
+    {
+        return result;
+    }
+
+    return (left->order < right->order) ? -1 : ((left->order > right->order) ? 1 : 0);
+}
+
+// writes the latest message of each topic as record of mqtt_pub -k -L;
+// topics containing a space cannot be split from the payload and are skipped
+static bool snapshot_write(struct snapshot * snapshot, FILE * file)
+{
+    qsort(snapshot->entries, snapshot->count, sizeof(struct snapshot_entry), &snapshot_compare);
+
+    unsigned long skipped = 0;
+    bool result = true;
+    for (size_t i = 0; (result) && (i < snapshot->count); i++)
+    {
+        struct snapshot_entry const * entry = &snapshot->entries[i];
+        if (((i + 1) < snapshot->count) && (0 == strcmp(entry->topic, snapshot->entries[i + 1].topic)))
+        {
+            continue;
+        }
+
+        size_t const topic_length = strlen(entry->topic);
+        size_t const length = topic_length + 1 + entry->length;
+        if ((NULL != memchr(entry->topic, ' ', topic_length)) || (UINT32_MAX < length))
+        {
+            skipped++;
+            continue;
+        }
+
+        unsigned char const header[4] = {
+            (unsigned char) (length >> 24),
+            (unsigned char) (length >> 16),
+            (unsigned char) (length >> 8),
+            (unsigned char) length
+        };
+        result = (1 == fwrite(header, sizeof(header), 1, file)) &&
+            (topic_length == fwrite(entry->topic, 1, topic_length, file)) &&
+            (EOF != fputc(' ', file)) &&
+            (entry->length == fwrite(entry->payload, 1, entry->length, file));
+    }
+
+    if (0 < skipped)
+    {
+        fprintf(stderr, "warning: skipped %lu topics, which contain a space or are too large\n", skipped);
+    }
+
+    return (result) && (0 == fflush(file));
+}
+
+struct client
+{
+    struct context * ctx;
+    struct output output;
+    struct writer * writer;
+    struct message_queue * queue;
+    struct mqtt_capture_writer * capture;
+    struct snapshot * snapshot;
+    struct mqtt_codec codec;
+
+    // set once the broker acknowledged the subscription; a session kept
+    // by the broker still holds it after a reconnect
+    bool subscribed;
+};
+
+static void mqtt_subscribe(struct context * ctx, struct mosquitto * mosq, bool snapshot)
+{
+    // with MQTT 5, topics subscribed again, e.g. of a session kept since
+    // the last run, do not send their retained messages again;
+    // a snapshot needs them each time
+    int const options = ((MQTT_PROTOCOL_V5 == ctx->mqtt.protocol_version) && (!snapshot)) ?
+        MQTT_SUB_OPT_SEND_RETAIN_NEW : 0;
+
+    // all topics are subscribed with a single SUBSCRIBE packet
+    int const rc = mosquitto_subscribe_multiple(mosq, NULL,
+        ctx->topic_count, ctx->topics, ctx->mqtt.qos, options, NULL);
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to subscribe\n");
+        ctx->exit_code = EXIT_FAILURE;
+    }
+}
+
+static void mqtt_unsubscribe(struct context * ctx, struct mosquitto * mosq)
+{
+    // unsubscribing would discard the persistent session's subscriptions
+    if (ctx->persistent)
+    {
+        return;
+    }
+
+    int const rc = mosquitto_unsubscribe_multiple(mosq, NULL,
+        ctx->topic_count, ctx->topics, NULL);
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "warning: failed to unsubscribe\n");
+    }
+}
+
+static void mqtt_on_connect(struct mqtt_connection * connection, void * user_data, int rc, int flags)
+{
+    struct client * client = user_data;
+
+    // a session kept since the last subscription holds the topics, so they
+    // are only subscribed on the first connect, e.g. to add topics to a
+    // session of the last run, or if the broker did not keep the session;
+    // retained messages are only sent on subscribe, so a snapshot always
+    // subscribes
+    bool const session_present = (0 != (flags & MQTT_CONNACK_SESSION_PRESENT));
+    bool const snapshot = (NULL != client->snapshot);
+    if ((0 == rc) && ((!session_present) || (!client->subscribed) || (snapshot)))
+    {
+        mqtt_subscribe(client->ctx, mqtt_connection_mosq(connection), snapshot);
+    }
+
+    if ((0 == rc) && (NULL != client->snapshot))
+    {
+        snapshot_subscribed(client->snapshot, false);
+    }
+}
+
+static void mqtt_on_subscribe(struct mqtt_connection * connection, void * user_data,
+    int mid, int qos_count, int const * granted_qos)
+{
+    (void) connection; // unused
+    (void) mid; // unused
+    (void) qos_count; // unused
+    (void) granted_qos; // unused
+    struct client * client = user_data;
+
+    client->subscribed = true;
+    if (NULL != client->snapshot)
+    {
+        snapshot_subscribed(client->snapshot, true);
+    }
+}
+
+static bool payload_contains(char const * payload, size_t length, char const * text, size_t text_length)
+{
+    if (0 == text_length)
+    {
+        return true;
+    }
+
+    char const * const end = &payload[length];
+    char const * current = payload;
+    while ((text_length <= (size_t) (end - current)) &&
+        (NULL != (current = memchr(current, text[0], (size_t) (end - current) - text_length + 1))))
+    {
+        if (0 == memcmp(current, text, text_length))
+        {
+            return true;
+        }
+        current++;
+    }
+
+    return false;
+}
+
+// returns false, if the message is rejected by the client-side filters
+static bool message_accepted(struct context const * ctx, struct mosquitto_message const * message)
+{
+    if ((0 < ctx->filter.count) && (!topic_filter_match(&ctx->filter, message->topic)))
+    {
+        return false;
+    }
+
+    char const * const payload = (NULL != message->payload) ? message->payload : "";
+    size_t const length = (0 < message->payloadlen) ? (size_t) message->payloadlen : 0;
+    if ((NULL != ctx->grep) && (!payload_contains(payload, length, ctx->grep, ctx->grep_length)))
+    {
+        return false;
+    }
+
+    if (ctx->has_regex)
+    {
+        // the payload is not terminated, so its bounds are passed explicitly
+        regmatch_t match = { .rm_so = 0, .rm_eo = (regoff_t) length };
+        if (0 != regexec(&ctx->regex, payload, 1, &match, REG_STARTEND))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// returns false, if the payload is marked with an unknown compression
+static bool message_compression(mosquitto_property const * properties, enum mqtt_compression * compression)
+{
+    *compression = MQTT_COMPRESSION_NONE;
+
+    bool result = true;
+    bool found = false;
+    char * name = NULL;
+    char * value = NULL;
+    for (mosquitto_property const * property = mosquitto_property_read_string_pair(properties,
+            MQTT_PROP_USER_PROPERTY, &name, &value, false);
+        (!found) && (NULL != property);
+        property = mosquitto_property_read_string_pair(property, MQTT_PROP_USER_PROPERTY, &name, &value, true))
+    {
+        found = (0 == strcmp(name, MQTT_COMPRESS_PROPERTY));
+        if (found)
+        {
+            result = mqtt_compression_parse(value, compression);
+        }
+
+        free(name);
+        free(value);
+        name = NULL;
+        value = NULL;
+    }
+
+    return result;
+}
+
+// replaces a compressed payload by its decompressed copy, which is owned by
+// the client's codec; returns false, if the payload cannot be decompressed
+static bool message_decompress(struct client * client, struct mosquitto_message const * * message,
+    mosquitto_property const * properties, struct mosquitto_message * decompressed)
+{
+    enum mqtt_compression compression = MQTT_COMPRESSION_NONE;
+    if (!message_compression(properties, &compression))
+    {
+        return false;
+    }
+
+    if (MQTT_COMPRESSION_NONE == compression)
+    {
+        return true;
+    }
+
+    void const * payload = NULL;
+    size_t length = 0;
+    size_t const compressed_length = (0 < (*message)->payloadlen) ? (size_t) (*message)->payloadlen : 0;
+    if (!mqtt_codec_decompress(&client->codec, compression, (*message)->payload, compressed_length, &payload, &length))
+    {
+        return false;
+    }
+
+    *decompressed = **message;
+    decompressed->payload = (void *) payload;
+    decompressed->payloadlen = (int) length;
+    *message = decompressed;
+
+    return true;
+}
+
+// records the latency of a traced message and replaces it by a copy without
+// the trace header, if any
+static void message_trace(struct client * client, struct mosquitto_message const * * message,
+    mosquitto_property const * properties, uint64_t received, struct mosquitto_message * untraced)
+{
+    struct mqtt_trace * trace = &client->ctx->trace;
+    size_t const length = (0 < (*message)->payloadlen) ? (size_t) (*message)->payloadlen : 0;
+
+    struct mqtt_trace_stamp stamp;
+    size_t header_size = 0;
+    if (!mqtt_trace_parse(properties, (*message)->payload, length, &stamp, &header_size))
+    {
+        atomic_fetch_add(&trace->untraced, 1);
+        return;
+    }
+
+    mqtt_trace_record(trace, (*message)->topic, &stamp, received);
+
+    if (0 < header_size)
+    {
+        *untraced = **message;
+        untraced->payload = &((char *) (*message)->payload)[header_size];
+        untraced->payloadlen = (int) (length - header_size);
+        *message = untraced;
+    }
+}
+
+static void mqtt_on_message(struct mqtt_connection * connection,
+    void * user_data, struct mosquitto_message const * message, mosquitto_property const * properties)
+{
+    (void) connection; // unused
+    struct client * client = user_data;
+
+    // taken first, so that the latency does not include the processing
+    uint64_t const arrived = (client->ctx->tracing) ? mqtt_capture_now() : 0;
+
+    // filters and output see the decompressed payload
+    struct mosquitto_message decompressed;
+    if ((NULL != properties) && (!message_decompress(client, &message, properties, &decompressed)))
+    {
+        fprintf(stderr, "warning: failed to decompress message\n");
+        atomic_fetch_add(&client->ctx->stats.errors, 1);
+        return;
+    }
+
+    struct mosquitto_message untraced;
+    if (client->ctx->tracing)
+    {
+        message_trace(client, &message, properties, arrived, &untraced);
+    }
+
+    // rejected messages are neither copied nor formatted
+    if (!message_accepted(client->ctx, message))
+    {
+        return;
+    }
+
+    uint64_t const start = mqtt_stats_now();
+    uint64_t const received = (NULL != client->capture) ? mqtt_capture_now() : 0;
+
+    // messages published after subscribe are not flagged as retained
+    if (NULL != client->snapshot)
+    {
+        if ((message->retain) && (!snapshot_add(client->snapshot, message)))
+        {
+            fprintf(stderr, "warning: failed to add message to snapshot\n");
+            atomic_fetch_add(&client->ctx->stats.errors, 1);
+        }
+    }
+    else if (NULL != client->queue)
+    {
+        message_queue_push(client->queue, message, properties, received);
+    }
+    else if (NULL != client->capture)
+    {
+        capture_add(client->capture, message, received);
+    }
+    else if (NULL == client->writer)
+    {
+        output_write(&client->output, message, properties);
+    }
+    else if (output_format(&client->output, message, properties))
+    {
+        writer_push(client->writer, &client->output);
+    }
+    else
+    {
+        fprintf(stderr, "warning: failed to format message\n");
+        atomic_fetch_add(&client->ctx->stats.errors, 1);
+    }
+
+    size_t const length = (0 < message->payloadlen) ? (size_t) message->payloadlen : 0;
+    mqtt_stats_record(&client->ctx->stats, length, start);
+}
+
+// sources of counters, which are collected on each report
+struct stats_source
+{
+    struct mqtt_connection * * connections;
+    unsigned int count;
+    struct message_queue * queue;
+    struct mqtt_trace * trace;
+};
+
+static void mqtt_sub_collect(void * user_data, struct mqtt_stats * stats)
+{
+    struct stats_source * source = user_data;
+
+    unsigned long reconnects = 0;
+    for (unsigned int i = 0; i < source->count; i++)
+    {
+        reconnects += mqtt_connection_disconnects(source->connections[i]);
+    }
+    atomic_store(&stats->reconnects, reconnects);
+
+    if (NULL != source->queue)
+    {
+        struct spsc_ring * ring = &source->queue->ring;
+        size_t const tail = atomic_load(&ring->tail);
+        size_t const head = atomic_load(&ring->head);
+        atomic_store(&stats->queue_depth, (tail > head) ? (tail - head) : 0);
+        atomic_store(&stats->dropped, atomic_load(&ring->dropped));
+    }
+
+    if (NULL != source->trace)
+    {
+        mqtt_trace_print(source->trace, stderr, false);
+    }
+}
+
+static volatile sig_atomic_t g_shutdown_requested = 0;
+static void on_shutdown_requested(int signal_number)
+{
+    (void) signal_number; // ignored;
+    g_shutdown_requested = 1;
+}
+
+static void mqtt_loop_poll(struct context * ctx, struct mqtt_connection * connection)
+{
+    while (!g_shutdown_requested)
+    {
+        mqtt_connection_poll(connection, LOOP_INTERVAL);
+    }
+
+    mqtt_unsubscribe(ctx, mqtt_connection_mosq(connection));
+}
+
+static void mqtt_loop_thread(struct context * ctx, struct mqtt_connection * connection)
+{
+    // signals are blocked before the loop thread is started,
+    // so that they are only delivered to sigwait below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (mqtt_connection_start(connection))
+    {
+        int signal_number = 0;
+        sigwait(&signals, &signal_number);
+
+        mqtt_unsubscribe(ctx, mqtt_connection_mosq(connection));
+        mqtt_connection_stop(connection);
+    }
+    else
+    {
+        ctx->exit_code = EXIT_FAILURE;
+    }
+}
+
+static void on_signal(void * user_data, int fd, uint32_t events)
+{
+    (void) events; // unused
+
+    struct signalfd_siginfo info;
+    if (sizeof(info) == read(fd, &info, sizeof(info)))
+    {
+        mqtt_event_loop_stop(user_data);
+    }
+}
+
+// drives all connections and the shutdown signals from the calling thread;
+// returns false, if the loop could not be set up
+static bool mqtt_loop_epoll(struct context * ctx, struct mqtt_connection * * connections, unsigned int count)
+{
+    // signals are received via signalfd, so that they wake the loop
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct mqtt_event_loop * loop = mqtt_event_loop_create();
+    int const signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    bool ok = (NULL != loop) && (0 <= signal_fd) &&
+        (mqtt_event_loop_add(loop, signal_fd, EPOLLIN, &on_signal, loop));
+    for (unsigned int i = 0; (ok) && (i < count); i++)
+    {
+        ok = mqtt_event_loop_add_connection(loop, connections[i]);
+    }
+
+    if (ok)
+    {
+        mqtt_event_loop_run(loop);
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            mqtt_unsubscribe(ctx, mqtt_connection_mosq(connections[i]));
+        }
+    }
+    else
+    {
+        fprintf(stderr, "error: failed to set up event loop\n");
+    }
+
+    mqtt_event_loop_destroy(loop);
+    if (0 <= signal_fd)
+    {
+        close(signal_fd);
+    }
+
+    return ok;
+}
+
+// each connection of the group is a client with an output buffer of
+// its own; messages are formatted on the connection's loop thread and
+// written by a single writer thread
+static void mqtt_sub_group(struct context * ctx, struct mqtt_capture_writer * capture)
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int rc = mosquitto_lib_init();
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        fprintf(stderr, "error: failed to init mosquitto library\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    struct mqtt_stats_reporter reporter;
+    mqtt_stats_reporter_init(&reporter, &ctx->stats, "mqtt_sub",
+        ctx->mqtt.stats_interval, ctx->mqtt.stats_file);
+
+    struct client * clients = calloc(ctx->connections, sizeof(struct client));
+    struct mqtt_connection * * connections = calloc(ctx->connections, sizeof(struct mqtt_connection *));
+    struct slab slab;
+    slab_init(&slab, ctx->pool_limit);
+    struct batch batch;
+    bool const has_batch = (ctx->batching) && (batch_init(&batch, ctx, stdout));
+    struct writer writer;
+    if ((NULL == clients) || (NULL == connections) || (ctx->batching != has_batch) ||
+        (!writer_start(&writer, stdout, has_batch ? &batch : NULL, &slab)))
+    {
+        fprintf(stderr, "error: failed to create group\n");
+        ctx->exit_code = EXIT_FAILURE;
+        free(connections);
+        free(clients);
+        if (has_batch)
+        {
+            batch_cleanup(&batch);
+        }
+        slab_cleanup(&slab);
+        mosquitto_lib_cleanup();
+        return;
+    }
+
+    struct mqtt_connection_callbacks const callbacks = {
+        .on_connect = &mqtt_on_connect,
+        .on_message = &mqtt_on_message,
+        .on_subscribe = &mqtt_on_subscribe
+    };
+
+    unsigned int count = 0;
+    bool ok = true;
+    while ((ok) && (count < ctx->connections))
+    {
+        struct client * client = &clients[count];
+        client->ctx = ctx;
+        client->writer = &writer;
+        client->queue = NULL;
+        client->capture = capture;
+        client->snapshot = NULL;
+        mqtt_codec_init(&client->codec, &ctx->dictionary);
+        client->subscribed = false;
+        ok = output_init(&client->output, ctx->format, stdout);
+        if (!ok)
+        {
+            fprintf(stderr, "error: failed to allocate output buffer\n");
+            break;
+        }
+
+        // persistent sessions need a distinct client id per connection
+        char id[256];
+        char const * client_id = NULL;
+        if ((NULL != ctx->mqtt.id) && (1 < ctx->connections))
+        {
+            snprintf(id, sizeof(id), "%s-%u", ctx->mqtt.id, count);
+            client_id = id;
+        }
+
+        connections[count] = mqtt_connection_create(&ctx->mqtt, client_id, &callbacks, client);
+        ok = (NULL != connections[count]);
+        if (!ok)
+        {
+            output_cleanup(&client->output);
+            mqtt_codec_cleanup(&client->codec);
+            break;
+        }
+        count++;
+
+        // an unreachable broker is retried by the loop
+        rc = mqtt_connection_connect(connections[count - 1], 0);
+        if ((MOSQ_ERR_ERRNO == rc) || (MOSQ_ERR_EAI == rc))
+        {
+            fprintf(stderr, "warning: failed to connect to MQTT broker\n");
+        }
+        else if (MOSQ_ERR_SUCCESS != rc)
+        {
+            fprintf(stderr, "error: failed to connect to MQTT broker\n");
+            ok = false;
+        }
+
+        // the event loop drives all connections from this thread
+        ok = ok && ((LOOP_EPOLL == ctx->loop_mode) || (mqtt_connection_start(connections[count - 1])));
+    }
+
+    struct stats_source source = {
+        .connections = connections,
+        .count = count,
+        .queue = NULL,
+        .trace = ctx->tracing ? &ctx->trace : NULL
+    };
+    if (ok)
+    {
+        mqtt_stats_reporter_start(&reporter, &mqtt_sub_collect, &source);
+
+        if (LOOP_EPOLL == ctx->loop_mode)
+        {
+            ok = mqtt_loop_epoll(ctx, connections, count);
+        }
+        else
+        {
+            int signal_number = 0;
+            sigwait(&signals, &signal_number);
+        }
+    }
+
+    if (!ok)
+    {
+        ctx->exit_code = EXIT_FAILURE;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        mqtt_unsubscribe(ctx, mqtt_connection_mosq(connections[i]));
+        mqtt_connection_stop(connections[i]);
+    }
+    writer_stop(&writer);
+    if (has_batch)
+    {
+        batch_cleanup(&batch);
+    }
+    mqtt_stats_reporter_stop(&reporter);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        mqtt_connection_destroy(connections[i]);
+        output_cleanup(&clients[i].output);
+        mqtt_codec_cleanup(&clients[i].codec);
+    }
+    free(connections);
+    free(clients);
+
+    if (ctx->pool_stats)
+    {
+        slab_report(&slab, stderr);
+    }
+    slab_cleanup(&slab);
+    mosquitto_lib_cleanup();
+}
+
+static void mqtt_sub_single(struct context * ctx, struct mqtt_capture_writer * capture)
+{
+    // the reporter is set up before the output thread is created
+    struct mqtt_stats_reporter reporter;
+    mqtt_stats_reporter_init(&reporter, &ctx->stats, "mqtt_sub",
+        ctx->mqtt.stats_interval, ctx->mqtt.stats_file);
+
+    struct client client;
+    client.ctx = ctx;
+    client.writer = NULL;
+    client.queue = NULL;
+    client.capture = capture;
+    client.snapshot = NULL;
+    mqtt_codec_init(&client.codec, &ctx->dictionary);
+    client.subscribed = false;
+    if (!output_init(&client.output, ctx->format, stdout))
+    {
+        fprintf(stderr, "error: failed to allocate output buffer\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    struct slab slab;
+    slab_init(&slab, ctx->pool_limit);
+    struct batch batch;
+    bool const has_batch = (ctx->batching) && (batch_init(&batch, ctx, stdout));
+    struct message_queue queue;
+    if ((ctx->batching != has_batch) || ((0 < ctx->queue_size) &&
+        (!message_queue_start(&queue, ctx, &client.output, has_batch ? &batch : NULL, capture, &slab))))
+    {
+        ctx->exit_code = EXIT_FAILURE;
+        if (has_batch)
+        {
+            batch_cleanup(&batch);
+        }
+        slab_cleanup(&slab);
+        output_cleanup(&client.output);
+        mqtt_codec_cleanup(&client.codec);
+        return;
+    }
+    client.queue = (0 < ctx->queue_size) ? &queue : NULL;
+
+    struct mqtt_connection * connection = NULL;
+    int rc = mosquitto_lib_init();
+    if (MOSQ_ERR_SUCCESS == rc)
+    {
+        struct mqtt_connection_callbacks const callbacks = {
+            .on_connect = &mqtt_on_connect,
+            .on_message = &mqtt_on_message,
+            .on_subscribe = &mqtt_on_subscribe
+        };
+        connection = mqtt_connection_create(&ctx->mqtt, NULL, &callbacks, &client);
+    }
+    else
+    {
+        fprintf(stderr, "error: failed to init mosquitto library\n");
+    }
+
+    // an unreachable broker is retried by the loop,
+    // other errors, e.g. invalid arguments, are fatal
+    rc = (NULL != connection) ? mqtt_connection_connect(connection, 0) : MOSQ_ERR_NOMEM;
+    if ((MOSQ_ERR_ERRNO == rc) || (MOSQ_ERR_EAI == rc))
+    {
+        fprintf(stderr, "warning: failed to connect to MQTT broker\n");
+        rc = MOSQ_ERR_SUCCESS;
+    }
+    else if ((NULL != connection) && (MOSQ_ERR_SUCCESS != rc))
+    {
+        fprintf(stderr, "error: failed to connect to MQTT broker\n");
+    }
+
+    struct stats_source source = {
+        .connections = &connection,
+        .count = 1,
+        .queue = client.queue,
+        .trace = ctx->tracing ? &ctx->trace : NULL
+    };
+    if (MOSQ_ERR_SUCCESS == rc)
+    {
+        mqtt_stats_reporter_start(&reporter, &mqtt_sub_collect, &source);
+    }
+
+    if (MOSQ_ERR_SUCCESS != rc)
+    {
+        ctx->exit_code = EXIT_FAILURE;
+    }
+    else if (ctx->loop_mode == LOOP_THREAD)
+    {
+        mqtt_loop_thread(ctx, connection);
+    }
+    else if (ctx->loop_mode == LOOP_EPOLL)
+    {
+        if (!mqtt_loop_epoll(ctx, &connection, 1))
+        {
+            ctx->exit_code = EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        mqtt_loop_poll(ctx, connection);
+    }
+
+    // the network loop is stopped, before the queue is drained
+    if (NULL != connection)
+    {
+        mqtt_connection_stop(connection);
+    }
+    mqtt_stats_reporter_stop(&reporter);
+    if (NULL != connection)
+    {
+        mqtt_connection_destroy(connection);
+    }
+    if (NULL != client.queue)
+    {
+        message_queue_stop(client.queue);
+    }
+    if (has_batch)
+    {
+        batch_cleanup(&batch);
+    }
+    if ((ctx->pool_stats) && (NULL != client.queue))
+    {
+        slab_report(&slab, stderr);
+    }
+    slab_cleanup(&slab);
+    mosquitto_lib_cleanup();
+    output_cleanup(&client.output);
+    mqtt_codec_cleanup(&client.codec);
+}
+
+// the file is replaced at once, so that readers never see a partial snapshot
+static bool mqtt_sub_snapshot_write(struct context * ctx, struct snapshot * snapshot)
+{
+    if (NULL == ctx->snapshot_file)
+    {
+        return snapshot_write(snapshot, stdout);
+    }
+
+    size_t const length = strlen(ctx->snapshot_file) + 5;
+    char * temp_path = malloc(length);
+    if (NULL == temp_path)
+    {
+        return false;
+    }
+    snprintf(temp_path, length, "%s.tmp", ctx->snapshot_file);
+
+    bool result = false;
+    FILE * file = fopen(temp_path, "wb");
+    if (NULL != file)
+    {
+        bool const written = snapshot_write(snapshot, file);
+        result = (0 == fclose(file)) && (written) && (0 == rename(temp_path, ctx->snapshot_file));
+        if (!result)
+        {
+            remove(temp_path);
+        }
+    }
+
+    free(temp_path);
+    return result;
+}
+
+// collects the retained messages of the topics on a network loop thread,
+// until none arrived for the idle time, and writes them at once
+static void mqtt_sub_snapshot(struct context * ctx)
+{
+    // signals are blocked before the loop thread is started,
+    // so that they are only delivered to sigtimedwait below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct mqtt_stats_reporter reporter;
+    mqtt_stats_reporter_init(&reporter, &ctx->stats, "mqtt_sub",
+        ctx->mqtt.stats_interval, ctx->mqtt.stats_file);
+
+    struct snapshot snapshot;
+    if (!snapshot_init(&snapshot))
+    {
+        fprintf(stderr, "error: failed to allocate snapshot\n");
+        snapshot_cleanup(&snapshot);
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    struct client client;
+    client.ctx = ctx;
+    client.writer = NULL;
+    client.queue = NULL;
+    client.capture = NULL;
+    client.snapshot = &snapshot;
+    client.subscribed = false;
+    mqtt_codec_init(&client.codec, &ctx->dictionary);
+
+    struct mqtt_connection * connection = NULL;
+    int rc = mosquitto_lib_init();
+    if (MOSQ_ERR_SUCCESS == rc)
+    {
+        struct mqtt_connection_callbacks const callbacks = {
+            .on_connect = &mqtt_on_connect,
+            .on_message = &mqtt_on_message,
+            .on_subscribe = &mqtt_on_subscribe
+        };
+        connection = mqtt_connection_create(&ctx->mqtt, NULL, &callbacks, &client);
+    }
+    else
+    {
+        fprintf(stderr, "error: failed to init mosquitto library\n");
+    }
+
+    // an unreachable broker is retried by the loop,
+    // other errors, e.g. invalid arguments, are fatal
+    rc = (NULL != connection) ? mqtt_connection_connect(connection, 0) : MOSQ_ERR_NOMEM;
+    if ((MOSQ_ERR_ERRNO == rc) || (MOSQ_ERR_EAI == rc))
+    {
+        fprintf(stderr, "warning: failed to connect to MQTT broker\n");
+        rc = MOSQ_ERR_SUCCESS;
+    }
+    else if ((NULL != connection) && (MOSQ_ERR_SUCCESS != rc))
+    {
+        fprintf(stderr, "error: failed to connect to MQTT broker\n");
+    }
+
+    struct stats_source source = {
+        .connections = &connection,
+        .count = 1,
+        .queue = NULL,
+        .trace = ctx->tracing ? &ctx->trace : NULL
+    };
+    bool complete = false;
+    if ((MOSQ_ERR_SUCCESS == rc) && (mqtt_connection_start(connection)))
+    {
+        mqtt_stats_reporter_start(&reporter, &mqtt_sub_collect, &source);
+
+        // an interrupted snapshot is incomplete and therefore not written
+        struct timespec const interval = {
+            .tv_sec = 0,
+            .tv_nsec = SNAPSHOT_POLL_INTERVAL * 1000000L
+        };
+        bool interrupted = false;
+        while ((!interrupted) && (!complete))
+        {
+            interrupted = (0 < sigtimedwait(&signals, NULL, &interval));
+            complete = (!interrupted) && (snapshot_complete(&snapshot, ctx->snapshot_idle));
+        }
+
+        mqtt_unsubscribe(ctx, mqtt_connection_mosq(connection));
+        mqtt_connection_stop(connection);
+    }
+
+    if ((complete) && (!mqtt_sub_snapshot_write(ctx, &snapshot)))
+    {
+        fprintf(stderr, "error: failed to write snapshot\n");
+        complete = false;
+    }
+
+    if (!complete)
+    {
+        ctx->exit_code = EXIT_FAILURE;
+    }
+
+    mqtt_stats_reporter_stop(&reporter);
+    if (NULL != connection)
+    {
+        mqtt_connection_destroy(connection);
+    }
+    mosquitto_lib_cleanup();
+    mqtt_codec_cleanup(&client.codec);
+    snapshot_cleanup(&snapshot);
+}
+
+static void mqtt_sub(struct context * ctx)
+{
+    signal(SIGINT, &on_shutdown_requested);
+    signal(SIGTERM, &on_shutdown_requested);
+
+    struct mqtt_capture_writer capture;
+    bool const recording = (NULL != ctx->record);
+    if ((recording) && (!mqtt_capture_writer_open(&capture, ctx->record)))
+    {
+        fprintf(stderr, "error: failed to open capture\n");
+        ctx->exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    if (ctx->retain)
+    {
+        mqtt_sub_snapshot(ctx);
+    }
+    else if (NULL != ctx->group)
+    {
+        mqtt_sub_group(ctx, recording ? &capture : NULL);
+    }
+    else
+    {
+        mqtt_sub_single(ctx, recording ? &capture : NULL);
+    }
+
+    if (ctx->tracing)
+    {
+        mqtt_trace_print(&ctx->trace, stderr, true);
+    }
+
+    if ((recording) && (!mqtt_capture_writer_close(&capture)))
+    {
+        fprintf(stderr, "error: failed to write capture\n");
+        ctx->exit_code = EXIT_FAILURE;
+    }
 }
 
 int main(int argc, char* argv[])
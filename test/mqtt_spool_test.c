@@ -0,0 +1,435 @@
+#include "mqtt_spool.h"
+#include "mqtt_capture.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// tests of the spool and the capture format it is based on; no broker involved
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+#define PAYLOAD_SIZE (1024)
+
+static int failures = 0;
+
+static char directory[] = "/tmp/mqtt_spool_test.XXXXXX";
+
+static char const * test_path(char const * name)
+{
+    static char path[sizeof(directory) + 64];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    return path;
+}
+
+static void remove_directory(char const * path)
+{
+    DIR * dir = opendir(path);
+    if (NULL == dir)
+    {
+        return;
+    }
+
+    struct dirent * entry;
+    while (NULL != (entry = readdir(dir)))
+    {
+        if ('.' != entry->d_name[0])
+        {
+            char file[512];
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+// returns the number of segments and their size in bytes
+static unsigned int count_segments(char const * path, unsigned long long * size)
+{
+    unsigned int count = 0;
+    *size = 0;
+    DIR * dir = opendir(path);
+    if (NULL == dir)
+    {
+        return 0;
+    }
+
+    struct dirent * entry;
+    while (NULL != (entry = readdir(dir)))
+    {
+        size_t const length = strlen(entry->d_name);
+        if ((4 < length) && (0 == strcmp(&entry->d_name[length - 4], ".cap")))
+        {
+            char file[512];
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            struct stat info;
+            if (0 == stat(file, &info))
+            {
+                *size += (unsigned long long) info.st_size;
+            }
+            count++;
+        }
+    }
+    closedir(dir);
+
+    return count;
+}
+
+// messages are numbered; the number is the start of the payload
+static bool add_message(struct mqtt_spool * spool, unsigned int number, size_t length)
+{
+    char payload[PAYLOAD_SIZE];
+    memset(payload, 'x', sizeof(payload));
+    snprintf(payload, sizeof(payload), "%u", number);
+
+    char topic[32];
+    snprintf(topic, sizeof(topic), "test/%u", number % 3);
+
+    struct mqtt_capture_message const message = {
+        .timestamp = mqtt_capture_now(),
+        .topic = topic,
+        .payload = payload,
+        .payloadlen = length,
+        .qos = 1,
+        .retain = false
+    };
+
+    return mqtt_spool_add(spool, &message);
+}
+
+// returns the number of the next message or 0, if there is none
+static unsigned int next_message(struct mqtt_spool * spool)
+{
+    struct mqtt_capture_message message;
+    if (!mqtt_spool_next(spool, &message))
+    {
+        return 0;
+    }
+
+    char payload[16];
+    size_t const length = (message.payloadlen < sizeof(payload)) ? message.payloadlen : sizeof(payload) - 1;
+    memcpy(payload, message.payload, length);
+    payload[length] = '\0';
+
+    char topic[32];
+    unsigned int const number = (unsigned int) strtoul(payload, NULL, 10);
+    snprintf(topic, sizeof(topic), "test/%u", number % 3);
+    CHECK(0 == strcmp(topic, message.topic));
+    CHECK(1 == message.qos);
+
+    return number;
+}
+
+static void test_rewind(void)
+{
+    char const * path = test_path("rewind");
+    struct mqtt_spool * spool = mqtt_spool_open(path, 0, MQTT_SPOOL_DROP_OLDEST, 0);
+    CHECK(NULL != spool);
+    if (NULL == spool)
+    {
+        return;
+    }
+
+    CHECK(mqtt_spool_empty(spool));
+    for (unsigned int i = 1; i <= 10; i++)
+    {
+        CHECK(add_message(spool, i, 16));
+    }
+    CHECK(!mqtt_spool_empty(spool));
+
+    for (unsigned int i = 1; i <= 6; i++)
+    {
+        CHECK(i == next_message(spool));
+    }
+
+    // read messages, which are not committed, are read again in order
+    mqtt_spool_rewind(spool);
+    for (unsigned int i = 1; i <= 10; i++)
+    {
+        CHECK(i == next_message(spool));
+    }
+    CHECK(0 == next_message(spool));
+    CHECK(mqtt_spool_empty(spool));
+
+    mqtt_spool_rewind(spool);
+    CHECK(!mqtt_spool_empty(spool));
+    CHECK(1 == next_message(spool));
+
+    mqtt_spool_close(spool);
+    remove_directory(path);
+}
+
+static void test_commit(void)
+{
+    char const * path = test_path("commit");
+    struct mqtt_spool * spool = mqtt_spool_open(path, 0, MQTT_SPOOL_DROP_OLDEST, 0);
+    CHECK(NULL != spool);
+    if (NULL == spool)
+    {
+        return;
+    }
+
+    unsigned long long size = 0;
+    for (unsigned int i = 1; i <= 10; i++)
+    {
+        CHECK(add_message(spool, i, 16));
+    }
+    for (unsigned int i = 1; i <= 4; i++)
+    {
+        CHECK(i == next_message(spool));
+    }
+
+    // committed messages are not read again after a rewind
+    mqtt_spool_commit(spool);
+    CHECK(5 == next_message(spool));
+    CHECK(6 == next_message(spool));
+    mqtt_spool_rewind(spool);
+    CHECK(5 == next_message(spool));
+
+    // messages added meanwhile follow the ones read before
+    CHECK(add_message(spool, 11, 16));
+    for (unsigned int i = 6; i <= 11; i++)
+    {
+        CHECK(i == next_message(spool));
+    }
+    CHECK(0 == next_message(spool));
+
+    // segments are kept on disk, until all of their messages are committed;
+    // the message added while reading started the second one
+    CHECK(2 == count_segments(path, &size));
+    mqtt_spool_commit(spool);
+    CHECK(0 == count_segments(path, &size));
+    CHECK(mqtt_spool_empty(spool));
+
+    mqtt_spool_rewind(spool);
+    CHECK(0 == next_message(spool));
+
+    mqtt_spool_close(spool);
+    remove_directory(path);
+}
+
+static void test_evict(void)
+{
+    char const * path = test_path("evict");
+
+    // segments of 8 KiB take a few messages each
+    unsigned long long const max_size = 64 * 1024;
+    struct mqtt_spool * spool = mqtt_spool_open(path, max_size, MQTT_SPOOL_DROP_OLDEST, 0);
+    CHECK(NULL != spool);
+    if (NULL == spool)
+    {
+        return;
+    }
+
+    unsigned int added = 0;
+    for (unsigned int i = 0; i < 50; i++)
+    {
+        CHECK(add_message(spool, ++added, PAYLOAD_SIZE));
+    }
+    CHECK(0 == mqtt_spool_dropped(spool));
+
+    // the first segment is being read, while the spool overflows
+    CHECK(1 == next_message(spool));
+    CHECK(2 == next_message(spool));
+    for (unsigned int i = 0; i < 100; i++)
+    {
+        CHECK(add_message(spool, ++added, PAYLOAD_SIZE));
+    }
+    CHECK(0 < mqtt_spool_dropped(spool));
+
+    unsigned long long size = 0;
+    count_segments(path, &size);
+    CHECK(size <= max_size);
+
+    // the rest of the segment being read was the oldest and is dropped;
+    // the rest keeps its order and ends with the newest message
+    unsigned int last = 2;
+    unsigned int received = 2;
+    unsigned int number = next_message(spool);
+    CHECK(3 < number);
+    for (; 0 != number; number = next_message(spool))
+    {
+        CHECK(last < number);
+        last = number;
+        received++;
+    }
+    CHECK(added == last);
+    CHECK(added <= received + mqtt_spool_dropped(spool));
+
+    // an evicted segment is removed, once it is no longer read
+    mqtt_spool_commit(spool);
+    CHECK(0 == count_segments(path, &size));
+
+    mqtt_spool_close(spool);
+    remove_directory(path);
+}
+
+static void test_reopen(void)
+{
+    char const * path = test_path("reopen");
+    struct mqtt_spool * spool = mqtt_spool_open(path, 64 * 1024, MQTT_SPOOL_DROP_OLDEST, 0);
+    CHECK(NULL != spool);
+    if (NULL == spool)
+    {
+        return;
+    }
+
+    // a second process must not use the same directory
+    struct mqtt_spool * other = mqtt_spool_open(path, 64 * 1024, MQTT_SPOOL_DROP_OLDEST, 0);
+    CHECK(NULL == other);
+    mqtt_spool_close(other);
+
+    for (unsigned int i = 1; i <= 20; i++)
+    {
+        CHECK(add_message(spool, i, PAYLOAD_SIZE));
+    }
+
+    // the first segment is committed, the second one is read in part
+    for (unsigned int i = 1; i <= 10; i++)
+    {
+        CHECK(i == next_message(spool));
+    }
+    mqtt_spool_commit(spool);
+    CHECK(11 == next_message(spool));
+    mqtt_spool_close(spool);
+
+    // the next process starts with the oldest segment, which is not
+    // committed, i.e. read messages of it are delivered again
+    spool = mqtt_spool_open(path, 64 * 1024, MQTT_SPOOL_DROP_OLDEST, 0);
+    CHECK(NULL != spool);
+    if (NULL == spool)
+    {
+        return;
+    }
+    CHECK(!mqtt_spool_empty(spool));
+    CHECK(add_message(spool, 21, PAYLOAD_SIZE));
+    unsigned int const first = next_message(spool);
+    CHECK((1 < first) && (first <= 11));
+    for (unsigned int i = first + 1; i <= 21; i++)
+    {
+        CHECK(i == next_message(spool));
+    }
+    CHECK(0 == next_message(spool));
+    mqtt_spool_commit(spool);
+    mqtt_spool_close(spool);
+
+    // nothing is left after all messages were committed
+    spool = mqtt_spool_open(path, 64 * 1024, MQTT_SPOOL_DROP_OLDEST, 0);
+    CHECK(NULL != spool);
+    if (NULL == spool)
+    {
+        return;
+    }
+    CHECK(mqtt_spool_empty(spool));
+    CHECK(0 == next_message(spool));
+    mqtt_spool_close(spool);
+
+    remove_directory(path);
+}
+
+static void test_capture(void)
+{
+    char const * path = test_path("capture.cap");
+    struct mqtt_capture_writer writer;
+    CHECK(mqtt_capture_writer_open(&writer, path));
+
+    // messages cross an index, which resets the base of timestamps
+    unsigned int const count = MQTT_CAPTURE_INDEX_INTERVAL + 10;
+    unsigned char const properties[] = { 0x26, 0x00, 0x01, 0xff };
+    uint64_t const start = mqtt_capture_now();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        char topic[32];
+        snprintf(topic, sizeof(topic), "capture/%u", i % 5);
+        bool const has_properties = (0 == (i % 2));
+        struct mqtt_capture_message const message = {
+            .timestamp = start + (i * 1000ULL),
+            .topic = topic,
+            .payload = &i,
+            .payloadlen = (0 == (i % 7)) ? 0 : sizeof(i),
+            .qos = (int) (i % 3),
+            .retain = (0 == (i % 4)),
+            .properties = has_properties ? properties : NULL,
+            .propertieslen = has_properties ? sizeof(properties) : 0
+        };
+        mqtt_capture_writer_add(&writer, &message);
+    }
+    CHECK(mqtt_capture_writer_close(&writer));
+
+    struct mqtt_capture_reader reader;
+    CHECK(mqtt_capture_reader_open(&reader, path));
+    unsigned int read = 0;
+    struct mqtt_capture_message message;
+    while (mqtt_capture_reader_next(&reader, &message))
+    {
+        char topic[32];
+        snprintf(topic, sizeof(topic), "capture/%u", read % 5);
+        bool const has_properties = (0 == (read % 2));
+        CHECK(start + (read * 1000ULL) == message.timestamp);
+        CHECK(0 == strcmp(topic, message.topic));
+        CHECK((int) (read % 3) == message.qos);
+        CHECK((0 == (read % 4)) == message.retain);
+        if (0 == (read % 7))
+        {
+            CHECK(0 == message.payloadlen);
+        }
+        else
+        {
+            CHECK((sizeof(read) == message.payloadlen) && (0 == memcmp(&read, message.payload, sizeof(read))));
+        }
+        if (has_properties)
+        {
+            CHECK((sizeof(properties) == message.propertieslen) &&
+                (0 == memcmp(properties, message.properties, sizeof(properties))));
+        }
+        else
+        {
+            CHECK((NULL == message.properties) && (0 == message.propertieslen));
+        }
+        read++;
+    }
+    CHECK(!reader.failed);
+    CHECK(count == read);
+    mqtt_capture_reader_close(&reader);
+
+    unlink(path);
+}
+
+int main(void)
+{
+    if (NULL == mkdtemp(directory))
+    {
+        fprintf(stderr, "error: failed to create test directory\n");
+        return EXIT_FAILURE;
+    }
+
+    test_rewind();
+    test_commit();
+    test_evict();
+    test_reopen();
+    test_capture();
+
+    rmdir(directory);
+    if (0 < failures)
+    {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}